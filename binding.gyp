@@ -75,6 +75,21 @@
           "src/mapnik_expression.cpp",
           "src/mapnik_cairo_surface.cpp",
           "src/mapnik_vector_tile.cpp",
+          "src/feature_cache.cpp",
+          "src/style_cache.cpp",
+          "src/worker_pool.cpp",
+          "src/grid_layers.cpp",
+          "src/png_stream_writer.cpp",
+          "src/png_encoder.cpp",
+          "src/webp_options.cpp",
+          "src/palette_lut.cpp",
+          "src/pixel_kernels.cpp",
+          "src/raster_pool.cpp",
+          "src/composite_stack.cpp",
+          "src/image_filters.cpp",
+          "src/image_resize.cpp",
+          "src/image_decode.cpp",
+          "src/encode_cache.cpp",
           "<(SHARED_INTERMEDIATE_DIR)/vector_tile.pb.cc"
       ],
       'include_dirs': [
@@ -126,7 +141,9 @@
                 '<!@(mapnik-config --libs)',
                 '<!@(mapnik-config --ldflags)',
                 '<!@(pkg-config protobuf --libs-only-L)',
-                '-lprotobuf-lite'
+                '-lprotobuf-lite',
+                '-lz',
+                '-ljpeg'
             ],
             'conditions': [
               ['runtime_link == "static"', {
@@ -0,0 +1,61 @@
+#ifndef __NODE_MAPNIK_BUFFER_UTILS_H__
+#define __NODE_MAPNIK_BUFFER_UTILS_H__
+
+// v8
+#include <v8.h>
+
+// node
+#include <node.h>
+#include <node_buffer.h>
+#include <node_version.h>
+
+// stl
+#include <string>
+
+namespace node_mapnik {
+
+// free callback of buffers created by buffer_from_string
+inline void release_string(char * /*data*/, void * hint)
+{
+    delete static_cast<std::string *>(hint);
+}
+
+/*
+ * Hands the bytes of `data` to a new Buffer without copying them: the
+ * string is moved to the heap and freed when the Buffer is collected.
+ * `data` is left empty.
+ */
+inline v8::Local<v8::Object> buffer_from_string(std::string & data)
+{
+    if (data.empty())
+    {
+        #if NODE_VERSION_AT_LEAST(0, 11, 0)
+        return node::Buffer::New(static_cast<size_t>(0));
+        #else
+        return v8::Local<v8::Object>::New(node::Buffer::New(static_cast<size_t>(0))->handle_);
+        #endif
+    }
+    std::string * owned = new std::string();
+    owned->swap(data);
+    // non-const operator[] also unshares a copy-on-write string
+    char * bytes = &(*owned)[0];
+    #if NODE_VERSION_AT_LEAST(0, 11, 0)
+    return node::Buffer::New(bytes, owned->size(), release_string, owned);
+    #else
+    return v8::Local<v8::Object>::New(node::Buffer::New(bytes, owned->size(), release_string, owned)->handle_);
+    #endif
+}
+
+// copies `data` into a new Buffer, for bytes that are shared elsewhere
+inline v8::Local<v8::Object> buffer_copy_of(std::string const& data)
+{
+    #if NODE_VERSION_AT_LEAST(0, 11, 0)
+    return node::Buffer::New(data.data(), data.size());
+    #else
+    return v8::Local<v8::Object>::New(node::Buffer::New(data.data(), data.size())->handle_);
+    #endif
+}
+
+}
+
+#endif // __NODE_MAPNIK_BUFFER_UTILS_H__
@@ -0,0 +1,74 @@
+#include "composite_stack.hpp"
+#include "parallel.hpp"
+
+// agg, as used by mapnik::composite
+#include "agg_rendering_buffer.h"
+#include "agg_pixfmt_rgba.h"
+#include "agg_renderer_base.h"
+
+// stl
+#include <algorithm>
+
+namespace node_mapnik {
+
+namespace {
+
+typedef agg::comp_op_adaptor_rgba_pre<agg::rgba8, agg::order_rgba> blender_type;
+typedef agg::pixfmt_custom_blend_rgba<blender_type, agg::rendering_buffer> pixfmt_type;
+typedef agg::renderer_base<pixfmt_type> renderer_type;
+
+// destination bytes per block, about half of a typical l2 cache
+const std::size_t block_bytes = 128 * 1024;
+
+struct composite_block_task
+{
+    composite_block_task(mapnik::image_data_32 & dst,
+                         std::vector<composite_layer> const& layers,
+                         unsigned block_rows)
+        : dst_(dst),
+          layers_(layers),
+          block_rows_(block_rows) {}
+
+    void operator()(std::size_t block)
+    {
+        unsigned y0 = static_cast<unsigned>(block) * block_rows_;
+        unsigned rows = std::min(block_rows_, dst_.height() - y0);
+        // a rendering buffer over just this block: sources are offset by
+        // -y0 and agg clips them to the block rows
+        agg::rendering_buffer dst_buffer(reinterpret_cast<agg::int8u *>(dst_.getRow(y0)),
+                                         dst_.width(), rows, dst_.width() * 4);
+        pixfmt_type pixf(dst_buffer);
+        renderer_type ren(pixf);
+        for (std::size_t i = 0; i < layers_.size(); ++i)
+        {
+            composite_layer const& layer = layers_[i];
+            mapnik::image_data_32 const& src = *layer.data;
+            agg::rendering_buffer src_buffer(const_cast<agg::int8u *>(src.getBytes()),
+                                             src.width(), src.height(), src.width() * 4);
+            agg::pixfmt_rgba32 pixf_src(src_buffer);
+            pixf.comp_op(static_cast<agg::comp_op_e>(layer.mode));
+            ren.blend_from(pixf_src, 0, layer.dx, layer.dy - static_cast<int>(y0),
+                           unsigned(255 * layer.opacity));
+        }
+    }
+
+    mapnik::image_data_32 & dst_;
+    std::vector<composite_layer> const& layers_;
+    unsigned block_rows_;
+};
+
+}
+
+void composite_stack(mapnik::image_data_32 & dst,
+                     std::vector<composite_layer> const& layers,
+                     unsigned threads)
+{
+    if (layers.empty() || dst.width() == 0 || dst.height() == 0) return;
+    std::size_t row_bytes = static_cast<std::size_t>(dst.width()) * 4;
+    unsigned block_rows = static_cast<unsigned>(std::max<std::size_t>(1, block_bytes / row_bytes));
+    std::size_t blocks = (dst.height() + block_rows - 1) / block_rows;
+    composite_block_task task(dst, layers, block_rows);
+    parallel_for(blocks, task, threads);
+}
+
+}
@@ -0,0 +1,44 @@
+#ifndef __NODE_MAPNIK_COMPOSITE_STACK_H__
+#define __NODE_MAPNIK_COMPOSITE_STACK_H__
+
+// mapnik
+#include <mapnik/image_compositing.hpp> // for composite_mode_e
+#include <mapnik/image_data.hpp>        // for image_data_32
+
+// stl
+#include <vector>
+
+namespace node_mapnik {
+
+// one source of composite_stack, blended like mapnik::composite
+struct composite_layer
+{
+    composite_layer()
+        : data(0),
+          mode(mapnik::src_over),
+          opacity(1.0),
+          dx(0),
+          dy(0) {}
+
+    mapnik::image_data_32 const* data;
+    mapnik::composite_mode_e mode;
+    float opacity;
+    int dx;
+    int dy;
+};
+
+/*
+ * Blends `layers` onto `dst` in order, with the same result as calling
+ * mapnik::composite once per layer. `dst` is walked in blocks of rows
+ * sized to stay in cache and every layer is blended into a block before
+ * moving on, so destination pixels are loaded and stored once instead of
+ * once per layer. Blocks are independent and run on up to `threads`
+ * threads (0 for one per core). No layer may share memory with `dst`.
+ */
+void composite_stack(mapnik::image_data_32 & dst,
+                     std::vector<composite_layer> const& layers,
+                     unsigned threads = 0);
+
+}
+
+#endif // __NODE_MAPNIK_COMPOSITE_STACK_H__
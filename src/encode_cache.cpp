@@ -0,0 +1,309 @@
+#include "encode_cache.hpp"
+#include "is_solid.hpp"
+#include "png_encoder.hpp"
+
+// mapnik
+#include <mapnik/palette.hpp>           // for rgba_palette
+
+// boost
+#include MAPNIK_MAKE_SHARED_INCLUDE
+
+// stl
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+namespace node_mapnik {
+
+namespace {
+
+const boost::uint64_t prime1 = 11400714785074694791ULL;
+const boost::uint64_t prime2 = 14029467366897019727ULL;
+const boost::uint64_t prime3 = 1609587929392839161ULL;
+const boost::uint64_t prime4 = 9650029242287828579ULL;
+const boost::uint64_t prime5 = 2870177450012600261ULL;
+
+inline boost::uint64_t rotl(boost::uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// native byte order: keys never leave the process
+inline boost::uint64_t read64(unsigned char const* p)
+{
+    boost::uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline boost::uint32_t read32(unsigned char const* p)
+{
+    boost::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline boost::uint64_t xxh_round(boost::uint64_t acc, boost::uint64_t input)
+{
+    acc += input * prime2;
+    acc = rotl(acc, 31);
+    return acc * prime1;
+}
+
+inline boost::uint64_t xxh_merge(boost::uint64_t acc, boost::uint64_t value)
+{
+    acc ^= xxh_round(0, value);
+    return acc * prime1 + prime4;
+}
+
+}
+
+boost::uint64_t xxhash64(void const* data, std::size_t size, boost::uint64_t seed)
+{
+    unsigned char const* p = static_cast<unsigned char const*>(data);
+    unsigned char const* end = p + size;
+    boost::uint64_t h;
+
+    if (size >= 32)
+    {
+        // four independent lanes keep the multipliers busy in parallel
+        boost::uint64_t v1 = seed + prime1 + prime2;
+        boost::uint64_t v2 = seed + prime2;
+        boost::uint64_t v3 = seed;
+        boost::uint64_t v4 = seed - prime1;
+        unsigned char const* limit = end - 32;
+        do
+        {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        }
+        while (p <= limit);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    }
+    else
+    {
+        h = seed + prime5;
+    }
+
+    h += static_cast<boost::uint64_t>(size);
+    for (; p + 8 <= end; p += 8)
+    {
+        h ^= xxh_round(0, read64(p));
+        h = rotl(h, 27) * prime1 + prime4;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= static_cast<boost::uint64_t>(read32(p)) * prime1;
+        h = rotl(h, 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+    {
+        h ^= (*p) * prime5;
+        h = rotl(h, 11) * prime1;
+    }
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+std::string encode_cache_key(mapnik::image_data_32 const& data,
+                             std::string const& format,
+                             mapnik::rgba_palette const* palette,
+                             png_options const* png)
+{
+    std::ostringstream key;
+    key << format << '\0';
+    if (png)
+    {
+        // threads only change how the work is split, not the output
+        key << "png:" << png->level << ',' << png->strategy << ',' << static_cast<int>(png->filter);
+    }
+    key << '\0';
+    if (palette)
+    {
+        std::vector<mapnik::rgb> const& colors = palette->palette();
+        std::vector<unsigned> const& alpha = palette->alphaTable();
+        key << "palette:" << colors.size() << ',' << alpha.size() << ':';
+        for (std::size_t i = 0; i < colors.size(); ++i)
+        {
+            key << static_cast<char>(colors[i].r)
+                << static_cast<char>(colors[i].g)
+                << static_cast<char>(colors[i].b);
+        }
+        for (std::size_t i = 0; i < alpha.size(); ++i)
+        {
+            key << static_cast<char>(alpha[i]);
+        }
+    }
+    key << '\0' << data.width() << 'x' << data.height() << ':';
+
+    unsigned pixel = 0;
+    if (data.width() > 0 && data.height() > 0 && is_solid(data, pixel))
+    {
+        key << "solid:" << std::hex << pixel;
+    }
+    else
+    {
+        std::size_t bytes = static_cast<std::size_t>(data.width()) * data.height() * 4;
+        key << "xxh64:" << std::hex << xxhash64(data.getData(), bytes);
+    }
+    return key.str();
+}
+
+encode_cache & encode_cache::instance()
+{
+    // intentionally leaked like the other process-wide caches
+    static encode_cache * cache = new encode_cache();
+    return *cache;
+}
+
+encode_cache::encode_cache()
+    : entries_(),
+      index_(),
+      max_bytes_(32 * 1024 * 1024),
+      bytes_(0),
+      hits_(0),
+      misses_(0)
+{
+    uv_mutex_init(&mutex_);
+}
+
+encode_cache::~encode_cache()
+{
+    uv_mutex_destroy(&mutex_);
+}
+
+encode_cache::encoded_ptr encode_cache::find(std::string const& key)
+{
+    encoded_ptr encoded;
+    uv_mutex_lock(&mutex_);
+    index_type::iterator itr = index_.find(key);
+    if (itr != index_.end())
+    {
+        entries_.splice(entries_.begin(), entries_, itr->second);
+        encoded = itr->second->encoded;
+        ++hits_;
+    }
+    else
+    {
+        ++misses_;
+    }
+    uv_mutex_unlock(&mutex_);
+    // entries are immutable, callers copy them into a Buffer unlocked
+    return encoded;
+}
+
+encode_cache::encoded_ptr encode_cache::insert(std::string const& key, std::string & encoded)
+{
+    if (key.size() + encoded.size() > max_bytes()) return encoded_ptr();
+    MAPNIK_SHARED_PTR<std::string> bytes = MAPNIK_MAKE_SHARED<std::string>();
+    bytes->swap(encoded);
+    entry e;
+    e.key = key;
+    e.encoded = bytes;
+    uv_mutex_lock(&mutex_);
+    if (key.size() + bytes->size() > max_bytes_)
+    {
+        // the cap shrank meanwhile, the caller still gets the bytes
+        uv_mutex_unlock(&mutex_);
+        return e.encoded;
+    }
+    index_type::iterator itr = index_.find(key);
+    if (itr != index_.end())
+    {
+        bytes_ -= itr->second->key.size() + itr->second->encoded->size();
+        entries_.erase(itr->second);
+        index_.erase(itr);
+    }
+    entries_.push_front(e);
+    index_.insert(std::make_pair(key, entries_.begin()));
+    bytes_ += key.size() + bytes->size();
+    evict();
+    uv_mutex_unlock(&mutex_);
+    return e.encoded;
+}
+
+// drops least recently used entries until under the cap, mutex held
+void encode_cache::evict()
+{
+    while (bytes_ > max_bytes_ && !entries_.empty())
+    {
+        entry const& e = entries_.back();
+        bytes_ -= e.key.size() + e.encoded->size();
+        index_.erase(e.key);
+        entries_.pop_back();
+    }
+}
+
+void encode_cache::clear()
+{
+    uv_mutex_lock(&mutex_);
+    entries_.clear();
+    index_.clear();
+    bytes_ = 0;
+    hits_ = 0;
+    misses_ = 0;
+    uv_mutex_unlock(&mutex_);
+}
+
+void encode_cache::set_max_bytes(std::size_t max_bytes)
+{
+    uv_mutex_lock(&mutex_);
+    max_bytes_ = max_bytes;
+    evict();
+    uv_mutex_unlock(&mutex_);
+}
+
+std::size_t encode_cache::max_bytes() const
+{
+    uv_mutex_lock(&mutex_);
+    std::size_t max_bytes = max_bytes_;
+    uv_mutex_unlock(&mutex_);
+    return max_bytes;
+}
+
+std::size_t encode_cache::bytes() const
+{
+    uv_mutex_lock(&mutex_);
+    std::size_t bytes = bytes_;
+    uv_mutex_unlock(&mutex_);
+    return bytes;
+}
+
+std::size_t encode_cache::size() const
+{
+    uv_mutex_lock(&mutex_);
+    std::size_t size = entries_.size();
+    uv_mutex_unlock(&mutex_);
+    return size;
+}
+
+unsigned long encode_cache::hits() const
+{
+    uv_mutex_lock(&mutex_);
+    unsigned long hits = hits_;
+    uv_mutex_unlock(&mutex_);
+    return hits;
+}
+
+unsigned long encode_cache::misses() const
+{
+    uv_mutex_lock(&mutex_);
+    unsigned long misses = misses_;
+    uv_mutex_unlock(&mutex_);
+    return misses;
+}
+
+}
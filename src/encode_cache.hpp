@@ -0,0 +1,99 @@
+#ifndef __NODE_MAPNIK_ENCODE_CACHE_H__
+#define __NODE_MAPNIK_ENCODE_CACHE_H__
+
+// libuv
+#include <uv.h>
+
+// mapnik
+#include <mapnik/image_data.hpp>        // for image_data_32
+
+#include "mapnik3x_compatibility.hpp"
+
+// boost
+#include MAPNIK_SHARED_INCLUDE
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+// stl
+#include <list>
+#include <map>
+#include <string>
+
+namespace mapnik { class rgba_palette; }
+
+namespace node_mapnik {
+
+struct png_options;
+
+/*
+ * Process-wide cache of encoded images keyed by their content.
+ *
+ * Tiles of open water, blank land or pattern fills come out of rendering
+ * byte for byte identical, so encoding one of them again only repeats
+ * work. Entries map an encode_cache_key (pixels and encode options) to
+ * the encoded bytes and are evicted least recently used first once their
+ * total size passes the byte cap.
+ */
+class encode_cache : private boost::noncopyable
+{
+public:
+    static encode_cache & instance();
+
+    typedef MAPNIK_SHARED_PTR<std::string const> encoded_ptr;
+
+    // the cached encoding of `key`, empty on a miss
+    encoded_ptr find(std::string const& key);
+
+    // takes the bytes of `encoded` into the cache without copying them,
+    // leaving it empty, and returns them. Encodings larger than the cap
+    // are left in `encoded` and an empty pointer is returned
+    encoded_ptr insert(std::string const& key, std::string & encoded);
+    void clear();
+
+    void set_max_bytes(std::size_t max_bytes);
+    std::size_t max_bytes() const;
+    std::size_t bytes() const;
+    std::size_t size() const;
+    unsigned long hits() const;
+    unsigned long misses() const;
+
+private:
+    encode_cache();
+    ~encode_cache();
+
+    void evict();
+
+    struct entry
+    {
+        std::string key;
+        MAPNIK_SHARED_PTR<std::string const> encoded;
+    };
+    typedef std::list<entry> lru_type;
+    typedef std::map<std::string, lru_type::iterator> index_type;
+
+    lru_type entries_; // most recently used at the front
+    index_type index_;
+    std::size_t max_bytes_;
+    std::size_t bytes_;
+    unsigned long hits_;
+    unsigned long misses_;
+    mutable uv_mutex_t mutex_;
+};
+
+// 64 bit xxHash (XXH64) of `size` bytes at `data`
+boost::uint64_t xxhash64(void const* data, std::size_t size, boost::uint64_t seed = 0);
+
+/*
+ * Cache key of `data` encoded as `format` (webp options already
+ * appended) with the optional `palette` and `png` encoder options. Solid
+ * images are keyed by their size and pixel, found with an early exit
+ * scan; others by their size and an XXH64 of the pixels.
+ */
+std::string encode_cache_key(mapnik::image_data_32 const& data,
+                             std::string const& format,
+                             mapnik::rgba_palette const* palette,
+                             png_options const* png);
+
+}
+
+#endif // __NODE_MAPNIK_ENCODE_CACHE_H__
@@ -0,0 +1,132 @@
+#ifndef __NODE_MAPNIK_FD_STREAM_H__
+#define __NODE_MAPNIK_FD_STREAM_H__
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <errno.h>
+
+// boost
+#include <boost/noncopyable.hpp>
+
+// stl
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <vector>
+
+namespace node_mapnik {
+
+/*
+ * Output streambuf writing straight to a file descriptor through a small
+ * fixed buffer, so encoders that write to a std::ostream stream their
+ * output instead of building it in memory first. The descriptor is owned
+ * by the caller and is not closed.
+ */
+class fd_streambuf : public std::streambuf, private boost::noncopyable
+{
+public:
+    explicit fd_streambuf(int fd, std::size_t buffer_size = 64 * 1024)
+        : fd_(fd),
+          buffer_(buffer_size)
+    {
+        setp(&buffer_[0], &buffer_[0] + buffer_.size());
+    }
+
+    ~fd_streambuf()
+    {
+        // errors have to be caught with an explicit flush before this
+        flush_buffer();
+    }
+
+protected:
+    int_type overflow(int_type c)
+    {
+        if (!flush_buffer()) return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(char const* s, std::streamsize n)
+    {
+        // large writes skip the buffer
+        if (n >= static_cast<std::streamsize>(buffer_.size()))
+        {
+            if (!flush_buffer() || !write_all(s, static_cast<std::size_t>(n))) return 0;
+            return n;
+        }
+        return std::streambuf::xsputn(s, n);
+    }
+
+    int sync()
+    {
+        return flush_buffer() ? 0 : -1;
+    }
+
+private:
+    bool flush_buffer()
+    {
+        std::size_t n = static_cast<std::size_t>(pptr() - pbase());
+        if (n > 0 && !write_all(pbase(), n)) return false;
+        setp(&buffer_[0], &buffer_[0] + buffer_.size());
+        return true;
+    }
+
+    bool write_all(char const* data, std::size_t size)
+    {
+        while (size > 0)
+        {
+#ifdef _WIN32
+            int written = ::_write(fd_, data, static_cast<unsigned>(size));
+#else
+            ssize_t written = ::write(fd_, data, size);
+#endif
+            if (written < 0)
+            {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            size -= static_cast<std::size_t>(written);
+        }
+        return true;
+    }
+
+    int fd_;
+    std::vector<char> buffer_;
+};
+
+// std::ostream over an fd_streambuf
+class fd_ostream : public std::ostream
+{
+public:
+    explicit fd_ostream(int fd)
+        : std::ostream(0),
+          buf_(fd)
+    {
+        rdbuf(&buf_);
+    }
+
+    // flushes and throws if any write failed
+    void finish()
+    {
+        flush();
+        if (fail())
+        {
+            throw std::runtime_error("could not write to file descriptor");
+        }
+    }
+
+private:
+    fd_streambuf buf_;
+};
+
+}
+
+#endif // __NODE_MAPNIK_FD_STREAM_H__
@@ -0,0 +1,433 @@
+#include "feature_cache.hpp"
+
+// mapnik
+#include <mapnik/feature.hpp>
+#include <mapnik/geometry.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/map.hpp>
+#include <mapnik/params.hpp>
+#include <mapnik/raster.hpp>
+
+// boost
+#include MAPNIK_MAKE_SHARED_INCLUDE
+#include <boost/foreach.hpp>
+#include <boost/variant/get.hpp>
+
+// stl
+#include <algorithm>
+
+namespace node_mapnik {
+
+namespace {
+
+bool same_resolution(mapnik::query::resolution_type const& a,
+                     mapnik::query::resolution_type const& b)
+{
+    return a.get<0>() == b.get<0>() && a.get<1>() == b.get<1>();
+}
+
+bool contains(std::set<std::string> const& haystack,
+              std::set<std::string> const& needles)
+{
+    BOOST_FOREACH(std::string const& name, needles)
+    {
+        if (haystack.find(name) == haystack.end()) return false;
+    }
+    return true;
+}
+
+// sql datasources can substitute the render scale into the query, in
+// which case features fetched for one resolution are not valid for another
+bool depends_on_scale(mapnik::parameters const& params)
+{
+    mapnik::parameters::const_iterator itr = params.begin();
+    mapnik::parameters::const_iterator end = params.end();
+    for (; itr != end; ++itr)
+    {
+        std::string const* str = boost::get<std::string>(&itr->second);
+        if (str && (str->find("!scale_denominator!") != std::string::npos ||
+                    str->find("!pixel_width!") != std::string::npos ||
+                    str->find("!pixel_height!") != std::string::npos))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool feature_intersects(mapnik::feature_impl const& feature, mapnik::box2d<double> const& bbox)
+{
+    if (feature.paths().empty())
+    {
+        mapnik::raster_ptr const& raster = feature.get_raster();
+        if (raster) return bbox.intersects(raster->ext_);
+        // nothing to test against, let the renderer decide
+        return true;
+    }
+    return bbox.intersects(feature.envelope());
+}
+
+}
+
+cached_featureset::cached_featureset(feature_cache::features_ptr const& features,
+                                     mapnik::box2d<double> const& bbox,
+                                     bool filter)
+    : features_(features),
+      itr_(features->begin()),
+      end_(features->end()),
+      bbox_(bbox),
+      filter_(filter) {}
+
+cached_featureset::~cached_featureset() {}
+
+mapnik::feature_ptr cached_featureset::next()
+{
+    while (itr_ != end_)
+    {
+        mapnik::feature_ptr const& feature = *itr_++;
+        if (!filter_ || intersects(*feature))
+        {
+            return feature;
+        }
+    }
+    return mapnik::feature_ptr();
+}
+
+bool cached_featureset::intersects(mapnik::feature_impl const& feature) const
+{
+    return feature_intersects(feature, bbox_);
+}
+
+caching_featureset::caching_featureset(mapnik::featureset_ptr const& fs,
+                                       mapnik::datasource_ptr const& source,
+                                       feature_cache_ptr const& cache,
+                                       mapnik::query const& fetch_q,
+                                       mapnik::box2d<double> const& bbox)
+    : fs_(fs),
+      source_(source),
+      cache_(cache),
+      fetch_q_(fetch_q),
+      bbox_(bbox),
+      filter_(!(fetch_q.get_bbox() == bbox)),
+      features_(MAPNIK_MAKE_SHARED<feature_cache::features_type>()),
+      bytes_(0) {}
+
+caching_featureset::~caching_featureset() {}
+
+mapnik::feature_ptr caching_featureset::next()
+{
+    mapnik::feature_ptr feature;
+    while ((feature = fs_->next()))
+    {
+        if (features_)
+        {
+            bytes_ += estimate_feature_bytes(*feature);
+            if (bytes_ > cache_->max_bytes())
+            {
+                // too large to cache: stop collecting and pass through
+                features_.reset();
+            }
+            else
+            {
+                features_->push_back(feature);
+            }
+        }
+        if (!filter_ || intersects(*feature))
+        {
+            return feature;
+        }
+    }
+    if (features_)
+    {
+        cache_->insert(source_, fetch_q_.get_bbox(), fetch_q_, features_, bytes_);
+        features_.reset();
+    }
+    return feature;
+}
+
+bool caching_featureset::intersects(mapnik::feature_impl const& feature) const
+{
+    return feature_intersects(feature, bbox_);
+}
+
+feature_cache::feature_cache(std::size_t max_bytes)
+    : entries_(),
+      max_bytes_(max_bytes),
+      bytes_(0),
+      hits_(0),
+      misses_(0),
+      evictions_(0)
+{
+    uv_mutex_init(&mutex_);
+}
+
+feature_cache::~feature_cache()
+{
+    uv_mutex_destroy(&mutex_);
+}
+
+bool feature_cache::find(mapnik::datasource_ptr const& source,
+                         mapnik::query const& q,
+                         bool exact,
+                         result & res)
+{
+    mapnik::box2d<double> const& bbox = q.get_bbox();
+    uv_mutex_lock(&mutex_);
+    lru_type::iterator itr = entries_.begin();
+    lru_type::iterator end = entries_.end();
+    for (; itr != end; ++itr)
+    {
+        if (itr->source != source) continue;
+        if (exact)
+        {
+            if (!(itr->bbox == bbox)) continue;
+            mapnik::query::resolution_type res_xy(itr->resolution_x, itr->resolution_y);
+            if (!same_resolution(res_xy, q.resolution())) continue;
+        }
+        else if (!itr->bbox.contains(bbox))
+        {
+            continue;
+        }
+        if (!contains(itr->names, q.property_names())) continue;
+        // move to the front of the lru list
+        entries_.splice(entries_.begin(), entries_, itr);
+        res.features = itr->features;
+        res.bbox = itr->bbox;
+        ++hits_;
+        uv_mutex_unlock(&mutex_);
+        return true;
+    }
+    ++misses_;
+    uv_mutex_unlock(&mutex_);
+    return false;
+}
+
+void feature_cache::insert(mapnik::datasource_ptr const& source,
+                           mapnik::box2d<double> const& bbox,
+                           mapnik::query const& q,
+                           features_ptr const& features,
+                           std::size_t bytes)
+{
+    if (bytes > max_bytes_) return;
+    uv_mutex_lock(&mutex_);
+    // drop entries that the new one makes redundant
+    lru_type::iterator itr = entries_.begin();
+    while (itr != entries_.end())
+    {
+        if (itr->source == source &&
+            bbox.contains(itr->bbox) &&
+            same_resolution(q.resolution(), mapnik::query::resolution_type(itr->resolution_x, itr->resolution_y)) &&
+            contains(q.property_names(), itr->names))
+        {
+            bytes_ -= itr->bytes;
+            itr = entries_.erase(itr);
+        }
+        else
+        {
+            ++itr;
+        }
+    }
+    evict_to(max_bytes_ - bytes);
+    entry e;
+    e.source = source;
+    e.bbox = bbox;
+    e.resolution_x = q.resolution().get<0>();
+    e.resolution_y = q.resolution().get<1>();
+    e.names = q.property_names();
+    e.features = features;
+    e.bytes = bytes;
+    entries_.push_front(e);
+    bytes_ += bytes;
+    uv_mutex_unlock(&mutex_);
+}
+
+void feature_cache::evict_to(std::size_t target_bytes)
+{
+    while (bytes_ > target_bytes && !entries_.empty())
+    {
+        bytes_ -= entries_.back().bytes;
+        entries_.pop_back();
+        ++evictions_;
+    }
+}
+
+void feature_cache::clear()
+{
+    uv_mutex_lock(&mutex_);
+    entries_.clear();
+    bytes_ = 0;
+    uv_mutex_unlock(&mutex_);
+}
+
+std::size_t feature_cache::bytes() const
+{
+    uv_mutex_lock(&mutex_);
+    std::size_t bytes = bytes_;
+    uv_mutex_unlock(&mutex_);
+    return bytes;
+}
+
+std::size_t feature_cache::size() const
+{
+    uv_mutex_lock(&mutex_);
+    std::size_t size = entries_.size();
+    uv_mutex_unlock(&mutex_);
+    return size;
+}
+
+unsigned long feature_cache::hits() const
+{
+    uv_mutex_lock(&mutex_);
+    unsigned long hits = hits_;
+    uv_mutex_unlock(&mutex_);
+    return hits;
+}
+
+unsigned long feature_cache::misses() const
+{
+    uv_mutex_lock(&mutex_);
+    unsigned long misses = misses_;
+    uv_mutex_unlock(&mutex_);
+    return misses;
+}
+
+unsigned long feature_cache::evictions() const
+{
+    uv_mutex_lock(&mutex_);
+    unsigned long evictions = evictions_;
+    uv_mutex_unlock(&mutex_);
+    return evictions;
+}
+
+std::size_t estimate_feature_bytes(mapnik::feature_impl const& feature)
+{
+    std::size_t bytes = sizeof(mapnik::feature_impl) + feature.size() * sizeof(mapnik::value);
+    BOOST_FOREACH(mapnik::geometry_type const& geom, feature.paths())
+    {
+        // x, y and a command byte per vertex
+        bytes += sizeof(mapnik::geometry_type) + geom.size() * (2 * sizeof(double) + 1);
+    }
+    mapnik::raster_ptr const& raster = feature.get_raster();
+    if (raster)
+    {
+        bytes += sizeof(mapnik::raster) + raster->data_.width() * raster->data_.height() * 4;
+    }
+    return bytes;
+}
+
+cached_datasource::cached_datasource(mapnik::datasource_ptr const& ds,
+                                     feature_cache_ptr const& cache,
+                                     double expand,
+                                     bool fetch_all_attributes)
+    : mapnik::datasource(ds->params()),
+      ds_(ds),
+      cache_(cache),
+      expand_(expand),
+      exact_(ds->type() == mapnik::datasource::Raster || depends_on_scale(ds->params())),
+      fetch_all_attributes_(fetch_all_attributes) {}
+
+cached_datasource::~cached_datasource() {}
+
+mapnik::datasource::datasource_t cached_datasource::type() const
+{
+    return ds_->type();
+}
+
+mapnik::featureset_ptr cached_datasource::features(mapnik::query const& q) const
+{
+    mapnik::box2d<double> const& bbox = q.get_bbox();
+    feature_cache::result cached;
+    if (cache_->find(ds_, q, exact_, cached))
+    {
+        return MAPNIK_MAKE_SHARED<cached_featureset>(cached.features, bbox, !(cached.bbox == bbox));
+    }
+
+    mapnik::box2d<double> fetch_bbox(bbox);
+    if (!exact_ && expand_ > 0)
+    {
+        fetch_bbox.pad(std::max(bbox.width(), bbox.height()) * expand_);
+    }
+    mapnik::query fetch_q(fetch_bbox, q.resolution(), q.scale_denominator(), q.get_unbuffered_bbox());
+    fetch_q.set_filter_factor(q.get_filter_factor());
+    if (fetch_all_attributes_)
+    {
+        BOOST_FOREACH(mapnik::attribute_descriptor const& desc, ds_->get_descriptor().get_descriptors())
+        {
+            fetch_q.add_property_name(desc.get_name());
+        }
+    }
+    // also covers names the descriptor does not list
+    BOOST_FOREACH(std::string const& name, q.property_names())
+    {
+        fetch_q.add_property_name(name);
+    }
+
+    mapnik::featureset_ptr fs = ds_->features(fetch_q);
+    if (!fs)
+    {
+        // nothing to stream, remember the empty result
+        feature_cache::features_ptr empty = MAPNIK_MAKE_SHARED<feature_cache::features_type>();
+        cache_->insert(ds_, fetch_bbox, fetch_q, empty, 0);
+        return MAPNIK_MAKE_SHARED<cached_featureset>(empty, bbox, false);
+    }
+    return MAPNIK_MAKE_SHARED<caching_featureset>(fs, ds_, cache_, fetch_q, bbox);
+}
+
+#if MAPNIK_VERSION >= 200200
+mapnik::featureset_ptr cached_datasource::features_at_point(mapnik::coord2d const& pt, double tol) const
+{
+    return ds_->features_at_point(pt, tol);
+}
+#else
+mapnik::featureset_ptr cached_datasource::features_at_point(mapnik::coord2d const& pt) const
+{
+    return ds_->features_at_point(pt);
+}
+#endif
+
+mapnik::box2d<double> cached_datasource::envelope() const
+{
+    return ds_->envelope();
+}
+
+boost::optional<mapnik::datasource::geometry_t> cached_datasource::get_geometry_type() const
+{
+    return ds_->get_geometry_type();
+}
+
+mapnik::layer_descriptor cached_datasource::get_descriptor() const
+{
+    return ds_->get_descriptor();
+}
+
+void attach_feature_cache(mapnik::Map & map, feature_cache_ptr const& cache, double expand)
+{
+    BOOST_FOREACH(mapnik::layer & lyr, map.layers())
+    {
+        mapnik::datasource_ptr ds = lyr.datasource();
+        if (!ds) continue;
+        cached_datasource * cds = dynamic_cast<cached_datasource *>(ds.get());
+        if (cds)
+        {
+            if (cds->cache() == cache) continue;
+            ds = cds->wrapped();
+        }
+        lyr.set_datasource(MAPNIK_MAKE_SHARED<cached_datasource>(ds, cache, expand, false));
+    }
+}
+
+void detach_feature_cache(mapnik::Map & map)
+{
+    BOOST_FOREACH(mapnik::layer & lyr, map.layers())
+    {
+        mapnik::datasource_ptr ds = lyr.datasource();
+        if (!ds) continue;
+        cached_datasource * cds = dynamic_cast<cached_datasource *>(ds.get());
+        if (cds)
+        {
+            lyr.set_datasource(cds->wrapped());
+        }
+    }
+}
+
+}
@@ -0,0 +1,206 @@
+#ifndef __NODE_MAPNIK_FEATURE_CACHE_H__
+#define __NODE_MAPNIK_FEATURE_CACHE_H__
+
+// libuv
+#include <uv.h>
+
+// mapnik
+#include <mapnik/box2d.hpp>
+#include <mapnik/datasource.hpp>        // for datasource, featureset_ptr
+#include <mapnik/feature.hpp>
+#include <mapnik/feature_layer_desc.hpp>
+#include <mapnik/query.hpp>
+#include <mapnik/version.hpp>
+#include "mapnik3x_compatibility.hpp"
+
+// boost
+#include MAPNIK_SHARED_INCLUDE
+#include <boost/noncopyable.hpp>
+#include <boost/optional/optional.hpp>
+
+// stl
+#include <list>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace mapnik { class Map; }
+
+namespace node_mapnik {
+
+/*
+ * Byte-bounded LRU cache of materialized featuresets.
+ *
+ * Entries are keyed by the datasource they came from, the fetched bbox,
+ * the attribute names that were fetched and (for raster sources) the
+ * query resolution. A lookup is served by any entry whose bbox contains
+ * the requested bbox and whose attributes are a superset of the requested
+ * ones, so neighbouring or 1x/2x renders of the same area can share data.
+ */
+class feature_cache : private boost::noncopyable
+{
+public:
+    typedef std::vector<mapnik::feature_ptr> features_type;
+    typedef MAPNIK_SHARED_PTR<features_type const> features_ptr;
+
+    struct result
+    {
+        features_ptr features;
+        mapnik::box2d<double> bbox;
+    };
+
+    explicit feature_cache(std::size_t max_bytes);
+    ~feature_cache();
+
+    // `exact` restricts hits to entries with the same bbox and resolution,
+    // used for rasters and sql queries that depend on the render scale
+    bool find(mapnik::datasource_ptr const& source,
+              mapnik::query const& q,
+              bool exact,
+              result & res);
+    void insert(mapnik::datasource_ptr const& source,
+                mapnik::box2d<double> const& bbox,
+                mapnik::query const& q,
+                features_ptr const& features,
+                std::size_t bytes);
+    void clear();
+
+    std::size_t max_bytes() const { return max_bytes_; }
+    std::size_t bytes() const;
+    std::size_t size() const;
+    unsigned long hits() const;
+    unsigned long misses() const;
+    unsigned long evictions() const;
+
+private:
+    struct entry
+    {
+        // holding the datasource keeps its address from being reused
+        // by another source while the entry is alive
+        mapnik::datasource_ptr source;
+        mapnik::box2d<double> bbox;
+        double resolution_x;
+        double resolution_y;
+        std::set<std::string> names;
+        features_ptr features;
+        std::size_t bytes;
+    };
+    typedef std::list<entry> lru_type;
+
+    void evict_to(std::size_t target_bytes);
+
+    lru_type entries_; // most recently used at the front
+    std::size_t max_bytes_;
+    std::size_t bytes_;
+    unsigned long hits_;
+    unsigned long misses_;
+    unsigned long evictions_;
+    mutable uv_mutex_t mutex_;
+};
+
+typedef MAPNIK_SHARED_PTR<feature_cache> feature_cache_ptr;
+
+// serves features out of a shared vector, optionally dropping the ones
+// that fall outside of `bbox` when the vector covers a larger area
+class cached_featureset : public mapnik::Featureset
+{
+public:
+    cached_featureset(feature_cache::features_ptr const& features,
+                      mapnik::box2d<double> const& bbox,
+                      bool filter);
+    virtual ~cached_featureset();
+    mapnik::feature_ptr next();
+
+private:
+    bool intersects(mapnik::feature_impl const& feature) const;
+
+    feature_cache::features_ptr features_;
+    feature_cache::features_type::const_iterator itr_;
+    feature_cache::features_type::const_iterator end_;
+    mapnik::box2d<double> bbox_;
+    bool filter_;
+};
+
+/*
+ * Streams the features of a datasource query while collecting them for
+ * the cache. Features are handed out as they are read; once the
+ * collected ones would exceed the cache budget they are released and the
+ * rest of the query passes straight through, so queries too large to
+ * cache never sit in memory as a whole. A fully read query that stayed
+ * within budget is inserted into the cache at its end.
+ */
+class caching_featureset : public mapnik::Featureset
+{
+public:
+    caching_featureset(mapnik::featureset_ptr const& fs,
+                       mapnik::datasource_ptr const& source,
+                       feature_cache_ptr const& cache,
+                       mapnik::query const& fetch_q,
+                       mapnik::box2d<double> const& bbox);
+    virtual ~caching_featureset();
+    mapnik::feature_ptr next();
+
+private:
+    bool intersects(mapnik::feature_impl const& feature) const;
+
+    mapnik::featureset_ptr fs_;
+    mapnik::datasource_ptr source_;
+    feature_cache_ptr cache_;
+    mapnik::query fetch_q_;
+    mapnik::box2d<double> bbox_;
+    bool filter_;
+    // null once the budget is exceeded or the entry has been inserted
+    MAPNIK_SHARED_PTR<feature_cache::features_type> features_;
+    std::size_t bytes_;
+};
+
+// rough in-memory size of a feature, used to enforce the cache budget
+std::size_t estimate_feature_bytes(mapnik::feature_impl const& feature);
+
+/*
+ * Datasource wrapper that answers queries out of a feature_cache and
+ * falls through to the wrapped datasource on a miss. Everything other
+ * than features() is forwarded untouched, so the wrapper is transparent
+ * to save_map, Layer.datasource and describe().
+ */
+class cached_datasource : public mapnik::datasource
+{
+public:
+    cached_datasource(mapnik::datasource_ptr const& ds,
+                      feature_cache_ptr const& cache,
+                      double expand = 0.0,
+                      bool fetch_all_attributes = false);
+    virtual ~cached_datasource();
+
+    virtual mapnik::datasource::datasource_t type() const;
+    virtual mapnik::featureset_ptr features(mapnik::query const& q) const;
+#if MAPNIK_VERSION >= 200200
+    virtual mapnik::featureset_ptr features_at_point(mapnik::coord2d const& pt, double tol = 0) const;
+#else
+    virtual mapnik::featureset_ptr features_at_point(mapnik::coord2d const& pt) const;
+#endif
+    virtual mapnik::box2d<double> envelope() const;
+    virtual boost::optional<mapnik::datasource::geometry_t> get_geometry_type() const;
+    virtual mapnik::layer_descriptor get_descriptor() const;
+
+    mapnik::datasource_ptr const& wrapped() const { return ds_; }
+    feature_cache_ptr const& cache() const { return cache_; }
+
+private:
+    mapnik::datasource_ptr ds_;
+    feature_cache_ptr cache_;
+    double expand_;
+    bool exact_;
+    bool fetch_all_attributes_;
+};
+
+// wrap every layer datasource of the map with a cached_datasource bound to
+// `cache`, re-wrapping layers that are bound to a different cache
+void attach_feature_cache(mapnik::Map & map, feature_cache_ptr const& cache, double expand);
+
+// restore the original datasources of all layers
+void detach_feature_cache(mapnik::Map & map);
+
+}
+
+#endif // __NODE_MAPNIK_FEATURE_CACHE_H__
@@ -0,0 +1,286 @@
+#include "grid_layers.hpp"
+#include "utils.hpp"
+
+// mapnik
+#include <mapnik/layer.hpp>             // for layer
+#include <mapnik/map.hpp>               // for Map
+
+// boost
+#include MAPNIK_MAKE_SHARED_INCLUDE
+#include <boost/foreach.hpp>
+
+// stl
+#include <map>
+#include <sstream>
+#include <stdint.h>                     // for int64_t
+
+using namespace v8;
+
+namespace node_mapnik {
+
+// name under which the qualified key is stored on merged features
+static const std::string qualified_key_name = "__layer_key__";
+
+static bool find_layer(Local<Value> const& layer_id,
+                       mapnik::Map const& map,
+                       std::size_t & layer_idx,
+                       std::string & error)
+{
+    std::vector<mapnik::layer> const& layers = map.layers();
+    if (layer_id->IsString())
+    {
+        std::string const& layer_name = TOSTR(layer_id);
+        for (std::size_t i = 0; i < layers.size(); ++i)
+        {
+            if (layers[i].name() == layer_name)
+            {
+                layer_idx = i;
+                return true;
+            }
+        }
+        std::ostringstream s;
+        s << "Layer name '" << layer_name << "' not found";
+        error = s.str();
+        return false;
+    }
+    else if (layer_id->IsNumber())
+    {
+        int64_t idx = layer_id->IntegerValue();
+        if (idx < 0 || static_cast<std::size_t>(idx) >= layers.size())
+        {
+            std::ostringstream s;
+            s << "Zero-based layer index '" << idx << "' not valid, ";
+            if (layers.size() > 0)
+            {
+                s << "only '" << layers.size() << "' layers exist in map";
+            }
+            else
+            {
+                s << "no layers found in map";
+            }
+            error = s.str();
+            return false;
+        }
+        layer_idx = static_cast<std::size_t>(idx);
+        return true;
+    }
+    error = "layer id must be a string or index number";
+    return false;
+}
+
+bool parse_grid_layers(Local<Value> const& value,
+                       mapnik::Map const& map,
+                       std::string const& default_key,
+                       std::vector<grid_layer_spec> & specs,
+                       std::string & error)
+{
+    if (!value->IsArray())
+    {
+        error = "option 'layers' must be an array of layer names, indexes or {layer,key,fields} objects";
+        return false;
+    }
+    Local<Array> a = Local<Array>::Cast(value);
+    if (a->Length() == 0)
+    {
+        error = "option 'layers' must not be empty";
+        return false;
+    }
+    for (unsigned i = 0; i < a->Length(); ++i)
+    {
+        Local<Value> item = a->Get(i);
+        grid_layer_spec spec;
+        spec.key = default_key;
+        Local<Value> layer_id = item;
+        if (item->IsObject() && !item->IsString() && !item->IsNumber())
+        {
+            Local<Object> obj = item->ToObject();
+            if (!obj->Has(String::New("layer")))
+            {
+                error = "each entry of option 'layers' requires a 'layer' name or index";
+                return false;
+            }
+            layer_id = obj->Get(String::New("layer"));
+            if (obj->Has(String::New("key")))
+            {
+                Local<Value> key = obj->Get(String::New("key"));
+                if (!key->IsString())
+                {
+                    error = "'key' of a grid layer must be a string";
+                    return false;
+                }
+                spec.key = TOSTR(key);
+            }
+            if (obj->Has(String::New("fields")))
+            {
+                Local<Value> fields = obj->Get(String::New("fields"));
+                if (!fields->IsArray())
+                {
+                    error = "'fields' of a grid layer must be an array of strings";
+                    return false;
+                }
+                Local<Array> f = Local<Array>::Cast(fields);
+                for (unsigned j = 0; j < f->Length(); ++j)
+                {
+                    Local<Value> name = f->Get(j);
+                    if (name->IsString())
+                    {
+                        spec.fields.insert(TOSTR(name));
+                    }
+                }
+            }
+        }
+        if (!find_layer(layer_id, map, spec.layer_idx, error))
+        {
+            return false;
+        }
+        spec.name = map.layers()[spec.layer_idx].name();
+        specs.push_back(spec);
+    }
+    return true;
+}
+
+std::set<std::string> grid_query_attributes(mapnik::grid const& grid)
+{
+    // copy property names
+    std::set<std::string> attributes = grid.property_names();
+
+    // todo - make this a static constant
+    std::string known_id_key = "__id__";
+    if (attributes.find(known_id_key) != attributes.end())
+    {
+        attributes.erase(known_id_key);
+    }
+
+    std::string join_field = grid.get_key();
+    if (known_id_key != join_field &&
+        attributes.find(join_field) == attributes.end())
+    {
+        attributes.insert(join_field);
+    }
+    return attributes;
+}
+
+grid_layer_merger::grid_layer_merger(mapnik::grid & target, std::vector<grid_layer_spec> const& specs)
+    : target_(target),
+      specs_(specs),
+      target_key_(target.get_key()),
+      ctx_(MAPNIK_MAKE_SHARED<mapnik::context_type>()),
+      next_id_(0),
+      scratch_()
+{
+    // merged features carry their layer qualified key under a private name
+    // so the target grid can look it up like any other join field
+    ctx_->push(qualified_key_name);
+    BOOST_FOREACH(grid_layer_spec const& spec, specs_)
+    {
+        BOOST_FOREACH(std::string const& field, spec.fields)
+        {
+            ctx_->push(field);
+            target_.add_property_name(field);
+        }
+    }
+    target_.set_key(qualified_key_name);
+
+    // stay clear of ids already painted into the target
+    mapnik::grid::feature_key_type const& keys = target_.get_feature_keys();
+    mapnik::grid::feature_key_type::const_iterator itr = keys.begin();
+    for (; itr != keys.end(); ++itr)
+    {
+        if (itr->first != mapnik::grid::base_mask && itr->first >= next_id_)
+        {
+            next_id_ = itr->first + 1;
+        }
+    }
+    if (next_id_ <= mapnik::grid::base_mask) next_id_ = mapnik::grid::base_mask + 1;
+}
+
+grid_layer_merger::~grid_layer_merger()
+{
+    target_.set_key(target_key_);
+}
+
+mapnik::grid & grid_layer_merger::layer_grid(std::size_t index)
+{
+    grid_layer_spec const& spec = specs_[index];
+    scratch_ = MAPNIK_MAKE_SHARED<mapnik::grid>(target_.width(), target_.height(), spec.key, 1);
+    BOOST_FOREACH(std::string const& field, spec.fields)
+    {
+        scratch_->add_property_name(field);
+    }
+    return *scratch_;
+}
+
+void grid_layer_merger::merge(std::size_t index)
+{
+    typedef mapnik::grid::value_type value_type;
+    typedef std::map<value_type, value_type> remap_type;
+
+    grid_layer_spec const& spec = specs_[index];
+    mapnik::grid const& source = *scratch_;
+    mapnik::grid::feature_key_type const& keys = source.get_feature_keys();
+    mapnik::grid::feature_type const& features = source.get_grid_features();
+
+    // features sharing a key within the layer share one id in the target
+    std::map<std::string, value_type> key_ids;
+    remap_type remap;
+    mapnik::grid::feature_key_type::const_iterator itr = keys.begin();
+    for (; itr != keys.end(); ++itr)
+    {
+        if (itr->first == mapnik::grid::base_mask) continue;
+        std::map<std::string, value_type>::const_iterator id_pos = key_ids.find(itr->second);
+        if (id_pos != key_ids.end())
+        {
+            remap[itr->first] = id_pos->second;
+            continue;
+        }
+        value_type id = next_id_++;
+        key_ids[itr->second] = id;
+        remap[itr->first] = id;
+
+        // the scratch grid owns copies of its features, build new ones
+        // rather than touching anything a datasource or cache may share
+        mapnik::feature_impl feature(ctx_, id);
+        feature.put(qualified_key_name, spec.name + ":" + itr->second);
+        mapnik::grid::feature_type::const_iterator feat_pos = features.find(itr->second);
+        if (feat_pos != features.end())
+        {
+            BOOST_FOREACH(std::string const& field, spec.fields)
+            {
+                if (feat_pos->second->has_key(field))
+                {
+                    feature.put(field, feat_pos->second->get(field));
+                }
+            }
+        }
+        target_.add_feature(feature);
+    }
+
+    // paint the layer over the target, remembering the last lookup since
+    // neighbouring pixels mostly belong to the same feature
+    mapnik::grid::data_type & dst = target_.data();
+    mapnik::grid::data_type const& src = source.data();
+    for (unsigned y = 0; y < src.height(); ++y)
+    {
+        value_type const* src_row = src.getRow(y);
+        value_type * dst_row = dst.getRow(y);
+        value_type last_src = mapnik::grid::base_mask;
+        value_type last_dst = mapnik::grid::base_mask;
+        for (unsigned x = 0; x < src.width(); ++x)
+        {
+            value_type id = src_row[x];
+            if (id == mapnik::grid::base_mask) continue;
+            if (id != last_src)
+            {
+                remap_type::const_iterator pos = remap.find(id);
+                if (pos == remap.end()) continue;
+                last_src = id;
+                last_dst = pos->second;
+            }
+            dst_row[x] = last_dst;
+        }
+    }
+    if (source.painted()) target_.painted(true);
+    scratch_.reset();
+}
+
+}
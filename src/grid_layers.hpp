@@ -0,0 +1,78 @@
+#ifndef __NODE_MAPNIK_GRID_LAYERS_H__
+#define __NODE_MAPNIK_GRID_LAYERS_H__
+
+// v8
+#include <v8.h>
+
+// mapnik
+#include <mapnik/feature.hpp>           // for context_ptr
+#include <mapnik/grid/grid.hpp>         // for grid
+#include "mapnik3x_compatibility.hpp"
+
+// boost
+#include MAPNIK_SHARED_INCLUDE
+
+// stl
+#include <set>
+#include <string>
+#include <vector>
+
+namespace mapnik { class Map; }
+
+namespace node_mapnik {
+
+// one layer of a multi-layer grid render
+struct grid_layer_spec
+{
+    std::size_t layer_idx;
+    std::string name;
+    std::string key;                // join field, "__id__" for feature ids
+    std::set<std::string> fields;
+};
+
+/*
+ * Parses the `layers` grid render option: an array of layer names or
+ * indexes, or of {layer, key, fields} objects. `key` defaults to the key of
+ * the grid and `fields` to none. Returns false and sets `error` on invalid
+ * input.
+ */
+bool parse_grid_layers(v8::Local<v8::Value> const& value,
+                       mapnik::Map const& map,
+                       std::string const& default_key,
+                       std::vector<grid_layer_spec> & specs,
+                       std::string & error);
+
+// attributes a grid render has to query: the requested fields plus the join field
+std::set<std::string> grid_query_attributes(mapnik::grid const& grid);
+
+/*
+ * Combines per-layer grids into one grid whose keys are qualified with the
+ * layer name ("<layer>:<key>"), so several layers can be interactive in a
+ * single UTFGrid. Each layer is rendered once into its own scratch grid,
+ * which keeps the feature ids of different layers from colliding, and is
+ * then painted over the target in layer order.
+ */
+class grid_layer_merger
+{
+public:
+    grid_layer_merger(mapnik::grid & target, std::vector<grid_layer_spec> const& specs);
+    ~grid_layer_merger();
+
+    // the scratch grid to render the layer at `index` into
+    mapnik::grid & layer_grid(std::size_t index);
+
+    // merge the scratch grid of the layer at `index` into the target
+    void merge(std::size_t index);
+
+private:
+    mapnik::grid & target_;
+    std::vector<grid_layer_spec> const& specs_;
+    std::string target_key_;
+    mapnik::context_ptr ctx_;
+    mapnik::grid::value_type next_id_;
+    MAPNIK_SHARED_PTR<mapnik::grid> scratch_;
+};
+
+}
+
+#endif // __NODE_MAPNIK_GRID_LAYERS_H__
@@ -0,0 +1,42 @@
+#ifndef __NODE_MAPNIK_GZIP_H__
+#define __NODE_MAPNIK_GZIP_H__
+
+// zlib
+#include <zlib.h>
+
+// stl
+#include <stdexcept>
+#include <string>
+
+namespace node_mapnik {
+
+// gzip-compresses `in` into `out`, throws std::runtime_error on failure
+inline void gzip_compress(std::string const& in, std::string & out, int level = Z_DEFAULT_COMPRESSION)
+{
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    // 15 window bits + 16 selects the gzip wrapper
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        throw std::runtime_error("gzip: could not initialize deflate");
+    }
+    out.resize(deflateBound(&stream, static_cast<uLong>(in.size())) + 32);
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+    stream.avail_in = static_cast<uInt>(in.size());
+    stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    stream.avail_out = static_cast<uInt>(out.size());
+    int ret = deflate(&stream, Z_FINISH);
+    std::size_t written = out.size() - stream.avail_out;
+    deflateEnd(&stream);
+    if (ret != Z_STREAM_END)
+    {
+        throw std::runtime_error("gzip: deflate failed");
+    }
+    out.resize(written);
+}
+
+}
+
+#endif // __NODE_MAPNIK_GZIP_H__
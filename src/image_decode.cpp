@@ -0,0 +1,399 @@
+#include "image_decode.hpp"
+#include "pixel_kernels.hpp"
+#include "raster_pool.hpp"
+
+// mapnik
+#include <mapnik/image_data.hpp>
+#include <mapnik/image_reader.hpp>
+
+#if defined(HAVE_JPEG)
+#include <cstdio>
+extern "C"
+{
+#include <jpeglib.h>
+}
+#endif
+
+// stl
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+using namespace v8;
+
+namespace node_mapnik {
+
+namespace {
+
+typedef MAPNIK_SHARED_PTR<mapnik::image_32> image_ptr;
+
+// tiff bands, in output rows, when decoding with a scale
+const unsigned band_output_rows = 64;
+
+struct window
+{
+    unsigned x;
+    unsigned y;
+    unsigned width;
+    unsigned height;
+};
+
+unsigned ceil_div(unsigned n, unsigned d)
+{
+    return (n + d - 1) / d;
+}
+
+window resolve_window(unsigned width, unsigned height, decode_options const& options)
+{
+    if (options.x >= width || options.y >= height)
+    {
+        throw std::runtime_error("decode window is outside of the image");
+    }
+    window win;
+    win.x = options.x;
+    win.y = options.y;
+    win.width = width - options.x;
+    win.height = height - options.y;
+    if (options.width > 0) win.width = std::min(win.width, options.width);
+    if (options.height > 0) win.height = std::min(win.height, options.height);
+    return win;
+}
+
+// averages 2x2 blocks of `src` into `dst`, which holds ceil(w/2) x ceil(h/2)
+// pixels; a last odd row or column is averaged with itself
+void halve(unsigned const* src, unsigned w, unsigned h, unsigned * dst)
+{
+    unsigned half_w = ceil_div(w, 2);
+    unsigned half_h = ceil_div(h, 2);
+    unsigned pairs = w / 2;
+    for (unsigned y = 0; y < half_h; ++y)
+    {
+        unsigned const* top = src + static_cast<std::size_t>(2 * y) * w;
+        unsigned const* bottom = (2 * y + 1 < h) ? top + w : top;
+        unsigned * out = dst + static_cast<std::size_t>(y) * half_w;
+        downsample_2x_pixels(top, bottom, out, pairs);
+        if (w % 2)
+        {
+            unsigned t[2] = { top[w - 1], top[w - 1] };
+            unsigned b[2] = { bottom[w - 1], bottom[w - 1] };
+            downsample_2x_pixels(t, b, out + pairs, 1);
+        }
+    }
+}
+
+// reduces premultiplied `src` (w x h) by `scale`, a power of two above 1,
+// into `dst` holding ceil(w/scale) x ceil(h/scale) pixels
+void reduce(unsigned const* src, unsigned w, unsigned h, unsigned scale, unsigned * dst)
+{
+    std::vector<unsigned> current;
+    std::vector<unsigned> next;
+    while (scale > 1)
+    {
+        unsigned half_w = ceil_div(w, 2);
+        unsigned half_h = ceil_div(h, 2);
+        unsigned * out = dst;
+        if (scale > 2)
+        {
+            next.resize(static_cast<std::size_t>(half_w) * half_h);
+            out = &next[0];
+        }
+        halve(src, w, h, out);
+        current.swap(next);
+        src = current.empty() ? 0 : &current[0];
+        w = half_w;
+        h = half_h;
+        scale /= 2;
+    }
+}
+
+image_ptr decode_with_reader(mapnik::image_reader & reader,
+                             bool windowed_reads,
+                             decode_options const& options)
+{
+    window win = resolve_window(reader.width(), reader.height(), options);
+    raster_pool & pool = raster_pool::instance();
+    if (options.scale == 1)
+    {
+        image_ptr out = pool.acquire_image(win.width, win.height);
+        reader.read(win.x, win.y, out->data());
+        return out;
+    }
+
+    unsigned scale = options.scale;
+    image_ptr out = pool.acquire_image(ceil_div(win.width, scale), ceil_div(win.height, scale));
+    // readers without windowed access decode everything above the window
+    // on every read, so they get a single band
+    unsigned band_rows = windowed_reads ? std::min(win.height, scale * band_output_rows) : win.height;
+    image_ptr band;
+    for (unsigned y = 0; y < win.height; y += band_rows)
+    {
+        unsigned rows = std::min(band_rows, win.height - y);
+        if (!band || band->height() != rows)
+        {
+            band = pool.acquire_image(win.width, rows);
+        }
+        reader.read(win.x, win.y + y, band->data());
+        // averaging is only correct on premultiplied colours
+        premultiply_pixels(band->data().getData(), static_cast<std::size_t>(win.width) * rows);
+        reduce(band->data().getData(), win.width, rows, scale, out->data().getRow(y / scale));
+    }
+    mapnik::image_data_32 & data = out->data();
+    demultiply_pixels(data.getData(), static_cast<std::size_t>(data.width()) * data.height());
+    return out;
+}
+
+bool is_tiff(char const* data, std::size_t size)
+{
+    return size >= 4 &&
+        ((data[0] == 'I' && data[1] == 'I' && data[2] == 42 && data[3] == 0) ||
+         (data[0] == 'M' && data[1] == 'M' && data[2] == 0 && data[3] == 42));
+}
+
+#if defined(HAVE_JPEG)
+
+bool is_jpeg(char const* data, std::size_t size)
+{
+    return size >= 3 &&
+        static_cast<unsigned char>(data[0]) == 0xff &&
+        static_cast<unsigned char>(data[1]) == 0xd8 &&
+        static_cast<unsigned char>(data[2]) == 0xff;
+}
+
+void on_jpeg_error(j_common_ptr cinfo)
+{
+    char buffer[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, buffer);
+    throw std::runtime_error(std::string("JPEG Reader: libjpeg could not read image: ") + buffer);
+}
+
+void on_jpeg_message(j_common_ptr /*cinfo*/) {}
+
+// owns a decompressor, destroyed even when libjpeg throws
+struct jpeg_decoder
+{
+    jpeg_decoder()
+    {
+        cinfo.err = jpeg_std_error(&jerr);
+        jerr.error_exit = on_jpeg_error;
+        jerr.output_message = on_jpeg_message;
+        jpeg_create_decompress(&cinfo);
+    }
+
+    ~jpeg_decoder()
+    {
+        jpeg_destroy_decompress(&cinfo);
+    }
+
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr jerr;
+};
+
+// libjpeg source over a memory buffer (jpeg_mem_src is not in libjpeg 6b)
+void init_memory_source(j_decompress_ptr /*cinfo*/) {}
+
+boolean fill_memory_source(j_decompress_ptr cinfo)
+{
+    // past the end of the data: feed an end of image marker, as the
+    // stdio source does
+    static JOCTET const eoi[2] = { 0xff, JPEG_EOI };
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
+    return TRUE;
+}
+
+void skip_memory_source(j_decompress_ptr cinfo, long count)
+{
+    if (count <= 0) return;
+    jpeg_source_mgr * src = cinfo->src;
+    if (static_cast<std::size_t>(count) > src->bytes_in_buffer)
+    {
+        fill_memory_source(cinfo);
+        return;
+    }
+    src->next_input_byte += count;
+    src->bytes_in_buffer -= count;
+}
+
+void term_memory_source(j_decompress_ptr /*cinfo*/) {}
+
+/*
+ * Decodes the window of a jpeg with its source already set, letting
+ * libjpeg scale in the DCT and stopping after the last window row.
+ * Returns an empty pointer for colour spaces left to mapnik's reader and
+ * for windows not aligned to the scale: DCT scaling reduces blocks
+ * aligned to the image origin, where the other readers reduce blocks
+ * aligned to the window.
+ */
+image_ptr decode_jpeg(jpeg_decompress_struct & cinfo, decode_options const& options)
+{
+    jpeg_read_header(&cinfo, TRUE);
+    window win = resolve_window(cinfo.image_width, cinfo.image_height, options);
+    if (win.x % options.scale != 0 || win.y % options.scale != 0)
+    {
+        return image_ptr();
+    }
+    if (cinfo.jpeg_color_space == JCS_GRAYSCALE)
+    {
+        cinfo.out_color_space = JCS_GRAYSCALE;
+    }
+    else if (cinfo.jpeg_color_space == JCS_YCbCr || cinfo.jpeg_color_space == JCS_RGB)
+    {
+        cinfo.out_color_space = JCS_RGB;
+    }
+    else
+    {
+        return image_ptr();
+    }
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = options.scale;
+    jpeg_start_decompress(&cinfo);
+
+    unsigned x0 = win.x / options.scale;
+    unsigned y0 = win.y / options.scale;
+    unsigned width = std::min(ceil_div(win.width, options.scale), cinfo.output_width - x0);
+    unsigned height = std::min(ceil_div(win.height, options.scale), cinfo.output_height - y0);
+    image_ptr out = raster_pool::instance().acquire_image(width, height);
+
+    unsigned components = cinfo.output_components;
+    std::vector<JSAMPLE> row(static_cast<std::size_t>(cinfo.output_width) * components);
+    JSAMPROW row_ptr = &row[0];
+    for (unsigned y = 0; y < y0 + height; ++y)
+    {
+        jpeg_read_scanlines(&cinfo, &row_ptr, 1);
+        if (y < y0) continue;
+        JSAMPLE const* src = &row[static_cast<std::size_t>(x0) * components];
+        unsigned * dst = out->data().getRow(y - y0);
+        for (unsigned x = 0; x < width; ++x)
+        {
+            if (components == 1)
+            {
+                unsigned v = src[x];
+                dst[x] = 0xff000000 | (v << 16) | (v << 8) | v;
+            }
+            else
+            {
+                JSAMPLE const* px = src + x * components;
+                dst[x] = 0xff000000 | (px[2] << 16) | (px[1] << 8) | px[0];
+            }
+        }
+    }
+    // the rows below the window are never decoded
+    jpeg_abort_decompress(&cinfo);
+    return out;
+}
+
+image_ptr decode_jpeg_bytes(char const* data, std::size_t size, decode_options const& options)
+{
+    jpeg_decoder decoder;
+    jpeg_source_mgr src;
+    src.init_source = init_memory_source;
+    src.fill_input_buffer = fill_memory_source;
+    src.skip_input_data = skip_memory_source;
+    src.resync_to_restart = jpeg_resync_to_restart;
+    src.term_source = term_memory_source;
+    src.next_input_byte = reinterpret_cast<JOCTET const*>(data);
+    src.bytes_in_buffer = size;
+    decoder.cinfo.src = &src;
+    return decode_jpeg(decoder.cinfo, options);
+}
+
+struct file_closer
+{
+    explicit file_closer(std::FILE * f) : file(f) {}
+    ~file_closer() { if (file) std::fclose(file); }
+    std::FILE * file;
+};
+
+image_ptr decode_jpeg_file(std::string const& filename, decode_options const& options)
+{
+    file_closer f(std::fopen(filename.c_str(), "rb"));
+    if (!f.file) return image_ptr();
+    jpeg_decoder decoder;
+    jpeg_stdio_src(&decoder.cinfo, f.file);
+    return decode_jpeg(decoder.cinfo, options);
+}
+
+#endif // HAVE_JPEG
+
+}
+
+bool parse_decode_options(Local<Value> const& value,
+                          decode_options & options,
+                          std::string & error)
+{
+    if (!value->IsObject())
+    {
+        error = "decode options must be an object";
+        return false;
+    }
+    Local<Object> obj = value->ToObject();
+    if (obj->Has(String::New("window")))
+    {
+        Local<Value> win = obj->Get(String::New("window"));
+        if (!win->IsObject())
+        {
+            error = "option 'window' must be an object with x, y, width and height";
+            return false;
+        }
+        Local<Object> w = win->ToObject();
+        char const* names[4] = { "x", "y", "width", "height" };
+        unsigned * fields[4] = { &options.x, &options.y, &options.width, &options.height };
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            if (!w->Has(String::New(names[i]))) continue;
+            Local<Value> v = w->Get(String::New(names[i]));
+            if (!v->IsNumber() || v->IntegerValue() < 0)
+            {
+                error = std::string("window '") + names[i] + "' must be a non-negative integer";
+                return false;
+            }
+            *fields[i] = v->IntegerValue();
+        }
+    }
+    if (obj->Has(String::New("scale")))
+    {
+        Local<Value> scale = obj->Get(String::New("scale"));
+        int s = scale->IsNumber() ? scale->IntegerValue() : 0;
+        if (s != 1 && s != 2 && s != 4 && s != 8)
+        {
+            error = "option 'scale' must be 1, 2, 4 or 8";
+            return false;
+        }
+        options.scale = s;
+    }
+    return true;
+}
+
+image_ptr decode_image(char const* data,
+                       std::size_t size,
+                       decode_options const& options)
+{
+#if defined(HAVE_JPEG)
+    if (!options.full() && is_jpeg(data, size))
+    {
+        image_ptr image = decode_jpeg_bytes(data, size, options);
+        if (image) return image;
+    }
+#endif
+    MAPNIK_UNIQUE_PTR<mapnik::image_reader> reader(mapnik::get_image_reader(data, size));
+    if (!reader.get()) return image_ptr();
+    return decode_with_reader(*reader, is_tiff(data, size), options);
+}
+
+image_ptr decode_image_file(std::string const& filename,
+                            std::string const& type,
+                            decode_options const& options)
+{
+#if defined(HAVE_JPEG)
+    if (!options.full() && type == "jpeg")
+    {
+        image_ptr image = decode_jpeg_file(filename, options);
+        if (image) return image;
+    }
+#endif
+    MAPNIK_UNIQUE_PTR<mapnik::image_reader> reader(mapnik::get_image_reader(filename, type));
+    if (!reader.get()) return image_ptr();
+    return decode_with_reader(*reader, type == "tiff", options);
+}
+
+}
@@ -0,0 +1,71 @@
+#ifndef __NODE_MAPNIK_IMAGE_DECODE_H__
+#define __NODE_MAPNIK_IMAGE_DECODE_H__
+
+// v8
+#include <v8.h>
+
+// mapnik
+#include <mapnik/graphics.hpp>          // for image_32
+
+#include "mapnik3x_compatibility.hpp"
+
+// boost
+#include MAPNIK_SHARED_INCLUDE
+
+// stl
+#include <string>
+
+namespace node_mapnik {
+
+struct decode_options
+{
+    decode_options()
+        : x(0),
+          y(0),
+          width(0),
+          height(0),
+          scale(1) {}
+
+    bool full() const
+    {
+        return x == 0 && y == 0 && width == 0 && height == 0 && scale == 1;
+    }
+
+    unsigned x;                     // window in source pixels
+    unsigned y;
+    unsigned width;                 // 0 to the right edge
+    unsigned height;                // 0 to the bottom edge
+    unsigned scale;                 // 1, 2, 4 or 8
+};
+
+/*
+ * Parses the decode options {window: {x, y, width, height}, scale}.
+ * Returns false and sets `error` on invalid input.
+ */
+bool parse_decode_options(v8::Local<v8::Value> const& value,
+                          decode_options & options,
+                          std::string & error);
+
+/*
+ * Decodes the window of `options` from an encoded image, reduced by
+ * `options.scale` (each output pixel averages a scale x scale block,
+ * edges rounded up). Jpeg is decoded by libjpeg with DCT scaling, rows
+ * below the window are never decoded, unless the window offset is not a
+ * multiple of the scale. Other formats go through mapnik's
+ * windowed readers; tiff reads only the strips or tiles of the window,
+ * in bands when scaling, so memory follows the output size. Returns an
+ * empty pointer when no reader handles the data and throws on decode
+ * errors or a window outside the image.
+ */
+MAPNIK_SHARED_PTR<mapnik::image_32> decode_image(char const* data,
+                                                 std::size_t size,
+                                                 decode_options const& options);
+
+// as above for the file `filename` of format `type` (see type_from_filename)
+MAPNIK_SHARED_PTR<mapnik::image_32> decode_image_file(std::string const& filename,
+                                                      std::string const& type,
+                                                      decode_options const& options);
+
+}
+
+#endif // __NODE_MAPNIK_IMAGE_DECODE_H__
@@ -0,0 +1,129 @@
+#include "image_filters.hpp"
+#include "parallel.hpp"
+#include "raster_pool.hpp"
+
+// mapnik
+#include <mapnik/image_data.hpp>
+#include <mapnik/image_filter.hpp>      // for filter_visitor
+
+// agg
+#include "agg_rendering_buffer.h"
+#include "agg_pixfmt_rgba.h"
+#include "agg_blur.h"
+
+// boost
+#include <boost/foreach.hpp>
+#include <boost/variant/get.hpp>
+
+// stl
+#include <algorithm>
+#include <cstring>
+
+namespace node_mapnik {
+
+namespace {
+
+// below this many pixels a blur is not worth spreading over threads
+const std::size_t parallel_blur_pixels = 256 * 256;
+
+// pixels per horizontal block or vertical strip
+const std::size_t blur_chunk_pixels = 32 * 1024;
+
+/*
+ * One pass of agg::stack_blur_rgba32 over part of the image: a block of
+ * rows for the horizontal pass or a strip of columns for the vertical
+ * one. Each row (column) is blurred independently of the others, so
+ * running the parts separately gives the same pixels as a single call.
+ */
+struct stack_blur_task
+{
+    stack_blur_task(mapnik::image_data_32 & data, unsigned radius, bool vertical, unsigned chunk)
+        : data_(data),
+          radius_(radius),
+          vertical_(vertical),
+          chunk_(chunk) {}
+
+    void operator()(std::size_t index)
+    {
+        unsigned width = data_.width();
+        unsigned height = data_.height();
+        unsigned stride = width * 4;
+        unsigned start = static_cast<unsigned>(index) * chunk_;
+        if (vertical_)
+        {
+            unsigned columns = std::min(chunk_, width - start);
+            agg::rendering_buffer buf(reinterpret_cast<agg::int8u *>(data_.getRow(0) + start),
+                                      columns, height, stride);
+            agg::pixfmt_rgba32_pre pixf(buf);
+            agg::stack_blur_rgba32(pixf, 0, radius_);
+        }
+        else
+        {
+            unsigned rows = std::min(chunk_, height - start);
+            agg::rendering_buffer buf(reinterpret_cast<agg::int8u *>(data_.getRow(start)),
+                                      width, rows, stride);
+            agg::pixfmt_rgba32_pre pixf(buf);
+            agg::stack_blur_rgba32(pixf, radius_, 0);
+        }
+    }
+
+    mapnik::image_data_32 & data_;
+    unsigned radius_;
+    bool vertical_;
+    unsigned chunk_;
+};
+
+void parallel_stack_blur(mapnik::image_data_32 & data, unsigned rx, unsigned ry, unsigned threads)
+{
+    unsigned width = data.width();
+    unsigned height = data.height();
+    if (width == 0 || height == 0) return;
+    if (static_cast<std::size_t>(width) * height < parallel_blur_pixels) threads = 1;
+    if (rx > 0)
+    {
+        unsigned rows = static_cast<unsigned>(std::max<std::size_t>(1, blur_chunk_pixels / width));
+        stack_blur_task task(data, rx, false, rows);
+        parallel_for((height + rows - 1) / rows, task, threads);
+    }
+    if (ry > 0)
+    {
+        unsigned columns = static_cast<unsigned>(std::max<std::size_t>(1, blur_chunk_pixels / height));
+        stack_blur_task task(data, ry, true, columns);
+        parallel_for((width + columns - 1) / columns, task, threads);
+    }
+}
+
+}
+
+void apply_image_filters(mapnik::image_32 & image,
+                         std::vector<mapnik::filter::filter_type> const& filters,
+                         unsigned threads)
+{
+    mapnik::filter::filter_visitor<mapnik::image_32> visitor(image);
+    BOOST_FOREACH(mapnik::filter::filter_type const& filter_tag, filters)
+    {
+        mapnik::filter::agg_stack_blur const* blur = boost::get<mapnik::filter::agg_stack_blur>(&filter_tag);
+        if (blur)
+        {
+            parallel_stack_blur(image.data(), blur->rx, blur->ry, threads);
+        }
+        else
+        {
+            boost::apply_visitor(visitor, filter_tag);
+        }
+    }
+}
+
+MAPNIK_SHARED_PTR<mapnik::image_32> filtered_copy(mapnik::image_32 const& source,
+                                                  std::vector<mapnik::filter::filter_type> const& filters,
+                                                  unsigned threads)
+{
+    MAPNIK_SHARED_PTR<mapnik::image_32> copy = raster_pool::instance().acquire_image(source.width(), source.height());
+    mapnik::image_data_32 const& src = source.data();
+    std::memcpy(copy->data().getData(), src.getData(),
+                static_cast<std::size_t>(src.width()) * src.height() * 4);
+    apply_image_filters(*copy, filters, threads);
+    return copy;
+}
+
+}
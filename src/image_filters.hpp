@@ -0,0 +1,40 @@
+#ifndef __NODE_MAPNIK_IMAGE_FILTERS_H__
+#define __NODE_MAPNIK_IMAGE_FILTERS_H__
+
+// mapnik
+#include <mapnik/graphics.hpp>          // for image_32
+#include <mapnik/image_filter_types.hpp> // for filter_type
+
+#include "mapnik3x_compatibility.hpp"
+
+// boost
+#include MAPNIK_SHARED_INCLUDE
+
+// stl
+#include <vector>
+
+namespace node_mapnik {
+
+/*
+ * Applies `filters` to `image` in place, like mapnik's filter_visitor.
+ * agg-stack-blur runs its horizontal pass on blocks of rows and its
+ * vertical pass on strips of columns across up to `threads` threads
+ * (0 for one per core); the result is identical to the single threaded
+ * filter. Other filters run as mapnik implements them.
+ */
+void apply_image_filters(mapnik::image_32 & image,
+                         std::vector<mapnik::filter::filter_type> const& filters,
+                         unsigned threads = 0);
+
+/*
+ * Returns a copy of `source` with `filters` applied, leaving `source`
+ * untouched. The copy comes from the raster pool so scratch images are
+ * recycled between calls.
+ */
+MAPNIK_SHARED_PTR<mapnik::image_32> filtered_copy(mapnik::image_32 const& source,
+                                                  std::vector<mapnik::filter::filter_type> const& filters,
+                                                  unsigned threads = 0);
+
+}
+
+#endif // __NODE_MAPNIK_IMAGE_FILTERS_H__
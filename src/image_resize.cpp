@@ -0,0 +1,158 @@
+#include "image_resize.hpp"
+#include "pixel_kernels.hpp"
+#include "raster_pool.hpp"
+#include "utils.hpp"
+
+// mapnik
+#include <mapnik/graphics.hpp>          // for image_32
+#include <mapnik/version.hpp>           // for MAPNIK_VERSION
+
+// boost
+#include <boost/optional/optional.hpp>
+
+// stl
+#include <cstring>
+#include <stdexcept>
+
+using namespace v8;
+
+namespace node_mapnik {
+
+// reads a number or an [x, y] pair of numbers
+static bool get_pair(Local<Object> const& obj,
+                     char const* name,
+                     bool allow_single,
+                     double & x,
+                     double & y,
+                     std::string & error)
+{
+    if (!obj->Has(String::New(name))) return true;
+    Local<Value> value = obj->Get(String::New(name));
+    if (allow_single && value->IsNumber())
+    {
+        x = y = value->NumberValue();
+        return true;
+    }
+    if (value->IsArray())
+    {
+        Local<Array> a = Local<Array>::Cast(value);
+        if (a->Length() == 2 && a->Get(0)->IsNumber() && a->Get(1)->IsNumber())
+        {
+            x = a->Get(0)->NumberValue();
+            y = a->Get(1)->NumberValue();
+            return true;
+        }
+    }
+    error = std::string("option '") + name + (allow_single ? "' must be a number or an array of two numbers"
+                                                           : "' must be an array of two numbers");
+    return false;
+}
+
+bool parse_resize_options(Local<Value> const& value,
+                          resize_options & options,
+                          std::string & error)
+{
+    if (!value->IsObject())
+    {
+        error = "resize options must be an object";
+        return false;
+    }
+    Local<Object> obj = value->ToObject();
+    if (obj->Has(String::New("filter")))
+    {
+        Local<Value> filter = obj->Get(String::New("filter"));
+        boost::optional<mapnik::scaling_method_e> method;
+        if (filter->IsString()) method = mapnik::scaling_method_from_string(TOSTR(filter));
+        if (!method)
+        {
+            error = "option 'filter' must be a scaling method name (e.g. 'bilinear', 'bicubic' or 'lanczos')";
+            return false;
+        }
+        options.method = *method;
+    }
+    if (!get_pair(obj, "offset", false, options.offset_x, options.offset_y, error) ||
+        !get_pair(obj, "scale", true, options.scale_x, options.scale_y, error))
+    {
+        return false;
+    }
+    if (obj->Has(String::New("scale")) && (options.scale_x <= 0 || options.scale_y <= 0))
+    {
+        error = "option 'scale' must be greater than zero";
+        return false;
+    }
+    if (obj->Has(String::New("premultiplied")))
+    {
+        options.premultiplied = obj->Get(String::New("premultiplied"))->BooleanValue();
+    }
+    return true;
+}
+
+static bool is_downsample_2x(mapnik::image_data_32 const& source,
+                             mapnik::image_data_32 const& target,
+                             resize_options const& options)
+{
+    return options.method == mapnik::SCALING_BILINEAR &&
+        options.scale_x == 0 && options.scale_y == 0 &&
+        options.offset_x == 0 && options.offset_y == 0 &&
+        target.width() * 2 == source.width() &&
+        target.height() * 2 == source.height();
+}
+
+void resize_image(mapnik::image_data_32 const& source,
+                  mapnik::image_data_32 & target,
+                  resize_options const& options)
+{
+    if (source.width() == 0 || source.height() == 0 ||
+        target.width() == 0 || target.height() == 0)
+    {
+        throw std::runtime_error("image does not have valid dimensions");
+    }
+
+    // scaling and averaging blend neighbouring pixels, which is only
+    // correct on premultiplied colours
+    MAPNIK_SHARED_PTR<mapnik::image_32> scratch;
+    mapnik::image_data_32 const* src = &source;
+    if (!options.premultiplied)
+    {
+        scratch = raster_pool::instance().acquire_image(source.width(), source.height());
+        std::size_t count = static_cast<std::size_t>(source.width()) * source.height();
+        std::memcpy(scratch->data().getData(), source.getData(), count * 4);
+        premultiply_pixels(scratch->data().getData(), count);
+        src = &scratch->data();
+    }
+
+    if (is_downsample_2x(*src, target, options))
+    {
+        for (unsigned y = 0; y < target.height(); ++y)
+        {
+            downsample_2x_pixels(src->getRow(2 * y), src->getRow(2 * y + 1),
+                                 target.getRow(y), target.width());
+        }
+    }
+    else
+    {
+        double scale_x = options.scale_x > 0 ? options.scale_x
+            : static_cast<double>(target.width()) / src->width();
+        double scale_y = options.scale_y > 0 ? options.scale_y
+            : static_cast<double>(target.height()) / src->height();
+#if MAPNIK_VERSION >= 200300
+        mapnik::scale_image_agg<mapnik::image_data_32>(target, *src, options.method,
+                                                       scale_x, scale_y,
+                                                       options.offset_x, options.offset_y, 1.0);
+#else
+        if (scale_x != scale_y)
+        {
+            throw std::runtime_error("scaling x and y differently requires mapnik >= 2.3");
+        }
+        mapnik::scale_image_agg<mapnik::image_data_32>(target, *src, options.method, scale_x,
+                                                       options.offset_x, options.offset_y);
+#endif
+    }
+
+    if (!options.premultiplied)
+    {
+        demultiply_pixels(target.getData(), static_cast<std::size_t>(target.width()) * target.height());
+    }
+}
+
+}
@@ -0,0 +1,58 @@
+#ifndef __NODE_MAPNIK_IMAGE_RESIZE_H__
+#define __NODE_MAPNIK_IMAGE_RESIZE_H__
+
+// v8
+#include <v8.h>
+
+// mapnik
+#include <mapnik/image_data.hpp>        // for image_data_32
+#include <mapnik/image_scaling.hpp>     // for scaling_method_e
+
+// stl
+#include <string>
+
+namespace node_mapnik {
+
+struct resize_options
+{
+    resize_options()
+        : method(mapnik::SCALING_BILINEAR),
+          scale_x(0.0),
+          scale_y(0.0),
+          offset_x(0.0),
+          offset_y(0.0),
+          premultiplied(false) {}
+
+    mapnik::scaling_method_e method;
+    double scale_x;                 // 0 to fit the source to the target
+    double scale_y;
+    double offset_x;                // source pixels, applied before scaling
+    double offset_y;
+    bool premultiplied;             // source is premultiplied, keep it so
+};
+
+/*
+ * Parses the resize options {filter, offset: [x, y], scale, premultiplied}.
+ * `filter` is any mapnik scaling method name ('bilinear', 'bicubic',
+ * 'lanczos', ...) and `scale` a number or an [x, y] pair. Returns false
+ * and sets `error` on invalid input.
+ */
+bool parse_resize_options(v8::Local<v8::Value> const& value,
+                          resize_options & options,
+                          std::string & error);
+
+/*
+ * Scales `source` into `target` (already sized) with mapnik's agg
+ * scaling, which works on premultiplied pixels: unless
+ * `options.premultiplied` is set the source is premultiplied into a
+ * scratch copy and the result demultiplied. An exact 2x bilinear
+ * downsample without offset or explicit scale averages each 2x2 block
+ * with vector kernels instead.
+ */
+void resize_image(mapnik::image_data_32 const& source,
+                  mapnik::image_data_32 & target,
+                  resize_options const& options);
+
+}
+
+#endif // __NODE_MAPNIK_IMAGE_RESIZE_H__
@@ -0,0 +1,105 @@
+#ifndef __NODE_MAPNIK_IS_SOLID_H__
+#define __NODE_MAPNIK_IS_SOLID_H__
+
+// stl
+#include <cstring>
+#include <vector>
+
+namespace node_mapnik {
+
+/*
+ * True if every pixel of `image` (an image, image view, grid view or
+ * anything else with width(), height() and getRow()) equals the first
+ * one, which is stored in `pixel`. Rows are compared with memcmp against
+ * a row filled with the first pixel, which libc vectorizes, and the scan
+ * stops at the first row that differs. `image` must not be empty.
+ */
+template <typename Image, typename T>
+bool is_solid(Image const& image, T & pixel)
+{
+    unsigned width = image.width();
+    unsigned height = image.height();
+    pixel = image.getRow(0)[0];
+    std::vector<T> solid_row(width, pixel);
+    std::size_t row_bytes = width * sizeof(T);
+    for (unsigned y = 0; y < height; ++y)
+    {
+        if (std::memcmp(image.getRow(y), &solid_row[0], row_bytes) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// per band minimum, maximum and sum of an rgba image
+struct band_stats
+{
+    band_stats()
+        : count(0)
+    {
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            min[i] = 255;
+            max[i] = 0;
+            sum[i] = 0;
+        }
+    }
+
+    double mean(unsigned band) const
+    {
+        return count > 0 ? static_cast<double>(sum[band]) / count : 0.0;
+    }
+
+    unsigned min[4];                // r, g, b, a
+    unsigned max[4];
+    unsigned long long sum[4];
+    unsigned long long count;
+};
+
+/*
+ * is_solid() for rgba images that also fills `stats` with band summaries,
+ * so it reads every pixel once without stopping early.
+ */
+template <typename Image>
+bool is_solid(Image const& image, unsigned & pixel, band_stats & stats)
+{
+    unsigned width = image.width();
+    unsigned height = image.height();
+    pixel = image.getRow(0)[0];
+    bool solid = true;
+    for (unsigned y = 0; y < height; ++y)
+    {
+        unsigned const* row = image.getRow(y);
+        // accumulate per row in 32 bits, a row sum cannot overflow them
+        unsigned row_min[4] = { 255, 255, 255, 255 };
+        unsigned row_max[4] = { 0, 0, 0, 0 };
+        unsigned row_sum[4] = { 0, 0, 0, 0 };
+        unsigned diff = 0;
+        for (unsigned x = 0; x < width; ++x)
+        {
+            unsigned rgba = row[x];
+            diff |= rgba ^ pixel;
+            for (unsigned b = 0; b < 4; ++b)
+            {
+                unsigned v = (rgba >> (b * 8)) & 0xff;
+                if (v < row_min[b]) row_min[b] = v;
+                if (v > row_max[b]) row_max[b] = v;
+                row_sum[b] += v;
+            }
+        }
+        if (diff != 0) solid = false;
+        for (unsigned b = 0; b < 4; ++b)
+        {
+            if (row_min[b] < stats.min[b]) stats.min[b] = row_min[b];
+            if (row_max[b] > stats.max[b]) stats.max[b] = row_max[b];
+            stats.sum[b] += row_sum[b];
+        }
+    }
+    stats.count += static_cast<unsigned long long>(width) * height;
+    return solid;
+}
+
+}
+
+#endif // __NODE_MAPNIK_IS_SOLID_H__
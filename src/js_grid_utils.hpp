@@ -13,11 +13,14 @@
 
 // boost
 #include <boost/foreach.hpp>
-#include "boost/ptr_container/ptr_vector.hpp"  // for ptr_vector
+#include <boost/unordered_map.hpp>
 
 // stl
 #include <cmath> // ceil
+#include <cstdlib> // strtod, atoi
+#include <sstream>
 #include <stdint.h>  // for uint16_t
+#include <vector>
 
 using namespace v8;
 using namespace node;
@@ -26,129 +29,129 @@ namespace node_mapnik {
 
 #if MAPNIK_VERSION >= 200100
 
-template <typename T>
-static void grid2utf(T const& grid_type,
-                     boost::ptr_vector<uint16_t> & lines,
-                     std::vector<typename T::lookup_type>& key_order)
+/*
+ * Encoded UTFGrid rows stored back to back in one allocation. Indexing
+ * returns the first codepoint of a row so `&lines[j]` can be handed
+ * straight to String::New.
+ */
+class utf_lines
 {
-    typedef std::map< typename T::lookup_type, typename T::value_type> keys_type;
-    typedef typename keys_type::const_iterator keys_iterator;
-
-    typename T::data_type const& data = grid_type.data();
-    typename T::feature_key_type const& feature_keys = grid_type.get_feature_keys();
-    typename T::feature_key_type::const_iterator feature_pos;
-
-    keys_type keys;
-    // start counting at utf8 codepoint 32, aka space character
-    uint16_t codepoint = 32;
+public:
+    utf_lines()
+        : codepoints_(),
+          width_(0),
+          rows_(0) {}
 
-    unsigned array_size = data.width();
-    for (unsigned y = 0; y < data.height(); ++y)
+    void reset(unsigned width, unsigned rows)
     {
-        uint16_t idx = 0;
-        uint16_t* line = new uint16_t[array_size];
-        typename T::value_type const* row = data.getRow(y);
-        for (unsigned x = 0; x < data.width(); ++x)
-        {
-            typename T::value_type feature_id = row[x];
-            feature_pos = feature_keys.find(feature_id);
-            if (feature_pos != feature_keys.end())
-            {
-                typename T::lookup_type const& val = feature_pos->second;
-                keys_iterator key_pos = keys.find(val);
-                if (key_pos == keys.end())
-                {
-                    // Create a new entry for this key. Skip the codepoints that
-                    // can't be encoded directly in JSON.
-                    if (codepoint == 34) ++codepoint;      // Skip "
-                    else if (codepoint == 92) ++codepoint; // Skip backslash
-                    if (feature_id == mapnik::grid::base_mask)
-                    {
-                        keys[""] = codepoint;
-                        key_order.push_back("");
-                    }
-                    else
-                    {
-                        keys[val] = codepoint;
-                        key_order.push_back(val);
-                    }
-                    line[idx++] = static_cast<uint16_t>(codepoint);
-                    ++codepoint;
-                }
-                else
-                {
-                    line[idx++] = static_cast<uint16_t>(key_pos->second);
-                }
-            }
-            // else, shouldn't get here...
-        }
-        lines.push_back(line);
+        width_ = width;
+        rows_ = rows;
+        codepoints_.assign(static_cast<std::size_t>(width) * rows, 0);
     }
-}
-
-// requires mapnik >= r2957
 
+    std::size_t size() const { return rows_; }
+    unsigned width() const { return width_; }
+    uint16_t * row(unsigned j) { return &codepoints_[static_cast<std::size_t>(j) * width_]; }
+    uint16_t const& operator[](std::size_t j) const { return codepoints_[j * width_]; }
+
+private:
+    std::vector<uint16_t> codepoints_;
+    unsigned width_;
+    unsigned rows_;
+};
+
+/*
+ * Encodes every `resolution`th pixel of the grid as a UTFGrid codepoint.
+ * Neighbouring pixels mostly hold the same feature id, so runs reuse the
+ * previous codepoint and only id changes go through the hash tables: one
+ * from feature id to codepoint, and one from key to codepoint since
+ * several features may share a key.
+ */
 template <typename T>
 static void grid2utf(T const& grid_type,
-                     boost::ptr_vector<uint16_t> & lines,
+                     utf_lines & lines,
                      std::vector<typename T::lookup_type>& key_order,
                      unsigned int resolution)
 {
-    typedef std::map< typename T::lookup_type, typename T::value_type> keys_type;
-    typedef typename keys_type::const_iterator keys_iterator;
+    typedef typename T::value_type value_type;
+    typedef typename T::lookup_type lookup_type;
+    typedef boost::unordered_map<value_type, uint16_t> id_codes_type;
+    typedef boost::unordered_map<lookup_type, uint16_t> key_codes_type;
 
     typename T::feature_key_type const& feature_keys = grid_type.get_feature_keys();
-    typename T::feature_key_type::const_iterator feature_pos;
 
-    keys_type keys;
+    id_codes_type id_codes;
+    key_codes_type key_codes;
     // start counting at utf8 codepoint 32, aka space character
     uint16_t codepoint = 32;
 
     unsigned array_size = std::ceil(grid_type.width()/static_cast<float>(resolution));
-    for (unsigned y = 0; y < grid_type.height(); y=y+resolution)
+    unsigned rows = std::ceil(grid_type.height()/static_cast<float>(resolution));
+    lines.reset(array_size, rows);
+
+    for (unsigned y = 0, row_idx = 0; y < grid_type.height(); y=y+resolution, ++row_idx)
     {
-        uint16_t idx = 0;
-        uint16_t* line = new uint16_t[array_size];
-        typename T::value_type const* row = grid_type.getRow(y);
+        uint16_t * line = lines.row(row_idx);
+        value_type const* row = grid_type.getRow(y);
+        bool have_last = false;
+        value_type last_id = 0;
+        uint16_t last_code = 0;
+        unsigned idx = 0;
         for (unsigned x = 0; x < grid_type.width(); x=x+resolution)
         {
-            // todo - this lookup is expensive
-            typename T::value_type feature_id = row[x];
-            feature_pos = feature_keys.find(feature_id);
-            if (feature_pos != feature_keys.end())
+            value_type feature_id = row[x];
+            if (!have_last || feature_id != last_id)
             {
-                typename T::lookup_type const& val = feature_pos->second;
-                keys_iterator key_pos = keys.find(val);
-                if (key_pos == keys.end())
+                typename id_codes_type::const_iterator id_pos = id_codes.find(feature_id);
+                if (id_pos != id_codes.end())
                 {
-                    // Create a new entry for this key. Skip the codepoints that
-                    // can't be encoded directly in JSON.
-                    if (codepoint == 34) ++codepoint;      // Skip "
-                    else if (codepoint == 92) ++codepoint; // Skip backslash
-                    if (feature_id == mapnik::grid::base_mask)
+                    last_code = id_pos->second;
+                }
+                else
+                {
+                    // ids without a key (which should not happen) encode as
+                    // empty space rather than leaving the slot unset
+                    lookup_type val;
+                    if (feature_id != mapnik::grid::base_mask)
                     {
-                        keys[""] = codepoint;
-                        key_order.push_back("");
+                        typename T::feature_key_type::const_iterator feature_pos = feature_keys.find(feature_id);
+                        if (feature_pos != feature_keys.end())
+                        {
+                            val = feature_pos->second;
+                        }
                     }
-                    else
+                    typename key_codes_type::const_iterator key_pos = key_codes.find(val);
+                    if (key_pos == key_codes.end())
                     {
-                        keys[val] = codepoint;
+                        // Create a new entry for this key. Skip the codepoints that
+                        // can't be encoded directly in JSON.
+                        if (codepoint == 34) ++codepoint;      // Skip "
+                        else if (codepoint == 92) ++codepoint; // Skip backslash
+                        key_codes[val] = codepoint;
                         key_order.push_back(val);
+                        last_code = codepoint++;
                     }
-                    line[idx++] = static_cast<uint16_t>(codepoint);
-                    ++codepoint;
-                }
-                else
-                {
-                    line[idx++] = static_cast<uint16_t>(key_pos->second);
+                    else
+                    {
+                        last_code = key_pos->second;
+                    }
+                    id_codes[feature_id] = last_code;
                 }
+                last_id = feature_id;
+                have_last = true;
             }
-            // else, shouldn't get here...
+            line[idx++] = last_code;
         }
-        lines.push_back(line);
     }
 }
 
+template <typename T>
+static void grid2utf(T const& grid_type,
+                     utf_lines & lines,
+                     std::vector<typename T::lookup_type>& key_order)
+{
+    grid2utf(grid_type, lines, key_order, 1);
+}
 
 template <typename T>
 static void write_features(T const& grid_type,
@@ -202,6 +205,292 @@ static void write_features(T const& grid_type,
 }
 
 
+
+// appends `str`, already utf-8, as a quoted JSON string
+inline void append_json_string(std::string & out, std::string const& str)
+{
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (std::string::const_iterator itr = str.begin(); itr != str.end(); ++itr)
+    {
+        unsigned char c = static_cast<unsigned char>(*itr);
+        switch (c)
+        {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (c < 0x20)
+            {
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xf];
+            }
+            else
+            {
+                out += static_cast<char>(c);
+            }
+        }
+    }
+    out += '"';
+}
+
+// appends a row of UTFGrid codepoints as a quoted, utf-8 encoded JSON string
+inline void append_json_row(std::string & out, uint16_t const* row, unsigned width)
+{
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (unsigned i = 0; i < width; ++i)
+    {
+        uint16_t c = row[i];
+        if (c < 0x80)
+        {
+            // 34 and 92 are never assigned, so nothing needs escaping
+            out += static_cast<char>(c);
+        }
+        else if (c < 0x800)
+        {
+            out += static_cast<char>(0xc0 | (c >> 6));
+            out += static_cast<char>(0x80 | (c & 0x3f));
+        }
+        else if (c >= 0xd800 && c < 0xe000)
+        {
+            // lone surrogates have no utf-8 form
+            out += "\\u";
+            out += hex[(c >> 12) & 0xf];
+            out += hex[(c >> 8) & 0xf];
+            out += hex[(c >> 4) & 0xf];
+            out += hex[c & 0xf];
+        }
+        else
+        {
+            out += static_cast<char>(0xe0 | (c >> 12));
+            out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+            out += static_cast<char>(0x80 | (c & 0x3f));
+        }
+    }
+    out += '"';
+}
+
+// appends `val` the way JSON.stringify writes a number: the shortest digits
+// that read back as `val`, in fixed notation for 1e-7 <= |val| < 1e21 and
+// as d.ddde+n / d.ddde-n otherwise
+inline void append_json_number(std::string & out, double val)
+{
+    if (val != val || val - val != 0)
+    {
+        // NaN and infinities
+        out += "null";
+        return;
+    }
+    if (val == 0)
+    {
+        // also -0
+        out += '0';
+        return;
+    }
+    if (val < 0)
+    {
+        out += '-';
+        val = -val;
+    }
+    std::string str;
+    for (int precision = 1; precision <= 17; ++precision)
+    {
+        std::ostringstream s;
+        s.setf(std::ios::scientific, std::ios::floatfield);
+        s.precision(precision - 1);
+        s << val;
+        str = s.str();
+        if (std::strtod(str.c_str(), NULL) == val) break;
+    }
+    // str is d[.ddd]e(+|-)nn: split into significant digits and exponent
+    std::string::size_type e_pos = str.find('e');
+    std::string digits;
+    for (std::string::size_type i = 0; i < e_pos; ++i)
+    {
+        if (str[i] != '.') digits += str[i];
+    }
+    std::string::size_type last = digits.find_last_not_of('0');
+    digits.erase(last + 1);
+    int k = static_cast<int>(digits.size());
+    int n = std::atoi(str.c_str() + e_pos + 1) + 1; // position of the point
+    if (k <= n && n <= 21)
+    {
+        out += digits;
+        out.append(n - k, '0');
+    }
+    else if (0 < n && n <= 21)
+    {
+        out.append(digits, 0, n);
+        out += '.';
+        out.append(digits, n, std::string::npos);
+    }
+    else if (-6 < n && n <= 0)
+    {
+        out += "0.";
+        out.append(-n, '0');
+        out += digits;
+    }
+    else
+    {
+        out += digits[0];
+        if (k > 1)
+        {
+            out += '.';
+            out.append(digits, 1, std::string::npos);
+        }
+        std::ostringstream s;
+        s << (n - 1 < 0 ? "e-" : "e+") << (n - 1 < 0 ? 1 - n : n - 1);
+        out += s.str();
+    }
+}
+
+// serializes feature attributes the way value_converter + JSON.stringify
+// would: null values are left out, so operator() returns false for them
+struct json_value_writer : public boost::static_visitor<bool>
+{
+    explicit json_value_writer(std::string & out)
+        : out_(out) {}
+
+    bool operator () ( value_integer val ) const
+    {
+        std::ostringstream s;
+        s << val;
+        out_ += s.str();
+        return true;
+    }
+
+    bool operator () ( bool val ) const
+    {
+        out_ += val ? "true" : "false";
+        return true;
+    }
+
+    bool operator () ( double val ) const
+    {
+        append_json_number(out_, val);
+        return true;
+    }
+
+    bool operator () ( std::string const& val ) const
+    {
+        append_json_string(out_, val);
+        return true;
+    }
+
+    bool operator () ( mapnik::value_unicode_string const& val) const
+    {
+        std::string buffer;
+        mapnik::to_utf8(val,buffer);
+        append_json_string(out_, buffer);
+        return true;
+    }
+
+    bool operator () ( mapnik::value_null const& val ) const
+    {
+        return false;
+    }
+
+    std::string & out_;
+};
+
+/*
+ * Serializes an encoded grid to the JSON text that JSON.stringify would
+ * produce for the object built by encode(), without touching V8, so it can
+ * run on a worker thread.
+ */
+template <typename T>
+static void grid2json(T const& grid_type,
+                      utf_lines const& lines,
+                      std::vector<typename T::lookup_type> const& key_order,
+                      bool add_features,
+                      std::string & out)
+{
+    out.reserve(out.size() + lines.size() * (lines.width() + 3) + key_order.size() * 16 + 64);
+    out += "{\"grid\":[";
+    for (std::size_t j = 0; j < lines.size(); ++j)
+    {
+        if (j > 0) out += ',';
+        append_json_row(out, &lines[j], lines.width());
+    }
+    out += "],\"keys\":[";
+    for (std::size_t i = 0; i < key_order.size(); ++i)
+    {
+        if (i > 0) out += ',';
+        append_json_string(out, key_order[i]);
+    }
+    out += "],\"data\":{";
+    typename T::feature_type const& g_features = grid_type.get_grid_features();
+    if (add_features && g_features.size() > 0)
+    {
+        std::set<std::string> const& attributes = grid_type.property_names();
+        typename T::feature_type::const_iterator feat_end = g_features.end();
+        bool first_feature = true;
+        BOOST_FOREACH ( std::string const& key_item, key_order )
+        {
+            if (key_item.empty())
+            {
+                continue;
+            }
+
+            typename T::feature_type::const_iterator feat_itr = g_features.find(key_item);
+            if (feat_itr == feat_end)
+            {
+                continue;
+            }
+
+            // same rules as write_features: a feature is only listed when
+            // it has at least one requested attribute other than __id__
+            bool found = false;
+            std::string feat = "{";
+            bool first_attr = true;
+            mapnik::feature_ptr feature = feat_itr->second;
+            BOOST_FOREACH ( std::string const& attr, attributes )
+            {
+                std::string::size_type mark = feat.size();
+                if (!first_attr) feat += ',';
+                append_json_string(feat, attr);
+                feat += ':';
+                bool written = false;
+                if (attr == "__id__")
+                {
+                    written = json_value_writer(feat)(static_cast<value_integer>(feature->id()));
+                }
+                else if (feature->has_key(attr))
+                {
+                    found = true;
+                    mapnik::feature_impl::value_type const& attr_val = feature->get(attr);
+                    written = boost::apply_visitor(json_value_writer(feat), attr_val.base());
+                }
+                if (written)
+                {
+                    first_attr = false;
+                }
+                else
+                {
+                    feat.resize(mark);
+                }
+            }
+            feat += '}';
+
+            if (found)
+            {
+                if (!first_feature) out += ',';
+                first_feature = false;
+                append_json_string(out, feat_itr->first);
+                out += ':';
+                out += feat;
+            }
+        }
+    }
+    out += "}}";
+}
+
 #else
 
 
@@ -90,10 +90,18 @@ Handle<Value> CairoSurface::getData(const Arguments& args)
 {
     HandleScope scope;
     CairoSurface* surface = node::ObjectWrap::Unwrap<CairoSurface>(args.This());
-    std::string s = surface->ss_.str();
+    // read straight into the buffer rather than through a ss_.str() copy
+    surface->ss_.clear();
+    std::streamsize size = surface->ss_.tellp();
+    if (size < 0) size = 0;
+    surface->ss_.seekg(0);
     #if NODE_VERSION_AT_LEAST(0, 11, 0)
-    return scope.Close(node::Buffer::New((char*)s.data(),s.size()));
+    Local<Object> buffer = node::Buffer::New(static_cast<size_t>(size));
+    surface->ss_.read(node::Buffer::Data(buffer), size);
+    return scope.Close(buffer);
     #else
-    return scope.Close(node::Buffer::New((char*)s.data(),s.size())->handle_);
+    node::Buffer * buffer = node::Buffer::New(static_cast<size_t>(size));
+    surface->ss_.read(node::Buffer::Data(buffer), size);
+    return scope.Close(buffer->handle_);
     #endif
 }
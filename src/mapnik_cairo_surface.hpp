@@ -38,7 +38,7 @@ public:
             return CAIRO_STATUS_WRITE_ERROR;
         }
         i_stream* fin = reinterpret_cast<i_stream*>(closure);
-        *fin << std::string((const char*)data,(size_t)length);
+        fin->write((const char*)data,(std::streamsize)length);
         return CAIRO_STATUS_SUCCESS;
 #else
         return 11; // CAIRO_STATUS_WRITE_ERROR
@@ -2,6 +2,8 @@
 // node
 #include <node.h>                       // for NODE_SET_PROTOTYPE_METHOD, etc
 #include <node_object_wrap.h>           // for ObjectWrap
+#include <node_buffer.h>
+#include <node_version.h>
 #include <v8.h>
 #include <uv.h>
 
@@ -12,11 +14,14 @@
 #include "mapnik_grid.hpp"
 #include "mapnik_grid_view.hpp"
 #include "js_grid_utils.hpp"
+#include "gzip.hpp"
 #include "utils.hpp"
+#include "buffer_utils.hpp"
+#include "worker_pool.hpp"
+#include "raster_pool.hpp"
 
 // boost
 #include "boost/ptr_container/ptr_sequence_adapter.hpp"
-#include "boost/ptr_container/ptr_vector.hpp"  // for ptr_vector
 #include MAPNIK_MAKE_SHARED_INCLUDE
 #include "boost/cstdint.hpp"            // for uint16_t
 
@@ -56,7 +61,7 @@ void Grid::Initialize(Handle<Object> target) {
 
 Grid::Grid(unsigned int width, unsigned int height, std::string const& key, unsigned int resolution) :
     ObjectWrap(),
-    this_(MAPNIK_MAKE_SHARED<mapnik::grid>(width,height,key,resolution)),
+    this_(node_mapnik::raster_pool::instance().acquire_grid(width,height,key,resolution)),
     estimated_size_(width * height) {
 #if MAPNIK_VERSION <= 200100
     this_->painted(false);
@@ -170,7 +175,7 @@ Handle<Value> Grid::clear(const Arguments& args)
     closure->g = g;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Clear, (uv_after_work_cb)EIO_AfterClear);
+    node_mapnik::queue_work(&closure->request, EIO_Clear, (uv_after_work_cb)EIO_AfterClear, node_mapnik::PRIORITY_HOUSEKEEPING);
     g->Ref();
     return Undefined();
 }
@@ -356,7 +361,7 @@ Handle<Value> Grid::encodeSync(const Arguments& args) // format, resolution
 
     try {
 
-        boost::ptr_vector<uint16_t> lines;
+        node_mapnik::utf_lines lines;
         std::vector<mapnik::grid::lookup_type> key_order;
         node_mapnik::grid2utf<mapnik::grid>(*g->get(),lines,key_order,resolution);
 
@@ -407,9 +412,12 @@ typedef struct {
     bool error;
     std::string error_name;
     Persistent<Function> cb;
-    boost::ptr_vector<uint16_t> lines;
+    node_mapnik::utf_lines lines;
     unsigned int resolution;
     bool add_features;
+    bool json;
+    bool gzip;
+    std::string result;
     std::vector<mapnik::grid::lookup_type> key_order;
 } encode_grid_baton_t;
 
@@ -423,6 +431,8 @@ Handle<Value> Grid::encode(const Arguments& args) // format, resolution
     std::string format("utf");
     unsigned int resolution = 4;
     bool add_features = true;
+    bool json = false;
+    bool gzip = false;
 
     // accept custom format
     if (args.Length() >= 1){
@@ -459,6 +469,28 @@ Handle<Value> Grid::encode(const Arguments& args) // format, resolution
 
             add_features = bind_opt->BooleanValue();
         }
+
+        if (options->Has(String::New("json")))
+        {
+            Local<Value> bind_opt = options->Get(String::New("json"));
+            if (!bind_opt->IsBoolean())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'json' must be an Boolean")));
+
+            json = bind_opt->BooleanValue();
+        }
+
+        if (options->Has(String::New("gzip")))
+        {
+            Local<Value> bind_opt = options->Get(String::New("gzip"));
+            if (!bind_opt->IsBoolean())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'gzip' must be an Boolean")));
+
+            // compressing implies serializing
+            gzip = bind_opt->BooleanValue();
+            if (gzip) json = true;
+        }
     }
 
     // ensure callback is a function
@@ -474,9 +506,10 @@ Handle<Value> Grid::encode(const Arguments& args) // format, resolution
     closure->error = false;
     closure->resolution = resolution;
     closure->add_features = add_features;
+    closure->json = json;
+    closure->gzip = gzip;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    // todo - reserve lines size?
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode);
+    node_mapnik::queue_work(&closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode, node_mapnik::PRIORITY_ENCODE);
     g->Ref();
     return Undefined();
 }
@@ -491,6 +524,23 @@ void Grid::EIO_Encode(uv_work_t* req)
                                             closure->lines,
                                             closure->key_order,
                                             closure->resolution);
+        if (closure->json)
+        {
+            std::string json;
+            node_mapnik::grid2json<mapnik::grid>(*closure->g->get(),
+                                                 closure->lines,
+                                                 closure->key_order,
+                                                 closure->add_features,
+                                                 json);
+            if (closure->gzip)
+            {
+                node_mapnik::gzip_compress(json, closure->result);
+            }
+            else
+            {
+                closure->result.swap(json);
+            }
+        }
     }
     catch (std::exception const& ex)
     {
@@ -510,6 +560,10 @@ void Grid::EIO_AfterEncode(uv_work_t* req)
     if (closure->error) {
         Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    } else if (closure->json) {
+        // serialized on the worker, only the buffer is handed over here
+        Local<Value> argv[2] = { Local<Value>::New(Null()), node_mapnik::buffer_from_string(closure->result) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
     } else {
 
         // convert key order to proper javascript array
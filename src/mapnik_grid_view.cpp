@@ -2,6 +2,8 @@
 // node
 #include <node.h>                       // for NODE_SET_PROTOTYPE_METHOD, etc
 #include <node_object_wrap.h>           // for ObjectWrap
+#include <node_buffer.h>
+#include <node_version.h>
 #include <v8.h>
 #include <uv.h>
 
@@ -14,13 +16,16 @@
 #include "mapnik_grid_view.hpp"
 #include "mapnik_grid.hpp"
 #include "js_grid_utils.hpp"
+#include "gzip.hpp"
 #include "utils.hpp"
+#include "is_solid.hpp"
+#include "buffer_utils.hpp"
+#include "worker_pool.hpp"
 
 // boost
 #include MAPNIK_MAKE_SHARED_INCLUDE
 #include "boost/cstdint.hpp"            // for uint16_t
 #include "boost/ptr_container/ptr_sequence_adapter.hpp"
-#include "boost/ptr_container/ptr_vector.hpp"  // for ptr_vector
 // std
 #include <exception>
 
@@ -141,7 +146,7 @@ Handle<Value> GridView::isSolid(const Arguments& args)
     closure->pixel = 0;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid);
+    node_mapnik::queue_work(&closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid, node_mapnik::PRIORITY_HOUSEKEEPING);
     g->Ref();
     return Undefined();
 }
@@ -151,20 +156,7 @@ void GridView::EIO_IsSolid(uv_work_t* req)
     grid_view_ptr view = closure->g->get();
     if (view->width() > 0 && view->height() > 0)
     {
-        mapnik::grid_view::value_type first_pixel = view->getRow(0)[0];
-        closure->pixel = first_pixel;
-        for (unsigned y = 0; y < view->height(); ++y)
-        {
-            mapnik::grid_view::value_type const * row = view->getRow(y);
-            for (unsigned x = 0; x < view->width(); ++x)
-            {
-                if (first_pixel != row[x])
-                {
-                    closure->result = false;
-                    return;
-                }
-            }
-        }
+        closure->result = node_mapnik::is_solid(*view, closure->pixel);
     }
     else
     {
@@ -216,18 +208,8 @@ Handle<Value> GridView::isSolidSync(const Arguments& args)
     grid_view_ptr view = g->get();
     if (view->width() > 0 && view->height() > 0)
     {
-        mapnik::grid_view::value_type first_pixel = view->getRow(0)[0];
-        for (unsigned y = 0; y < view->height(); ++y)
-        {
-            mapnik::grid_view::value_type const * row = view->getRow(y);
-            for (unsigned x = 0; x < view->width(); ++x)
-            {
-                if (first_pixel != row[x])
-                {
-                    return scope.Close(False());
-                }
-            }
-        }
+        mapnik::grid_view::value_type pixel;
+        return scope.Close(Boolean::New(node_mapnik::is_solid(*view, pixel)));
     }
     return scope.Close(True());
 }
@@ -316,7 +298,7 @@ Handle<Value> GridView::encodeSync(const Arguments& args)
 
     try {
 
-        boost::ptr_vector<uint16_t> lines;
+        node_mapnik::utf_lines lines;
         std::vector<mapnik::grid_view::lookup_type> key_order;
         node_mapnik::grid2utf<mapnik::grid_view>(*g->get(),lines,key_order,resolution);
 
@@ -368,9 +350,12 @@ typedef struct {
     bool error;
     std::string error_name;
     Persistent<Function> cb;
-    boost::ptr_vector<uint16_t> lines;
+    node_mapnik::utf_lines lines;
     unsigned int resolution;
     bool add_features;
+    bool json;
+    bool gzip;
+    std::string result;
     std::vector<mapnik::grid::lookup_type> key_order;
 } encode_grid_view_baton_t;
 
@@ -385,6 +370,8 @@ Handle<Value> GridView::encode(const Arguments& args)
     std::string format("utf");
     unsigned int resolution = 4;
     bool add_features = true;
+    bool json = false;
+    bool gzip = false;
 
     // accept custom format
     if (args.Length() >= 1){
@@ -421,6 +408,28 @@ Handle<Value> GridView::encode(const Arguments& args)
 
             add_features = bind_opt->BooleanValue();
         }
+
+        if (options->Has(String::New("json")))
+        {
+            Local<Value> bind_opt = options->Get(String::New("json"));
+            if (!bind_opt->IsBoolean())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'json' must be an Boolean")));
+
+            json = bind_opt->BooleanValue();
+        }
+
+        if (options->Has(String::New("gzip")))
+        {
+            Local<Value> bind_opt = options->Get(String::New("gzip"));
+            if (!bind_opt->IsBoolean())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'gzip' must be an Boolean")));
+
+            // compressing implies serializing
+            gzip = bind_opt->BooleanValue();
+            if (gzip) json = true;
+        }
     }
 
     // ensure callback is a function
@@ -436,8 +445,10 @@ Handle<Value> GridView::encode(const Arguments& args)
     closure->error = false;
     closure->resolution = resolution;
     closure->add_features = add_features;
+    closure->json = json;
+    closure->gzip = gzip;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode);
+    node_mapnik::queue_work(&closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode, node_mapnik::PRIORITY_ENCODE);
     g->Ref();
     return Undefined();
 }
@@ -453,6 +464,23 @@ void GridView::EIO_Encode(uv_work_t* req)
                                                  closure->lines,
                                                  closure->key_order,
                                                  closure->resolution);
+        if (closure->json)
+        {
+            std::string json;
+            node_mapnik::grid2json<mapnik::grid_view>(*(closure->g->get()),
+                                                      closure->lines,
+                                                      closure->key_order,
+                                                      closure->add_features,
+                                                      json);
+            if (closure->gzip)
+            {
+                node_mapnik::gzip_compress(json, closure->result);
+            }
+            else
+            {
+                closure->result.swap(json);
+            }
+        }
     }
     catch (std::exception const& ex)
     {
@@ -473,6 +501,12 @@ void GridView::EIO_AfterEncode(uv_work_t* req)
         Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     }
+    else if (closure->json)
+    {
+        // serialized on the worker, only the buffer is handed over here
+        Local<Value> argv[2] = { Local<Value>::New(Null()), node_mapnik::buffer_from_string(closure->result) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    }
     else
     {
         // convert key order to proper javascript array
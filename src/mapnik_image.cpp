@@ -23,6 +23,20 @@
 #include "mapnik_color.hpp"
 
 #include "utils.hpp"
+#include "buffer_utils.hpp"
+#include "png_encoder.hpp"
+#include "webp_options.hpp"
+#include "pixel_kernels.hpp"
+#include "is_solid.hpp"
+#include "raster_pool.hpp"
+#include "image_resize.hpp"
+#include "image_decode.hpp"
+#include "encode_cache.hpp"
+#include "worker_pool.hpp"
+#if MAPNIK_VERSION >= 200100
+#include "composite_stack.hpp"
+#include "image_filters.hpp"
+#endif
 
 // boost
 #include MAPNIK_MAKE_SHARED_INCLUDE
@@ -30,10 +44,12 @@
 #include <boost/foreach.hpp>
 
 // std
+#include <cstring>
 #include <exception>
 #include <memory>                       // for auto_ptr, etc
 #include <ostream>                      // for operator<<, basic_ostream
 #include <sstream>                      // for basic_ostringstream, etc
+#include <stdexcept>
 
 Persistent<FunctionTemplate> Image::constructor;
 
@@ -54,8 +70,18 @@ void Image::Initialize(Handle<Object> target) {
     NODE_SET_PROTOTYPE_METHOD(constructor, "setGrayScaleToAlpha", setGrayScaleToAlpha);
     NODE_SET_PROTOTYPE_METHOD(constructor, "width", width);
     NODE_SET_PROTOTYPE_METHOD(constructor, "height", height);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "data", data);
     NODE_SET_PROTOTYPE_METHOD(constructor, "painted", painted);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "isSolid", isSolid);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "isSolidSync", isSolidSync);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "compareSync", compareSync);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "compare", compare);
     NODE_SET_PROTOTYPE_METHOD(constructor, "composite", composite);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "compositeMany", compositeMany);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "filterSync", filterSync);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "filter", filter);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "resizeSync", resizeSync);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "resize", resize);
     NODE_SET_PROTOTYPE_METHOD(constructor, "premultiplySync", premultiplySync);
     NODE_SET_PROTOTYPE_METHOD(constructor, "premultiply", premultiply);
     NODE_SET_PROTOTYPE_METHOD(constructor, "demultiplySync", demultiplySync);
@@ -78,12 +104,15 @@ void Image::Initialize(Handle<Object> target) {
     NODE_SET_METHOD(constructor->GetFunction(),
                     "fromBytesSync",
                     Image::fromBytesSync);
+    NODE_SET_METHOD(constructor->GetFunction(),
+                    "fromBuffer",
+                    Image::fromBuffer);
     target->Set(String::NewSymbol("Image"),constructor->GetFunction());
 }
 
 Image::Image(unsigned int width, unsigned int height) :
     ObjectWrap(),
-    this_(MAPNIK_MAKE_SHARED<mapnik::image_32>(width,height)),
+    this_(node_mapnik::raster_pool::instance().acquire_image(width,height)),
     estimated_size_(width * height * 4)
 {
     V8::AdjustAmountOfExternalAllocatedMemory(estimated_size_);
@@ -272,7 +301,7 @@ Handle<Value> Image::clear(const Arguments& args)
     closure->im = im;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Clear, (uv_after_work_cb)EIO_AfterClear);
+    node_mapnik::queue_work(&closure->request, EIO_Clear, (uv_after_work_cb)EIO_AfterClear, node_mapnik::PRIORITY_HOUSEKEEPING);
     im->Ref();
     return Undefined();
 }
@@ -317,14 +346,26 @@ void Image::EIO_AfterClear(uv_work_t* req)
     delete closure;
 }
 
+typedef struct {
+    uv_work_t request;
+    Image* im;
+    unsigned color; // grayscale fill colour, rgb packed as in image_32
+    bool error;
+    std::string error_name;
+    Persistent<Function> cb;
+} image_op_baton_t;
+
 Handle<Value> Image::setGrayScaleToAlpha(const Arguments& args)
 {
     HandleScope scope;
 
     Image* im = node::ObjectWrap::Unwrap<Image>(args.This());
-    if (args.Length() == 0) {
-        im->this_->set_grayscale_to_alpha();
-    } else {
+
+    // white unless a colour is given
+    unsigned color = 0xffffff;
+    int color_args = args.Length();
+    if (color_args > 0 && args[args.Length()-1]->IsFunction()) --color_args;
+    if (color_args > 0) {
         if (!args[0]->IsObject())
             return ThrowException(Exception::TypeError(
                                       String::New("optional second arg must be a mapnik.Color")));
@@ -334,49 +375,51 @@ Handle<Value> Image::setGrayScaleToAlpha(const Arguments& args)
         if (obj->IsNull() || obj->IsUndefined() || !Color::constructor->HasInstance(obj))
             return ThrowException(Exception::TypeError(String::New("mapnik.Color expected as second arg")));
 
-        Color * color = node::ObjectWrap::Unwrap<Color>(obj);
+        Color * c = node::ObjectWrap::Unwrap<Color>(obj);
+        color = (c->get()->blue() << 16) | (c->get()->green() << 8) | c->get()->red();
+    }
 
+    if (color_args == args.Length()) {
         mapnik::image_data_32 & data = im->this_->data();
-        for (unsigned int y = 0; y < data.height(); ++y)
-        {
-            unsigned int* row_from = data.getRow(y);
-            for (unsigned int x = 0; x < data.width(); ++x)
-            {
-                unsigned rgba = row_from[x];
-                // TODO - big endian support
-                unsigned r = rgba & 0xff;
-                unsigned g = (rgba >> 8 ) & 0xff;
-                unsigned b = (rgba >> 16) & 0xff;
-
-                // magic numbers for grayscale
-                unsigned a = (int)((r * .3) + (g * .59) + (b * .11));
-
-                row_from[x] = (a << 24) |
-                    (color->get()->blue() << 16) |
-                    (color->get()->green() << 8) |
-                    (color->get()->red()) ;
-            }
-        }
+        node_mapnik::grayscale_to_alpha_pixels(data.getData(), static_cast<std::size_t>(data.width()) * data.height(), color);
+        return Undefined();
     }
 
+    Local<Value> callback = args[args.Length()-1];
+    image_op_baton_t *closure = new image_op_baton_t();
+    closure->request.data = closure;
+    closure->im = im;
+    closure->color = color;
+    closure->error = false;
+    closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+    node_mapnik::queue_work(&closure->request, EIO_SetGrayScaleToAlpha, (uv_after_work_cb)EIO_AfterMultiply, node_mapnik::PRIORITY_HOUSEKEEPING);
+    im->Ref();
     return Undefined();
 }
 
-typedef struct {
-    uv_work_t request;
-    Image* im;
-    bool error;
-    std::string error_name;
-    Persistent<Function> cb;
-} image_op_baton_t;
+void Image::EIO_SetGrayScaleToAlpha(uv_work_t* req)
+{
+    image_op_baton_t *closure = static_cast<image_op_baton_t *>(req->data);
 
+    try
+    {
+        mapnik::image_data_32 & data = closure->im->this_->data();
+        node_mapnik::grayscale_to_alpha_pixels(data.getData(), static_cast<std::size_t>(data.width()) * data.height(), closure->color);
+    }
+    catch (std::exception const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
 
 Handle<Value> Image::premultiplySync(const Arguments& args)
 {
     HandleScope scope;
 #if MAPNIK_VERSION >= 200100
     Image* im = node::ObjectWrap::Unwrap<Image>(args.This());
-    im->get()->premultiply();
+    mapnik::image_data_32 & data = im->get()->data();
+    node_mapnik::premultiply_pixels(data.getData(), static_cast<std::size_t>(data.width()) * data.height());
 #endif
     return Undefined();
 }
@@ -400,7 +443,7 @@ Handle<Value> Image::premultiply(const Arguments& args)
     closure->im = im;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Premultiply, (uv_after_work_cb)EIO_AfterMultiply);
+    node_mapnik::queue_work(&closure->request, EIO_Premultiply, (uv_after_work_cb)EIO_AfterMultiply, node_mapnik::PRIORITY_ENCODE);
     im->Ref();
     return Undefined();
 }
@@ -411,7 +454,8 @@ void Image::EIO_Premultiply(uv_work_t* req)
 
     try
     {
-        closure->im->get()->premultiply();
+        mapnik::image_data_32 & data = closure->im->get()->data();
+        node_mapnik::premultiply_pixels(data.getData(), static_cast<std::size_t>(data.width()) * data.height());
     }
     catch (std::exception const& ex)
     {
@@ -448,7 +492,8 @@ Handle<Value> Image::demultiplySync(const Arguments& args)
     HandleScope scope;
 #if MAPNIK_VERSION >= 200100
     Image* im = node::ObjectWrap::Unwrap<Image>(args.This());
-    im->get()->demultiply();
+    mapnik::image_data_32 & data = im->get()->data();
+    node_mapnik::demultiply_pixels(data.getData(), static_cast<std::size_t>(data.width()) * data.height());
 #endif
     return Undefined();
 }
@@ -472,7 +517,7 @@ Handle<Value> Image::demultiply(const Arguments& args)
     closure->im = im;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Demultiply, (uv_after_work_cb)EIO_AfterMultiply);
+    node_mapnik::queue_work(&closure->request, EIO_Demultiply, (uv_after_work_cb)EIO_AfterMultiply, node_mapnik::PRIORITY_ENCODE);
     im->Ref();
     return Undefined();
 }
@@ -483,7 +528,323 @@ void Image::EIO_Demultiply(uv_work_t* req)
 
     try
     {
-        closure->im->get()->demultiply();
+        mapnik::image_data_32 & data = closure->im->get()->data();
+        node_mapnik::demultiply_pixels(data.getData(), static_cast<std::size_t>(data.width()) * data.height());
+    }
+    catch (std::exception const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+typedef struct {
+    uv_work_t request;
+    Image* im;
+    Persistent<Function> cb;
+    bool error;
+    std::string error_name;
+    bool result;
+    unsigned pixel;
+    bool want_stats;
+    node_mapnik::band_stats stats;
+} is_solid_image_baton_t;
+
+static Local<Object> band_stats_to_object(node_mapnik::band_stats const& stats)
+{
+    static char const* names[4] = { "r", "g", "b", "a" };
+    Local<Object> result = Object::New();
+    for (unsigned b = 0; b < 4; ++b)
+    {
+        Local<Object> band = Object::New();
+        band->Set(String::NewSymbol("min"), Integer::New(stats.min[b]));
+        band->Set(String::NewSymbol("max"), Integer::New(stats.max[b]));
+        band->Set(String::NewSymbol("mean"), Number::New(stats.mean(b)));
+        result->Set(String::NewSymbol(names[b]), band);
+    }
+    return result;
+}
+
+// parses the optional {stats:true} argument of isSolid and isSolidSync
+static bool parse_is_solid_options(const Arguments& args, int count, bool & want_stats)
+{
+    if (count == 0) return true;
+    if (!args[0]->IsObject()) return false;
+    Local<Object> options = args[0]->ToObject();
+    if (options->Has(String::New("stats")))
+    {
+        want_stats = options->Get(String::New("stats"))->BooleanValue();
+    }
+    return true;
+}
+
+Handle<Value> Image::isSolidSync(const Arguments& args)
+{
+    HandleScope scope;
+    Image* im = node::ObjectWrap::Unwrap<Image>(args.This());
+    bool want_stats = false;
+    if (!parse_is_solid_options(args, args.Length(), want_stats))
+        return ThrowException(Exception::TypeError(
+                                  String::New("optional argument must be an options object")));
+    mapnik::image_data_32 const& data = im->this_->data();
+    if (data.width() == 0 || data.height() == 0)
+        return ThrowException(Exception::Error(
+                                  String::New("image does not have valid dimensions")));
+    unsigned pixel = 0;
+    if (!want_stats)
+    {
+        return scope.Close(Boolean::New(node_mapnik::is_solid(data, pixel)));
+    }
+    node_mapnik::band_stats stats;
+    bool solid = node_mapnik::is_solid(data, pixel, stats);
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("solid"), Boolean::New(solid));
+    if (solid) result->Set(String::NewSymbol("pixel"), Number::New(pixel));
+    result->Set(String::NewSymbol("stats"), band_stats_to_object(stats));
+    return scope.Close(result);
+}
+
+Handle<Value> Image::isSolid(const Arguments& args)
+{
+    HandleScope scope;
+    Image* im = node::ObjectWrap::Unwrap<Image>(args.This());
+
+    if (args.Length() == 0 || !args[args.Length()-1]->IsFunction()) {
+        return isSolidSync(args);
+    }
+    bool want_stats = false;
+    if (!parse_is_solid_options(args, args.Length() - 1, want_stats))
+        return ThrowException(Exception::TypeError(
+                                  String::New("optional argument must be an options object")));
+    Local<Value> callback = args[args.Length()-1];
+
+    is_solid_image_baton_t *closure = new is_solid_image_baton_t();
+    closure->request.data = closure;
+    closure->im = im;
+    closure->result = true;
+    closure->pixel = 0;
+    closure->want_stats = want_stats;
+    closure->error = false;
+    closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+    node_mapnik::queue_work(&closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid, node_mapnik::PRIORITY_HOUSEKEEPING);
+    im->Ref();
+    return Undefined();
+}
+
+void Image::EIO_IsSolid(uv_work_t* req)
+{
+    is_solid_image_baton_t *closure = static_cast<is_solid_image_baton_t *>(req->data);
+    mapnik::image_data_32 const& data = closure->im->this_->data();
+    if (data.width() > 0 && data.height() > 0)
+    {
+        if (closure->want_stats)
+        {
+            closure->result = node_mapnik::is_solid(data, closure->pixel, closure->stats);
+        }
+        else
+        {
+            closure->result = node_mapnik::is_solid(data, closure->pixel);
+        }
+    }
+    else
+    {
+        closure->error = true;
+        closure->error_name = "image does not have valid dimensions";
+    }
+}
+
+void Image::EIO_AfterIsSolid(uv_work_t* req)
+{
+    HandleScope scope;
+    is_solid_image_baton_t *closure = static_cast<is_solid_image_baton_t *>(req->data);
+    TryCatch try_catch;
+    if (closure->error) {
+        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    }
+    else
+    {
+        // same arguments as ImageView.isSolid, band stats follow the pixel
+        Local<Value> argv[4] = { Local<Value>::New(Null()),
+                                 Local<Value>::New(Boolean::New(closure->result)),
+                                 Local<Value>::New(Undefined()),
+                                 Local<Value>::New(Undefined())
+        };
+        int argc = 2;
+        if (closure->result)
+        {
+            argv[2] = Number::New(closure->pixel);
+            argc = 3;
+        }
+        if (closure->want_stats)
+        {
+            argv[3] = band_stats_to_object(closure->stats);
+            argc = 4;
+        }
+        closure->cb->Call(Context::GetCurrent()->Global(), argc, argv);
+    }
+    if (try_catch.HasCaught())
+    {
+        node::FatalException(try_catch);
+    }
+    closure->im->Unref();
+    closure->cb.Dispose();
+    delete closure;
+}
+
+// parses the other image and the optional {threshold, alpha, diff} of
+// compare and compareSync
+static bool parse_compare_arguments(const Arguments& args,
+                                    int count,
+                                    Image* & other,
+                                    unsigned & threshold,
+                                    unsigned & mask,
+                                    bool & want_diff,
+                                    std::string & error)
+{
+    if (count < 1 || !args[0]->IsObject() || !Image::constructor->HasInstance(args[0]->ToObject())) {
+        error = "first argument must be a mapnik.Image";
+        return false;
+    }
+    other = node::ObjectWrap::Unwrap<Image>(args[0]->ToObject());
+    if (count > 1) {
+        if (!args[1]->IsObject()) {
+            error = "optional second argument must be an options object";
+            return false;
+        }
+        Local<Object> options = args[1]->ToObject();
+        if (options->Has(String::New("threshold"))) {
+            Local<Value> value = options->Get(String::New("threshold"));
+            if (!value->IsNumber() || value->NumberValue() != value->IntegerValue() ||
+                value->IntegerValue() < 0 || value->IntegerValue() > 255) {
+                error = "option 'threshold' must be an integer between 0 and 255";
+                return false;
+            }
+            threshold = static_cast<unsigned>(value->IntegerValue());
+        }
+        if (options->Has(String::New("alpha"))) {
+            mask = options->Get(String::New("alpha"))->BooleanValue() ? 0xffffffff : 0x00ffffff;
+        }
+        if (options->Has(String::New("diff"))) {
+            want_diff = options->Get(String::New("diff"))->BooleanValue();
+        }
+    }
+    return true;
+}
+
+// counts the differing pixels of `a` and `b`, filling `diff` if given
+static std::size_t compare_images(mapnik::image_32 const& a,
+                                  mapnik::image_32 const& b,
+                                  unsigned threshold,
+                                  unsigned mask,
+                                  image_ptr const& diff)
+{
+    mapnik::image_data_32 const& da = a.data();
+    mapnik::image_data_32 const& db = b.data();
+    if (da.width() != db.width() || da.height() != db.height())
+    {
+        throw std::runtime_error("images must have the same dimensions");
+    }
+    return node_mapnik::compare_pixels(da.getData(), db.getData(),
+                                       static_cast<std::size_t>(da.width()) * da.height(),
+                                       threshold, mask,
+                                       diff ? diff->data().getData() : NULL);
+}
+
+Handle<Value> Image::compareSync(const Arguments& args)
+{
+    HandleScope scope;
+    Image* im = node::ObjectWrap::Unwrap<Image>(args.This());
+    Image* other = NULL;
+    unsigned threshold = 16;
+    unsigned mask = 0xffffffff;
+    bool want_diff = false;
+    std::string error;
+    if (!parse_compare_arguments(args, args.Length(), other, threshold, mask, want_diff, error))
+        return ThrowException(Exception::TypeError(String::New(error.c_str())));
+    try
+    {
+        image_ptr diff;
+        if (want_diff)
+        {
+            diff = node_mapnik::raster_pool::instance().acquire_image(im->this_->width(), im->this_->height());
+        }
+        std::size_t mismatched = compare_images(*im->this_, *other->this_, threshold, mask, diff);
+        if (!want_diff)
+        {
+            return scope.Close(Number::New(mismatched));
+        }
+        Image* out = new Image(diff);
+        Handle<Value> ext = External::New(out);
+        Local<Object> result = Object::New();
+        result->Set(String::NewSymbol("mismatched"), Number::New(mismatched));
+        result->Set(String::NewSymbol("diff"), constructor->GetFunction()->NewInstance(1, &ext));
+        return scope.Close(result);
+    }
+    catch (std::exception const& ex)
+    {
+        return ThrowException(Exception::Error(String::New(ex.what())));
+    }
+}
+
+typedef struct {
+    uv_work_t request;
+    Image* im;
+    Image* other;
+    unsigned threshold;
+    unsigned mask;
+    bool want_diff;
+    std::size_t mismatched;
+    image_ptr diff;
+    bool error;
+    std::string error_name;
+    Persistent<Function> cb;
+} compare_image_baton_t;
+
+Handle<Value> Image::compare(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() == 0 || !args[args.Length()-1]->IsFunction()) {
+        return compareSync(args);
+    }
+    Local<Value> callback = args[args.Length()-1];
+    Image* other = NULL;
+    unsigned threshold = 16;
+    unsigned mask = 0xffffffff;
+    bool want_diff = false;
+    std::string error;
+    if (!parse_compare_arguments(args, args.Length() - 1, other, threshold, mask, want_diff, error))
+        return ThrowException(Exception::TypeError(String::New(error.c_str())));
+
+    compare_image_baton_t *closure = new compare_image_baton_t();
+    closure->request.data = closure;
+    closure->im = node::ObjectWrap::Unwrap<Image>(args.This());
+    closure->other = other;
+    closure->threshold = threshold;
+    closure->mask = mask;
+    closure->want_diff = want_diff;
+    closure->mismatched = 0;
+    closure->error = false;
+    closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+    node_mapnik::queue_work(&closure->request, EIO_Compare, (uv_after_work_cb)EIO_AfterCompare, node_mapnik::PRIORITY_HOUSEKEEPING);
+    closure->im->Ref();
+    closure->other->Ref();
+    return Undefined();
+}
+
+void Image::EIO_Compare(uv_work_t* req)
+{
+    compare_image_baton_t *closure = static_cast<compare_image_baton_t *>(req->data);
+    try
+    {
+        if (closure->want_diff)
+        {
+            closure->diff = node_mapnik::raster_pool::instance().acquire_image(closure->im->this_->width(),
+                                                                               closure->im->this_->height());
+        }
+        closure->mismatched = compare_images(*closure->im->this_, *closure->other->this_,
+                                             closure->threshold, closure->mask, closure->diff);
     }
     catch (std::exception const& ex)
     {
@@ -492,6 +853,41 @@ void Image::EIO_Demultiply(uv_work_t* req)
     }
 }
 
+void Image::EIO_AfterCompare(uv_work_t* req)
+{
+    HandleScope scope;
+    compare_image_baton_t *closure = static_cast<compare_image_baton_t *>(req->data);
+    TryCatch try_catch;
+    if (closure->error) {
+        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    }
+    else
+    {
+        Local<Value> argv[3] = { Local<Value>::New(Null()),
+                                 Local<Value>::New(Number::New(closure->mismatched)),
+                                 Local<Value>::New(Undefined())
+        };
+        int argc = 2;
+        if (closure->want_diff)
+        {
+            Image* out = new Image(closure->diff);
+            Handle<Value> ext = External::New(out);
+            argv[2] = constructor->GetFunction()->NewInstance(1, &ext);
+            argc = 3;
+        }
+        closure->cb->Call(Context::GetCurrent()->Global(), argc, argv);
+    }
+    if (try_catch.HasCaught())
+    {
+        node::FatalException(try_catch);
+    }
+    closure->im->Unref();
+    closure->other->Unref();
+    closure->cb.Dispose();
+    delete closure;
+}
+
 Handle<Value> Image::painted(const Arguments& args)
 {
     HandleScope scope;
@@ -516,6 +912,89 @@ Handle<Value> Image::height(const Arguments& args)
     return scope.Close(Integer::New(im->get()->height()));
 }
 
+// free callback of buffers returned by Image.data: drops the reference
+// that kept the pixels alive
+static void release_image(char * /*data*/, void * hint)
+{
+    delete static_cast<image_ptr *>(hint);
+}
+
+Handle<Value> Image::data(const Arguments& args)
+{
+    HandleScope scope;
+
+    Image* im = node::ObjectWrap::Unwrap<Image>(args.This());
+    mapnik::image_data_32 & pixels = im->get()->data();
+    std::size_t size = static_cast<std::size_t>(pixels.width()) * pixels.height() * 4;
+    if (size == 0)
+    {
+        #if NODE_VERSION_AT_LEAST(0, 11, 0)
+        return scope.Close(node::Buffer::New(static_cast<size_t>(0)));
+        #else
+        return scope.Close(node::Buffer::New(static_cast<size_t>(0))->handle_);
+        #endif
+    }
+    // the buffer shares the pixel memory and holds a reference to the
+    // image so the memory outlives this object if needed
+    image_ptr * owner = new image_ptr(im->get());
+    char * bytes = reinterpret_cast<char *>(pixels.getData());
+    #if NODE_VERSION_AT_LEAST(0, 11, 0)
+    return scope.Close(node::Buffer::New(bytes, size, release_image, owner));
+    #else
+    return scope.Close(node::Buffer::New(bytes, size, release_image, owner)->handle_);
+    #endif
+}
+
+Handle<Value> Image::fromBuffer(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 3 || !args[0]->IsObject() || !node::Buffer::HasInstance(args[0]->ToObject())) {
+        return ThrowException(Exception::TypeError(
+                                  String::New("must provide a buffer, width and height")));
+    }
+    if (!args[1]->IsNumber() || !args[2]->IsNumber()) {
+        return ThrowException(Exception::TypeError(
+                                  String::New("width and height must be integers")));
+    }
+    int width = args[1]->IntegerValue();
+    int height = args[2]->IntegerValue();
+    if (width <= 0 || height <= 0) {
+        return ThrowException(Exception::TypeError(
+                                  String::New("width and height must be greater than zero")));
+    }
+
+    bool premultiplied = false;
+    if (args.Length() > 3) {
+        if (!args[3]->IsObject()) {
+            return ThrowException(Exception::TypeError(
+                                      String::New("optional fourth argument must be an options object")));
+        }
+        Local<Object> options = args[3]->ToObject();
+        if (options->Has(String::New("premultiplied"))) {
+            premultiplied = options->Get(String::New("premultiplied"))->BooleanValue();
+        }
+    }
+
+    Local<Object> obj = args[0]->ToObject();
+    std::size_t count = static_cast<std::size_t>(width) * height;
+    if (node::Buffer::Length(obj) != count * 4) {
+        return ThrowException(Exception::TypeError(
+                                  String::New("buffer length must be width * height * 4")));
+    }
+
+    image_ptr image = node_mapnik::raster_pool::instance().acquire_image(width, height);
+    mapnik::image_data_32 & pixels = image->data();
+    std::memcpy(pixels.getData(), node::Buffer::Data(obj), count * 4);
+    if (premultiplied) {
+        // images hold straight alpha, as when decoded
+        node_mapnik::demultiply_pixels(pixels.getData(), count);
+    }
+    Image* im = new Image(image);
+    Handle<Value> ext = External::New(im);
+    return scope.Close(constructor->GetFunction()->NewInstance(1, &ext));
+}
+
 Handle<Value> Image::openSync(const Arguments& args)
 {
     HandleScope scope;
@@ -530,17 +1009,22 @@ Handle<Value> Image::openSync(const Arguments& args)
                                                        "Argument must be a string")));
     }
 
+    node_mapnik::decode_options options;
+    if (args.Length() > 1) {
+        std::string error;
+        if (!node_mapnik::parse_decode_options(args[1], options, error))
+            return ThrowException(Exception::TypeError(String::New(error.c_str())));
+    }
+
     try
     {
         std::string filename = TOSTR(args[0]);
         boost::optional<std::string> type = mapnik::type_from_filename(filename);
         if (type)
         {
-            MAPNIK_UNIQUE_PTR<mapnik::image_reader> reader(mapnik::get_image_reader(filename,*type));
-            if (reader.get())
+            MAPNIK_SHARED_PTR<mapnik::image_32> image_ptr = node_mapnik::decode_image_file(filename,*type,options);
+            if (image_ptr)
             {
-                MAPNIK_SHARED_PTR<mapnik::image_32> image_ptr(new mapnik::image_32(reader->width(),reader->height()));
-                reader->read(0,0,image_ptr->data());
                 Image* im = new Image(image_ptr);
                 Handle<Value> ext = External::New(im);
                 Handle<Object> obj = constructor->GetFunction()->NewInstance(1, &ext);
@@ -564,6 +1048,7 @@ typedef struct {
     image_ptr im;
     const char *data;
     size_t dataLength;
+    node_mapnik::decode_options options;
     bool error;
     std::string error_name;
     Persistent<Function> cb;
@@ -573,6 +1058,7 @@ typedef struct {
     uv_work_t request;
     image_ptr im;
     std::string filename;
+    node_mapnik::decode_options options;
     bool error;
     std::string error_name;
     Persistent<Function> cb;
@@ -582,7 +1068,7 @@ Handle<Value> Image::open(const Arguments& args)
 {
     HandleScope scope;
 
-    if (args.Length() == 1) {
+    if (args.Length() == 1 || (args.Length() == 2 && !args[1]->IsFunction())) {
         return openSync(args);
     }
 
@@ -602,12 +1088,20 @@ Handle<Value> Image::open(const Arguments& args)
         return ThrowException(Exception::TypeError(
                                   String::New("last argument must be a callback function")));
 
+    node_mapnik::decode_options options;
+    if (args.Length() > 2) {
+        std::string error;
+        if (!node_mapnik::parse_decode_options(args[1], options, error))
+            return ThrowException(Exception::TypeError(String::New(error.c_str())));
+    }
+
     image_file_ptr_baton_t *closure = new image_file_ptr_baton_t();
     closure->request.data = closure;
     closure->filename = TOSTR(args[0]);
+    closure->options = options;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Open, (uv_after_work_cb)EIO_AfterOpen);
+    node_mapnik::queue_work(&closure->request, EIO_Open, (uv_after_work_cb)EIO_AfterOpen, node_mapnik::PRIORITY_ENCODE);
     return Undefined();
 }
 
@@ -625,13 +1119,8 @@ void Image::EIO_Open(uv_work_t* req)
         }
         else
         {
-            MAPNIK_UNIQUE_PTR<mapnik::image_reader> reader(mapnik::get_image_reader(closure->filename,*type));
-            if (reader.get())
-            {
-                closure->im = MAPNIK_MAKE_SHARED<mapnik::image_32>(reader->width(),reader->height());
-                reader->read(0,0,closure->im->data());
-            }
-            else
+            closure->im = node_mapnik::decode_image_file(closure->filename,*type,closure->options);
+            if (!closure->im)
             {
                 closure->error = true;
                 closure->error_name = "Failed to load: " + closure->filename;
@@ -687,13 +1176,18 @@ Handle<Value> Image::fromBytesSync(const Arguments& args)
                                                        "first argument must be a buffer")));
     }
 
+    node_mapnik::decode_options options;
+    if (args.Length() > 1) {
+        std::string error;
+        if (!node_mapnik::parse_decode_options(args[1], options, error))
+            return ThrowException(Exception::TypeError(String::New(error.c_str())));
+    }
+
     try
     {
-        MAPNIK_UNIQUE_PTR<mapnik::image_reader> reader(mapnik::get_image_reader(node::Buffer::Data(obj),node::Buffer::Length(obj)));
-        if (reader.get())
+        MAPNIK_SHARED_PTR<mapnik::image_32> image_ptr = node_mapnik::decode_image(node::Buffer::Data(obj),node::Buffer::Length(obj),options);
+        if (image_ptr)
         {
-            MAPNIK_SHARED_PTR<mapnik::image_32> image_ptr(new mapnik::image_32(reader->width(),reader->height()));
-            reader->read(0,0,image_ptr->data());
             Image* im = new Image(image_ptr);
             Handle<Value> ext = External::New(im);
             return scope.Close(constructor->GetFunction()->NewInstance(1, &ext));
@@ -712,7 +1206,7 @@ Handle<Value> Image::fromBytes(const Arguments& args)
 {
     HandleScope scope;
 
-    if (args.Length() == 1) {
+    if (args.Length() == 1 || (args.Length() == 2 && !args[1]->IsFunction())) {
         return fromBytesSync(args);
     }
 
@@ -739,13 +1233,21 @@ Handle<Value> Image::fromBytes(const Arguments& args)
         return ThrowException(Exception::TypeError(
                                   String::New("last argument must be a callback function")));
 
+    node_mapnik::decode_options options;
+    if (args.Length() > 2) {
+        std::string error;
+        if (!node_mapnik::parse_decode_options(args[1], options, error))
+            return ThrowException(Exception::TypeError(String::New(error.c_str())));
+    }
+
     image_mem_ptr_baton_t *closure = new image_mem_ptr_baton_t();
     closure->request.data = closure;
     closure->data = node::Buffer::Data(obj);
     closure->dataLength = node::Buffer::Length(obj);
+    closure->options = options;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_FromBytes, (uv_after_work_cb)EIO_AfterFromBytes);
+    node_mapnik::queue_work(&closure->request, EIO_FromBytes, (uv_after_work_cb)EIO_AfterFromBytes, node_mapnik::PRIORITY_ENCODE);
     return Undefined();
 }
 
@@ -755,13 +1257,8 @@ void Image::EIO_FromBytes(uv_work_t* req)
 
     try
     {
-        MAPNIK_UNIQUE_PTR<mapnik::image_reader> reader(mapnik::get_image_reader(closure->data,closure->dataLength));
-        if (reader.get())
-        {
-            closure->im = MAPNIK_MAKE_SHARED<mapnik::image_32>(reader->width(),reader->height());
-            reader->read(0,0,closure->im->data());
-        }
-        else
+        closure->im = node_mapnik::decode_image(closure->data,closure->dataLength,closure->options);
+        if (!closure->im)
         {
             closure->error = true;
             closure->error_name = "Failed to load from buffer";
@@ -807,6 +1304,11 @@ Handle<Value> Image::encodeSync(const Arguments& args)
 
     std::string format = "png";
     palette_ptr palette;
+    palette_lut_ptr lut;
+    bool use_png_encoder = false;
+    bool use_lut = false;
+    node_mapnik::png_options png;
+    bool use_cache = false;
 
     // accept custom format
     if (args.Length() >= 1){
@@ -834,25 +1336,89 @@ Handle<Value> Image::encodeSync(const Arguments& args)
             if (obj->IsNull() || obj->IsUndefined() || !Palette::constructor->HasInstance(obj))
                 return ThrowException(Exception::TypeError(String::New("mapnik.Palette expected as second arg")));
             palette = node::ObjectWrap::Unwrap<Palette>(obj)->palette();
+            lut = node::ObjectWrap::Unwrap<Palette>(obj)->lut();
+        }
+        if (options->Has(String::New("png")))
+        {
+            std::string error;
+            if (!node_mapnik::parse_png_options(options->Get(String::New("png")), png, error))
+                return ThrowException(Exception::TypeError(String::New(error.c_str())));
+            use_png_encoder = true;
+        }
+        if (options->Has(String::New("webp")))
+        {
+            if (!node_mapnik::is_webp_format(format) || palette.get())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'webp' options require format 'webp' and no palette")));
+            std::string error;
+            if (!node_mapnik::parse_webp_options(options->Get(String::New("webp")), format, error))
+                return ThrowException(Exception::TypeError(String::New(error.c_str())));
+        }
+        if (options->Has(String::New("lut")))
+        {
+            Local<Value> lut_opt = options->Get(String::New("lut"));
+            if (!lut_opt->IsBoolean())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'lut' must be a boolean")));
+            use_lut = lut_opt->BooleanValue();
+        }
+        if (options->Has(String::New("cache")))
+        {
+            Local<Value> cache_opt = options->Get(String::New("cache"));
+            if (!cache_opt->IsBoolean())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'cache' must be a boolean")));
+            use_cache = cache_opt->BooleanValue();
         }
     }
 
+    // the palette's lookup table keeps only 3 bits of alpha, so png8 goes
+    // through it only when asked for; otherwise mapnik's exact palette
+    // matching is used
+    bool use_png8_encoder = use_lut;
+    if (use_lut && !(palette.get() && (format == "png8" || format == "png256")))
+        return ThrowException(Exception::TypeError(
+                                  String::New("'lut' requires format 'png8' or 'png256' with a palette")));
+    if (use_png_encoder && !use_png8_encoder && (palette.get() || (format != "png" && format != "png32")))
+        return ThrowException(Exception::TypeError(
+                                  String::New("'png' options require format 'png' or 'png32', or 'png8' with a palette and 'lut: true'")));
+
     try {
         std::string s;
-        if (palette.get())
+        std::string key;
+        if (use_cache)
+        {
+            key = node_mapnik::encode_cache_key(im->this_->data(), use_lut ? format + ":lut" : format,
+                                                palette.get(), use_png_encoder || use_lut ? &png : NULL);
+            node_mapnik::encode_cache::encoded_ptr cached = node_mapnik::encode_cache::instance().find(key);
+            if (cached)
+            {
+                return scope.Close(node_mapnik::buffer_copy_of(*cached));
+            }
+        }
+        if (use_png8_encoder)
+        {
+            node_mapnik::encode_png8(im->this_->data(), *lut, png, s);
+        }
+        else if (use_png_encoder)
+        {
+            node_mapnik::encode_png(im->this_->data(), png, s);
+        }
+        else if (palette.get())
         {
             s = save_to_string(*(im->this_), format, *palette);
         }
         else {
             s = save_to_string(*(im->this_), format);
         }
+        if (use_cache)
+        {
+            // the Buffer is writable, so it gets its own copy of the cached bytes
+            node_mapnik::encode_cache::encoded_ptr cached = node_mapnik::encode_cache::instance().insert(key, s);
+            if (cached) return scope.Close(node_mapnik::buffer_copy_of(*cached));
+        }
 
-        // https://github.com/joyent/node/commit/3a2f273bd73bc94a6e93f342d629106a9f022f2d#src/node_buffer.h
-        #if NODE_VERSION_AT_LEAST(0, 11, 0)
-        return scope.Close(node::Buffer::New((char*)s.data(),s.size()));
-        #else
-        return scope.Close(node::Buffer::New((char*)s.data(),s.size())->handle_);
-        #endif
+        return scope.Close(node_mapnik::buffer_from_string(s));
     }
     catch (std::exception const& ex)
     {
@@ -866,10 +1432,16 @@ typedef struct {
     Image* im;
     std::string format;
     palette_ptr palette;
+    palette_lut_ptr lut;
+    bool use_png8_encoder;
+    bool use_png_encoder;
+    node_mapnik::png_options png;
+    bool use_cache;
     bool error;
     std::string error_name;
     Persistent<Function> cb;
     std::string result;
+    node_mapnik::encode_cache::encoded_ptr cached; // holds the result when caching
 } encode_image_baton_t;
 
 Handle<Value> Image::encode(const Arguments& args)
@@ -880,6 +1452,11 @@ Handle<Value> Image::encode(const Arguments& args)
 
     std::string format = "png";
     palette_ptr palette;
+    palette_lut_ptr lut;
+    bool use_png_encoder = false;
+    bool use_lut = false;
+    node_mapnik::png_options png;
+    bool use_cache = false;
 
     // accept custom format
     if (args.Length() >= 1){
@@ -909,9 +1486,53 @@ Handle<Value> Image::encode(const Arguments& args)
                 return ThrowException(Exception::TypeError(String::New("mapnik.Palette expected as second arg")));
 
             palette = node::ObjectWrap::Unwrap<Palette>(obj)->palette();
+            lut = node::ObjectWrap::Unwrap<Palette>(obj)->lut();
+        }
+        if (options->Has(String::New("png")))
+        {
+            std::string error;
+            if (!node_mapnik::parse_png_options(options->Get(String::New("png")), png, error))
+                return ThrowException(Exception::TypeError(String::New(error.c_str())));
+            use_png_encoder = true;
+        }
+        if (options->Has(String::New("webp")))
+        {
+            if (!node_mapnik::is_webp_format(format) || palette.get())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'webp' options require format 'webp' and no palette")));
+            std::string error;
+            if (!node_mapnik::parse_webp_options(options->Get(String::New("webp")), format, error))
+                return ThrowException(Exception::TypeError(String::New(error.c_str())));
+        }
+        if (options->Has(String::New("lut")))
+        {
+            Local<Value> lut_opt = options->Get(String::New("lut"));
+            if (!lut_opt->IsBoolean())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'lut' must be a boolean")));
+            use_lut = lut_opt->BooleanValue();
+        }
+        if (options->Has(String::New("cache")))
+        {
+            Local<Value> cache_opt = options->Get(String::New("cache"));
+            if (!cache_opt->IsBoolean())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'cache' must be a boolean")));
+            use_cache = cache_opt->BooleanValue();
         }
     }
 
+    // the palette's lookup table keeps only 3 bits of alpha, so png8 goes
+    // through it only when asked for; otherwise mapnik's exact palette
+    // matching is used
+    bool use_png8_encoder = use_lut;
+    if (use_lut && !(palette.get() && (format == "png8" || format == "png256")))
+        return ThrowException(Exception::TypeError(
+                                  String::New("'lut' requires format 'png8' or 'png256' with a palette")));
+    if (use_png_encoder && !use_png8_encoder && (palette.get() || (format != "png" && format != "png32")))
+        return ThrowException(Exception::TypeError(
+                                  String::New("'png' options require format 'png' or 'png32', or 'png8' with a palette and 'lut: true'")));
+
     // ensure callback is a function
     Local<Value> callback = args[args.Length()-1];
     if (!args[args.Length()-1]->IsFunction())
@@ -923,9 +1544,14 @@ Handle<Value> Image::encode(const Arguments& args)
     closure->im = im;
     closure->format = format;
     closure->palette = palette;
+    closure->lut = lut;
+    closure->use_png8_encoder = use_png8_encoder;
+    closure->use_png_encoder = use_png_encoder;
+    closure->png = png;
+    closure->use_cache = use_cache;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode);
+    node_mapnik::queue_work(&closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode, node_mapnik::PRIORITY_ENCODE);
     im->Ref();
 
     return Undefined();
@@ -936,7 +1562,26 @@ void Image::EIO_Encode(uv_work_t* req)
     encode_image_baton_t *closure = static_cast<encode_image_baton_t *>(req->data);
 
     try {
-        if (closure->palette.get())
+        std::string key;
+        if (closure->use_cache)
+        {
+            // hashing happens here on the worker rather than the main thread
+            key = node_mapnik::encode_cache_key(closure->im->this_->data(),
+                                                closure->use_png8_encoder ? closure->format + ":lut" : closure->format,
+                                                closure->palette.get(),
+                                                closure->use_png_encoder || closure->use_png8_encoder ? &closure->png : NULL);
+            closure->cached = node_mapnik::encode_cache::instance().find(key);
+            if (closure->cached) return;
+        }
+        if (closure->use_png8_encoder)
+        {
+            node_mapnik::encode_png8(closure->im->this_->data(), *closure->lut, closure->png, closure->result);
+        }
+        else if (closure->use_png_encoder)
+        {
+            node_mapnik::encode_png(closure->im->this_->data(), closure->png, closure->result);
+        }
+        else if (closure->palette.get())
         {
             closure->result = save_to_string(*(closure->im->this_), closure->format, *closure->palette);
         }
@@ -944,6 +1589,10 @@ void Image::EIO_Encode(uv_work_t* req)
         {
             closure->result = save_to_string(*(closure->im->this_), closure->format);
         }
+        if (closure->use_cache)
+        {
+            closure->cached = node_mapnik::encode_cache::instance().insert(key, closure->result);
+        }
     }
     catch (std::exception const& ex)
     {
@@ -966,11 +1615,140 @@ void Image::EIO_AfterEncode(uv_work_t* req)
     }
     else
     {
-        #if NODE_VERSION_AT_LEAST(0, 11, 0)
-        Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(node::Buffer::New((char*)closure->result.data(),closure->result.size())) };
-        #else
-        Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(node::Buffer::New((char*)closure->result.data(),closure->result.size())->handle_) };
-        #endif
+        Local<Value> buffer = closure->cached ? node_mapnik::buffer_copy_of(*closure->cached)
+                                              : node_mapnik::buffer_from_string(closure->result);
+        Local<Value> argv[2] = { Local<Value>::New(Null()), buffer };
+        closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    }
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    closure->im->Unref();
+    closure->cb.Dispose();
+    delete closure;
+}
+
+// parses the width, height and optional options of resize and resizeSync
+static bool parse_resize_arguments(const Arguments& args,
+                                   int count,
+                                   unsigned & width,
+                                   unsigned & height,
+                                   node_mapnik::resize_options & options,
+                                   std::string & error)
+{
+    if (count < 2 || !args[0]->IsNumber() || !args[1]->IsNumber()) {
+        error = "requires a width and a height";
+        return false;
+    }
+    if (args[0]->IntegerValue() <= 0 || args[1]->IntegerValue() <= 0) {
+        error = "width and height must be greater than zero";
+        return false;
+    }
+    width = args[0]->IntegerValue();
+    height = args[1]->IntegerValue();
+    if (count > 2) {
+        return node_mapnik::parse_resize_options(args[2], options, error);
+    }
+    return true;
+}
+
+Handle<Value> Image::resizeSync(const Arguments& args)
+{
+    HandleScope scope;
+    Image* im = node::ObjectWrap::Unwrap<Image>(args.This());
+    unsigned width = 0;
+    unsigned height = 0;
+    node_mapnik::resize_options options;
+    std::string error;
+    if (!parse_resize_arguments(args, args.Length(), width, height, options, error))
+        return ThrowException(Exception::TypeError(String::New(error.c_str())));
+    try
+    {
+        image_ptr result = node_mapnik::raster_pool::instance().acquire_image(width, height);
+        node_mapnik::resize_image(im->this_->data(), result->data(), options);
+        Image* out = new Image(result);
+        Handle<Value> ext = External::New(out);
+        return scope.Close(constructor->GetFunction()->NewInstance(1, &ext));
+    }
+    catch (std::exception const& ex)
+    {
+        return ThrowException(Exception::Error(String::New(ex.what())));
+    }
+}
+
+typedef struct {
+    uv_work_t request;
+    Image* im;
+    unsigned width;
+    unsigned height;
+    node_mapnik::resize_options options;
+    image_ptr result;
+    bool error;
+    std::string error_name;
+    Persistent<Function> cb;
+} resize_image_baton_t;
+
+Handle<Value> Image::resize(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() == 0 || !args[args.Length()-1]->IsFunction()) {
+        return resizeSync(args);
+    }
+    Local<Value> callback = args[args.Length()-1];
+    unsigned width = 0;
+    unsigned height = 0;
+    node_mapnik::resize_options options;
+    std::string error;
+    if (!parse_resize_arguments(args, args.Length() - 1, width, height, options, error))
+        return ThrowException(Exception::TypeError(String::New(error.c_str())));
+
+    resize_image_baton_t *closure = new resize_image_baton_t();
+    closure->request.data = closure;
+    closure->im = node::ObjectWrap::Unwrap<Image>(args.This());
+    closure->width = width;
+    closure->height = height;
+    closure->options = options;
+    closure->error = false;
+    closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+    node_mapnik::queue_work(&closure->request, EIO_Resize, (uv_after_work_cb)EIO_AfterResize, node_mapnik::PRIORITY_ENCODE);
+    closure->im->Ref();
+    return Undefined();
+}
+
+void Image::EIO_Resize(uv_work_t* req)
+{
+    resize_image_baton_t *closure = static_cast<resize_image_baton_t *>(req->data);
+    try
+    {
+        closure->result = node_mapnik::raster_pool::instance().acquire_image(closure->width, closure->height);
+        node_mapnik::resize_image(closure->im->this_->data(), closure->result->data(), closure->options);
+    }
+    catch (std::exception const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+void Image::EIO_AfterResize(uv_work_t* req)
+{
+    HandleScope scope;
+
+    resize_image_baton_t *closure = static_cast<resize_image_baton_t *>(req->data);
+
+    TryCatch try_catch;
+
+    if (closure->error) {
+        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    } else {
+        Image* out = new Image(closure->result);
+        Handle<Value> ext = External::New(out);
+        Local<Object> image_obj = constructor->GetFunction()->NewInstance(1, &ext);
+        Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(image_obj) };
         closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
     }
 
@@ -1060,6 +1838,70 @@ typedef struct {
     Persistent<Function> cb;
 } composite_image_baton_t;
 
+// parses the comp_op, opacity, dx, dy and image_filters options shared by
+// composite and compositeMany
+static bool parse_composite_options(Local<Object> const& options,
+                                    node_mapnik::composite_layer & layer,
+                                    std::vector<mapnik::filter::filter_type> & filters,
+                                    std::string & error)
+{
+    if (options->Has(String::New("comp_op")))
+    {
+        Local<Value> opt = options->Get(String::New("comp_op"));
+        if (!opt->IsNumber()) {
+            error = "comp_op must be a mapnik.compositeOp value";
+            return false;
+        }
+        layer.mode = static_cast<mapnik::composite_mode_e>(opt->IntegerValue());
+    }
+
+    if (options->Has(String::New("opacity")))
+    {
+        Local<Value> opt = options->Get(String::New("opacity"));
+        if (!opt->IsNumber()) {
+            error = "opacity must be a floating point number";
+            return false;
+        }
+        layer.opacity = opt->NumberValue();
+    }
+
+    if (options->Has(String::New("dx")))
+    {
+        Local<Value> opt = options->Get(String::New("dx"));
+        if (!opt->IsNumber()) {
+            error = "dx must be an integer";
+            return false;
+        }
+        layer.dx = opt->IntegerValue();
+    }
+
+    if (options->Has(String::New("dy")))
+    {
+        Local<Value> opt = options->Get(String::New("dy"));
+        if (!opt->IsNumber()) {
+            error = "dy must be an integer";
+            return false;
+        }
+        layer.dy = opt->IntegerValue();
+    }
+
+    if (options->Has(String::New("image_filters")))
+    {
+        Local<Value> opt = options->Get(String::New("image_filters"));
+        if (!opt->IsString()) {
+            error = "image_filters argument must string of filter names";
+            return false;
+        }
+        std::string filter_str = TOSTR(opt);
+        if (!mapnik::filter::parse_image_filters(filter_str, filters))
+        {
+            error = "could not parse image_filters";
+            return false;
+        }
+    }
+    return true;
+}
+
 Handle<Value> Image::composite(const Arguments& args)
 {
     HandleScope scope;
@@ -1086,87 +1928,30 @@ Handle<Value> Image::composite(const Arguments& args)
 
     try
     {
-        mapnik::composite_mode_e mode = mapnik::src_over;
-        float opacity = 1.0;
+        node_mapnik::composite_layer layer;
         std::vector<mapnik::filter::filter_type> filters;
-        int dx = 0;
-        int dy = 0;
         if (args.Length() >= 2) {
             if (!args[1]->IsObject())
                 return ThrowException(Exception::TypeError(
                                           String::New("optional second arg must be an options object")));
 
-            Local<Object> options = args[1]->ToObject();
-
-            if (options->Has(String::New("comp_op")))
-            {
-                Local<Value> opt = options->Get(String::New("comp_op"));
-                if (!opt->IsNumber()) {
-                    return ThrowException(Exception::TypeError(
-                                              String::New("comp_op must be a mapnik.compositeOp value")));
-                }
-                mode = static_cast<mapnik::composite_mode_e>(opt->IntegerValue());
-            }
-
-            if (options->Has(String::New("opacity")))
-            {
-                Local<Value> opt = options->Get(String::New("opacity"));
-                if (!opt->IsNumber()) {
-                    return ThrowException(Exception::TypeError(
-                                              String::New("opacity must be a floating point number")));
-                }
-                opacity = opt->NumberValue();
-            }
-
-            if (options->Has(String::New("dx")))
-            {
-                Local<Value> opt = options->Get(String::New("dx"));
-                if (!opt->IsNumber()) {
-                    return ThrowException(Exception::TypeError(
-                                              String::New("dx must be an integer")));
-                }
-                dx = opt->IntegerValue();
-            }
-
-            if (options->Has(String::New("dy")))
-            {
-                Local<Value> opt = options->Get(String::New("dy"));
-                if (!opt->IsNumber()) {
-                    return ThrowException(Exception::TypeError(
-                                              String::New("dy must be an integer")));
-                }
-                dy = opt->IntegerValue();
-            }
-
-            if (options->Has(String::New("image_filters")))
-            {
-                Local<Value> opt = options->Get(String::New("image_filters"));
-                if (!opt->IsString()) {
-                    return ThrowException(Exception::TypeError(
-                                              String::New("image_filters argument must string of filter names")));
-                }
-                std::string filter_str = TOSTR(opt);
-                bool result = mapnik::filter::parse_image_filters(filter_str, filters);
-                if (!result)
-                {
-                    return ThrowException(Exception::TypeError(
-                                              String::New("could not parse image_filters")));
-                }
-            }
+            std::string error;
+            if (!parse_composite_options(args[1]->ToObject(), layer, filters, error))
+                return ThrowException(Exception::TypeError(String::New(error.c_str())));
         }
 
         composite_image_baton_t *closure = new composite_image_baton_t();
         closure->request.data = closure;
         closure->im1 = node::ObjectWrap::Unwrap<Image>(args.This());
         closure->im2 = node::ObjectWrap::Unwrap<Image>(im2);
-        closure->mode = mode;
-        closure->opacity = opacity;
+        closure->mode = layer.mode;
+        closure->opacity = layer.opacity;
         closure->filters = filters;
-        closure->dx = dx;
-        closure->dy = dy;
+        closure->dx = layer.dx;
+        closure->dy = layer.dy;
         closure->error = false;
         closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-        uv_queue_work(uv_default_loop(), &closure->request, EIO_Composite, (uv_after_work_cb)EIO_AfterComposite);
+        node_mapnik::queue_work(&closure->request, EIO_Composite, (uv_after_work_cb)EIO_AfterComposite, node_mapnik::PRIORITY_ENCODE);
         closure->im1->Ref();
         closure->im2->Ref();
     }
@@ -1185,13 +1970,14 @@ void Image::EIO_Composite(uv_work_t* req)
     {
         if (closure->filters.size() > 0)
         {
-            mapnik::filter::filter_visitor<mapnik::image_32> visitor(*closure->im2->this_);
-            BOOST_FOREACH(mapnik::filter::filter_type const& filter_tag, closure->filters)
-            {
-                boost::apply_visitor(visitor, filter_tag);
-            }
+            // filter a scratch copy so the source can be reused unchanged
+            image_ptr filtered = node_mapnik::filtered_copy(*closure->im2->this_, closure->filters);
+            mapnik::composite(closure->im1->this_->data(),filtered->data(), closure->mode, closure->opacity, closure->dx, closure->dy);
+        }
+        else
+        {
+            mapnik::composite(closure->im1->this_->data(),closure->im2->this_->data(), closure->mode, closure->opacity, closure->dx, closure->dy);
         }
-        mapnik::composite(closure->im1->this_->data(),closure->im2->this_->data(), closure->mode, closure->opacity, closure->dx, closure->dy);
     }
     catch (std::exception const& ex)
     {
@@ -1226,6 +2012,242 @@ void Image::EIO_AfterComposite(uv_work_t* req)
     delete closure;
 }
 
+typedef struct {
+    uv_work_t request;
+    Image* im;
+    std::vector<Image*> sources;
+    std::vector<node_mapnik::composite_layer> layers;
+    std::vector<std::vector<mapnik::filter::filter_type> > filters;
+    bool error;
+    std::string error_name;
+    Persistent<Function> cb;
+} composite_many_baton_t;
+
+Handle<Value> Image::compositeMany(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 2 || !args[0]->IsArray()) {
+        return ThrowException(Exception::TypeError(
+                                  String::New("requires an array of layers and a callback")));
+    }
+
+    Local<Value> callback = args[args.Length()-1];
+    if (!callback->IsFunction())
+        return ThrowException(Exception::TypeError(
+                                  String::New("last argument must be a callback function")));
+
+    Image* im = node::ObjectWrap::Unwrap<Image>(args.This());
+    Local<Array> list = Local<Array>::Cast(args[0]);
+    unsigned count = list->Length();
+    std::vector<Image*> sources;
+    std::vector<node_mapnik::composite_layer> layers(count);
+    std::vector<std::vector<mapnik::filter::filter_type> > filters(count);
+    for (unsigned i = 0; i < count; ++i)
+    {
+        Local<Value> item = list->Get(i);
+        if (!item->IsObject())
+            return ThrowException(Exception::TypeError(
+                                      String::New("layers must be objects with an image and optional composite options")));
+        Local<Object> options = item->ToObject();
+        Local<Value> image = options->Get(String::New("image"));
+        if (!image->IsObject() || !Image::constructor->HasInstance(image->ToObject()))
+            return ThrowException(Exception::TypeError(
+                                      String::New("each layer requires a mapnik.Image as 'image'")));
+        Image* source = node::ObjectWrap::Unwrap<Image>(image->ToObject());
+        if (source == im || source->this_ == im->this_)
+            return ThrowException(Exception::TypeError(
+                                      String::New("an image cannot be composited onto itself")));
+        std::string error;
+        if (!parse_composite_options(options, layers[i], filters[i], error))
+            return ThrowException(Exception::TypeError(String::New(error.c_str())));
+        sources.push_back(source);
+    }
+
+    composite_many_baton_t *closure = new composite_many_baton_t();
+    closure->request.data = closure;
+    closure->im = im;
+    closure->sources = sources;
+    closure->layers = layers;
+    closure->filters = filters;
+    closure->error = false;
+    closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+    node_mapnik::queue_work(&closure->request, EIO_CompositeMany, (uv_after_work_cb)EIO_AfterCompositeMany, node_mapnik::PRIORITY_ENCODE);
+    closure->im->Ref();
+    for (std::size_t i = 0; i < closure->sources.size(); ++i)
+    {
+        closure->sources[i]->Ref();
+    }
+    return Undefined();
+}
+
+void Image::EIO_CompositeMany(uv_work_t* req)
+{
+    composite_many_baton_t *closure = static_cast<composite_many_baton_t *>(req->data);
+
+    try
+    {
+        // filters need whole neighbourhoods so they run on scratch copies
+        // before blending, which leaves the sources unchanged
+        std::vector<image_ptr> filtered;
+        for (std::size_t i = 0; i < closure->sources.size(); ++i)
+        {
+            mapnik::image_32 const& source = *closure->sources[i]->this_;
+            if (closure->filters[i].size() > 0)
+            {
+                filtered.push_back(node_mapnik::filtered_copy(source, closure->filters[i]));
+                closure->layers[i].data = &filtered.back()->data();
+            }
+            else
+            {
+                closure->layers[i].data = &source.data();
+            }
+        }
+        node_mapnik::composite_stack(closure->im->this_->data(), closure->layers);
+    }
+    catch (std::exception const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+void Image::EIO_AfterCompositeMany(uv_work_t* req)
+{
+    HandleScope scope;
+
+    composite_many_baton_t *closure = static_cast<composite_many_baton_t *>(req->data);
+
+    TryCatch try_catch;
+
+    if (closure->error) {
+        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    } else {
+        Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->im->handle_) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    }
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    closure->im->Unref();
+    for (std::size_t i = 0; i < closure->sources.size(); ++i)
+    {
+        closure->sources[i]->Unref();
+    }
+    closure->cb.Dispose();
+    delete closure;
+}
+
+typedef struct {
+    uv_work_t request;
+    Image* im;
+    std::vector<mapnik::filter::filter_type> filters;
+    bool error;
+    std::string error_name;
+    Persistent<Function> cb;
+} filter_image_baton_t;
+
+static bool parse_filter_argument(const Arguments& args,
+                                  std::vector<mapnik::filter::filter_type> & filters,
+                                  std::string & error)
+{
+    if (args.Length() < 1 || !args[0]->IsString()) {
+        error = "first argument must be a string of filter names";
+        return false;
+    }
+    std::string filter_str = TOSTR(args[0]);
+    if (!mapnik::filter::parse_image_filters(filter_str, filters)) {
+        error = "could not parse image filters";
+        return false;
+    }
+    return true;
+}
+
+Handle<Value> Image::filterSync(const Arguments& args)
+{
+    HandleScope scope;
+    Image* im = node::ObjectWrap::Unwrap<Image>(args.This());
+    std::vector<mapnik::filter::filter_type> filters;
+    std::string error;
+    if (!parse_filter_argument(args, filters, error))
+        return ThrowException(Exception::TypeError(String::New(error.c_str())));
+    try
+    {
+        node_mapnik::apply_image_filters(*im->this_, filters);
+    }
+    catch (std::exception const& ex)
+    {
+        return ThrowException(Exception::Error(String::New(ex.what())));
+    }
+    return scope.Close(args.This());
+}
+
+Handle<Value> Image::filter(const Arguments& args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 2 || !args[args.Length()-1]->IsFunction()) {
+        return filterSync(args);
+    }
+    Local<Value> callback = args[args.Length()-1];
+    std::vector<mapnik::filter::filter_type> filters;
+    std::string error;
+    if (!parse_filter_argument(args, filters, error))
+        return ThrowException(Exception::TypeError(String::New(error.c_str())));
+
+    filter_image_baton_t *closure = new filter_image_baton_t();
+    closure->request.data = closure;
+    closure->im = node::ObjectWrap::Unwrap<Image>(args.This());
+    closure->filters = filters;
+    closure->error = false;
+    closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
+    node_mapnik::queue_work(&closure->request, EIO_Filter, (uv_after_work_cb)EIO_AfterFilter, node_mapnik::PRIORITY_ENCODE);
+    closure->im->Ref();
+    return Undefined();
+}
+
+void Image::EIO_Filter(uv_work_t* req)
+{
+    filter_image_baton_t *closure = static_cast<filter_image_baton_t *>(req->data);
+    try
+    {
+        node_mapnik::apply_image_filters(*closure->im->this_, closure->filters);
+    }
+    catch (std::exception const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+void Image::EIO_AfterFilter(uv_work_t* req)
+{
+    HandleScope scope;
+
+    filter_image_baton_t *closure = static_cast<filter_image_baton_t *>(req->data);
+
+    TryCatch try_catch;
+
+    if (closure->error) {
+        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    } else {
+        Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->im->handle_) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    }
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    closure->im->Unref();
+    closure->cb.Dispose();
+    delete closure;
+}
+
 #else
 
 Handle<Value> Image::composite(const Arguments& args)
@@ -1237,4 +2259,27 @@ Handle<Value> Image::composite(const Arguments& args)
 
 }
 
+Handle<Value> Image::compositeMany(const Arguments& args)
+{
+    HandleScope scope;
+
+    return ThrowException(Exception::TypeError(
+                              String::New("compositing is only supported if node-mapnik is built against >= Mapnik 2.1.x")));
+
+}
+
+Handle<Value> Image::filterSync(const Arguments& args)
+{
+    HandleScope scope;
+
+    return ThrowException(Exception::TypeError(
+                              String::New("image filters are only supported if node-mapnik is built against >= Mapnik 2.1.x")));
+
+}
+
+Handle<Value> Image::filter(const Arguments& args)
+{
+    return filterSync(args);
+}
+
 #endif
@@ -26,9 +26,16 @@ public:
     static void EIO_AfterEncode(uv_work_t* req);
 
     static Handle<Value> setGrayScaleToAlpha(const Arguments &args);
+    static void EIO_SetGrayScaleToAlpha(uv_work_t* req);
     static Handle<Value> width(const Arguments &args);
     static Handle<Value> height(const Arguments &args);
+    static Handle<Value> data(const Arguments &args);
+    static Handle<Value> fromBuffer(const Arguments &args);
     static Handle<Value> view(const Arguments &args);
+    static Handle<Value> resizeSync(const Arguments &args);
+    static Handle<Value> resize(const Arguments &args);
+    static void EIO_Resize(uv_work_t* req);
+    static void EIO_AfterResize(uv_work_t* req);
     static Handle<Value> openSync(const Arguments &args);
     static Handle<Value> open(const Arguments &args);
     static void EIO_Open(uv_work_t* req);
@@ -39,6 +46,14 @@ public:
     static void EIO_AfterFromBytes(uv_work_t* req);
     static Handle<Value> save(const Arguments &args);
     static Handle<Value> painted(const Arguments &args);
+    static Handle<Value> isSolid(const Arguments &args);
+    static void EIO_IsSolid(uv_work_t* req);
+    static void EIO_AfterIsSolid(uv_work_t* req);
+    static Handle<Value> isSolidSync(const Arguments &args);
+    static Handle<Value> compareSync(const Arguments &args);
+    static Handle<Value> compare(const Arguments &args);
+    static void EIO_Compare(uv_work_t* req);
+    static void EIO_AfterCompare(uv_work_t* req);
     static Handle<Value> composite(const Arguments &args);
     static Handle<Value> premultiplySync(const Arguments& args);
     static Handle<Value> premultiply(const Arguments& args);
@@ -53,6 +68,13 @@ public:
     static void EIO_AfterClear(uv_work_t* req);
     static void EIO_Composite(uv_work_t* req);
     static void EIO_AfterComposite(uv_work_t* req);
+    static Handle<Value> compositeMany(const Arguments& args);
+    static void EIO_CompositeMany(uv_work_t* req);
+    static void EIO_AfterCompositeMany(uv_work_t* req);
+    static Handle<Value> filterSync(const Arguments& args);
+    static Handle<Value> filter(const Arguments& args);
+    static void EIO_Filter(uv_work_t* req);
+    static void EIO_AfterFilter(uv_work_t* req);
 
     static Handle<Value> get_prop(Local<String> property,
                                   const AccessorInfo& info);
@@ -18,6 +18,9 @@
 #include "mapnik_color.hpp"
 #include "mapnik_palette.hpp"
 #include "utils.hpp"
+#include "is_solid.hpp"
+#include "buffer_utils.hpp"
+#include "worker_pool.hpp"
 
 // boost
 #include MAPNIK_MAKE_SHARED_INCLUDE
@@ -127,7 +130,7 @@ Handle<Value> ImageView::isSolid(const Arguments& args)
     closure->pixel = 0;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid);
+    node_mapnik::queue_work(&closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid, node_mapnik::PRIORITY_HOUSEKEEPING);
     im->Ref();
     return Undefined();
 }
@@ -138,21 +141,7 @@ void ImageView::EIO_IsSolid(uv_work_t* req)
     image_view_ptr view = closure->im->get();
     if (view->width() > 0 && view->height() > 0)
     {
-        typedef mapnik::image_view<mapnik::image_data_32>::pixel_type pixel_type;
-        pixel_type const first_pixel = view->getRow(0)[0];
-        closure->pixel = first_pixel;
-        for (unsigned y = 0; y < view->height(); ++y)
-        {
-            pixel_type const * row = view->getRow(y);
-            for (unsigned x = 0; x < view->width(); ++x)
-            {
-                if (first_pixel != row[x])
-                {
-                    closure->result = false;
-                    return;
-                }
-            }
-        }
+        closure->result = node_mapnik::is_solid(*view, closure->pixel);
     }
     else
     {
@@ -205,19 +194,8 @@ Handle<Value> ImageView::isSolidSync(const Arguments& args)
     image_view_ptr view = im->get();
     if (view->width() > 0 && view->height() > 0)
     {
-        mapnik::image_view<mapnik::image_data_32>::pixel_type const* first_row = view->getRow(0);
-        mapnik::image_view<mapnik::image_data_32>::pixel_type const first_pixel = first_row[0];
-        for (unsigned y = 0; y < view->height(); ++y)
-        {
-            mapnik::image_view<mapnik::image_data_32>::pixel_type const * row = view->getRow(y);
-            for (unsigned x = 0; x < view->width(); ++x)
-            {
-                if (first_pixel != row[x])
-                {
-                    return scope.Close(False());
-                }
-            }
-        }
+        mapnik::image_view<mapnik::image_data_32>::pixel_type pixel;
+        return scope.Close(Boolean::New(node_mapnik::is_solid(*view, pixel)));
     }
     return scope.Close(True());
 }
@@ -329,11 +307,7 @@ Handle<Value> ImageView::encodeSync(const Arguments& args)
             s = save_to_string(image, format);
         }
 
-        #if NODE_VERSION_AT_LEAST(0, 11, 0)
-        return scope.Close(node::Buffer::New((char*)s.data(),s.size()));
-        #else
-        return scope.Close(node::Buffer::New((char*)s.data(),s.size())->handle_);
-        #endif
+        return scope.Close(node_mapnik::buffer_from_string(s));
     }
     catch (std::exception const& ex)
     {
@@ -407,7 +381,7 @@ Handle<Value> ImageView::encode(const Arguments& args)
     closure->palette = palette;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode);
+    node_mapnik::queue_work(&closure->request, EIO_Encode, (uv_after_work_cb)EIO_AfterEncode, node_mapnik::PRIORITY_ENCODE);
     im->Ref();
     return Undefined();
 }
@@ -448,11 +422,7 @@ void ImageView::EIO_AfterEncode(uv_work_t* req)
     }
     else
     {
-        #if NODE_VERSION_AT_LEAST(0, 11, 0)
-        Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(node::Buffer::New((char*)closure->result.data(),closure->result.size())) };
-        #else
-        Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(node::Buffer::New((char*)closure->result.data(),closure->result.size())->handle_) };
-        #endif
+        Local<Value> argv[2] = { Local<Value>::New(Null()), node_mapnik::buffer_from_string(closure->result) };
         closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
     }
 
@@ -1,6 +1,7 @@
 
 #include "mapnik_map.hpp"
 #include "utils.hpp"
+#include "buffer_utils.hpp"
 #include "mapnik_color.hpp"             // for Color, Color::constructor
 #include "mapnik_featureset.hpp"        // for Featureset
 #include "mapnik_grid.hpp"              // for Grid, Grid::constructor
@@ -10,6 +11,14 @@
 #include "vector_tile_processor.hpp"
 #include "vector_tile_backend_pbf.hpp"
 #include "mapnik_vector_tile.hpp"
+#include "style_cache.hpp"
+#include "parallel.hpp"
+#include "worker_pool.hpp"
+#include "render_coalescer.hpp"
+#include "grid_layers.hpp"
+#include "fd_stream.hpp"
+#include "png_stream_writer.hpp"
+#include "webp_options.hpp"
 
 // node
 #include <node.h>
@@ -21,7 +30,10 @@
 #include <mapnik/box2d.hpp>             // for box2d
 #include <mapnik/color.hpp>             // for color
 #include <mapnik/datasource.hpp>        // for featureset_ptr
+#include <mapnik/datasource_cache.hpp>  // for datasource_cache
+#include <mapnik/feature_factory.hpp>  // for feature_factory
 #include <mapnik/feature_type_style.hpp>  // for rules, feature_type_style
+#include <mapnik/geometry.hpp>          // for geometry_type
 #include <mapnik/graphics.hpp>          // for image_32
 #include <mapnik/grid/grid.hpp>         // for hit_grid, grid
 #include <mapnik/grid/grid_renderer.hpp>  // for grid_renderer
@@ -36,10 +48,28 @@
 #include <mapnik/version.hpp>           // for MAPNIK_VERSION
 #include <mapnik/scale_denominator.hpp>
 
+#ifdef HAVE_CAIRO
+#include <mapnik/cairo_renderer.hpp>
+#include <cairo.h>
+#ifdef CAIRO_HAS_PDF_SURFACE
+#include <cairo-pdf.h>
+#endif // CAIRO_HAS_PDF_SURFACE
+#ifdef CAIRO_HAS_PS_SURFACE
+#include <cairo-ps.h>
+#endif // CAIRO_HAS_PS_SURFACE
+#ifdef CAIRO_HAS_SVG_SURFACE
+#include <cairo-svg.h>
+#endif // CAIRO_HAS_SVG_SURFACE
+#endif
+
 // stl
+#include <algorithm>                    // for min, max
 #include <exception>                    // for exception
+#include <fstream>                      // for ofstream
 #include <iosfwd>                       // for ostringstream, ostream
 #include <iostream>                     // for clog
+#include <limits>                       // for numeric_limits
+#include <map>
 #include <ostream>                      // for operator<<, basic_ostream, etc
 #include <sstream>                      // for basic_ostringstream, etc
 
@@ -79,6 +109,9 @@ void Map::Initialize(Handle<Object> target) {
     NODE_SET_PROTOTYPE_METHOD(constructor, "scaleDenominator", scaleDenominator);
     NODE_SET_PROTOTYPE_METHOD(constructor, "queryPoint", queryPoint);
     NODE_SET_PROTOTYPE_METHOD(constructor, "queryMapPoint", queryMapPoint);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "enableFeatureCache", enableFeatureCache);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "disableFeatureCache", disableFeatureCache);
+    NODE_SET_PROTOTYPE_METHOD(constructor, "featureCacheStats", featureCacheStats);
 
     // layer access
     NODE_SET_PROTOTYPE_METHOD(constructor, "add_layer", add_layer);
@@ -102,12 +135,16 @@ void Map::Initialize(Handle<Object> target) {
 Map::Map(int width, int height) :
     ObjectWrap(),
     map_(MAPNIK_MAKE_SHARED<mapnik::Map>(width,height)),
-    in_use_(0) {}
+    in_use_(0),
+    feature_cache_(),
+    feature_cache_expand_(0.0) {}
 
 Map::Map(int width, int height, std::string const& srs) :
     ObjectWrap(),
     map_(MAPNIK_MAKE_SHARED<mapnik::Map>(width,height,srs)),
-    in_use_(0) {}
+    in_use_(0),
+    feature_cache_(),
+    feature_cache_expand_(0.0) {}
 
 Map::~Map() { }
 
@@ -123,6 +160,13 @@ int Map::active() const {
     return in_use_;
 }
 
+void Map::attach_feature_cache() {
+    // layers must not be swapped out under a render in progress
+    if (feature_cache_ && in_use_ == 0) {
+        node_mapnik::attach_feature_cache(*map_, feature_cache_, feature_cache_expand_);
+    }
+}
+
 Handle<Value> Map::New(const Arguments& args)
 {
     HandleScope scope;
@@ -362,11 +406,14 @@ Handle<Value> Map::scaleDenominator(const Arguments& args)
 typedef struct {
     uv_work_t request;
     Map *m;
-    std::map<std::string,mapnik::featureset_ptr> featuresets;
-    int layer_idx;
+    std::vector<mapnik::coord2d> points;
+    std::vector<unsigned> layers;
+    std::vector<std::string> layer_names;
+    std::vector<std::string> fields;
+    // one entry per point and queried layer: results[point * layers.size() + layer]
+    std::vector<node_mapnik::feature_cache::features_ptr> results;
+    bool batch;
     bool geo_coords;
-    double x;
-    double y;
     bool error;
     std::string error_name;
     Persistent<Function> cb;
@@ -390,37 +437,79 @@ Handle<Value> Map::queryPoint(const Arguments& args)
 Handle<Value> Map::abstractQueryPoint(const Arguments& args, bool geo_coords)
 {
     HandleScope scope;
-    if (args.Length() < 3)
-    {
-        return ThrowException(Exception::TypeError(
-                                  String::New("requires at least three arguments, a x,y query and a callback")));
-    }
 
-    double x,y;
-    if (!args[0]->IsNumber() || !args[1]->IsNumber())
+    // a batch of points is passed as an array of [x,y] pairs in place of x,y
+    bool batch = args.Length() > 0 && args[0]->IsArray();
+    int options_idx = batch ? 1 : 2;
+    std::vector<mapnik::coord2d> points;
+
+    if (batch)
     {
-        return ThrowException(Exception::TypeError(
-                                  String::New("x,y arguments must be numbers")));
+        if (args.Length() < 2)
+        {
+            return ThrowException(Exception::TypeError(
+                                      String::New("requires at least two arguments, an array of [x,y] points and a callback")));
+        }
+        Local<Array> a = Local<Array>::Cast(args[0]);
+        unsigned int num_points = a->Length();
+        points.reserve(num_points);
+        for (unsigned int i = 0; i < num_points; ++i)
+        {
+            Local<Value> pt = a->Get(i);
+            if (!pt->IsArray() || Local<Array>::Cast(pt)->Length() != 2)
+                return ThrowException(Exception::TypeError(
+                                          String::New("points must be an array of [x,y] arrays")));
+            Local<Array> xy = Local<Array>::Cast(pt);
+            if (!xy->Get(0)->IsNumber() || !xy->Get(1)->IsNumber())
+                return ThrowException(Exception::TypeError(
+                                          String::New("x,y values of points must be numbers")));
+            points.push_back(mapnik::coord2d(xy->Get(0)->NumberValue(), xy->Get(1)->NumberValue()));
+        }
     }
     else
     {
-        x = args[0]->NumberValue();
-        y = args[1]->NumberValue();
+        if (args.Length() < 3)
+        {
+            return ThrowException(Exception::TypeError(
+                                      String::New("requires at least three arguments, a x,y query and a callback")));
+        }
+
+        if (!args[0]->IsNumber() || !args[1]->IsNumber())
+        {
+            return ThrowException(Exception::TypeError(
+                                      String::New("x,y arguments must be numbers")));
+        }
+        points.push_back(mapnik::coord2d(args[0]->NumberValue(), args[1]->NumberValue()));
     }
 
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
 
     Local<Object> options = Object::New();
     int layer_idx = -1;
+    std::vector<std::string> fields;
 
-    if (args.Length() > 3)
+    if (args.Length() > options_idx + 1)
     {
         // options object
-        if (!args[2]->IsObject())
+        if (!args[options_idx]->IsObject())
             return ThrowException(Exception::TypeError(
-                                      String::New("optional third argument must be an options object")));
+                                      String::New("optional options argument must be an object")));
+
+        options = args[options_idx]->ToObject();
 
-        options = args[2]->ToObject();
+        if (options->Has(String::New("fields")))
+        {
+            Local<Value> fields_opt = options->Get(String::New("fields"));
+            if (!fields_opt->IsArray())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'fields' option must be an array of attribute names")));
+            Local<Array> a = Local<Array>::Cast(fields_opt);
+            unsigned int num_fields = a->Length();
+            for (unsigned int i = 0; i < num_fields; ++i)
+            {
+                fields.push_back(TOSTR(a->Get(i)));
+            }
+        }
 
         if (options->Has(String::New("layer")))
         {
@@ -497,65 +586,154 @@ Handle<Value> Map::abstractQueryPoint(const Arguments& args, bool geo_coords)
     query_map_baton_t *closure = new query_map_baton_t();
     closure->request.data = closure;
     closure->m = m;
-    closure->x = x;
-    closure->y = y;
-    closure->layer_idx = static_cast<std::size_t>(layer_idx);
+    closure->points.swap(points);
+    std::vector<mapnik::layer> const& layers = m->map_->layers();
+    for (unsigned i = 0; i < layers.size(); ++i)
+    {
+        if (layer_idx < 0 || static_cast<unsigned>(layer_idx) == i)
+        {
+            closure->layers.push_back(i);
+            closure->layer_names.push_back(layers[i].name());
+        }
+    }
+    closure->fields.swap(fields);
+    closure->batch = batch;
     closure->geo_coords = geo_coords;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_QueryMap, (uv_after_work_cb)EIO_AfterQueryMap);
+    node_mapnik::queue_work(&closure->request, EIO_QueryMap, (uv_after_work_cb)EIO_AfterQueryMap, node_mapnik::PRIORITY_INTERACTIVE);
     m->Ref();
     return Undefined();
 }
 
-void Map::EIO_QueryMap(uv_work_t* req)
+// copy of a feature restricted to the given attributes
+static mapnik::feature_ptr subset_feature(mapnik::feature_impl const& feature,
+                                          mapnik::context_ptr const& ctx,
+                                          std::vector<std::string> const& fields)
 {
-    query_map_baton_t *closure = static_cast<query_map_baton_t *>(req->data);
+    mapnik::feature_ptr copy = mapnik::feature_factory::create(ctx, feature.id());
+    BOOST_FOREACH ( std::string const& name, fields )
+    {
+        if (feature.has_key(name))
+        {
+            copy->put(name, feature.get(name));
+        }
+    }
+    BOOST_FOREACH ( mapnik::geometry_type const& geom, feature.paths() )
+    {
+        mapnik::geometry_type * path = new mapnik::geometry_type(geom.type());
+        double x = 0;
+        double y = 0;
+        for (unsigned i = 0; i < geom.size(); ++i)
+        {
+            unsigned cmd = geom.vertex(i, &x, &y);
+            path->push_vertex(x, y, static_cast<mapnik::CommandType>(cmd));
+        }
+        copy->add_geometry(path);
+    }
+    copy->set_raster(feature.get_raster());
+    return copy;
+}
 
-    try
+// the datasource a layer reads from, looking through the feature cache
+static mapnik::datasource const* underlying_datasource(mapnik::layer const& lyr)
+{
+    mapnik::datasource_ptr const& ds = lyr.datasource();
+    node_mapnik::cached_datasource const* cds = dynamic_cast<node_mapnik::cached_datasource const*>(ds.get());
+    return cds ? cds->wrapped().get() : ds.get();
+}
+
+// queries every point against a group of layers sharing one datasource,
+// called concurrently from parallel_for with one group per call so that
+// no datasource is ever queried from two threads at once
+struct query_map_task
+{
+    query_map_task(query_map_baton_t & closure,
+                   mapnik::Map const& map,
+                   std::vector<std::vector<std::size_t> > const& groups)
+        : closure_(closure),
+          map_(map),
+          groups_(groups),
+          ctx_()
     {
-        std::vector<mapnik::layer> const& layers = closure->m->map_->layers();
-        if (closure->layer_idx >= 0)
+        if (!closure_.fields.empty())
         {
-            mapnik::featureset_ptr fs;
-            if (closure->geo_coords)
+            ctx_ = MAPNIK_MAKE_SHARED<mapnik::context_type>();
+            BOOST_FOREACH ( std::string const& name, closure_.fields )
             {
-                fs = closure->m->map_->query_point(closure->layer_idx,
-                                                   closure->x,
-                                                   closure->y);
+                ctx_->push(name);
             }
-            else
+        }
+    }
+
+    void operator() (std::size_t group)
+    {
+        std::size_t num_layers = closure_.layers.size();
+        BOOST_FOREACH ( std::size_t l, groups_[group] )
+        {
+            for (std::size_t p = 0; p < closure_.points.size(); ++p)
             {
-                fs = closure->m->map_->query_map_point(closure->layer_idx,
-                                                       closure->x,
-                                                       closure->y);
+                closure_.results[p * num_layers + l] = query(closure_.points[p], closure_.layers[l]);
             }
-            mapnik::layer const& lyr = layers[closure->layer_idx];
-            closure->featuresets.insert(std::make_pair(lyr.name(),fs));
+        }
+    }
+
+    node_mapnik::feature_cache::features_ptr query(mapnik::coord2d const& pt, unsigned layer_idx)
+    {
+        mapnik::featureset_ptr fs;
+        if (closure_.geo_coords)
+        {
+            fs = map_.query_point(layer_idx, pt.x, pt.y);
         }
         else
         {
-            // query all layers
-            unsigned idx = 0;
-            BOOST_FOREACH ( mapnik::layer const& lyr, layers )
+            fs = map_.query_map_point(layer_idx, pt.x, pt.y);
+        }
+        // features are read here so no datasource i/o happens on the main thread
+        MAPNIK_SHARED_PTR<node_mapnik::feature_cache::features_type> features =
+            MAPNIK_MAKE_SHARED<node_mapnik::feature_cache::features_type>();
+        if (fs)
+        {
+            mapnik::feature_ptr feature;
+            while ((feature = fs->next()))
             {
-                mapnik::featureset_ptr fs;
-                if (closure->geo_coords)
-                {
-                    fs = closure->m->map_->query_point(idx,
-                                                       closure->x,
-                                                       closure->y);
-                }
-                else
-                {
-                    fs = closure->m->map_->query_map_point(idx,
-                                                           closure->x,
-                                                           closure->y);
-                }
-                closure->featuresets.insert(std::make_pair(lyr.name(),fs));
-                ++idx;
+                features->push_back(ctx_ ? subset_feature(*feature, ctx_, closure_.fields) : feature);
+            }
+        }
+        return features;
+    }
+
+    query_map_baton_t & closure_;
+    mapnik::Map const& map_;
+    std::vector<std::vector<std::size_t> > const& groups_;
+    mapnik::context_ptr ctx_;
+};
+
+void Map::EIO_QueryMap(uv_work_t* req)
+{
+    query_map_baton_t *closure = static_cast<query_map_baton_t *>(req->data);
+
+    try
+    {
+        // datasources are not thread safe, so only layers reading from
+        // different ones are queried in parallel
+        mapnik::Map const& map = *closure->m->map_;
+        std::vector<std::vector<std::size_t> > groups;
+        std::map<mapnik::datasource const*, std::size_t> group_of;
+        for (std::size_t l = 0; l < closure->layers.size(); ++l)
+        {
+            mapnik::datasource const* ds = underlying_datasource(map.layers()[closure->layers[l]]);
+            std::map<mapnik::datasource const*, std::size_t>::iterator itr = group_of.find(ds);
+            if (itr == group_of.end())
+            {
+                itr = group_of.insert(std::make_pair(ds, groups.size())).first;
+                groups.push_back(std::vector<std::size_t>());
             }
+            groups[itr->second].push_back(l);
         }
+        closure->results.resize(closure->points.size() * closure->layers.size());
+        query_map_task task(*closure, map, groups);
+        node_mapnik::parallel_for(groups.size(), task);
     }
     catch (std::exception const& ex)
     {
@@ -576,13 +754,23 @@ void Map::EIO_AfterQueryMap(uv_work_t* req)
         Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
         closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
     } else {
-        std::size_t num_result = closure->featuresets.size();
-        if (num_result >= 1)
+        std::size_t num_layers = closure->layers.size();
+        std::size_t num_points = closure->points.size();
+        Local<Array> points = Array::New(num_points);
+        for (std::size_t p = 0; p < num_points; ++p)
         {
-            Local<Array> a = Array::New(num_result);
+            // results are ordered (and keyed) by layer name
             typedef std::map<std::string,mapnik::featureset_ptr> fs_itr;
-            fs_itr::const_iterator it = closure->featuresets.begin();
-            fs_itr::const_iterator end = closure->featuresets.end();
+            fs_itr featuresets;
+            for (std::size_t l = 0; l < num_layers; ++l)
+            {
+                node_mapnik::feature_cache::features_ptr const& features = closure->results[p * num_layers + l];
+                featuresets.insert(std::make_pair(closure->layer_names[l],
+                                                  MAPNIK_MAKE_SHARED<node_mapnik::cached_featureset>(features, mapnik::box2d<double>(), false)));
+            }
+            Local<Array> a = Array::New(featuresets.size());
+            fs_itr::const_iterator it = featuresets.begin();
+            fs_itr::const_iterator end = featuresets.end();
             unsigned idx = 0;
             for (; it != end; ++it)
             {
@@ -592,8 +780,17 @@ void Map::EIO_AfterQueryMap(uv_work_t* req)
                 a->Set(idx, obj);
                 ++idx;
             }
-            closure->featuresets.clear();
-            Local<Value> argv[2] = { Local<Value>::New(Null()), a };
+            points->Set(p, a);
+        }
+        closure->results.clear();
+        if (closure->batch)
+        {
+            Local<Value> argv[2] = { Local<Value>::New(Null()), points };
+            closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+        }
+        else if (num_layers >= 1)
+        {
+            Local<Value> argv[2] = { Local<Value>::New(Null()), points->Get(0) };
             closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
         }
         else
@@ -613,6 +810,76 @@ void Map::EIO_AfterQueryMap(uv_work_t* req)
     delete closure;
 }
 
+Handle<Value> Map::enableFeatureCache(const Arguments& args)
+{
+    HandleScope scope;
+
+    // defaults
+    std::size_t size = 64 * 1024 * 1024;
+    double expand = 0.0;
+
+    if (args.Length() > 0) {
+        if (!args[0]->IsObject())
+            return ThrowException(Exception::TypeError(
+                                      String::New("optional argument must be an object, eg. {size: 67108864, expand: 0.5}")));
+
+        Local<Object> options = args[0]->ToObject();
+        if (options->Has(String::New("size"))) {
+            Local<Value> bind_opt = options->Get(String::New("size"));
+            if (!bind_opt->IsNumber() || bind_opt->NumberValue() < 0)
+                return ThrowException(Exception::TypeError(
+                                          String::New("optional arg 'size' must be a positive number of bytes")));
+            size = static_cast<std::size_t>(bind_opt->NumberValue());
+        }
+        if (options->Has(String::New("expand"))) {
+            Local<Value> bind_opt = options->Get(String::New("expand"));
+            if (!bind_opt->IsNumber() || bind_opt->NumberValue() < 0)
+                return ThrowException(Exception::TypeError(
+                                          String::New("optional arg 'expand' must be a positive number")));
+            expand = bind_opt->NumberValue();
+        }
+    }
+
+    Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
+    if (m->active() != 0) {
+        return ThrowException(Exception::Error(
+                                  String::New("cannot change the feature cache while the map is rendering")));
+    }
+    m->feature_cache_ = MAPNIK_MAKE_SHARED<node_mapnik::feature_cache>(size);
+    m->feature_cache_expand_ = expand;
+    m->attach_feature_cache();
+    return Undefined();
+}
+
+Handle<Value> Map::disableFeatureCache(const Arguments& args)
+{
+    HandleScope scope;
+    Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
+    if (m->active() != 0) {
+        return ThrowException(Exception::Error(
+                                  String::New("cannot change the feature cache while the map is rendering")));
+    }
+    node_mapnik::detach_feature_cache(*m->map_);
+    m->feature_cache_.reset();
+    return Undefined();
+}
+
+Handle<Value> Map::featureCacheStats(const Arguments& args)
+{
+    HandleScope scope;
+    Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
+    if (!m->feature_cache_) return Undefined();
+    node_mapnik::feature_cache const& cache = *m->feature_cache_;
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("size"), Number::New(cache.max_bytes()));
+    stats->Set(String::NewSymbol("bytes"), Number::New(cache.bytes()));
+    stats->Set(String::NewSymbol("entries"), Number::New(cache.size()));
+    stats->Set(String::NewSymbol("hits"), Number::New(cache.hits()));
+    stats->Set(String::NewSymbol("misses"), Number::New(cache.misses()));
+    stats->Set(String::NewSymbol("evictions"), Number::New(cache.evictions()));
+    return scope.Close(stats);
+}
+
 Handle<Value> Map::layers(const Arguments& args)
 {
     HandleScope scope;
@@ -732,6 +999,7 @@ typedef struct {
     std::string stylesheet;
     std::string base_path;
     bool strict;
+    bool cache;
     bool error;
     std::string error_name;
     Persistent<Function> cb;
@@ -780,6 +1048,7 @@ Handle<Value> Map::load(const Arguments& args)
 
     load_xml_baton_t *closure = new load_xml_baton_t();
     closure->request.data = closure;
+    closure->cache = false;
 
     param = String::New("base");
     if (options->Has(param))
@@ -791,12 +1060,22 @@ Handle<Value> Map::load(const Arguments& args)
         closure->base_path = TOSTR(param_val);
     }
 
+    param = String::New("cache");
+    if (options->Has(param))
+    {
+        Local<Value> param_val = options->Get(param);
+        if (!param_val->IsBoolean())
+            return ThrowException(Exception::TypeError(
+                                      String::New("'cache' must be a Boolean")));
+        closure->cache = param_val->BooleanValue();
+    }
+
     closure->stylesheet = TOSTR(stylesheet);
     closure->m = m;
     closure->strict = strict;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Load, (uv_after_work_cb)EIO_AfterLoad);
+    node_mapnik::queue_work(&closure->request, EIO_Load, (uv_after_work_cb)EIO_AfterLoad, node_mapnik::PRIORITY_BATCH);
     m->Ref();
     return Undefined();
 }
@@ -807,12 +1086,7 @@ void Map::EIO_Load(uv_work_t* req)
 
     try
     {
-#if MAPNIK_VERSION >= 200200
-        mapnik::load_map(*closure->m->map_,closure->stylesheet,closure->strict,closure->base_path);
-#else
-        mapnik::load_map(*closure->m->map_,closure->stylesheet,closure->strict);
-#endif
-
+        node_mapnik::load_stylesheet(*closure->m->map_,closure->stylesheet,false,closure->strict,closure->base_path,closure->cache);
     }
     catch (std::exception const& ex)
     {
@@ -857,6 +1131,7 @@ Handle<Value> Map::loadSync(const Arguments& args)
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
     std::string stylesheet = TOSTR(args[0]);
     bool strict = false;
+    bool cache = false;
     std::string base_path;
 
     if (args.Length() > 2)
@@ -893,15 +1168,21 @@ Handle<Value> Map::loadSync(const Arguments& args)
                                           String::New("'base' must be a string representing a filesystem path")));
             base_path = TOSTR(param_val);
         }
+
+        param = String::New("cache");
+        if (options->Has(param))
+        {
+            Local<Value> param_val = options->Get(param);
+            if (!param_val->IsBoolean())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'cache' must be a Boolean")));
+            cache = param_val->BooleanValue();
+        }
     }
 
     try
     {
-#if MAPNIK_VERSION >= 200200
-        mapnik::load_map(*m->map_,stylesheet,strict,base_path);
-#else
-        mapnik::load_map(*m->map_,stylesheet,strict);
-#endif
+        node_mapnik::load_stylesheet(*m->map_,stylesheet,false,strict,base_path,cache);
     }
     catch (std::exception const& ex)
     {
@@ -926,6 +1207,7 @@ Handle<Value> Map::fromStringSync(const Arguments& args)
 
     // defaults
     bool strict = false;
+    bool cache = false;
     std::string base_path("");
 
     if (args.Length() >= 2) {
@@ -955,6 +1237,16 @@ Handle<Value> Map::fromStringSync(const Arguments& args)
                                           String::New("'base' must be a string representing a filesystem path")));
             base_path = TOSTR(param_val);
         }
+
+        param = String::New("cache");
+        if (options->Has(param))
+        {
+            Local<Value> param_val = options->Get(param);
+            if (!param_val->IsBoolean())
+                return ThrowException(Exception::TypeError(
+                                          String::New("'cache' must be a Boolean")));
+            cache = param_val->BooleanValue();
+        }
     }
 
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
@@ -963,7 +1255,7 @@ Handle<Value> Map::fromStringSync(const Arguments& args)
 
     try
     {
-        mapnik::load_map_string(*m->map_,stylesheet,strict,base_path);
+        node_mapnik::load_stylesheet(*m->map_,stylesheet,true,strict,base_path,cache);
     }
     catch (std::exception const& ex)
     {
@@ -1015,6 +1307,7 @@ Handle<Value> Map::fromString(const Arguments& args)
 
     load_xml_baton_t *closure = new load_xml_baton_t();
     closure->request.data = closure;
+    closure->cache = false;
 
     param = String::New("base");
     if (options->Has(param))
@@ -1026,12 +1319,22 @@ Handle<Value> Map::fromString(const Arguments& args)
         closure->base_path = TOSTR(param_val);
     }
 
+    param = String::New("cache");
+    if (options->Has(param))
+    {
+        Local<Value> param_val = options->Get(param);
+        if (!param_val->IsBoolean())
+            return ThrowException(Exception::TypeError(
+                                      String::New("'cache' must be a Boolean")));
+        closure->cache = param_val->BooleanValue();
+    }
+
     closure->stylesheet = TOSTR(stylesheet);
     closure->m = m;
     closure->strict = strict;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_FromString, (uv_after_work_cb)EIO_AfterFromString);
+    node_mapnik::queue_work(&closure->request, EIO_FromString, (uv_after_work_cb)EIO_AfterFromString, node_mapnik::PRIORITY_BATCH);
     m->Ref();
     return Undefined();
 }
@@ -1042,7 +1345,7 @@ void Map::EIO_FromString(uv_work_t* req)
 
     try
     {
-        mapnik::load_map_string(*closure->m->map_,closure->stylesheet,closure->strict,closure->base_path);
+        node_mapnik::load_stylesheet(*closure->m->map_,closure->stylesheet,true,closure->strict,closure->base_path,closure->cache);
     }
     catch (std::exception const& ex)
     {
@@ -1161,6 +1464,7 @@ struct image_baton_t {
     double scale_denominator;
     unsigned offset_x;
     unsigned offset_y;
+    std::string coalesce_key;
     bool error;
     std::string error_name;
     Persistent<Function> cb;
@@ -1179,6 +1483,7 @@ struct grid_baton_t {
     Map *m;
     Grid *g;
     std::size_t layer_idx;
+    std::vector<node_mapnik::grid_layer_spec> layers; // multi-layer render when not empty
     int buffer_size; // TODO - no effect until mapnik::request is used
     double scale_factor;
     double scale_denominator;
@@ -1211,6 +1516,7 @@ struct vector_tile_baton_t {
     unsigned offset_y;
     std::string image_format;
     mapnik::scaling_method_e scaling_method;
+    std::string coalesce_key;
     bool error;
     std::string error_name;
     Persistent<Function> cb;
@@ -1226,6 +1532,220 @@ struct vector_tile_baton_t {
         error(false) {}
 };
 
+// identifies a render for coalescing: everything that affects its output
+static std::string render_key(std::string const& id,
+                              mapnik::Map const& map,
+                              char const* target,
+                              unsigned width,
+                              unsigned height,
+                              int buffer_size,
+                              double scale_factor,
+                              double scale_denominator,
+                              unsigned offset_x,
+                              unsigned offset_y)
+{
+    std::ostringstream s;
+    s.precision(17);
+    mapnik::box2d<double> const& extent = map.get_current_extent();
+    s << id << '|' << target << '|' << width << 'x' << height
+      << '|' << map.width() << 'x' << map.height()
+      << '|' << extent.minx() << ',' << extent.miny() << ',' << extent.maxx() << ',' << extent.maxy()
+      << '|' << map.srs()
+      << '|' << buffer_size << '|' << scale_factor << '|' << scale_denominator
+      << '|' << offset_x << ',' << offset_y;
+    return s.str();
+}
+
+// reads the grid-only render options, adding requested fields to the grid
+static bool parse_grid_options(Local<Object> const& options,
+                               mapnik::Map const& map,
+                               grid_baton_t * closure,
+                               std::string & error)
+{
+    Grid * g = closure->g;
+    std::size_t & layer_idx = closure->layer_idx;
+
+    // several layers with layer qualified keys
+    if (options->Has(String::New("layers"))) {
+        return node_mapnik::parse_grid_layers(options->Get(String::New("layers")), map,
+                                              g->get()->get_key(), closure->layers, error);
+    }
+
+    // grid requires special options for now
+    if (!options->Has(String::New("layer"))) {
+        error = "'layer' or 'layers' option required for grid rendering and must be either a layer name(string) or layer index (integer)";
+        return false;
+    }
+
+    std::vector<mapnik::layer> const& layers = map.layers();
+
+    Local<Value> layer_id = options->Get(String::New("layer"));
+    if (layer_id->IsString()) {
+        bool found = false;
+        unsigned int idx(0);
+        std::string const & layer_name = TOSTR(layer_id);
+        BOOST_FOREACH ( mapnik::layer const& lyr, layers )
+        {
+            if (lyr.name() == layer_name)
+            {
+                found = true;
+                layer_idx = idx;
+                break;
+            }
+            ++idx;
+        }
+        if (!found)
+        {
+            std::ostringstream s;
+            s << "Layer name '" << layer_name << "' not found";
+            error = s.str();
+            return false;
+        }
+    } else if (layer_id->IsNumber()) {
+        layer_idx = layer_id->IntegerValue();
+        std::size_t layer_num = layers.size();
+
+        if (layer_idx >= layer_num) {
+            std::ostringstream s;
+            s << "Zero-based layer index '" << layer_idx << "' not valid, ";
+            if (layer_num > 0)
+            {
+                s << "only '" << layer_num << "' layers exist in map";
+            }
+            else
+            {
+                s << "no layers found in map";
+            }
+            error = s.str();
+            return false;
+        }
+    } else {
+        error = "'layer' option required for grid rendering and must be either a layer name(string) or layer index (integer)";
+        return false;
+    }
+
+    if (options->Has(String::New("fields"))) {
+
+        Local<Value> param_val = options->Get(String::New("fields"));
+        if (!param_val->IsArray()) {
+            error = "option 'fields' must be an array of strings";
+            return false;
+        }
+        Local<Array> a = Local<Array>::Cast(param_val);
+        unsigned int i = 0;
+        unsigned int num_fields = a->Length();
+        while (i < num_fields) {
+            Local<Value> name = a->Get(i);
+            if (name->IsString()){
+                g->get()->add_property_name(TOSTR(name));
+            }
+            i++;
+        }
+    }
+    return true;
+}
+
+// reads the vector tile only render options into the baton
+static bool parse_vector_tile_options(Local<Object> const& options,
+                                      vector_tile_baton_t * closure,
+                                      std::string & error)
+{
+    if (options->Has(String::New("image_scaling"))) {
+        Local<Value> param_val = options->Get(String::New("image_scaling"));
+        if (!param_val->IsString()) {
+            error = "option 'image_scaling' must be an unsigned integer";
+            return false;
+        }
+        std::string image_scaling = TOSTR(param_val);
+        boost::optional<mapnik::scaling_method_e> method = mapnik::scaling_method_from_string(image_scaling);
+        if (!method) {
+            error = "option 'image_scaling' must be a string and a valid scaling method (e.g 'bilinear')";
+            return false;
+        }
+        closure->scaling_method = *method;
+    }
+
+    if (options->Has(String::New("image_format"))) {
+        Local<Value> param_val = options->Get(String::New("image_format"));
+        if (!param_val->IsString()) {
+            error = "option 'image_format' must be a string";
+            return false;
+        }
+        closure->image_format = TOSTR(param_val);
+    }
+
+    if (options->Has(String::New("webp"))) {
+        // structured webp tuning implies webp raster payloads
+        if (!options->Has(String::New("image_format"))) {
+            closure->image_format = "webp";
+        }
+        if (!node_mapnik::is_webp_format(closure->image_format)) {
+            error = "option 'webp' requires 'image_format' to be 'webp'";
+            return false;
+        }
+        if (!node_mapnik::parse_webp_options(options->Get(String::New("webp")), closure->image_format, error)) {
+            return false;
+        }
+    }
+
+#if !defined(HAVE_WEBP)
+    if (node_mapnik::is_webp_format(closure->image_format)) {
+        error = "webp raster encoding is not supported by this build of mapnik";
+        return false;
+    }
+#endif
+
+    if (options->Has(String::New("tolerance"))) {
+        Local<Value> param_val = options->Get(String::New("tolerance"));
+        if (!param_val->IsNumber()) {
+            error = "option 'tolerance' must be an unsigned integer";
+            return false;
+        }
+        closure->tolerance = param_val->IntegerValue();
+    }
+
+    if (options->Has(String::New("path_multiplier"))) {
+        Local<Value> param_val = options->Get(String::New("path_multiplier"));
+        if (!param_val->IsNumber()) {
+            error = "option 'path_multiplier' must be an unsigned integer";
+            return false;
+        }
+        closure->path_multiplier = param_val->NumberValue();
+    }
+    return true;
+}
+
+// budget of the feature cache shared by the targets of a multi render;
+// queries beyond it are streamed to each target separately
+static const std::size_t multi_render_cache_bytes = 64 * 1024 * 1024;
+
+// several targets rendered from one query per layer
+struct multi_render_baton_t {
+    uv_work_t request;
+    Map *m;
+    std::vector<image_baton_t *> images;
+    std::vector<grid_baton_t *> grids;
+    std::vector<vector_tile_baton_t *> tiles;
+    // layer datasources replaced for the request, restored afterwards
+    std::vector<mapnik::datasource_ptr> datasources;
+    // private copy rendered instead when the map was already in use
+    MAPNIK_SHARED_PTR<mapnik::Map> map_copy;
+    Persistent<Array> targets;
+    bool error;
+    std::string error_name;
+    Persistent<Function> cb;
+    multi_render_baton_t() :
+      m(NULL),
+      error(false),
+      error_name() {}
+    ~multi_render_baton_t()
+    {
+        for (std::size_t i = 0; i < images.size(); ++i) delete images[i];
+        for (std::size_t i = 0; i < grids.size(); ++i) delete grids[i];
+        for (std::size_t i = 0; i < tiles.size(); ++i) delete tiles[i];
+    }
+};
+
 Handle<Value> Map::render(const Arguments& args)
 {
     HandleScope scope;
@@ -1248,6 +1768,7 @@ Handle<Value> Map::render(const Arguments& args)
                                   String::New("last argument must be a callback function")));
 
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
+    m->attach_feature_cache();
 
     if (m->active() != 0) {
         std::ostringstream s;
@@ -1266,6 +1787,9 @@ Handle<Value> Map::render(const Arguments& args)
     double scale_denominator = 0.0;
     unsigned offset_x = 0;
     unsigned offset_y = 0;
+    node_mapnik::work_priority priority = node_mapnik::PRIORITY_INTERACTIVE;
+    // identity under which identical concurrent renders share one result
+    std::string coalesce_id;
 
     Local<Object> options = Object::New();
 
@@ -1322,19 +1846,162 @@ Handle<Value> Map::render(const Arguments& args)
 
             offset_y = bind_opt->IntegerValue();
         }
-    }
-
-    Local<Object> obj = args[0]->ToObject();
-    if (obj->IsNull() || obj->IsUndefined())
-        return ThrowException(Exception::TypeError(String::New("first argument is invalid, must be a renderable mapnik object, not null/undefined")));
 
-    if (Image::constructor->HasInstance(obj)) {
+        if (options->Has(String::New("priority"))) {
+            Local<Value> bind_opt = options->Get(String::New("priority"));
+            if (!bind_opt->IsString() || !node_mapnik::parse_priority(TOSTR(bind_opt), priority) ||
+                (priority != node_mapnik::PRIORITY_INTERACTIVE && priority != node_mapnik::PRIORITY_BATCH))
+                return ThrowException(Exception::TypeError(
+                                          String::New("optional arg 'priority' must be 'interactive' or 'batch'")));
+        }
 
-        image_baton_t *closure = new image_baton_t();
-        closure->request.data = closure;
-        closure->m = m;
-        closure->im = node::ObjectWrap::Unwrap<Image>(obj);
+        if (options->Has(String::New("coalesce"))) {
+            Local<Value> bind_opt = options->Get(String::New("coalesce"));
+            if (bind_opt->IsString()) {
+                coalesce_id = TOSTR(bind_opt);
+            } else if (bind_opt->IsBoolean()) {
+                if (bind_opt->BooleanValue()) {
+                    std::ostringstream s;
+                    s << "map:" << m;
+                    coalesce_id = s.str();
+                }
+            } else {
+                return ThrowException(Exception::TypeError(
+                                          String::New("optional arg 'coalesce' must be a boolean or a string")));
+            }
+        }
+    }
+
+    // an array of targets is rendered in one pass: each layer is queried
+    // once and the features are shared by the image, grid and tile backends
+    if (args[0]->IsArray()) {
+        Local<Array> input = Local<Array>::Cast(args[0]);
+        unsigned int num_targets = input->Length();
+        if (num_targets == 0)
+            return ThrowException(Exception::TypeError(String::New("array of renderable mapnik objects must not be empty")));
+
+        multi_render_baton_t *closure = new multi_render_baton_t();
+        Local<Array> targets = Array::New(num_targets);
+        for (unsigned int i = 0; i < num_targets; ++i) {
+            Local<Value> target = input->Get(i);
+            if (!target->IsObject()) {
+                delete closure;
+                return ThrowException(Exception::TypeError(String::New("renderable mapnik object expected")));
+            }
+            Local<Object> target_obj = target->ToObject();
+            if (Image::constructor->HasInstance(target_obj)) {
+                image_baton_t *im_closure = new image_baton_t();
+                im_closure->im = node::ObjectWrap::Unwrap<Image>(target_obj);
+                closure->images.push_back(im_closure);
+            } else if (Grid::constructor->HasInstance(target_obj)) {
+                grid_baton_t *g_closure = new grid_baton_t();
+                closure->grids.push_back(g_closure);
+                g_closure->g = node::ObjectWrap::Unwrap<Grid>(target_obj);
+                std::string error;
+                if (!parse_grid_options(options, *m->map_, g_closure, error)) {
+                    delete closure;
+                    return ThrowException(Exception::TypeError(String::New(error.c_str())));
+                }
+            } else if (VectorTile::constructor->HasInstance(target_obj)) {
+                vector_tile_baton_t *vt_closure = new vector_tile_baton_t();
+                closure->tiles.push_back(vt_closure);
+                vt_closure->d = node::ObjectWrap::Unwrap<VectorTile>(target_obj);
+                std::string error;
+                if (!parse_vector_tile_options(options, vt_closure, error)) {
+                    delete closure;
+                    return ThrowException(Exception::TypeError(String::New(error.c_str())));
+                }
+            } else {
+                delete closure;
+                return ThrowException(Exception::TypeError(String::New("renderable mapnik object expected")));
+            }
+            targets->Set(i, target_obj);
+        }
+
+        for (std::size_t i = 0; i < closure->images.size(); ++i) {
+            image_baton_t *im_closure = closure->images[i];
+            im_closure->m = m;
+            im_closure->im->_ref();
+            im_closure->buffer_size = buffer_size;
+            im_closure->scale_factor = scale_factor;
+            im_closure->scale_denominator = scale_denominator;
+            im_closure->offset_x = offset_x;
+            im_closure->offset_y = offset_y;
+        }
+        for (std::size_t i = 0; i < closure->grids.size(); ++i) {
+            grid_baton_t *g_closure = closure->grids[i];
+            g_closure->m = m;
+            g_closure->g->_ref();
+            g_closure->buffer_size = buffer_size;
+            g_closure->scale_factor = scale_factor;
+            g_closure->scale_denominator = scale_denominator;
+            g_closure->offset_x = offset_x;
+            g_closure->offset_y = offset_y;
+        }
+        for (std::size_t i = 0; i < closure->tiles.size(); ++i) {
+            vector_tile_baton_t *vt_closure = closure->tiles[i];
+            vt_closure->m = m;
+            vt_closure->d->_ref();
+            vt_closure->buffer_size = buffer_size;
+            vt_closure->scale_factor = scale_factor;
+            vt_closure->scale_denominator = scale_denominator;
+            vt_closure->offset_x = offset_x;
+            vt_closure->offset_y = offset_y;
+        }
+
+        // layers fetch every attribute once per request and hand the same
+        // features to each backend. Layers are swapped in place, as for the
+        // persistent feature cache, but never under a render in progress:
+        // a map already in use is copied instead
+        node_mapnik::feature_cache_ptr cache = MAPNIK_MAKE_SHARED<node_mapnik::feature_cache>(multi_render_cache_bytes);
+        bool in_place = m->active() == 0;
+        if (!in_place) closure->map_copy = MAPNIK_MAKE_SHARED<mapnik::Map>(*m->map_);
+        mapnik::Map & request_map = in_place ? *m->map_ : *closure->map_copy;
+        BOOST_FOREACH(mapnik::layer & lyr, request_map.layers())
+        {
+            mapnik::datasource_ptr ds = lyr.datasource();
+            if (in_place) closure->datasources.push_back(ds);
+            if (ds)
+            {
+                lyr.set_datasource(MAPNIK_MAKE_SHARED<node_mapnik::cached_datasource>(ds, cache, 0.0, true));
+            }
+        }
+
+        closure->request.data = closure;
+        closure->m = m;
+        closure->targets = Persistent<Array>::New(targets);
+        closure->cb = Persistent<Function>::New(Handle<Function>::Cast(args[args.Length()-1]));
+        node_mapnik::queue_work(&closure->request, EIO_RenderMulti, (uv_after_work_cb)EIO_AfterRenderMulti, priority);
+        m->acquire();
+        m->Ref();
+        return Undefined();
+    }
+
+    Local<Object> obj = args[0]->ToObject();
+    if (obj->IsNull() || obj->IsUndefined())
+        return ThrowException(Exception::TypeError(String::New("first argument is invalid, must be a renderable mapnik object, not null/undefined")));
+
+    if (Image::constructor->HasInstance(obj)) {
+
+        Image * im = node::ObjectWrap::Unwrap<Image>(obj);
+        std::string coalesce_key;
+        // only blank images are coalesced, see is_blank_render_target
+        if (!coalesce_id.empty() && node_mapnik::is_blank_render_target(*im->get())) {
+            coalesce_key = render_key(coalesce_id, *m->map_, "image",
+                                      im->get()->width(), im->get()->height(),
+                                      buffer_size, scale_factor, scale_denominator,
+                                      offset_x, offset_y);
+            if (node_mapnik::render_coalescer::instance().join(coalesce_key, obj, Handle<Function>::Cast(args[args.Length()-1]))) {
+                return Undefined();
+            }
+        }
+
+        image_baton_t *closure = new image_baton_t();
+        closure->request.data = closure;
+        closure->m = m;
+        closure->im = im;
         closure->im->_ref();
+        closure->coalesce_key = coalesce_key;
         closure->buffer_size = buffer_size;
         closure->scale_factor = scale_factor;
         closure->scale_denominator = scale_denominator;
@@ -1342,93 +2009,23 @@ Handle<Value> Map::render(const Arguments& args)
         closure->offset_y = offset_y;
         closure->error = false;
         closure->cb = Persistent<Function>::New(Handle<Function>::Cast(args[args.Length()-1]));
-        uv_queue_work(uv_default_loop(), &closure->request, EIO_RenderImage, (uv_after_work_cb)EIO_AfterRenderImage);
+        node_mapnik::queue_work(&closure->request, EIO_RenderImage, (uv_after_work_cb)EIO_AfterRenderImage, priority);
 
     } else if (Grid::constructor->HasInstance(obj)) {
 
         Grid * g = node::ObjectWrap::Unwrap<Grid>(obj);
 
-        std::size_t layer_idx = 0;
-
-        // grid requires special options for now
-        if (!options->Has(String::New("layer"))) {
-            return ThrowException(Exception::TypeError(
-                                      String::New("'layer' option required for grid rendering and must be either a layer name(string) or layer index (integer)")));
-        } else {
-
-            std::vector<mapnik::layer> const& layers = m->map_->layers();
-
-            Local<Value> layer_id = options->Get(String::New("layer"));
-            if (! (layer_id->IsString() || layer_id->IsNumber()) )
-                return ThrowException(Exception::TypeError(
-                                          String::New("'layer' option required for grid rendering and must be either a layer name(string) or layer index (integer)")));
-
-            if (layer_id->IsString()) {
-                bool found = false;
-                unsigned int idx(0);
-                std::string const & layer_name = TOSTR(layer_id);
-                BOOST_FOREACH ( mapnik::layer const& lyr, layers )
-                {
-                    if (lyr.name() == layer_name)
-                    {
-                        found = true;
-                        layer_idx = idx;
-                        break;
-                    }
-                    ++idx;
-                }
-                if (!found)
-                {
-                    std::ostringstream s;
-                    s << "Layer name '" << layer_name << "' not found";
-                    return ThrowException(Exception::TypeError(String::New(s.str().c_str())));
-                }
-            } else if (layer_id->IsNumber()) {
-                layer_idx = layer_id->IntegerValue();
-                std::size_t layer_num = layers.size();
-
-                if (layer_idx >= layer_num) {
-                    std::ostringstream s;
-                    s << "Zero-based layer index '" << layer_idx << "' not valid, ";
-                    if (layer_num > 0)
-                    {
-                        s << "only '" << layer_num << "' layers exist in map";
-                    }
-                    else
-                    {
-                        s << "no layers found in map";
-                    }
-                    return ThrowException(Exception::TypeError(String::New(s.str().c_str())));
-                }
-            } else {
-                return ThrowException(Exception::TypeError(String::New("layer id must be a string or index number")));
-            }
-        }
-
-        if (options->Has(String::New("fields"))) {
-
-            Local<Value> param_val = options->Get(String::New("fields"));
-            if (!param_val->IsArray())
-                return ThrowException(Exception::TypeError(
-                                          String::New("option 'fields' must be an array of strings")));
-            Local<Array> a = Local<Array>::Cast(param_val);
-            unsigned int i = 0;
-            unsigned int num_fields = a->Length();
-            while (i < num_fields) {
-                Local<Value> name = a->Get(i);
-                if (name->IsString()){
-                    g->get()->add_property_name(TOSTR(name));
-                }
-                i++;
-            }
+        grid_baton_t *closure = new grid_baton_t();
+        closure->g = g;
+        std::string error;
+        if (!parse_grid_options(options, *m->map_, closure, error)) {
+            delete closure;
+            return ThrowException(Exception::TypeError(String::New(error.c_str())));
         }
 
-        grid_baton_t *closure = new grid_baton_t();
         closure->request.data = closure;
         closure->m = m;
-        closure->g = g;
         closure->g->_ref();
-        closure->layer_idx = layer_idx;
         closure->buffer_size = buffer_size;
         closure->scale_factor = scale_factor;
         closure->scale_denominator = scale_denominator;
@@ -1436,57 +2033,37 @@ Handle<Value> Map::render(const Arguments& args)
         closure->offset_y = offset_y;
         closure->error = false;
         closure->cb = Persistent<Function>::New(Handle<Function>::Cast(args[args.Length()-1]));
-        uv_queue_work(uv_default_loop(), &closure->request, EIO_RenderGrid, (uv_after_work_cb)EIO_AfterRenderGrid);
+        node_mapnik::queue_work(&closure->request, EIO_RenderGrid, (uv_after_work_cb)EIO_AfterRenderGrid, priority);
     } else if (VectorTile::constructor->HasInstance(obj)) {
 
         vector_tile_baton_t *closure = new vector_tile_baton_t();
         VectorTile * vector_tile_obj = node::ObjectWrap::Unwrap<VectorTile>(obj);
 
-        if (options->Has(String::New("image_scaling"))) {
-            Local<Value> param_val = options->Get(String::New("image_scaling"));
-            if (!param_val->IsString()) {
-                delete closure;
-                return ThrowException(Exception::TypeError(
-                                          String::New("option 'image_scaling' must be an unsigned integer")));
-            }
-            std::string image_scaling = TOSTR(param_val);
-            boost::optional<mapnik::scaling_method_e> method = mapnik::scaling_method_from_string(image_scaling);
-            if (!method) {
-                delete closure;
-                return ThrowException(Exception::TypeError(
-                                          String::New("option 'image_scaling' must be a string and a valid scaling method (e.g 'bilinear')")));
-            }
-            closure->scaling_method = *method;
-        }
-
-        if (options->Has(String::New("image_format"))) {
-            Local<Value> param_val = options->Get(String::New("image_format"));
-            if (!param_val->IsString()) {
-                delete closure;
-                return ThrowException(Exception::TypeError(
-                                          String::New("option 'image_format' must be a string")));
-            }
-            closure->image_format = TOSTR(param_val);
-        }
-
-        if (options->Has(String::New("tolerance"))) {
-            Local<Value> param_val = options->Get(String::New("tolerance"));
-            if (!param_val->IsNumber()) {
-                delete closure;
-                return ThrowException(Exception::TypeError(
-                                          String::New("option 'tolerance' must be an unsigned integer")));
-            }
-            closure->tolerance = param_val->IntegerValue();
+        std::string error;
+        if (!parse_vector_tile_options(options, closure, error)) {
+            delete closure;
+            return ThrowException(Exception::TypeError(String::New(error.c_str())));
         }
 
-        if (options->Has(String::New("path_multiplier"))) {
-            Local<Value> param_val = options->Get(String::New("path_multiplier"));
-            if (!param_val->IsNumber()) {
+        // only empty tiles are coalesced, since waiters get a copy of the
+        // first render rather than their own layers appended to
+        if (!coalesce_id.empty() &&
+            vector_tile_obj->get_tile().layers_size() == 0 &&
+            vector_tile_obj->buffer_.empty()) {
+            std::ostringstream s;
+            s.precision(17);
+            s << render_key(coalesce_id, *m->map_, "tile",
+                            vector_tile_obj->width(), vector_tile_obj->height(),
+                            buffer_size, scale_factor, scale_denominator,
+                            offset_x, offset_y)
+              << '|' << vector_tile_obj->z_ << '/' << vector_tile_obj->x_ << '/' << vector_tile_obj->y_
+              << '|' << closure->image_format << '|' << closure->scaling_method
+              << '|' << closure->tolerance << '|' << closure->path_multiplier;
+            closure->coalesce_key = s.str();
+            if (node_mapnik::render_coalescer::instance().join(closure->coalesce_key, obj, Handle<Function>::Cast(args[args.Length()-1]))) {
                 delete closure;
-                return ThrowException(Exception::TypeError(
-                                          String::New("option 'path_multiplier' must be an unsigned integer")));
+                return Undefined();
             }
-            closure->path_multiplier = param_val->NumberValue();
         }
 
         closure->request.data = closure;
@@ -1500,7 +2077,7 @@ Handle<Value> Map::render(const Arguments& args)
         closure->offset_y = offset_y;
         closure->error = false;
         closure->cb = Persistent<Function>::New(Handle<Function>::Cast(args[args.Length()-1]));
-        uv_queue_work(uv_default_loop(), &closure->request, EIO_RenderVectorTile, (uv_after_work_cb)EIO_AfterRenderVectorTile);
+        node_mapnik::queue_work(&closure->request, EIO_RenderVectorTile, (uv_after_work_cb)EIO_AfterRenderVectorTile, priority);
     } else {
         return ThrowException(Exception::TypeError(String::New("renderable mapnik object expected")));
     }
@@ -1510,31 +2087,34 @@ Handle<Value> Map::render(const Arguments& args)
     return Undefined();
 }
 
+static void render_vector_tile(mapnik::Map const& map, vector_tile_baton_t * closure)
+{
+    typedef mapnik::vector::backend_pbf backend_type;
+    typedef mapnik::vector::processor<backend_type> renderer_type;
+    backend_type backend(closure->d->get_tile_nonconst(),
+                         closure->path_multiplier);
+    mapnik::request m_req(map.width(),map.height(),map.get_current_extent());
+    m_req.set_buffer_size(closure->buffer_size);
+    renderer_type ren(backend,
+                      map,
+                      m_req,
+                      closure->scale_factor,
+                      closure->offset_x,
+                      closure->offset_y,
+                      closure->tolerance,
+                      closure->image_format,
+                      closure->scaling_method);
+    ren.apply(closure->scale_denominator);
+    closure->d->painted(ren.painted());
+    closure->d->cache_bytesize();
+}
+
 void Map::EIO_RenderVectorTile(uv_work_t* req)
 {
     vector_tile_baton_t *closure = static_cast<vector_tile_baton_t *>(req->data);
     try
     {
-        typedef mapnik::vector::backend_pbf backend_type;
-        typedef mapnik::vector::processor<backend_type> renderer_type;
-        backend_type backend(closure->d->get_tile_nonconst(),
-                             closure->path_multiplier);
-        mapnik::Map const& map = *closure->m->get();
-        mapnik::request m_req(map.width(),map.height(),map.get_current_extent());
-        m_req.set_buffer_size(closure->buffer_size);
-        renderer_type ren(backend,
-                          map,
-                          m_req,
-                          closure->scale_factor,
-                          closure->offset_x,
-                          closure->offset_y,
-                          closure->tolerance,
-                          closure->image_format,
-                          closure->scaling_method);
-        ren.apply(closure->scale_denominator);
-        closure->d->painted(ren.painted());
-        closure->d->cache_bytesize();
-
+        render_vector_tile(*closure->m->get(), closure);
     }
     catch (std::exception const& ex)
     {
@@ -1549,6 +2129,16 @@ void Map::EIO_AfterRenderVectorTile(uv_work_t* req)
 
     vector_tile_baton_t *closure = static_cast<vector_tile_baton_t *>(req->data);
 
+    // hand the result to coalesced renders before the callback can touch it
+    if (!closure->coalesce_key.empty()) {
+        node_mapnik::render_coalescer & coalescer = node_mapnik::render_coalescer::instance();
+        if (closure->error) {
+            coalescer.fail(closure->coalesce_key, closure->error_name);
+        } else {
+            coalescer.complete(closure->coalesce_key, node_mapnik::copy_tile_result(*closure->d));
+        }
+    }
+
     TryCatch try_catch;
 
     if (closure->error) {
@@ -1570,40 +2160,46 @@ void Map::EIO_AfterRenderVectorTile(uv_work_t* req)
     delete closure;
 }
 
-void Map::EIO_RenderGrid(uv_work_t* req)
+static void render_grid(mapnik::Map const& map, grid_baton_t * closure)
 {
-
-    grid_baton_t *closure = static_cast<grid_baton_t *>(req->data);
-
-    std::vector<mapnik::layer> const& layers = closure->m->map_->layers();
-
-    try
+    mapnik::grid & grid = *closure->g->get();
+    if (!closure->layers.empty())
     {
-        // copy property names
-        std::set<std::string> attributes = closure->g->get()->property_names();
-
-        // todo - make this a static constant
-        std::string known_id_key = "__id__";
-        if (attributes.find(known_id_key) != attributes.end())
+        node_mapnik::grid_layer_merger merger(grid, closure->layers);
+        for (std::size_t i = 0; i < closure->layers.size(); ++i)
         {
-            attributes.erase(known_id_key);
+            mapnik::grid & layer_grid = merger.layer_grid(i);
+            mapnik::grid_renderer<mapnik::grid> ren(map,
+                                                    layer_grid,
+                                                    closure->scale_factor,
+                                                    closure->offset_x,
+                                                    closure->offset_y);
+            mapnik::layer const& layer = map.layers()[closure->layers[i].layer_idx];
+            std::set<std::string> attributes = node_mapnik::grid_query_attributes(layer_grid);
+            ren.apply(layer,attributes,closure->scale_denominator);
+            merger.merge(i);
         }
+        return;
+    }
 
-        std::string join_field = closure->g->get()->get_key();
-        if (known_id_key != join_field &&
-            attributes.find(join_field) == attributes.end())
-        {
-            attributes.insert(join_field);
-        }
+    mapnik::grid_renderer<mapnik::grid> ren(map,
+                                            grid,
+                                            closure->scale_factor,
+                                            closure->offset_x,
+                                            closure->offset_y);
+    mapnik::layer const& layer = map.layers()[closure->layer_idx];
+    std::set<std::string> attributes = node_mapnik::grid_query_attributes(grid);
+    ren.apply(layer,attributes,closure->scale_denominator);
+}
 
-        mapnik::grid_renderer<mapnik::grid> ren(*closure->m->map_,
-                                                *closure->g->get(),
-                                                closure->scale_factor,
-                                                closure->offset_x,
-                                                closure->offset_y);
-        mapnik::layer const& layer = layers[closure->layer_idx];
-        ren.apply(layer,attributes,closure->scale_denominator);
+void Map::EIO_RenderGrid(uv_work_t* req)
+{
 
+    grid_baton_t *closure = static_cast<grid_baton_t *>(req->data);
+
+    try
+    {
+        render_grid(*closure->m->map_, closure);
     }
     catch (std::exception const& ex)
     {
@@ -1642,18 +2238,23 @@ void Map::EIO_AfterRenderGrid(uv_work_t* req)
     delete closure;
 }
 
+static void render_image(mapnik::Map const& map, image_baton_t * closure)
+{
+    mapnik::agg_renderer<mapnik::image_32> ren(map,
+                                               *closure->im->get(),
+                                               closure->scale_factor,
+                                               closure->offset_x,
+                                               closure->offset_y);
+    ren.apply(closure->scale_denominator);
+}
+
 void Map::EIO_RenderImage(uv_work_t* req)
 {
     image_baton_t *closure = static_cast<image_baton_t *>(req->data);
 
     try
     {
-        mapnik::agg_renderer<mapnik::image_32> ren(*closure->m->map_,
-                                                   *closure->im->get(),
-                                                   closure->scale_factor,
-                                                   closure->offset_x,
-                                                   closure->offset_y);
-        ren.apply(closure->scale_denominator);
+        render_image(*closure->m->map_, closure);
     }
     catch (std::exception const& ex)
     {
@@ -1668,6 +2269,16 @@ void Map::EIO_AfterRenderImage(uv_work_t* req)
 
     image_baton_t *closure = static_cast<image_baton_t *>(req->data);
 
+    // hand the result to coalesced renders before the callback can touch it
+    if (!closure->coalesce_key.empty()) {
+        node_mapnik::render_coalescer & coalescer = node_mapnik::render_coalescer::instance();
+        if (closure->error) {
+            coalescer.fail(closure->coalesce_key, closure->error_name);
+        } else {
+            coalescer.complete(closure->coalesce_key, node_mapnik::copy_image_result(*closure->im->get()));
+        }
+    }
+
     TryCatch try_catch;
 
     if (closure->error) {
@@ -1689,11 +2300,82 @@ void Map::EIO_AfterRenderImage(uv_work_t* req)
     delete closure;
 }
 
+void Map::EIO_RenderMulti(uv_work_t* req)
+{
+    multi_render_baton_t *closure = static_cast<multi_render_baton_t *>(req->data);
+
+    try
+    {
+        // the layers read through the request's feature cache, see render
+        mapnik::Map const& map = closure->map_copy ? *closure->map_copy : *closure->m->map_;
+
+        // features fetched for one bbox are reused for any bbox inside it,
+        // so the target with the widest buffer has to query first
+        bool tiles_first = false;
+        for (std::size_t i = 0; i < closure->tiles.size(); ++i)
+        {
+            if (closure->tiles[i]->buffer_size > map.buffer_size()) tiles_first = true;
+        }
+        if (tiles_first)
+        {
+            for (std::size_t i = 0; i < closure->tiles.size(); ++i) render_vector_tile(map, closure->tiles[i]);
+        }
+        for (std::size_t i = 0; i < closure->images.size(); ++i) render_image(map, closure->images[i]);
+        for (std::size_t i = 0; i < closure->grids.size(); ++i) render_grid(map, closure->grids[i]);
+        if (!tiles_first)
+        {
+            for (std::size_t i = 0; i < closure->tiles.size(); ++i) render_vector_tile(map, closure->tiles[i]);
+        }
+    }
+    catch (std::exception const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+void Map::EIO_AfterRenderMulti(uv_work_t* req)
+{
+    HandleScope scope;
+
+    multi_render_baton_t *closure = static_cast<multi_render_baton_t *>(req->data);
+
+    TryCatch try_catch;
+
+    if (closure->error) {
+        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 1, argv);
+    } else {
+        Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(closure->targets) };
+        closure->cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    }
+
+    if (try_catch.HasCaught()) {
+        node::FatalException(try_catch);
+    }
+
+    std::vector<mapnik::layer> & layers = closure->m->map_->layers();
+    for (std::size_t i = 0; i < closure->datasources.size() && i < layers.size(); ++i)
+    {
+        if (closure->datasources[i]) layers[i].set_datasource(closure->datasources[i]);
+    }
+    closure->m->release();
+    closure->m->Unref();
+    for (std::size_t i = 0; i < closure->images.size(); ++i) closure->images[i]->im->_unref();
+    for (std::size_t i = 0; i < closure->grids.size(); ++i) closure->grids[i]->g->_unref();
+    for (std::size_t i = 0; i < closure->tiles.size(); ++i) closure->tiles[i]->d->_unref();
+    closure->targets.Dispose();
+    closure->cb.Dispose();
+    delete closure;
+}
+
 typedef struct {
     uv_work_t request;
     Map *m;
     std::string format;
     std::string output;
+    int fd; // written to instead of `output` when not -1
+    unsigned band_height; // render in parallel bands of this height when not 0
     palette_ptr palette;
     double scale_factor;
     double scale_denominator;
@@ -1707,15 +2389,17 @@ Handle<Value> Map::renderFile(const Arguments& args)
 {
     HandleScope scope;
 
-    if (args.Length() < 1 || !args[0]->IsString())
+    if (args.Length() < 1 || !(args[0]->IsString() || args[0]->IsNumber()))
         return ThrowException(Exception::TypeError(
-                                  String::New("first argument must be a path to a file to save")));
+                                  String::New("first argument must be a path to a file to save or a file descriptor")));
 
     // defaults
     std::string format = "png";
     double scale_factor = 1.0;
     double scale_denominator = 0.0;
     palette_ptr palette;
+    node_mapnik::work_priority priority = node_mapnik::PRIORITY_INTERACTIVE;
+    unsigned band_height = 0;
 
     Local<Value> callback = args[args.Length()-1];
 
@@ -1766,13 +2450,45 @@ Handle<Value> Map::renderFile(const Arguments& args)
             scale_denominator = bind_opt->NumberValue();
         }
 
+        if (options->Has(String::New("priority"))) {
+            Local<Value> bind_opt = options->Get(String::New("priority"));
+            if (!bind_opt->IsString() || !node_mapnik::parse_priority(TOSTR(bind_opt), priority) ||
+                (priority != node_mapnik::PRIORITY_INTERACTIVE && priority != node_mapnik::PRIORITY_BATCH))
+                return ThrowException(Exception::TypeError(
+                                          String::New("optional arg 'priority' must be 'interactive' or 'batch'")));
+        }
+
+        if (options->Has(String::New("band_height"))) {
+            Local<Value> bind_opt = options->Get(String::New("band_height"));
+            if (!bind_opt->IsNumber() || bind_opt->IntegerValue() <= 0)
+                return ThrowException(Exception::TypeError(
+                                          String::New("optional arg 'band_height' must be a positive integer")));
+
+            band_height = bind_opt->IntegerValue();
+        }
+
     } else if (!args[1]->IsFunction()) {
         return ThrowException(Exception::TypeError(
                                   String::New("optional argument must be an object")));
     }
 
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
-    std::string output = TOSTR(args[0]);
+    m->attach_feature_cache();
+
+    // encoded output is streamed to an open descriptor owned by the caller
+    int fd = -1;
+    std::string output;
+    if (args[0]->IsNumber()) {
+        fd = args[0]->Int32Value();
+        if (fd < 0)
+            return ThrowException(Exception::TypeError(
+                                      String::New("file descriptor must be a non-negative integer")));
+        if (format.empty())
+            return ThrowException(Exception::TypeError(
+                                      String::New("'format' is required when rendering to a file descriptor")));
+    } else {
+        output = TOSTR(args[0]);
+    }
 
     //maybe do this in the async part?
     if (format.empty()) {
@@ -1785,6 +2501,12 @@ Handle<Value> Map::renderFile(const Arguments& args)
         }
     }
 
+    // bands are streamed through our own png encoder
+    if (band_height > 0 && (palette || (format != "png" && format != "png32"))) {
+        return ThrowException(Exception::TypeError(
+                                  String::New("'band_height' is only supported for full color 'png' output")));
+    }
+
     render_file_baton_t *closure = new render_file_baton_t();
 
     if (format == "pdf" || format == "svg" || format == "ps" || format == "ARGB32" || format == "RGB24") {
@@ -1812,20 +2534,252 @@ Handle<Value> Map::renderFile(const Arguments& args)
     closure->format = format;
     closure->palette = palette;
     closure->output = output;
+    closure->fd = fd;
+    closure->band_height = band_height;
 
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_RenderFile, (uv_after_work_cb)EIO_AfterRenderFile);
+    node_mapnik::queue_work(&closure->request, EIO_RenderFile, (uv_after_work_cb)EIO_AfterRenderFile, priority);
+    m->acquire();
     m->Ref();
 
     return Undefined();
 
 }
 
+#if defined(HAVE_CAIRO)
+static cairo_status_t write_to_ostream(void * closure,
+                                       unsigned char const* data,
+                                       unsigned int length)
+{
+    std::ostream * stream = static_cast<std::ostream *>(closure);
+    stream->write(reinterpret_cast<char const*>(data), length);
+    return stream->fail() ? CAIRO_STATUS_WRITE_ERROR : CAIRO_STATUS_SUCCESS;
+}
+
+// like save_to_cairo_file, but cairo hands its output to `stream` as it
+// is produced instead of going through a file name
+static void render_cairo_to_stream(mapnik::Map const& map,
+                                   std::ostream & stream,
+                                   std::string const& format,
+                                   double scale_factor,
+                                   double scale_denominator)
+{
+    unsigned width = map.width();
+    unsigned height = map.height();
+    mapnik::cairo_surface_ptr surface;
+    if (format == "pdf") {
+#ifdef CAIRO_HAS_PDF_SURFACE
+        surface = mapnik::cairo_surface_ptr(cairo_pdf_surface_create_for_stream(write_to_ostream, &stream, width, height),
+                                            mapnik::cairo_surface_closer());
+#endif
+    } else if (format == "svg") {
+#ifdef CAIRO_HAS_SVG_SURFACE
+        surface = mapnik::cairo_surface_ptr(cairo_svg_surface_create_for_stream(write_to_ostream, &stream, width, height),
+                                            mapnik::cairo_surface_closer());
+#endif
+    } else if (format == "ps") {
+#ifdef CAIRO_HAS_PS_SURFACE
+        surface = mapnik::cairo_surface_ptr(cairo_ps_surface_create_for_stream(write_to_ostream, &stream, width, height),
+                                            mapnik::cairo_surface_closer());
+#endif
+    } else if (format == "ARGB32") {
+        surface = mapnik::cairo_surface_ptr(cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height),
+                                            mapnik::cairo_surface_closer());
+    } else if (format == "RGB24") {
+        surface = mapnik::cairo_surface_ptr(cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height),
+                                            mapnik::cairo_surface_closer());
+    }
+    if (!surface) {
+        throw std::runtime_error("cairo surface for '" + format + "' is not available");
+    }
+    {
+        mapnik::cairo_ptr context = mapnik::create_context(surface);
+        mapnik::cairo_renderer<mapnik::cairo_ptr> ren(map, context, scale_factor);
+        ren.apply(scale_denominator);
+    }
+    if (format == "ARGB32" || format == "RGB24") {
+        cairo_surface_write_to_png_stream(&*surface, write_to_ostream, &stream);
+    }
+    cairo_surface_finish(&*surface);
+}
+#endif
+
+// gives the layers of `map` datasources of their own, recreated from their
+// parameters, so it can be rendered alongside the map it was copied from.
+// Returns false when one of them cannot be recreated, as for in-memory
+// datasources
+static bool recreate_datasources(mapnik::Map & map)
+{
+    try
+    {
+        BOOST_FOREACH(mapnik::layer & lyr, map.layers())
+        {
+            mapnik::datasource const* ds = underlying_datasource(lyr);
+            if (!ds) continue;
+            boost::optional<std::string> type = ds->params().get<std::string>("type");
+            if (!type || *type == "memory") return false;
+#if MAPNIK_VERSION >= 200200
+            lyr.set_datasource(mapnik::datasource_cache::instance().create(ds->params()));
+#else
+            lyr.set_datasource(mapnik::datasource_cache::instance()->create(ds->params()));
+#endif
+        }
+    }
+    catch (std::exception const&)
+    {
+        return false;
+    }
+    return true;
+}
+
+// renders one horizontal band with its own copy of the map. Bands
+// rendered at the same time use different entries of `maps`, which never
+// share a datasource or its features
+struct band_render_task
+{
+    band_render_task(std::vector<mapnik::Map const*> const& maps,
+                     unsigned band_height,
+                     unsigned first_band,
+                     double scale_factor,
+                     double scale_denominator,
+                     std::vector<MAPNIK_SHARED_PTR<mapnik::image_32> > & bands)
+        : maps_(maps),
+          band_height_(band_height),
+          first_band_(first_band),
+          scale_factor_(scale_factor),
+          scale_denominator_(scale_denominator),
+          bands_(bands) {}
+
+    void operator() (std::size_t i)
+    {
+        mapnik::Map const& map = *maps_[i];
+        unsigned width = map.width();
+        unsigned height = map.height();
+        unsigned y = (first_band_ + static_cast<unsigned>(i)) * band_height_;
+        unsigned rows = std::min(band_height_, height - y);
+        mapnik::box2d<double> const& extent = map.get_current_extent();
+        double pixel_height = extent.height() / height;
+        mapnik::box2d<double> band_extent(extent.minx(),
+                                          extent.maxy() - (y + rows) * pixel_height,
+                                          extent.maxx(),
+                                          extent.maxy() - y * pixel_height);
+        mapnik::Map band_map(map);
+        band_map.resize(width, rows);
+        band_map.zoom_to_box(band_extent);
+        // like metatiles: symbols crossing a seam are drawn on both sides
+        // of it. Label placement is not shared between bands, so a label
+        // near a seam may still be placed differently on either side
+        band_map.set_buffer_size(std::max(map.buffer_size(), 128));
+        // the band keeps the pixel size of the full map, so scale
+        // dependent styles resolve exactly as they would unbanded
+        bands_[i] = MAPNIK_MAKE_SHARED<mapnik::image_32>(width, rows);
+        mapnik::agg_renderer<mapnik::image_32> ren(band_map, *bands_[i], scale_factor_);
+        ren.apply(scale_denominator_);
+    }
+
+    std::vector<mapnik::Map const*> const& maps_;
+    unsigned band_height_;
+    unsigned first_band_;
+    double scale_factor_;
+    double scale_denominator_;
+    std::vector<MAPNIK_SHARED_PTR<mapnik::image_32> > & bands_;
+};
+
+// Renders the map as horizontal bands, one per core at a time, and
+// streams each finished band into a png. Only `threads` bands are ever
+// held in memory instead of the full image. Every band after the first
+// in a round renders from a copy of the map with datasources of its own;
+// when they cannot be recreated the bands render one after another.
+static void render_bands(mapnik::Map const& map,
+                         std::ostream & stream,
+                         unsigned band_height,
+                         double scale_factor,
+                         double scale_denominator)
+{
+    unsigned height = map.height();
+    unsigned band_count = (height + band_height - 1) / band_height;
+    unsigned threads = std::min(node_mapnik::hardware_concurrency(), band_count);
+    std::vector<MAPNIK_SHARED_PTR<mapnik::Map> > copies;
+    std::vector<mapnik::Map const*> maps(1, &map);
+    while (maps.size() < threads)
+    {
+        MAPNIK_SHARED_PTR<mapnik::Map> copy = MAPNIK_MAKE_SHARED<mapnik::Map>(map);
+        if (!recreate_datasources(*copy)) break;
+        copies.push_back(copy);
+        maps.push_back(copy.get());
+    }
+    threads = static_cast<unsigned>(maps.size());
+    node_mapnik::png_stream_writer writer(stream, map.width(), height);
+    for (unsigned first = 0; first < band_count; first += threads)
+    {
+        unsigned count = std::min(threads, band_count - first);
+        std::vector<MAPNIK_SHARED_PTR<mapnik::image_32> > bands(count);
+        band_render_task task(maps, band_height, first, scale_factor, scale_denominator, bands);
+        node_mapnik::parallel_for(count, task, threads);
+        for (unsigned i = 0; i < count; ++i)
+        {
+            writer.write_rows(bands[i]->data(), 0, bands[i]->height());
+            bands[i].reset();
+        }
+    }
+    writer.finish();
+}
+
 void Map::EIO_RenderFile(uv_work_t* req)
 {
     render_file_baton_t *closure = static_cast<render_file_baton_t *>(req->data);
 
     try
     {
+        if (closure->band_height > 0)
+        {
+            if (closure->fd >= 0)
+            {
+                node_mapnik::fd_ostream stream(closure->fd);
+                render_bands(*closure->m->map_,stream,closure->band_height,closure->scale_factor,closure->scale_denominator);
+                stream.finish();
+            }
+            else
+            {
+                std::ofstream stream(closure->output.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+                if (!stream) {
+                    throw std::runtime_error("could not open " + closure->output + " for writing");
+                }
+                render_bands(*closure->m->map_,stream,closure->band_height,closure->scale_factor,closure->scale_denominator);
+                stream.close();
+                if (!stream) {
+                    throw std::runtime_error("could not write " + closure->output);
+                }
+            }
+            return;
+        }
+
+        if (closure->fd >= 0)
+        {
+            // encoders write through a fixed size buffer straight to the
+            // descriptor, so only the raster itself is held in memory
+            node_mapnik::fd_ostream stream(closure->fd);
+            if(closure->use_cairo)
+            {
+#if defined(HAVE_CAIRO)
+                render_cairo_to_stream(*closure->m->map_,stream,closure->format,closure->scale_factor,closure->scale_denominator);
+#endif
+            }
+            else
+            {
+                mapnik::image_32 im(closure->m->map_->width(),closure->m->map_->height());
+                mapnik::agg_renderer<mapnik::image_32> ren(*closure->m->map_,im,closure->scale_factor);
+                ren.apply(closure->scale_denominator);
+
+                if (closure->palette.get()) {
+                    mapnik::save_to_stream<mapnik::image_data_32>(im.data(),stream,closure->format,*closure->palette);
+                } else {
+                    mapnik::save_to_stream<mapnik::image_data_32>(im.data(),stream,closure->format);
+                }
+            }
+            stream.finish();
+            return;
+        }
+
         if(closure->use_cairo)
         {
 #if defined(HAVE_CAIRO)
@@ -1974,6 +2928,7 @@ Handle<Value> Map::renderSync(const Arguments& args)
     }
 
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
+    m->attach_feature_cache();
     std::string s;
     try
     {
@@ -1994,11 +2949,7 @@ Handle<Value> Map::renderSync(const Arguments& args)
         return ThrowException(Exception::Error(
                                   String::New(ex.what())));
     }
-    #if NODE_VERSION_AT_LEAST(0, 11, 0)
-    return scope.Close(node::Buffer::New((char*)s.data(),s.size()));
-    #else
-    return scope.Close(node::Buffer::New((char*)s.data(),s.size())->handle_);
-    #endif
+    return scope.Close(node_mapnik::buffer_from_string(s));
 }
 
 Handle<Value> Map::renderFileSync(const Arguments& args)
@@ -2066,6 +3017,7 @@ Handle<Value> Map::renderFileSync(const Arguments& args)
     }
 
     Map* m = node::ObjectWrap::Unwrap<Map>(args.This());
+    m->attach_feature_cache();
     std::string output = TOSTR(args[0]);
 
     if (format.empty()) {
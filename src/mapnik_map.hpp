@@ -5,6 +5,7 @@
 #include <uv.h>
 #include <node_object_wrap.h>
 #include "mapnik3x_compatibility.hpp"
+#include "feature_cache.hpp"
 // boost
 #include MAPNIK_SHARED_INCLUDE
 
@@ -40,6 +41,8 @@ public:
     static void EIO_AfterRenderGrid(uv_work_t* req);
     static void EIO_RenderVectorTile(uv_work_t* req);
     static void EIO_AfterRenderVectorTile(uv_work_t* req);
+    static void EIO_RenderMulti(uv_work_t* req);
+    static void EIO_AfterRenderMulti(uv_work_t* req);
 
     static Handle<Value> renderFile(const Arguments &args);
     static void EIO_RenderFile(uv_work_t* req);
@@ -65,6 +68,10 @@ public:
     static void EIO_QueryMap(uv_work_t* req);
     static void EIO_AfterQueryMap(uv_work_t* req);
 
+    static Handle<Value> enableFeatureCache(const Arguments &args);
+    static Handle<Value> disableFeatureCache(const Arguments &args);
+    static Handle<Value> featureCacheStats(const Arguments &args);
+
     static Handle<Value> add_layer(const Arguments &args);
     static Handle<Value> get_layer(const Arguments &args);
 
@@ -85,10 +92,15 @@ public:
 
     inline map_ptr get() { return map_; }
 
+    // wraps layers added or loaded since the cache was enabled
+    void attach_feature_cache();
+
 private:
     ~Map();
     map_ptr map_;
     int in_use_;
+    node_mapnik::feature_cache_ptr feature_cache_;
+    double feature_cache_expand_;
 };
 
 #endif
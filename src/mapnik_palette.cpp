@@ -33,7 +33,8 @@ void Palette::Initialize(Handle<Object> target) {
 
 Palette::Palette(std::string const& palette, mapnik::rgba_palette::palette_type type) :
     ObjectWrap(),
-    palette_(MAPNIK_MAKE_SHARED<mapnik::rgba_palette>(palette, type)) {}
+    palette_(MAPNIK_MAKE_SHARED<mapnik::rgba_palette>(palette, type)),
+    lut_(MAPNIK_MAKE_SHARED<node_mapnik::palette_lut>(*palette_)) {}
 
 Palette::~Palette() {
 }
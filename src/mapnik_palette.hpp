@@ -9,9 +9,12 @@
 
 #include <mapnik/palette.hpp>
 
+#include "palette_lut.hpp"
+
 using namespace v8;
 
 typedef MAPNIK_SHARED_PTR<mapnik::rgba_palette> palette_ptr;
+typedef MAPNIK_SHARED_PTR<node_mapnik::palette_lut> palette_lut_ptr;
 
 class Palette: public node::ObjectWrap {
 public:
@@ -25,9 +28,12 @@ public:
     static Handle<Value> ToBuffer(const Arguments& args);
 
     inline palette_ptr palette() { return palette_; }
+    // lookup table for png8 encoding, filled by the first encode using it
+    inline palette_lut_ptr lut() { return lut_; }
 private:
     ~Palette();
     palette_ptr palette_;
+    palette_lut_ptr lut_;
 };
 
 #endif
@@ -18,6 +18,10 @@
 #include "vector_tile_projection.hpp"
 #include "vector_tile_datasource.hpp"
 #include "vector_tile_util.hpp"
+#include "worker_pool.hpp"
+#include "render_coalescer.hpp"
+#include "grid_layers.hpp"
+#include "webp_options.hpp"
 #include "vector_tile.pb.h"
 #include "vector_tile_processor.hpp"
 #include "vector_tile_backend_pbf.hpp"
@@ -29,6 +33,7 @@
 #include <mapnik/version.hpp>
 #include <mapnik/request.hpp>
 #include <mapnik/graphics.hpp>
+#include <mapnik/image_util.hpp>         // for save_to_string
 #include <mapnik/feature.hpp>
 #include <mapnik/projection.hpp>
 #include <mapnik/datasource.hpp>
@@ -1231,7 +1236,7 @@ Handle<Value> VectorTile::parse(const Arguments& args)
     closure->d = d;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Parse, (uv_after_work_cb)EIO_AfterParse);
+    node_mapnik::queue_work(&closure->request, EIO_Parse, (uv_after_work_cb)EIO_AfterParse, node_mapnik::PRIORITY_ENCODE);
     d->Ref();
     return Undefined();
 }
@@ -1278,17 +1283,66 @@ Handle<Value> VectorTile::addImage(const Arguments& args)
     VectorTile* d = ObjectWrap::Unwrap<VectorTile>(args.This());
     if (args.Length() < 1 || !args[0]->IsObject())
         return ThrowException(Exception::Error(
-                                  String::New("first argument must be a Buffer representing encoded image data")));
+                                  String::New("first argument must be a Buffer representing encoded image data or a mapnik.Image")));
     if (args.Length() < 2 || !args[1]->IsString())
         return ThrowException(Exception::Error(
                                   String::New("second argument must be a layer name (string)")));
     std::string layer_name = TOSTR(args[1]);
     Local<Object> obj = args[0]->ToObject();
-    if (obj->IsNull() || obj->IsUndefined() || !node::Buffer::HasInstance(obj))
+    std::string raster;
+    if (!obj->IsNull() && !obj->IsUndefined() && Image::constructor->HasInstance(obj))
+    {
+        // encode the image here, with the same options as Map.render uses
+        // for raster layers
+        std::string format = "jpeg";
+        if (args.Length() > 2)
+        {
+            if (!args[2]->IsObject())
+                return ThrowException(Exception::TypeError(
+                                          String::New("optional third argument must be an options object")));
+            Local<Object> options = args[2]->ToObject();
+            if (options->Has(String::New("image_format")))
+            {
+                Local<Value> param_val = options->Get(String::New("image_format"));
+                if (!param_val->IsString())
+                    return ThrowException(Exception::TypeError(
+                                              String::New("option 'image_format' must be a string")));
+                format = TOSTR(param_val);
+            }
+            else if (options->Has(String::New("webp")))
+            {
+                format = "webp";
+            }
+            if (options->Has(String::New("webp")))
+            {
+                if (!node_mapnik::is_webp_format(format))
+                    return ThrowException(Exception::TypeError(
+                                              String::New("option 'webp' requires 'image_format' to be 'webp'")));
+                std::string error;
+                if (!node_mapnik::parse_webp_options(options->Get(String::New("webp")), format, error))
+                    return ThrowException(Exception::TypeError(String::New(error.c_str())));
+            }
+        }
+        try
+        {
+            raster = mapnik::save_to_string(*node::ObjectWrap::Unwrap<Image>(obj)->get(), format);
+        }
+        catch (std::exception const& ex)
+        {
+            return ThrowException(Exception::Error(
+                                      String::New(ex.what())));
+        }
+    }
+    else if (!obj->IsNull() && !obj->IsUndefined() && node::Buffer::HasInstance(obj))
+    {
+        raster.assign(node::Buffer::Data(obj),node::Buffer::Length(obj));
+    }
+    else
+    {
         return ThrowException(Exception::Error(
-                                  String::New("first argument must be a Buffer representing encoded image data")));
-    std::size_t buffer_size = node::Buffer::Length(obj);
-    if (buffer_size <= 0)
+                                  String::New("first argument must be a Buffer representing encoded image data or a mapnik.Image")));
+    }
+    if (raster.empty())
     {
         return ThrowException(Exception::Error(
                                   String::New("cannot accept empty buffer as image")));
@@ -1302,7 +1356,7 @@ Handle<Value> VectorTile::addImage(const Arguments& args)
     // no need
     // current_feature_->set_id(feature.id());
     mapnik::vector::tile_feature * new_feature = new_layer->add_features();
-    new_feature->set_raster(std::string(node::Buffer::Data(obj),buffer_size));
+    new_feature->mutable_raster()->swap(raster);
     // report that we have data
     d->painted(true);
     // cache modified size
@@ -1442,7 +1496,7 @@ Handle<Value> VectorTile::setData(const Arguments& args)
     closure->dataLength = node::Buffer::Length(obj);
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_SetData, (uv_after_work_cb)EIO_AfterSetData);
+    node_mapnik::queue_work(&closure->request, EIO_SetData, (uv_after_work_cb)EIO_AfterSetData, node_mapnik::PRIORITY_ENCODE);
     d->Ref();
     return Undefined();
 }
@@ -1535,6 +1589,7 @@ struct vector_tile_render_baton_t {
     CairoSurface * c;
     Grid * g;
     std::size_t layer_idx;
+    std::vector<node_mapnik::grid_layer_spec> layers; // multi-layer grid when not empty
     int z;
     int x;
     int y;
@@ -1548,6 +1603,7 @@ struct vector_tile_render_baton_t {
     std::string error_name;
     Persistent<Function> cb;
     std::string result;
+    std::string coalesce_key;
     bool use_cairo;
     vector_tile_render_baton_t() :
         request(),
@@ -1656,10 +1712,52 @@ Handle<Value> VectorTile::render(const Arguments& args)
         }
     }
 
+    // identity under which identical concurrent renders share one result
+    std::string coalesce_id;
+    if (options->Has(String::New("coalesce")))
+    {
+        Local<Value> bind_opt = options->Get(String::New("coalesce"));
+        if (bind_opt->IsString())
+        {
+            coalesce_id = TOSTR(bind_opt);
+        }
+        else if (bind_opt->IsBoolean())
+        {
+            if (bind_opt->BooleanValue())
+            {
+                std::ostringstream s;
+                s << "tile:" << d << "|map:" << m;
+                coalesce_id = s.str();
+            }
+        }
+        else
+        {
+            delete closure;
+            return ThrowException(Exception::TypeError(
+                                    String::New("optional arg 'coalesce' must be a boolean or a string")));
+        }
+    }
+
     closure->layer_idx = 0;
     if (Image::constructor->HasInstance(im_obj))
     {
         Image *im = node::ObjectWrap::Unwrap<Image>(im_obj);
+        // only blank images are coalesced, see is_blank_render_target
+        if (!coalesce_id.empty() && node_mapnik::is_blank_render_target(*im->get()))
+        {
+            std::ostringstream s;
+            s.precision(17);
+            s << coalesce_id << "|image|" << im->get()->width() << 'x' << im->get()->height()
+              << '|' << d->z_ << '/' << d->x_ << '/' << d->y_
+              << '|' << closure->zxy_override << '|' << closure->z << '/' << closure->x << '/' << closure->y
+              << '|' << closure->buffer_size << '|' << closure->scale_factor << '|' << closure->scale_denominator;
+            closure->coalesce_key = s.str();
+            if (node_mapnik::render_coalescer::instance().join(closure->coalesce_key, im_obj, Handle<Function>::Cast(callback)))
+            {
+                delete closure;
+                return Undefined();
+            }
+        }
         closure->im = im;
         closure->width = im->get()->width();
         closure->height = im->get()->height();
@@ -1707,11 +1805,22 @@ Handle<Value> VectorTile::render(const Arguments& args)
         std::size_t layer_idx = 0;
 
         // grid requires special options for now
-        if (!options->Has(String::New("layer")))
+        if (options->Has(String::New("layers")))
+        {
+            // several layers with layer qualified keys
+            std::string error;
+            if (!node_mapnik::parse_grid_layers(options->Get(String::New("layers")), *m->get(),
+                                                g->get()->get_key(), closure->layers, error))
+            {
+                delete closure;
+                return ThrowException(Exception::TypeError(String::New(error.c_str())));
+            }
+        }
+        else if (!options->Has(String::New("layer")))
         {
             delete closure;
             return ThrowException(Exception::TypeError(
-                                      String::New("'layer' option required for grid rendering and must be either a layer name(string) or layer index (integer)")));
+                                      String::New("'layer' or 'layers' option required for grid rendering and must be either a layer name(string) or layer index (integer)")));
         } else {
             std::vector<mapnik::layer> const& layers = m->get()->layers();
 
@@ -1799,7 +1908,7 @@ Handle<Value> VectorTile::render(const Arguments& args)
     closure->m = m;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_RenderTile, (uv_after_work_cb)EIO_AfterRenderTile);
+    node_mapnik::queue_work(&closure->request, EIO_RenderTile, (uv_after_work_cb)EIO_AfterRenderTile, node_mapnik::PRIORITY_INTERACTIVE);
     m->_ref();
     d->Ref();
     return Undefined();
@@ -1854,6 +1963,70 @@ template <typename Renderer> void process_layers(Renderer & ren,
         }
     }
 }
+// renders a single map layer out of the tile into `grid`
+static void render_grid_layer(vector_tile_render_baton_t * closure,
+                              mapnik::Map const& map_in,
+                              mapnik::request const& m_req,
+                              mapnik::projection const& map_proj,
+                              double scale_denom,
+                              std::size_t layer_idx,
+                              mapnik::grid & grid)
+{
+    mapnik::vector::tile const& tiledata = closure->d->get_tile();
+    mapnik::grid_renderer<mapnik::grid> ren(map_in,
+                                            m_req,
+                                            grid,
+                                            closure->scale_factor);
+    ren.start_map_processing(map_in);
+
+    mapnik::layer const& lyr = map_in.layers()[layer_idx];
+    if (lyr.visible(scale_denom))
+    {
+        int tile_layer_idx = -1;
+        for (int j=0; j < tiledata.layers_size(); ++j)
+        {
+            mapnik::vector::tile_layer const& layer = tiledata.layers(j);
+            if (lyr.name() == layer.name())
+            {
+                tile_layer_idx = j;
+                break;
+            }
+        }
+        if (tile_layer_idx > -1)
+        {
+            mapnik::vector::tile_layer const& layer = tiledata.layers(tile_layer_idx);
+            if (layer.features_size() <= 0)
+            {
+                return;
+            }
+
+            mapnik::layer lyr_copy(lyr);
+            MAPNIK_SHARED_PTR<mapnik::vector::tile_datasource> ds = MAPNIK_MAKE_SHARED<
+                                            mapnik::vector::tile_datasource>(
+                                                layer,
+                                                closure->d->x_,
+                                                closure->d->y_,
+                                                closure->d->z_,
+                                                closure->d->width_
+                                                );
+            ds->set_envelope(m_req.get_buffered_extent());
+            lyr_copy.set_datasource(ds);
+            std::set<std::string> attributes = node_mapnik::grid_query_attributes(grid);
+            ren.apply_to_layer(lyr_copy,
+                               ren,
+                               map_proj,
+                               m_req.scale(),
+                               scale_denom,
+                               m_req.width(),
+                               m_req.height(),
+                               m_req.extent(),
+                               m_req.buffer_size(),
+                               attributes);
+        }
+        ren.end_map_processing(map_in);
+    }
+}
+
 void VectorTile::EIO_RenderTile(uv_work_t* req)
 {
     vector_tile_render_baton_t *closure = static_cast<vector_tile_render_baton_t *>(req->data);
@@ -1882,71 +2055,21 @@ void VectorTile::EIO_RenderTile(uv_work_t* req)
         // render grid for layer
         if (closure->g)
         {
-            mapnik::grid_renderer<mapnik::grid> ren(map_in,
-                                                    m_req,
-                                                    *closure->g->get(),
-                                                    closure->scale_factor);
-            ren.start_map_processing(map_in);
-
-            mapnik::layer const& lyr = layers[closure->layer_idx];
-            if (lyr.visible(scale_denom))
+            mapnik::grid & grid = *closure->g->get();
+            if (!closure->layers.empty())
             {
-                int tile_layer_idx = -1;
-                for (int j=0; j < tiledata.layers_size(); ++j)
-                {
-                    mapnik::vector::tile_layer const& layer = tiledata.layers(j);
-                    if (lyr.name() == layer.name())
-                    {
-                        tile_layer_idx = j;
-                        break;
-                    }
-                }
-                if (tile_layer_idx > -1)
+                node_mapnik::grid_layer_merger merger(grid, closure->layers);
+                for (std::size_t i = 0; i < closure->layers.size(); ++i)
                 {
-                    mapnik::vector::tile_layer const& layer = tiledata.layers(tile_layer_idx);
-                    if (layer.features_size() <= 0)
-                    {
-                        return;
-                    }
-
-                    // copy property names
-                    std::set<std::string> attributes = closure->g->get()->property_names();
-                    // todo - make this a static constant
-                    std::string known_id_key = "__id__";
-                    if (attributes.find(known_id_key) != attributes.end())
-                    {
-                        attributes.erase(known_id_key);
-                    }
-                    std::string join_field = closure->g->get()->get_key();
-                    if (known_id_key != join_field &&
-                        attributes.find(join_field) == attributes.end())
-                    {
-                        attributes.insert(join_field);
-                    }
-
-                    mapnik::layer lyr_copy(lyr);
-                    MAPNIK_SHARED_PTR<mapnik::vector::tile_datasource> ds = MAPNIK_MAKE_SHARED<
-                                                    mapnik::vector::tile_datasource>(
-                                                        layer,
-                                                        closure->d->x_,
-                                                        closure->d->y_,
-                                                        closure->d->z_,
-                                                        closure->d->width_
-                                                        );
-                    ds->set_envelope(m_req.get_buffered_extent());
-                    lyr_copy.set_datasource(ds);
-                    ren.apply_to_layer(lyr_copy,
-                                       ren,
-                                       map_proj,
-                                       m_req.scale(),
-                                       scale_denom,
-                                       m_req.width(),
-                                       m_req.height(),
-                                       m_req.extent(),
-                                       m_req.buffer_size(),
-                                       attributes);
+                    render_grid_layer(closure, map_in, m_req, map_proj, scale_denom,
+                                      closure->layers[i].layer_idx, merger.layer_grid(i));
+                    merger.merge(i);
                 }
-                ren.end_map_processing(map_in);
+            }
+            else
+            {
+                render_grid_layer(closure, map_in, m_req, map_proj, scale_denom,
+                                  closure->layer_idx, grid);
             }
         }
         else if (closure->c)
@@ -2014,6 +2137,20 @@ void VectorTile::EIO_AfterRenderTile(uv_work_t* req)
 
     vector_tile_render_baton_t *closure = static_cast<vector_tile_render_baton_t *>(req->data);
 
+    // hand the result to coalesced renders before the callback can touch it
+    if (!closure->coalesce_key.empty())
+    {
+        node_mapnik::render_coalescer & coalescer = node_mapnik::render_coalescer::instance();
+        if (closure->error)
+        {
+            coalescer.fail(closure->coalesce_key, closure->error_name);
+        }
+        else
+        {
+            coalescer.complete(closure->coalesce_key, node_mapnik::copy_image_result(*closure->im->get()));
+        }
+    }
+
     TryCatch try_catch;
 
     if (closure->error) {
@@ -2088,7 +2225,7 @@ Handle<Value> VectorTile::clear(const Arguments& args)
     closure->d = d;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_Clear, (uv_after_work_cb)EIO_AfterClear);
+    node_mapnik::queue_work(&closure->request, EIO_Clear, (uv_after_work_cb)EIO_AfterClear, node_mapnik::PRIORITY_HOUSEKEEPING);
     d->Ref();
     return Undefined();
 }
@@ -2188,7 +2325,7 @@ Handle<Value> VectorTile::isSolid(const Arguments& args)
     closure->result = true;
     closure->error = false;
     closure->cb = Persistent<Function>::New(Handle<Function>::Cast(callback));
-    uv_queue_work(uv_default_loop(), &closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid);
+    node_mapnik::queue_work(&closure->request, EIO_IsSolid, (uv_after_work_cb)EIO_AfterIsSolid, node_mapnik::PRIORITY_HOUSEKEEPING);
     d->Ref();
     return Undefined();
 }
@@ -25,6 +25,11 @@
 #include "mapnik_grid.hpp"
 #include "mapnik_cairo_surface.hpp"
 #include "mapnik_grid_view.hpp"
+#include "style_cache.hpp"
+#include "worker_pool.hpp"
+#include "raster_pool.hpp"
+#include "encode_cache.hpp"
+#include "pixel_kernels.hpp"
 #ifdef NODE_MAPNIK_EXPRESSION
 #include "mapnik_expression.hpp"
 #endif
@@ -95,6 +100,129 @@ static Handle<Value> clearCache(const Arguments& args)
     return scope.Close(Undefined());
 }
 
+static Handle<Value> styleCacheStats(const Arguments& args)
+{
+    HandleScope scope;
+    style_cache const& cache = style_cache::instance();
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("size"), Number::New(cache.max_size()));
+    stats->Set(String::NewSymbol("entries"), Number::New(cache.size()));
+    stats->Set(String::NewSymbol("hits"), Number::New(cache.hits()));
+    stats->Set(String::NewSymbol("misses"), Number::New(cache.misses()));
+    return scope.Close(stats);
+}
+
+static Handle<Value> setStyleCacheSize(const Arguments& args)
+{
+    HandleScope scope;
+    if (args.Length() != 1 || !args[0]->IsNumber() || args[0]->IntegerValue() < 0)
+        return ThrowException(Exception::TypeError(
+                                  String::New("requires one argument: the maximum number of cached stylesheets")));
+    style_cache::instance().set_max_size(args[0]->IntegerValue());
+    return scope.Close(Undefined());
+}
+
+static Handle<Value> clearStyleCache(const Arguments& args)
+{
+    HandleScope scope;
+    style_cache::instance().clear();
+    return scope.Close(Undefined());
+}
+
+static Handle<Value> workerPoolStats(const Arguments& args)
+{
+    HandleScope scope;
+    worker_pool const& pool = worker_pool::instance();
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("size"), Integer::New(pool.size()));
+    stats->Set(String::NewSymbol("threads"), Integer::New(pool.threads()));
+    for (int i = 0; i < PRIORITY_COUNT; ++i)
+    {
+        work_priority priority = static_cast<work_priority>(i);
+        worker_pool::class_stats s = pool.stats(priority);
+        Local<Object> cls = Object::New();
+        cls->Set(String::NewSymbol("queued"), Number::New(s.queued));
+        cls->Set(String::NewSymbol("active"), Number::New(s.active));
+        cls->Set(String::NewSymbol("completed"), Number::New(s.completed));
+        // waits are recorded when a job starts running
+        std::size_t started = s.completed + s.active;
+        cls->Set(String::NewSymbol("wait_avg_ms"), Number::New(started > 0 ? s.wait_total_ms / started : 0.0));
+        cls->Set(String::NewSymbol("wait_max_ms"), Number::New(s.wait_max_ms));
+        stats->Set(String::NewSymbol(priority_name(priority)), cls);
+    }
+    return scope.Close(stats);
+}
+
+static Handle<Value> setWorkerPoolSize(const Arguments& args)
+{
+    HandleScope scope;
+    if (args.Length() != 1 || !args[0]->IsNumber() || args[0]->IntegerValue() < 1)
+        return ThrowException(Exception::TypeError(
+                                  String::New("requires one argument: the number of render threads (at least 1)")));
+    worker_pool::instance().set_size(args[0]->IntegerValue());
+    return scope.Close(Undefined());
+}
+
+static Handle<Value> rasterPoolStats(const Arguments& args)
+{
+    HandleScope scope;
+    raster_pool const& pool = raster_pool::instance();
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("size"), Number::New(pool.max_bytes()));
+    stats->Set(String::NewSymbol("bytes"), Number::New(pool.bytes()));
+    stats->Set(String::NewSymbol("entries"), Number::New(pool.size()));
+    stats->Set(String::NewSymbol("hits"), Number::New(pool.hits()));
+    stats->Set(String::NewSymbol("misses"), Number::New(pool.misses()));
+    return scope.Close(stats);
+}
+
+static Handle<Value> setRasterPoolSize(const Arguments& args)
+{
+    HandleScope scope;
+    if (args.Length() != 1 || !args[0]->IsNumber() || args[0]->IntegerValue() < 0)
+        return ThrowException(Exception::TypeError(
+                                  String::New("requires one argument: the maximum number of bytes kept for reuse")));
+    raster_pool::instance().set_max_bytes(args[0]->IntegerValue());
+    return scope.Close(Undefined());
+}
+
+static Handle<Value> clearRasterPool(const Arguments& args)
+{
+    HandleScope scope;
+    raster_pool::instance().clear();
+    return scope.Close(Undefined());
+}
+
+static Handle<Value> encodeCacheStats(const Arguments& args)
+{
+    HandleScope scope;
+    encode_cache const& cache = encode_cache::instance();
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("size"), Number::New(cache.max_bytes()));
+    stats->Set(String::NewSymbol("bytes"), Number::New(cache.bytes()));
+    stats->Set(String::NewSymbol("entries"), Number::New(cache.size()));
+    stats->Set(String::NewSymbol("hits"), Number::New(cache.hits()));
+    stats->Set(String::NewSymbol("misses"), Number::New(cache.misses()));
+    return scope.Close(stats);
+}
+
+static Handle<Value> setEncodeCacheSize(const Arguments& args)
+{
+    HandleScope scope;
+    if (args.Length() != 1 || !args[0]->IsNumber() || args[0]->IntegerValue() < 0)
+        return ThrowException(Exception::TypeError(
+                                  String::New("requires one argument: the maximum number of bytes of cached encodings")));
+    encode_cache::instance().set_max_bytes(args[0]->IntegerValue());
+    return scope.Close(Undefined());
+}
+
+static Handle<Value> clearEncodeCache(const Arguments& args)
+{
+    HandleScope scope;
+    encode_cache::instance().clear();
+    return scope.Close(Undefined());
+}
+
 static Handle<Value> shutdown(const Arguments& args)
 {
     HandleScope scope;
@@ -117,6 +245,17 @@ extern "C" {
         NODE_SET_METHOD(target, "fonts", node_mapnik::available_font_faces);
         NODE_SET_METHOD(target, "fontFiles", node_mapnik::available_font_files);
         NODE_SET_METHOD(target, "clearCache", clearCache);
+        NODE_SET_METHOD(target, "styleCacheStats", styleCacheStats);
+        NODE_SET_METHOD(target, "setStyleCacheSize", setStyleCacheSize);
+        NODE_SET_METHOD(target, "clearStyleCache", clearStyleCache);
+        NODE_SET_METHOD(target, "workerPoolStats", workerPoolStats);
+        NODE_SET_METHOD(target, "setWorkerPoolSize", setWorkerPoolSize);
+        NODE_SET_METHOD(target, "rasterPoolStats", rasterPoolStats);
+        NODE_SET_METHOD(target, "setRasterPoolSize", setRasterPoolSize);
+        NODE_SET_METHOD(target, "clearRasterPool", clearRasterPool);
+        NODE_SET_METHOD(target, "encodeCacheStats", encodeCacheStats);
+        NODE_SET_METHOD(target, "setEncodeCacheSize", setEncodeCacheSize);
+        NODE_SET_METHOD(target, "clearEncodeCache", clearEncodeCache);
         NODE_SET_METHOD(target, "gc", gc);
         NODE_SET_METHOD(target, "shutdown",shutdown);
 
@@ -226,6 +365,8 @@ extern "C" {
         supports->Set(String::NewSymbol("threadsafe"), False());
 #endif
 
+        supports->Set(String::NewSymbol("pixel_kernels"), String::New(node_mapnik::pixel_kernels_name()));
+
         target->Set(String::NewSymbol("supports"), supports);
 
 #if MAPNIK_VERSION >= 200100
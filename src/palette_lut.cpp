@@ -0,0 +1,97 @@
+#include "palette_lut.hpp"
+#include "parallel.hpp"
+
+namespace node_mapnik {
+
+// quantized keys: 5 bits each of r, g and b and 3 bits of alpha
+static const unsigned table_size = 1 << 18;
+
+// keys filled per parallel job
+static const unsigned build_block = 4096;
+
+// expands a quantized channel so 0 and the maximum map to 0 and 255
+static inline int expand(unsigned value, unsigned bits)
+{
+    unsigned max = (1u << bits) - 1;
+    return static_cast<int>((value * 255 + max / 2) / max);
+}
+
+struct lut_build_task
+{
+    lut_build_task(std::vector<mapnik::rgb> const& colors,
+                   std::vector<unsigned> const& alpha,
+                   std::vector<unsigned char> & table)
+        : colors_(colors),
+          alpha_(alpha),
+          table_(table) {}
+
+    void operator() (std::size_t block)
+    {
+        unsigned begin = static_cast<unsigned>(block) * build_block;
+        for (unsigned key = begin; key < begin + build_block; ++key)
+        {
+            int r = expand(key & 0x1f, 5);
+            int g = expand((key >> 5) & 0x1f, 5);
+            int b = expand((key >> 10) & 0x1f, 5);
+            int a = expand((key >> 15) & 0x7, 3);
+            unsigned best = 0;
+            int best_distance = -1;
+            for (unsigned i = 0; i < colors_.size(); ++i)
+            {
+                int dr = r - colors_[i].r;
+                int dg = g - colors_[i].g;
+                int db = b - colors_[i].b;
+                int da = a - static_cast<int>(i < alpha_.size() ? alpha_[i] : 255);
+                int distance = dr * dr + dg * dg + db * db + da * da;
+                if (best_distance < 0 || distance < best_distance)
+                {
+                    best = i;
+                    best_distance = distance;
+                    if (distance == 0) break;
+                }
+            }
+            table_[key] = static_cast<unsigned char>(best);
+        }
+    }
+
+    std::vector<mapnik::rgb> const& colors_;
+    std::vector<unsigned> const& alpha_;
+    std::vector<unsigned char> & table_;
+};
+
+palette_lut::palette_lut(mapnik::rgba_palette const& palette)
+    : colors_(palette.palette()),
+      alpha_(palette.alphaTable()),
+      table_(),
+      built_(false)
+{
+    uv_mutex_init(&mutex_);
+}
+
+palette_lut::~palette_lut()
+{
+    uv_mutex_destroy(&mutex_);
+}
+
+void palette_lut::build(unsigned threads)
+{
+    uv_mutex_lock(&mutex_);
+    if (!built_)
+    {
+        try
+        {
+            table_.resize(table_size);
+            lut_build_task task(colors_, alpha_, table_);
+            parallel_for(table_size / build_block, task, threads);
+            built_ = true;
+        }
+        catch (...)
+        {
+            uv_mutex_unlock(&mutex_);
+            throw;
+        }
+    }
+    uv_mutex_unlock(&mutex_);
+}
+
+}
@@ -0,0 +1,59 @@
+#ifndef __NODE_MAPNIK_PALETTE_LUT_H__
+#define __NODE_MAPNIK_PALETTE_LUT_H__
+
+// libuv
+#include <uv.h>
+
+// mapnik
+#include <mapnik/palette.hpp>           // for rgba_palette, rgb
+
+// boost
+#include <boost/noncopyable.hpp>
+
+// stl
+#include <vector>
+
+namespace node_mapnik {
+
+/*
+ * Dense lookup table from quantized rgba (5 bits per colour channel, 3 bits
+ * of alpha) to the index of the nearest colour of a palette, so png8
+ * encoding maps a pixel with one table load instead of a nearest colour
+ * search. The 256k table is built on first use, from any thread, and kept
+ * for the life of the palette.
+ */
+class palette_lut : private boost::noncopyable
+{
+public:
+    explicit palette_lut(mapnik::rgba_palette const& palette);
+    ~palette_lut();
+
+    // builds the table on up to `threads` threads (0 for the pool size)
+    // if no other encode has done so yet
+    void build(unsigned threads = 0);
+
+    // index of the colour nearest to the image_32 pixel `rgba`, build() first
+    inline unsigned char operator() (unsigned rgba) const
+    {
+        return table_[((rgba >> 3) & 0x1f) |
+                      ((rgba >> 6) & 0x3e0) |
+                      ((rgba >> 9) & 0x7c00) |
+                      ((rgba >> 14) & 0x38000)];
+    }
+
+    std::vector<mapnik::rgb> const& colors() const { return colors_; }
+
+    // alpha of the leading colours, the others are opaque
+    std::vector<unsigned> const& alpha() const { return alpha_; }
+
+private:
+    std::vector<mapnik::rgb> colors_;
+    std::vector<unsigned> alpha_;
+    std::vector<unsigned char> table_;
+    bool built_;
+    uv_mutex_t mutex_;
+};
+
+}
+
+#endif // __NODE_MAPNIK_PALETTE_LUT_H__
@@ -0,0 +1,175 @@
+#ifndef __NODE_MAPNIK_PARALLEL_H__
+#define __NODE_MAPNIK_PARALLEL_H__
+
+// libuv
+#include <uv.h>
+
+#include "worker_pool.hpp"
+
+// stl
+#include <exception>
+#include <stdexcept>
+#include <string>
+
+namespace node_mapnik {
+
+namespace detail {
+
+inline unsigned & concurrency_value()
+{
+    // zero initialized before any code runs, so no construction race
+    static unsigned concurrency = 0;
+    return concurrency;
+}
+
+inline void init_concurrency()
+{
+    uv_cpu_info_t * cpu_infos = 0;
+    int count = 0;
+    uv_cpu_info(&cpu_infos, &count);
+    if (cpu_infos) uv_free_cpu_info(cpu_infos, count);
+    concurrency_value() = count > 0 ? static_cast<unsigned>(count) : 1;
+}
+
+}
+
+// number of cpus, safe to call from any thread
+inline unsigned hardware_concurrency()
+{
+    static uv_once_t once = UV_ONCE_INIT;
+    uv_once(&once, detail::init_concurrency);
+    return detail::concurrency_value();
+}
+
+namespace detail {
+
+template <typename Task>
+struct parallel_state
+{
+    parallel_state(Task & t, std::size_t n)
+        : task(t), count(n), next(0), failed(false), error(), helpers_done(0)
+    {
+        uv_mutex_init(&mutex);
+        uv_cond_init(&cond);
+    }
+
+    ~parallel_state()
+    {
+        uv_cond_destroy(&cond);
+        uv_mutex_destroy(&mutex);
+    }
+
+    Task & task;
+    std::size_t count;
+    std::size_t next;
+    bool failed;
+    std::string error;
+    unsigned helpers_done;
+    uv_mutex_t mutex;
+    uv_cond_t cond;
+};
+
+template <typename Task>
+void parallel_worker(void * arg)
+{
+    parallel_state<Task> * state = static_cast<parallel_state<Task> *>(arg);
+    for (;;)
+    {
+        uv_mutex_lock(&state->mutex);
+        if (state->failed || state->next >= state->count)
+        {
+            uv_mutex_unlock(&state->mutex);
+            return;
+        }
+        std::size_t index = state->next++;
+        uv_mutex_unlock(&state->mutex);
+        try
+        {
+            state->task(index);
+        }
+        catch (std::exception const& ex)
+        {
+            uv_mutex_lock(&state->mutex);
+            if (!state->failed)
+            {
+                state->failed = true;
+                state->error = ex.what();
+            }
+            uv_mutex_unlock(&state->mutex);
+        }
+        catch (...)
+        {
+            // must not escape a pool thread, which would end the process
+            uv_mutex_lock(&state->mutex);
+            if (!state->failed)
+            {
+                state->failed = true;
+                state->error = "unknown exception in parallel task";
+            }
+            uv_mutex_unlock(&state->mutex);
+        }
+    }
+}
+
+// runs on a worker_pool thread that claimed a helper slot
+template <typename Task>
+void parallel_helper(void * arg)
+{
+    parallel_state<Task> * state = static_cast<parallel_state<Task> *>(arg);
+    parallel_worker<Task>(arg);
+    uv_mutex_lock(&state->mutex);
+    ++state->helpers_done;
+    uv_cond_signal(&state->cond);
+    uv_mutex_unlock(&state->mutex);
+}
+
+}
+
+/*
+ * Fork-join loop: calls task(i) for every i in [0, count) on the calling
+ * thread and on up to `threads - 1` idle threads of the worker_pool
+ * (`threads` defaults to the pool size), and returns once all calls have
+ * finished. No threads are created: helpers only run on pool threads that
+ * have nothing else to do, so a request can use several cores without the
+ * process ever running more threads than the pool holds, and the calling
+ * thread makes progress on its own when the pool is busy.
+ *
+ * The first exception thrown by a task stops the remaining work and is
+ * rethrown to the caller as a std::runtime_error.
+ */
+template <typename Task>
+void parallel_for(std::size_t count, Task & task, unsigned threads = 0)
+{
+    if (count == 0) return;
+    worker_pool & pool = worker_pool::instance();
+    if (threads == 0 || threads > pool.size()) threads = pool.size();
+    if (threads > count) threads = static_cast<unsigned>(count);
+
+    detail::parallel_state<Task> state(task, count);
+    unsigned helpers = threads > 1 ? threads - 1 : 0;
+    if (helpers > 0)
+    {
+        pool.post_helpers(detail::parallel_helper<Task>, &state, helpers);
+    }
+    detail::parallel_worker<Task>(&state);
+    if (helpers > 0)
+    {
+        // every index is taken, so slots no thread claimed yet are dropped
+        // and only the helpers already running need to be waited for
+        unsigned claimed = pool.withdraw_helpers(&state, helpers);
+        uv_mutex_lock(&state.mutex);
+        while (state.helpers_done < claimed)
+        {
+            uv_cond_wait(&state.cond, &state.mutex);
+        }
+        uv_mutex_unlock(&state.mutex);
+    }
+    if (state.failed)
+    {
+        throw std::runtime_error(state.error);
+    }
+}
+
+}
+
+#endif // __NODE_MAPNIK_PARALLEL_H__
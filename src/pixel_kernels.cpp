@@ -0,0 +1,578 @@
+#include "pixel_kernels.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define NODE_MAPNIK_SSE2
+#include <emmintrin.h>
+#endif
+
+// avx2 kernels are compiled for a target attribute and only called when
+// the cpu reports avx2 support
+#if defined(NODE_MAPNIK_SSE2) && defined(__GNUC__) && \
+    ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define NODE_MAPNIK_AVX2
+#include <immintrin.h>
+#define NODE_MAPNIK_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define NODE_MAPNIK_NEON
+#include <arm_neon.h>
+#endif
+
+// stl
+#include <cstdlib>
+#include <cstring>
+
+namespace node_mapnik {
+
+// scalar versions, also used for the tails of the vector versions
+
+static void premultiply_scalar(unsigned * pixels, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        unsigned rgba = pixels[i];
+        unsigned a = rgba >> 24;
+        if (a == 255) continue;
+        unsigned r = ((rgba & 0xff) * a + 255) >> 8;
+        unsigned g = (((rgba >> 8) & 0xff) * a + 255) >> 8;
+        unsigned b = (((rgba >> 16) & 0xff) * a + 255) >> 8;
+        pixels[i] = (a << 24) | (b << 16) | (g << 8) | r;
+    }
+}
+
+static inline unsigned demultiply_channel(unsigned c, unsigned a)
+{
+    unsigned v = c * 255 / a;
+    return v > 255 ? 255 : v;
+}
+
+static void demultiply_scalar(unsigned * pixels, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        unsigned rgba = pixels[i];
+        unsigned a = rgba >> 24;
+        if (a == 255) continue;
+        if (a == 0)
+        {
+            pixels[i] = 0;
+            continue;
+        }
+        unsigned r = demultiply_channel(rgba & 0xff, a);
+        unsigned g = demultiply_channel((rgba >> 8) & 0xff, a);
+        unsigned b = demultiply_channel((rgba >> 16) & 0xff, a);
+        pixels[i] = (a << 24) | (b << 16) | (g << 8) | r;
+    }
+}
+
+static void grayscale_to_alpha_scalar(unsigned * pixels, std::size_t count, unsigned color)
+{
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        unsigned rgba = pixels[i];
+        unsigned r = rgba & 0xff;
+        unsigned g = (rgba >> 8) & 0xff;
+        unsigned b = (rgba >> 16) & 0xff;
+        // magic numbers for grayscale
+        unsigned a = (int)((r * .3) + (g * .59) + (b * .11));
+        pixels[i] = (a << 24) | color;
+    }
+}
+
+static void downsample_2x_scalar(unsigned const* top, unsigned const* bottom, unsigned * out, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        unsigned p0 = top[2 * i];
+        unsigned p1 = top[2 * i + 1];
+        unsigned p2 = bottom[2 * i];
+        unsigned p3 = bottom[2 * i + 1];
+        unsigned rgba = 0;
+        for (unsigned shift = 0; shift < 32; shift += 8)
+        {
+            unsigned sum = ((p0 >> shift) & 0xff) + ((p1 >> shift) & 0xff) +
+                           ((p2 >> shift) & 0xff) + ((p3 >> shift) & 0xff);
+            rgba |= ((sum + 2) >> 2) << shift;
+        }
+        out[i] = rgba;
+    }
+}
+
+static std::size_t compare_scalar(unsigned const* a, unsigned const* b, std::size_t count,
+                                  unsigned threshold, unsigned mask, unsigned * diff)
+{
+    std::size_t mismatched = 0;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        bool differs = false;
+        for (unsigned shift = 0; shift < 32 && !differs; shift += 8)
+        {
+            if (((mask >> shift) & 0xff) == 0) continue;
+            unsigned ca = (a[i] >> shift) & 0xff;
+            unsigned cb = (b[i] >> shift) & 0xff;
+            differs = (ca > cb ? ca - cb : cb - ca) > threshold;
+        }
+        if (differs) ++mismatched;
+        if (diff) diff[i] = differs ? 0xff0000ff : 0;
+    }
+    return mismatched;
+}
+
+#if defined(NODE_MAPNIK_SSE2)
+
+static void premultiply_sse2(unsigned * pixels, std::size_t count)
+{
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const round = _mm_set1_epi16(255);
+    __m128i const alpha_mask = _mm_set1_epi32(0xff000000);
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i px = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pixels + i));
+        __m128i lo = _mm_unpacklo_epi8(px, zero);
+        __m128i hi = _mm_unpackhi_epi8(px, zero);
+        __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+        __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+        lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(lo, alo), round), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(hi, ahi), round), 8);
+        __m128i out = _mm_packus_epi16(lo, hi);
+        out = _mm_or_si128(_mm_andnot_si128(alpha_mask, out), _mm_and_si128(alpha_mask, px));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pixels + i), out);
+    }
+    premultiply_scalar(pixels + i, count - i);
+}
+
+// c * 255 and a are exact in float and the division is correctly
+// rounded, so truncating it gives the same quotient as integer division
+static inline __m128i demultiply_pixel_sse2(__m128i px)
+{
+    __m128 v = _mm_cvtepi32_ps(px);
+    __m128 a = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3,3,3,3));
+    __m128 q = _mm_div_ps(_mm_mul_ps(v, _mm_set1_ps(255.0f)), a);
+    // a == 0 divides by zero, those lanes are cleared below
+    __m128 zero_alpha = _mm_cmpeq_ps(a, _mm_setzero_ps());
+    return _mm_andnot_si128(_mm_castps_si128(zero_alpha), _mm_cvttps_epi32(_mm_andnot_ps(zero_alpha, q)));
+}
+
+static void demultiply_sse2(unsigned * pixels, std::size_t count)
+{
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const alpha_mask = _mm_set1_epi32(0xff000000);
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i px = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pixels + i));
+        __m128i lo = _mm_unpacklo_epi8(px, zero);
+        __m128i hi = _mm_unpackhi_epi8(px, zero);
+        __m128i p0 = demultiply_pixel_sse2(_mm_unpacklo_epi16(lo, zero));
+        __m128i p1 = demultiply_pixel_sse2(_mm_unpackhi_epi16(lo, zero));
+        __m128i p2 = demultiply_pixel_sse2(_mm_unpacklo_epi16(hi, zero));
+        __m128i p3 = demultiply_pixel_sse2(_mm_unpackhi_epi16(hi, zero));
+        // saturating packs clamp quotients above 255
+        __m128i out = _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3));
+        out = _mm_or_si128(_mm_andnot_si128(alpha_mask, out), _mm_and_si128(alpha_mask, px));
+        // fully transparent pixels become 0 altogether
+        __m128i transparent = _mm_cmpeq_epi32(_mm_and_si128(px, alpha_mask), zero);
+        out = _mm_andnot_si128(transparent, out);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pixels + i), out);
+    }
+    demultiply_scalar(pixels + i, count - i);
+}
+
+// the same three multiplies and two adds, in the same order, as the
+// scalar version
+static inline __m128i grayscale_sse2(__m128i r, __m128i g, __m128i b)
+{
+    __m128d const kr = _mm_set1_pd(.3);
+    __m128d const kg = _mm_set1_pd(.59);
+    __m128d const kb = _mm_set1_pd(.11);
+    __m128d sum_lo = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(r), kr),
+                                           _mm_mul_pd(_mm_cvtepi32_pd(g), kg)),
+                                _mm_mul_pd(_mm_cvtepi32_pd(b), kb));
+    r = _mm_shuffle_epi32(r, _MM_SHUFFLE(1,0,3,2));
+    g = _mm_shuffle_epi32(g, _MM_SHUFFLE(1,0,3,2));
+    b = _mm_shuffle_epi32(b, _MM_SHUFFLE(1,0,3,2));
+    __m128d sum_hi = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(r), kr),
+                                           _mm_mul_pd(_mm_cvtepi32_pd(g), kg)),
+                                _mm_mul_pd(_mm_cvtepi32_pd(b), kb));
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(sum_lo), _mm_cvttpd_epi32(sum_hi));
+}
+
+static void grayscale_to_alpha_sse2(unsigned * pixels, std::size_t count, unsigned color)
+{
+    __m128i const channel = _mm_set1_epi32(0xff);
+    __m128i const fill = _mm_set1_epi32(static_cast<int>(color));
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i px = _mm_loadu_si128(reinterpret_cast<__m128i const*>(pixels + i));
+        __m128i r = _mm_and_si128(px, channel);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(px, 8), channel);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(px, 16), channel);
+        __m128i a = grayscale_sse2(r, g, b);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pixels + i), _mm_or_si128(_mm_slli_epi32(a, 24), fill));
+    }
+    grayscale_to_alpha_scalar(pixels + i, count - i, color);
+}
+
+static void downsample_2x_sse2(unsigned const* top, unsigned const* bottom, unsigned * out, std::size_t count)
+{
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const round = _mm_set1_epi16(2);
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 t0 = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<__m128i const*>(top + 2 * i)));
+        __m128 t1 = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<__m128i const*>(top + 2 * i + 4)));
+        __m128 b0 = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<__m128i const*>(bottom + 2 * i)));
+        __m128 b1 = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<__m128i const*>(bottom + 2 * i + 4)));
+        // even and odd pixels of each row, lined up with the 4 outputs
+        __m128i te = _mm_castps_si128(_mm_shuffle_ps(t0, t1, _MM_SHUFFLE(2,0,2,0)));
+        __m128i to = _mm_castps_si128(_mm_shuffle_ps(t0, t1, _MM_SHUFFLE(3,1,3,1)));
+        __m128i be = _mm_castps_si128(_mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2,0,2,0)));
+        __m128i bo = _mm_castps_si128(_mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3,1,3,1)));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(te, zero), _mm_unpacklo_epi8(to, zero)),
+                                   _mm_add_epi16(_mm_unpacklo_epi8(be, zero), _mm_unpacklo_epi8(bo, zero)));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(te, zero), _mm_unpackhi_epi8(to, zero)),
+                                   _mm_add_epi16(_mm_unpackhi_epi8(be, zero), _mm_unpackhi_epi8(bo, zero)));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 2);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packus_epi16(lo, hi));
+    }
+    downsample_2x_scalar(top + 2 * i, bottom + 2 * i, out + i, count - i);
+}
+
+static std::size_t compare_sse2(unsigned const* a, unsigned const* b, std::size_t count,
+                                unsigned threshold, unsigned mask, unsigned * diff)
+{
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const thr = _mm_set1_epi8(static_cast<char>(threshold));
+    __m128i const channels = _mm_set1_epi32(static_cast<int>(mask));
+    __m128i const red = _mm_set1_epi32(static_cast<int>(0xff0000ff));
+    // each lane goes down by one per matching pixel
+    __m128i matches = zero;
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i pa = _mm_loadu_si128(reinterpret_cast<__m128i const*>(a + i));
+        __m128i pb = _mm_loadu_si128(reinterpret_cast<__m128i const*>(b + i));
+        // |a - b| per byte, then what is left above the threshold
+        __m128i d = _mm_or_si128(_mm_subs_epu8(pa, pb), _mm_subs_epu8(pb, pa));
+        __m128i over = _mm_and_si128(_mm_subs_epu8(d, thr), channels);
+        __m128i same = _mm_cmpeq_epi32(over, zero);
+        matches = _mm_add_epi32(matches, same);
+        if (diff)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(diff + i), _mm_andnot_si128(same, red));
+        }
+    }
+    unsigned lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), _mm_sub_epi32(zero, matches));
+    std::size_t mismatched = i - (static_cast<std::size_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3]);
+    return mismatched + compare_scalar(a + i, b + i, count - i, threshold, mask, diff ? diff + i : 0);
+}
+
+#endif // NODE_MAPNIK_SSE2
+
+#if defined(NODE_MAPNIK_AVX2)
+
+// 256 bit unpacks and packs work within 128 bit lanes, the unpack/pack
+// pairs below undo each other so pixel order is kept
+
+NODE_MAPNIK_TARGET_AVX2
+static void premultiply_avx2(unsigned * pixels, std::size_t count)
+{
+    __m256i const zero = _mm256_setzero_si256();
+    __m256i const round = _mm256_set1_epi16(255);
+    __m256i const alpha_mask = _mm256_set1_epi32(0xff000000);
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i px = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(pixels + i));
+        __m256i lo = _mm256_unpacklo_epi8(px, zero);
+        __m256i hi = _mm256_unpackhi_epi8(px, zero);
+        __m256i alo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+        __m256i ahi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+        lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(lo, alo), round), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(hi, ahi), round), 8);
+        __m256i out = _mm256_packus_epi16(lo, hi);
+        out = _mm256_blendv_epi8(out, px, alpha_mask);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(pixels + i), out);
+    }
+    premultiply_scalar(pixels + i, count - i);
+}
+
+NODE_MAPNIK_TARGET_AVX2
+static inline __m256i demultiply_pixels_avx2(__m256i px)
+{
+    __m256 v = _mm256_cvtepi32_ps(px);
+    __m256 a = _mm256_shuffle_ps(v, v, _MM_SHUFFLE(3,3,3,3));
+    __m256 q = _mm256_div_ps(_mm256_mul_ps(v, _mm256_set1_ps(255.0f)), a);
+    __m256 zero_alpha = _mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_EQ_OQ);
+    return _mm256_andnot_si256(_mm256_castps_si256(zero_alpha), _mm256_cvttps_epi32(_mm256_andnot_ps(zero_alpha, q)));
+}
+
+NODE_MAPNIK_TARGET_AVX2
+static void demultiply_avx2(unsigned * pixels, std::size_t count)
+{
+    __m256i const zero = _mm256_setzero_si256();
+    __m256i const alpha_mask = _mm256_set1_epi32(0xff000000);
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i px = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(pixels + i));
+        __m256i lo = _mm256_unpacklo_epi8(px, zero);
+        __m256i hi = _mm256_unpackhi_epi8(px, zero);
+        __m256i p0 = demultiply_pixels_avx2(_mm256_unpacklo_epi16(lo, zero));
+        __m256i p1 = demultiply_pixels_avx2(_mm256_unpackhi_epi16(lo, zero));
+        __m256i p2 = demultiply_pixels_avx2(_mm256_unpacklo_epi16(hi, zero));
+        __m256i p3 = demultiply_pixels_avx2(_mm256_unpackhi_epi16(hi, zero));
+        __m256i out = _mm256_packus_epi16(_mm256_packs_epi32(p0, p1), _mm256_packs_epi32(p2, p3));
+        out = _mm256_blendv_epi8(out, px, alpha_mask);
+        __m256i transparent = _mm256_cmpeq_epi32(_mm256_and_si256(px, alpha_mask), zero);
+        out = _mm256_andnot_si256(transparent, out);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(pixels + i), out);
+    }
+    demultiply_scalar(pixels + i, count - i);
+}
+
+NODE_MAPNIK_TARGET_AVX2
+static inline __m128i grayscale_avx2(__m128i r, __m128i g, __m128i b)
+{
+    __m256d sum = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(r), _mm256_set1_pd(.3)),
+                                              _mm256_mul_pd(_mm256_cvtepi32_pd(g), _mm256_set1_pd(.59))),
+                                _mm256_mul_pd(_mm256_cvtepi32_pd(b), _mm256_set1_pd(.11)));
+    return _mm256_cvttpd_epi32(sum);
+}
+
+NODE_MAPNIK_TARGET_AVX2
+static void grayscale_to_alpha_avx2(unsigned * pixels, std::size_t count, unsigned color)
+{
+    __m256i const channel = _mm256_set1_epi32(0xff);
+    __m256i const fill = _mm256_set1_epi32(static_cast<int>(color));
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i px = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(pixels + i));
+        __m256i r = _mm256_and_si256(px, channel);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(px, 8), channel);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(px, 16), channel);
+        __m128i a_lo = grayscale_avx2(_mm256_castsi256_si128(r),
+                                      _mm256_castsi256_si128(g),
+                                      _mm256_castsi256_si128(b));
+        __m128i a_hi = grayscale_avx2(_mm256_extracti128_si256(r, 1),
+                                      _mm256_extracti128_si256(g, 1),
+                                      _mm256_extracti128_si256(b, 1));
+        __m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(a_lo), a_hi, 1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(pixels + i), _mm256_or_si256(_mm256_slli_epi32(a, 24), fill));
+    }
+    grayscale_to_alpha_scalar(pixels + i, count - i, color);
+}
+
+#endif // NODE_MAPNIK_AVX2
+
+#if defined(NODE_MAPNIK_NEON)
+
+static void premultiply_neon(unsigned * pixels, std::size_t count)
+{
+    uint16x8_t const round = vdupq_n_u16(255);
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        uint8_t * p = reinterpret_cast<uint8_t *>(pixels + i);
+        uint8x8x4_t px = vld4_u8(p);
+        px.val[0] = vshrn_n_u16(vaddq_u16(vmull_u8(px.val[0], px.val[3]), round), 8);
+        px.val[1] = vshrn_n_u16(vaddq_u16(vmull_u8(px.val[1], px.val[3]), round), 8);
+        px.val[2] = vshrn_n_u16(vaddq_u16(vmull_u8(px.val[2], px.val[3]), round), 8);
+        vst4_u8(p, px);
+    }
+    premultiply_scalar(pixels + i, count - i);
+}
+
+#if defined(__aarch64__)
+
+// armv7 neon has no exact float division, only aarch64 gets this one
+static inline uint32x4_t demultiply_neon_half(uint32x4_t c, uint32x4_t a)
+{
+    float32x4_t af = vcvtq_f32_u32(a);
+    float32x4_t q = vdivq_f32(vmulq_n_f32(vcvtq_f32_u32(c), 255.0f), af);
+    uint32x4_t zero_alpha = vceqq_u32(a, vdupq_n_u32(0));
+    return vbicq_u32(vcvtq_u32_f32(vbslq_f32(zero_alpha, vdupq_n_f32(0.0f), q)), zero_alpha);
+}
+
+static inline uint8x8_t demultiply_neon_channel(uint8x8_t c, uint8x8_t a)
+{
+    uint16x8_t c16 = vmovl_u8(c);
+    uint16x8_t a16 = vmovl_u8(a);
+    uint32x4_t lo = demultiply_neon_half(vmovl_u16(vget_low_u16(c16)), vmovl_u16(vget_low_u16(a16)));
+    uint32x4_t hi = demultiply_neon_half(vmovl_u16(vget_high_u16(c16)), vmovl_u16(vget_high_u16(a16)));
+    // saturating narrows clamp quotients above 255
+    return vqmovn_u16(vcombine_u16(vqmovn_u32(lo), vqmovn_u32(hi)));
+}
+
+static void demultiply_neon(unsigned * pixels, std::size_t count)
+{
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        uint8_t * p = reinterpret_cast<uint8_t *>(pixels + i);
+        uint8x8x4_t px = vld4_u8(p);
+        px.val[0] = demultiply_neon_channel(px.val[0], px.val[3]);
+        px.val[1] = demultiply_neon_channel(px.val[1], px.val[3]);
+        px.val[2] = demultiply_neon_channel(px.val[2], px.val[3]);
+        vst4_u8(p, px);
+    }
+    demultiply_scalar(pixels + i, count - i);
+}
+
+#endif // __aarch64__
+
+static void downsample_2x_neon(unsigned const* top, unsigned const* bottom, unsigned * out, std::size_t count)
+{
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        // vld2 splits even and odd pixels
+        uint32x4x2_t t = vld2q_u32(top + 2 * i);
+        uint32x4x2_t b = vld2q_u32(bottom + 2 * i);
+        uint8x16_t te = vreinterpretq_u8_u32(t.val[0]);
+        uint8x16_t to = vreinterpretq_u8_u32(t.val[1]);
+        uint8x16_t be = vreinterpretq_u8_u32(b.val[0]);
+        uint8x16_t bo = vreinterpretq_u8_u32(b.val[1]);
+        uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(te), vget_low_u8(to)),
+                                  vaddl_u8(vget_low_u8(be), vget_low_u8(bo)));
+        uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(te), vget_high_u8(to)),
+                                  vaddl_u8(vget_high_u8(be), vget_high_u8(bo)));
+        uint8x16_t px = vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2));
+        vst1q_u32(out + i, vreinterpretq_u32_u8(px));
+    }
+    downsample_2x_scalar(top + 2 * i, bottom + 2 * i, out + i, count - i);
+}
+
+static std::size_t compare_neon(unsigned const* a, unsigned const* b, std::size_t count,
+                                unsigned threshold, unsigned mask, unsigned * diff)
+{
+    uint8x16_t const thr = vdupq_n_u8(static_cast<uint8_t>(threshold));
+    uint32x4_t const channels = vdupq_n_u32(mask);
+    uint32x4_t const red = vdupq_n_u32(0xff0000ff);
+    // each lane counts the differing pixels it saw
+    uint32x4_t mismatches = vdupq_n_u32(0);
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        uint8x16_t d = vabdq_u8(vreinterpretq_u8_u32(vld1q_u32(a + i)),
+                                vreinterpretq_u8_u32(vld1q_u32(b + i)));
+        uint32x4_t over = vandq_u32(vreinterpretq_u32_u8(vcgtq_u8(d, thr)), channels);
+        uint32x4_t differs = vtstq_u32(over, over);
+        mismatches = vsubq_u32(mismatches, differs);
+        if (diff) vst1q_u32(diff + i, vandq_u32(differs, red));
+    }
+    std::size_t mismatched = static_cast<std::size_t>(vgetq_lane_u32(mismatches, 0)) +
+        vgetq_lane_u32(mismatches, 1) + vgetq_lane_u32(mismatches, 2) + vgetq_lane_u32(mismatches, 3);
+    return mismatched + compare_scalar(a + i, b + i, count - i, threshold, mask, diff ? diff + i : 0);
+}
+
+#endif // NODE_MAPNIK_NEON
+
+typedef void (*pixel_kernel)(unsigned *, std::size_t);
+typedef void (*fill_kernel)(unsigned *, std::size_t, unsigned);
+typedef void (*downsample_kernel)(unsigned const*, unsigned const*, unsigned *, std::size_t);
+typedef std::size_t (*compare_kernel)(unsigned const*, unsigned const*, std::size_t,
+                                      unsigned, unsigned, unsigned *);
+
+struct pixel_kernel_set
+{
+    char const* name;
+    pixel_kernel premultiply;
+    pixel_kernel demultiply;
+    fill_kernel grayscale_to_alpha;
+    downsample_kernel downsample_2x;
+    compare_kernel compare;
+};
+
+static pixel_kernel_set select_kernels()
+{
+    pixel_kernel_set k;
+    k.name = "scalar";
+    k.premultiply = premultiply_scalar;
+    k.demultiply = demultiply_scalar;
+    k.grayscale_to_alpha = grayscale_to_alpha_scalar;
+    k.downsample_2x = downsample_2x_scalar;
+    k.compare = compare_scalar;
+    // lets the tests compare the vector kernels with the scalar ones
+    char const* forced = std::getenv("NODE_MAPNIK_PIXEL_KERNELS");
+    if (forced && std::strcmp(forced, "scalar") == 0)
+    {
+        return k;
+    }
+#if defined(NODE_MAPNIK_SSE2)
+    k.name = "sse2";
+    k.premultiply = premultiply_sse2;
+    k.demultiply = demultiply_sse2;
+    k.grayscale_to_alpha = grayscale_to_alpha_sse2;
+    k.downsample_2x = downsample_2x_sse2;
+    k.compare = compare_sse2;
+#endif
+#if defined(NODE_MAPNIK_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        k.name = "avx2";
+        k.premultiply = premultiply_avx2;
+        k.demultiply = demultiply_avx2;
+        k.grayscale_to_alpha = grayscale_to_alpha_avx2;
+    }
+#endif
+#if defined(NODE_MAPNIK_NEON)
+    // grayscale stays scalar on arm: compilers there may contract its
+    // multiply-adds into fused ones in one version and not the other
+    k.name = "neon";
+    k.premultiply = premultiply_neon;
+    k.downsample_2x = downsample_2x_neon;
+    k.compare = compare_neon;
+#if defined(__aarch64__)
+    k.demultiply = demultiply_neon;
+#endif
+#endif
+    return k;
+}
+
+static pixel_kernel_set const& kernels()
+{
+    static pixel_kernel_set const k = select_kernels();
+    return k;
+}
+
+void premultiply_pixels(unsigned * pixels, std::size_t count)
+{
+    kernels().premultiply(pixels, count);
+}
+
+void demultiply_pixels(unsigned * pixels, std::size_t count)
+{
+    kernels().demultiply(pixels, count);
+}
+
+void grayscale_to_alpha_pixels(unsigned * pixels, std::size_t count, unsigned color)
+{
+    kernels().grayscale_to_alpha(pixels, count, color & 0xffffff);
+}
+
+void downsample_2x_pixels(unsigned const* top, unsigned const* bottom, unsigned * out, std::size_t count)
+{
+    kernels().downsample_2x(top, bottom, out, count);
+}
+
+std::size_t compare_pixels(unsigned const* a, unsigned const* b, std::size_t count,
+                           unsigned threshold, unsigned mask, unsigned * diff)
+{
+    return kernels().compare(a, b, count, threshold, mask, diff);
+}
+
+char const* pixel_kernels_name()
+{
+    return kernels().name;
+}
+
+}
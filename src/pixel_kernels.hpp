@@ -0,0 +1,45 @@
+#ifndef __NODE_MAPNIK_PIXEL_KERNELS_H__
+#define __NODE_MAPNIK_PIXEL_KERNELS_H__
+
+// stl
+#include <cstddef>
+
+namespace node_mapnik {
+
+/*
+ * Per-pixel kernels over image_32 data (rgba bytes, r in the low byte).
+ * Each has a scalar version and vector versions (sse2, avx2 or neon)
+ * chosen once at runtime from what the cpu supports; all versions give
+ * bit-identical results. Setting NODE_MAPNIK_PIXEL_KERNELS=scalar in the
+ * environment forces the scalar versions.
+ */
+
+// c = (c * a + 255) >> 8 for every colour channel, as agg's premultiply
+void premultiply_pixels(unsigned * pixels, std::size_t count);
+
+// c = min(255, c * 255 / a) for every colour channel, 0 where a is 0,
+// as agg's demultiply
+void demultiply_pixels(unsigned * pixels, std::size_t count);
+
+// replaces each pixel by `color` (alpha ignored) with the pixel's
+// grayscale value, (int)(r * .3 + g * .59 + b * .11), as alpha
+void grayscale_to_alpha_pixels(unsigned * pixels, std::size_t count, unsigned color);
+
+// writes `count` pixels to `out`, each the rounded mean of a 2x2 block:
+// pixels 2i and 2i+1 of the rows `top` and `bottom`
+void downsample_2x_pixels(unsigned const* top, unsigned const* bottom, unsigned * out, std::size_t count);
+
+// number of pixels of `a` and `b` differing by more than `threshold` in
+// any channel set in the per pixel byte `mask` (0x00ffffff for colour
+// only, 0xffffffff to include alpha). Unless NULL, `diff` receives
+// opaque red for each differing pixel and transparent black otherwise
+std::size_t compare_pixels(unsigned const* a, unsigned const* b, std::size_t count,
+                           unsigned threshold, unsigned mask, unsigned * diff);
+
+// name of the selected kernels: "avx2", "sse2", "neon" or "scalar",
+// exposed as mapnik.supports.pixel_kernels
+char const* pixel_kernels_name();
+
+}
+
+#endif // __NODE_MAPNIK_PIXEL_KERNELS_H__
@@ -0,0 +1,525 @@
+#include "png_encoder.hpp"
+#include "palette_lut.hpp"
+#include "parallel.hpp"
+#include "utils.hpp"
+
+// stl
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+using namespace v8;
+
+namespace node_mapnik {
+
+// filtered bytes deflated per piece, as in pigz
+static const std::size_t piece_size = 128 * 1024;
+
+// deflate window primed into each piece from the input before it
+static const std::size_t window_size = 32 * 1024;
+
+// rows filtered per parallel job
+static const unsigned filter_rows = 64;
+
+bool parse_png_options(Local<Value> const& value,
+                       png_options & options,
+                       std::string & error)
+{
+    if (!value->IsObject())
+    {
+        error = "option 'png' must be an object";
+        return false;
+    }
+    Local<Object> obj = value->ToObject();
+    if (obj->Has(String::New("level")))
+    {
+        Local<Value> level = obj->Get(String::New("level"));
+        if (!level->IsNumber() || level->NumberValue() != level->IntegerValue() || level->IntegerValue() < -1 || level->IntegerValue() > 9)
+        {
+            error = "png option 'level' must be an integer between -1 and 9";
+            return false;
+        }
+        options.level = static_cast<int>(level->IntegerValue());
+    }
+    if (obj->Has(String::New("strategy")))
+    {
+        Local<Value> strategy = obj->Get(String::New("strategy"));
+        std::string name = strategy->IsString() ? TOSTR(strategy) : "";
+        if (name == "default") options.strategy = Z_DEFAULT_STRATEGY;
+        else if (name == "filtered") options.strategy = Z_FILTERED;
+        else if (name == "huffman") options.strategy = Z_HUFFMAN_ONLY;
+        else if (name == "rle") options.strategy = Z_RLE;
+        else if (name == "fixed") options.strategy = Z_FIXED;
+        else
+        {
+            error = "png option 'strategy' must be one of 'default', 'filtered', 'huffman', 'rle' or 'fixed'";
+            return false;
+        }
+    }
+    if (obj->Has(String::New("filter")))
+    {
+        Local<Value> filter = obj->Get(String::New("filter"));
+        std::string name = filter->IsString() ? TOSTR(filter) : "";
+        if (name == "none") options.filter = png_filter_none;
+        else if (name == "sub") options.filter = png_filter_sub;
+        else if (name == "up") options.filter = png_filter_up;
+        else if (name == "average") options.filter = png_filter_average;
+        else if (name == "paeth") options.filter = png_filter_paeth;
+        else if (name == "adaptive") options.filter = png_filter_adaptive;
+        else
+        {
+            error = "png option 'filter' must be one of 'none', 'sub', 'up', 'average', 'paeth' or 'adaptive'";
+            return false;
+        }
+    }
+    if (obj->Has(String::New("threads")))
+    {
+        Local<Value> threads = obj->Get(String::New("threads"));
+        if (!threads->IsNumber() || threads->NumberValue() != threads->IntegerValue() || threads->IntegerValue() < 0)
+        {
+            error = "png option 'threads' must be a positive integer, or 0 for one per core";
+            return false;
+        }
+        options.threads = static_cast<unsigned>(threads->IntegerValue());
+    }
+    return true;
+}
+
+static inline unsigned char paeth_predictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return static_cast<unsigned char>(a);
+    if (pb <= pc) return static_cast<unsigned char>(b);
+    return static_cast<unsigned char>(c);
+}
+
+static void filter_row_with(png_filter filter,
+                            unsigned char const* row,
+                            unsigned char const* prev,
+                            std::size_t row_bytes,
+                            unsigned char * out)
+{
+    out[0] = static_cast<unsigned char>(filter);
+    unsigned char * dst = out + 1;
+    switch (filter)
+    {
+    case png_filter_sub:
+        for (std::size_t i = 0; i < row_bytes; ++i)
+        {
+            dst[i] = static_cast<unsigned char>(row[i] - (i >= 4 ? row[i - 4] : 0));
+        }
+        break;
+    case png_filter_up:
+        for (std::size_t i = 0; i < row_bytes; ++i)
+        {
+            dst[i] = static_cast<unsigned char>(row[i] - (prev ? prev[i] : 0));
+        }
+        break;
+    case png_filter_average:
+        for (std::size_t i = 0; i < row_bytes; ++i)
+        {
+            int left = i >= 4 ? row[i - 4] : 0;
+            int up = prev ? prev[i] : 0;
+            dst[i] = static_cast<unsigned char>(row[i] - ((left + up) >> 1));
+        }
+        break;
+    case png_filter_paeth:
+        for (std::size_t i = 0; i < row_bytes; ++i)
+        {
+            int left = i >= 4 ? row[i - 4] : 0;
+            int up = prev ? prev[i] : 0;
+            int up_left = (prev && i >= 4) ? prev[i - 4] : 0;
+            dst[i] = static_cast<unsigned char>(row[i] - paeth_predictor(left, up, up_left));
+        }
+        break;
+    default:
+        std::memcpy(dst, row, row_bytes);
+        break;
+    }
+}
+
+void png_filter_row(png_filter filter,
+                    unsigned char const* row,
+                    unsigned char const* prev,
+                    std::size_t row_bytes,
+                    unsigned char * out,
+                    unsigned char * scratch)
+{
+    if (filter != png_filter_adaptive)
+    {
+        filter_row_with(filter, row, prev, row_bytes, out);
+        return;
+    }
+    // libpng's heuristic: keep the filter with the smallest sum of
+    // absolute values of the filtered bytes taken as signed
+    std::size_t line_bytes = row_bytes + 1;
+    unsigned best = 0;
+    unsigned long best_sum = 0;
+    for (unsigned f = png_filter_none; f <= png_filter_paeth; ++f)
+    {
+        unsigned char * candidate = scratch + f * line_bytes;
+        filter_row_with(static_cast<png_filter>(f), row, prev, row_bytes, candidate);
+        unsigned long sum = 0;
+        for (std::size_t i = 1; i < line_bytes; ++i)
+        {
+            sum += std::abs(static_cast<int>(static_cast<signed char>(candidate[i])));
+        }
+        if (f == png_filter_none || sum < best_sum)
+        {
+            best = f;
+            best_sum = sum;
+        }
+    }
+    std::memcpy(out, scratch + best * line_bytes, line_bytes);
+}
+
+// filters a block of `filter_rows` rows into its place in `filtered`
+struct png_filter_task
+{
+    png_filter_task(mapnik::image_data_32 const& data,
+                    png_filter filter,
+                    std::vector<unsigned char> & filtered)
+        : data_(data),
+          filter_(filter),
+          filtered_(filtered) {}
+
+    void operator() (std::size_t block)
+    {
+        std::size_t row_bytes = static_cast<std::size_t>(data_.width()) * 4;
+        std::vector<unsigned char> scratch;
+        if (filter_ == png_filter_adaptive) scratch.resize(5 * (row_bytes + 1));
+        unsigned begin = static_cast<unsigned>(block) * filter_rows;
+        unsigned end = std::min(begin + filter_rows, data_.height());
+        for (unsigned y = begin; y < end; ++y)
+        {
+            unsigned char const* row = reinterpret_cast<unsigned char const*>(data_.getRow(y));
+            unsigned char const* prev = y > 0 ? reinterpret_cast<unsigned char const*>(data_.getRow(y - 1)) : NULL;
+            png_filter_row(filter_, row, prev, row_bytes,
+                           &filtered_[y * (row_bytes + 1)],
+                           scratch.empty() ? NULL : &scratch[0]);
+        }
+    }
+
+    mapnik::image_data_32 const& data_;
+    png_filter filter_;
+    std::vector<unsigned char> & filtered_;
+};
+
+// deflates one piece of the filtered image as raw deflate data
+struct png_deflate_task
+{
+    png_deflate_task(std::vector<unsigned char> const& filtered,
+                     std::size_t piece_bytes,
+                     png_options const& options,
+                     std::vector<std::vector<unsigned char> > & pieces,
+                     std::vector<uLong> & checksums)
+        : filtered_(filtered),
+          piece_bytes_(piece_bytes),
+          options_(options),
+          pieces_(pieces),
+          checksums_(checksums) {}
+
+    void operator() (std::size_t i)
+    {
+        std::size_t begin = i * piece_bytes_;
+        std::size_t size = std::min(piece_bytes_, filtered_.size() - begin);
+        bool last = (i + 1 == pieces_.size());
+        Bytef * input = const_cast<Bytef *>(&filtered_[begin]);
+
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, options_.level, Z_DEFLATED, -15, 8, options_.strategy) != Z_OK)
+        {
+            throw std::runtime_error("png: could not initialize deflate");
+        }
+        if (begin > 0)
+        {
+            std::size_t dict = std::min(begin, window_size);
+            if (deflateSetDictionary(&zs, input - dict, static_cast<uInt>(dict)) != Z_OK)
+            {
+                deflateEnd(&zs);
+                throw std::runtime_error("png: could not prime deflate");
+            }
+        }
+
+        // earlier pieces end on a byte boundary with a sync flush, only
+        // the last one closes the stream
+        std::vector<unsigned char> & piece = pieces_[i];
+        std::size_t used = 0;
+        piece.resize(deflateBound(&zs, static_cast<uLong>(size)) + 16);
+        zs.next_in = input;
+        zs.avail_in = static_cast<uInt>(size);
+        int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+        for (;;)
+        {
+            zs.next_out = &piece[used];
+            zs.avail_out = static_cast<uInt>(piece.size() - used);
+            int ret = deflate(&zs, flush);
+            used = piece.size() - zs.avail_out;
+            // Z_BUF_ERROR only means the output buffer filled up
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            {
+                deflateEnd(&zs);
+                throw std::runtime_error("png: deflate failed");
+            }
+            if (last ? ret == Z_STREAM_END : (zs.avail_in == 0 && zs.avail_out != 0))
+            {
+                break;
+            }
+            piece.resize(piece.size() * 2);
+        }
+        // pieces left open by a sync flush report Z_DATA_ERROR here,
+        // only the finished last one can be checked
+        if (deflateEnd(&zs) != Z_OK && last)
+        {
+            throw std::runtime_error("png: deflate failed");
+        }
+        piece.resize(used);
+        checksums_[i] = adler32(adler32(0L, Z_NULL, 0), input, static_cast<uInt>(size));
+    }
+
+    std::vector<unsigned char> const& filtered_;
+    std::size_t piece_bytes_;
+    png_options const& options_;
+    std::vector<std::vector<unsigned char> > & pieces_;
+    std::vector<uLong> & checksums_;
+};
+
+// threads to encode with: one per core for 0, never more than the cores
+static unsigned encode_threads(png_options const& options)
+{
+    unsigned cores = hardware_concurrency();
+    return options.threads > 0 ? std::min(options.threads, cores) : cores;
+}
+
+static void put_uint32(unsigned char * out, unsigned long value)
+{
+    out[0] = static_cast<unsigned char>((value >> 24) & 0xff);
+    out[1] = static_cast<unsigned char>((value >> 16) & 0xff);
+    out[2] = static_cast<unsigned char>((value >> 8) & 0xff);
+    out[3] = static_cast<unsigned char>(value & 0xff);
+}
+
+// appends a chunk made of `prefix` followed by `data`
+static void append_chunk(std::string & out,
+                         char const* type,
+                         unsigned char const* prefix, std::size_t prefix_size,
+                         unsigned char const* data, std::size_t size)
+{
+    unsigned char header[8];
+    put_uint32(header, static_cast<unsigned long>(prefix_size + size));
+    std::memcpy(header + 4, type, 4);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, header + 4, 4);
+    if (prefix_size > 0) crc = crc32(crc, prefix, static_cast<uInt>(prefix_size));
+    if (size > 0) crc = crc32(crc, data, static_cast<uInt>(size));
+    unsigned char footer[4];
+    put_uint32(footer, crc);
+
+    out.append(reinterpret_cast<char const*>(header), 8);
+    if (prefix_size > 0) out.append(reinterpret_cast<char const*>(prefix), prefix_size);
+    if (size > 0) out.append(reinterpret_cast<char const*>(data), size);
+    out.append(reinterpret_cast<char const*>(footer), 4);
+}
+
+// appends the signature and IHDR of a non-interlaced png
+static void append_header(std::string & out,
+                          unsigned width,
+                          unsigned height,
+                          unsigned char bit_depth,
+                          unsigned char color_type)
+{
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    out.append(reinterpret_cast<char const*>(signature), 8);
+
+    unsigned char ihdr[13];
+    put_uint32(ihdr, width);
+    put_uint32(ihdr + 4, height);
+    ihdr[8] = bit_depth;
+    ihdr[9] = color_type;
+    ihdr[10] = 0;  // deflate
+    ihdr[11] = 0;  // adaptive filtering
+    ihdr[12] = 0;  // no interlace
+    append_chunk(out, "IHDR", NULL, 0, ihdr, sizeof(ihdr));
+}
+
+// deflates filtered scanlines of `line_bytes` bytes each in parallel
+// pieces and appends them to `out` as IDAT chunks
+static void append_image_data(std::string & out,
+                              std::vector<unsigned char> const& filtered,
+                              std::size_t line_bytes,
+                              png_options const& options,
+                              unsigned threads)
+{
+    // pieces hold whole rows so a piece boundary never splits a scanline
+    std::size_t piece_rows = std::max<std::size_t>(1, piece_size / line_bytes);
+    std::size_t piece_bytes = piece_rows * line_bytes;
+    std::size_t piece_count = (filtered.size() + piece_bytes - 1) / piece_bytes;
+    std::vector<std::vector<unsigned char> > pieces(piece_count);
+    std::vector<uLong> checksums(piece_count);
+    png_deflate_task deflate_task(filtered, piece_bytes, options, pieces, checksums);
+    parallel_for(piece_count, deflate_task, threads);
+
+    uLong checksum = checksums[0];
+    std::size_t compressed = pieces[0].size();
+    for (std::size_t i = 1; i < piece_count; ++i)
+    {
+        std::size_t size = std::min(piece_bytes, filtered.size() - i * piece_bytes);
+        checksum = adler32_combine(checksum, checksums[i], static_cast<z_off_t>(size));
+        compressed += pieces[i].size();
+    }
+    out.reserve(out.size() + compressed + piece_count * 12 + 6 + 12);
+
+    // one IDAT per piece, the zlib header goes in front of the first and
+    // the adler32 of the whole stream after the last
+    static const unsigned char zlib_header[2] = { 0x78, 0x9c };
+    unsigned char trailer[4];
+    put_uint32(trailer, checksum);
+    for (std::size_t i = 0; i < piece_count; ++i)
+    {
+        std::vector<unsigned char> & piece = pieces[i];
+        if (i + 1 == piece_count) piece.insert(piece.end(), trailer, trailer + 4);
+        append_chunk(out, "IDAT",
+                     i == 0 ? zlib_header : NULL, i == 0 ? 2 : 0,
+                     piece.empty() ? NULL : &piece[0], piece.size());
+        std::vector<unsigned char>().swap(piece);
+    }
+}
+
+void encode_png(mapnik::image_data_32 const& data,
+                png_options const& options,
+                std::string & out)
+{
+    unsigned width = data.width();
+    unsigned height = data.height();
+    if (width == 0 || height == 0)
+    {
+        throw std::runtime_error("png: cannot encode an empty image");
+    }
+    unsigned threads = encode_threads(options);
+    std::size_t line_bytes = static_cast<std::size_t>(width) * 4 + 1;
+
+    std::vector<unsigned char> filtered(line_bytes * height);
+    png_filter_task filter_task(data, options.filter, filtered);
+    parallel_for((height + filter_rows - 1) / filter_rows, filter_task, threads);
+
+    out.clear();
+    append_header(out, width, height, 8, 6);
+    append_image_data(out, filtered, line_bytes, options, threads);
+    append_chunk(out, "IEND", NULL, 0, NULL, 0);
+}
+
+// maps a block of `filter_rows` rows to packed palette indices
+struct png_index_task
+{
+    png_index_task(mapnik::image_data_32 const& data,
+                   palette_lut const& lut,
+                   unsigned bit_depth,
+                   std::size_t line_bytes,
+                   std::vector<unsigned char> & lines)
+        : data_(data),
+          lut_(lut),
+          bit_depth_(bit_depth),
+          line_bytes_(line_bytes),
+          lines_(lines) {}
+
+    void operator() (std::size_t block)
+    {
+        unsigned width = data_.width();
+        unsigned begin = static_cast<unsigned>(block) * filter_rows;
+        unsigned end = std::min(begin + filter_rows, data_.height());
+        unsigned per_byte = 8 / bit_depth_;
+        for (unsigned y = begin; y < end; ++y)
+        {
+            unsigned const* row = data_.getRow(y);
+            // palette images compress best unfiltered
+            unsigned char * line = &lines_[y * line_bytes_];
+            line[0] = png_filter_none;
+            unsigned char * dst = line + 1;
+            if (bit_depth_ == 8)
+            {
+                for (unsigned x = 0; x < width; ++x)
+                {
+                    dst[x] = lut_(row[x]);
+                }
+                continue;
+            }
+            std::memset(dst, 0, line_bytes_ - 1);
+            for (unsigned x = 0; x < width; ++x)
+            {
+                unsigned shift = 8 - bit_depth_ * (x % per_byte + 1);
+                dst[x / per_byte] |= static_cast<unsigned char>(lut_(row[x]) << shift);
+            }
+        }
+    }
+
+    mapnik::image_data_32 const& data_;
+    palette_lut const& lut_;
+    unsigned bit_depth_;
+    std::size_t line_bytes_;
+    std::vector<unsigned char> & lines_;
+};
+
+void encode_png8(mapnik::image_data_32 const& data,
+                 palette_lut & lut,
+                 png_options const& options,
+                 std::string & out)
+{
+    unsigned width = data.width();
+    unsigned height = data.height();
+    if (width == 0 || height == 0)
+    {
+        throw std::runtime_error("png: cannot encode an empty image");
+    }
+    std::vector<mapnik::rgb> const& colors = lut.colors();
+    std::vector<unsigned> const& alpha = lut.alpha();
+    if (colors.empty() || colors.size() > 256)
+    {
+        throw std::runtime_error("png: palette must hold between 1 and 256 colors");
+    }
+    unsigned threads = encode_threads(options);
+    lut.build(threads);
+
+    // smallest bit depth that holds every index
+    unsigned bit_depth = 8;
+    if (colors.size() <= 2) bit_depth = 1;
+    else if (colors.size() <= 4) bit_depth = 2;
+    else if (colors.size() <= 16) bit_depth = 4;
+
+    std::size_t line_bytes = (static_cast<std::size_t>(width) * bit_depth + 7) / 8 + 1;
+    std::vector<unsigned char> lines(line_bytes * height);
+    png_index_task index_task(data, lut, bit_depth, line_bytes, lines);
+    parallel_for((height + filter_rows - 1) / filter_rows, index_task, threads);
+
+    out.clear();
+    append_header(out, width, height, static_cast<unsigned char>(bit_depth), 3);
+
+    std::vector<unsigned char> plte;
+    plte.reserve(colors.size() * 3);
+    for (std::size_t i = 0; i < colors.size(); ++i)
+    {
+        plte.push_back(colors[i].r);
+        plte.push_back(colors[i].g);
+        plte.push_back(colors[i].b);
+    }
+    append_chunk(out, "PLTE", NULL, 0, &plte[0], plte.size());
+    if (!alpha.empty())
+    {
+        std::vector<unsigned char> trns;
+        for (std::size_t i = 0; i < alpha.size() && i < colors.size(); ++i)
+        {
+            trns.push_back(static_cast<unsigned char>(alpha[i]));
+        }
+        append_chunk(out, "tRNS", NULL, 0, &trns[0], trns.size());
+    }
+
+    append_image_data(out, lines, line_bytes, options, threads);
+    append_chunk(out, "IEND", NULL, 0, NULL, 0);
+}
+
+}
@@ -0,0 +1,94 @@
+#ifndef __NODE_MAPNIK_PNG_ENCODER_H__
+#define __NODE_MAPNIK_PNG_ENCODER_H__
+
+// v8
+#include <v8.h>
+
+// mapnik
+#include <mapnik/image_data.hpp>        // for image_data_32
+
+// zlib
+#include <zlib.h>
+
+// stl
+#include <string>
+
+namespace node_mapnik {
+
+// png scanline filters, `png_filter_adaptive` picks one per row
+enum png_filter
+{
+    png_filter_none = 0,
+    png_filter_sub = 1,
+    png_filter_up = 2,
+    png_filter_average = 3,
+    png_filter_paeth = 4,
+    png_filter_adaptive = 5
+};
+
+struct png_options
+{
+    png_options()
+        : level(Z_DEFAULT_COMPRESSION),
+          strategy(Z_DEFAULT_STRATEGY),
+          filter(png_filter_adaptive),
+          threads(0) {}
+
+    int level;                      // zlib level, -1 to 9
+    int strategy;                   // zlib strategy
+    png_filter filter;
+    unsigned threads;               // 0 for one per core, capped at the cores
+};
+
+/*
+ * Parses the `png` encode option: {level, strategy, filter, threads}.
+ * `strategy` is one of "default", "filtered", "huffman", "rle" or
+ * "fixed" and `filter` one of "none", "sub", "up", "average", "paeth" or
+ * "adaptive". Returns false and sets `error` on invalid input.
+ */
+bool parse_png_options(v8::Local<v8::Value> const& value,
+                       png_options & options,
+                       std::string & error);
+
+/*
+ * Writes the scanline `row` of `row_bytes` bytes (4 bytes per pixel)
+ * filtered with `filter` into `out`, which receives the filter type byte
+ * followed by `row_bytes` filtered bytes. `prev` is the unfiltered row
+ * above or NULL for the first row. `scratch` must hold 5 * (row_bytes + 1)
+ * bytes when `filter` is png_filter_adaptive and is unused otherwise.
+ */
+void png_filter_row(png_filter filter,
+                    unsigned char const* row,
+                    unsigned char const* prev,
+                    std::size_t row_bytes,
+                    unsigned char * out,
+                    unsigned char * scratch);
+
+/*
+ * Encodes `data` as an RGBA png into `out`. Scanlines are filtered in
+ * parallel and the deflate stream is cut into independently compressed
+ * pieces, pigz style: each piece is primed with the 32k of input before
+ * it and ends on a byte boundary, so the pieces concatenate into a single
+ * valid zlib stream.
+ */
+void encode_png(mapnik::image_data_32 const& data,
+                png_options const& options,
+                std::string & out);
+
+class palette_lut;
+
+/*
+ * Encodes `data` as a palette png into `out`, mapping pixels to the
+ * palette of `lut` through its lookup table (built on first use, on
+ * `options.threads` threads). The bit depth is the smallest that holds
+ * the palette. `options.filter` is ignored: indexed scanlines are written
+ * unfiltered.
+ */
+void encode_png8(mapnik::image_data_32 const& data,
+                 palette_lut & lut,
+                 png_options const& options,
+                 std::string & out);
+
+}
+
+#endif // __NODE_MAPNIK_PNG_ENCODER_H__
@@ -0,0 +1,139 @@
+#include "png_stream_writer.hpp"
+#include "png_encoder.hpp"
+
+// stl
+#include <cstring>
+#include <stdexcept>
+
+namespace node_mapnik {
+
+static void put_uint32(unsigned char * out, unsigned long value)
+{
+    out[0] = static_cast<unsigned char>((value >> 24) & 0xff);
+    out[1] = static_cast<unsigned char>((value >> 16) & 0xff);
+    out[2] = static_cast<unsigned char>((value >> 8) & 0xff);
+    out[3] = static_cast<unsigned char>(value & 0xff);
+}
+
+png_stream_writer::png_stream_writer(std::ostream & stream,
+                                     unsigned width,
+                                     unsigned height,
+                                     int level)
+    : stream_(stream),
+      width_(width),
+      height_(height),
+      rows_written_(0),
+      finished_(false),
+      zs_(),
+      scanline_(1 + static_cast<std::size_t>(width) * 4),
+      out_(64 * 1024)
+{
+    zs_.zalloc = Z_NULL;
+    zs_.zfree = Z_NULL;
+    zs_.opaque = Z_NULL;
+    if (deflateInit(&zs_, level) != Z_OK)
+    {
+        throw std::runtime_error("png: could not initialize deflate");
+    }
+
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    stream_.write(reinterpret_cast<char const*>(signature), 8);
+
+    unsigned char ihdr[13];
+    put_uint32(ihdr, width_);
+    put_uint32(ihdr + 4, height_);
+    ihdr[8] = 8;   // bit depth
+    ihdr[9] = 6;   // rgba
+    ihdr[10] = 0;  // deflate
+    ihdr[11] = 0;  // adaptive filtering
+    ihdr[12] = 0;  // no interlace
+    write_chunk("IHDR", ihdr, sizeof(ihdr));
+}
+
+png_stream_writer::~png_stream_writer()
+{
+    deflateEnd(&zs_);
+}
+
+void png_stream_writer::write_rows(mapnik::image_data_32 const& data, unsigned y, unsigned rows)
+{
+    if (data.width() != width_)
+    {
+        throw std::runtime_error("png: row width does not match the image width");
+    }
+    for (unsigned r = 0; r < rows; ++r)
+    {
+        if (rows_written_ >= height_)
+        {
+            throw std::runtime_error("png: more rows written than the image height");
+        }
+        // the Sub filter only looks at the current row, so rows can be
+        // filtered without keeping the previous band around
+        unsigned char const* row = reinterpret_cast<unsigned char const*>(data.getRow(y + r));
+        png_filter_row(png_filter_sub, row, NULL, static_cast<std::size_t>(width_) * 4, &scanline_[0], NULL);
+        zs_.next_in = &scanline_[0];
+        zs_.avail_in = static_cast<uInt>(scanline_.size());
+        deflate_input(Z_NO_FLUSH);
+        ++rows_written_;
+    }
+}
+
+void png_stream_writer::finish()
+{
+    if (finished_) return;
+    if (rows_written_ != height_)
+    {
+        throw std::runtime_error("png: fewer rows written than the image height");
+    }
+    zs_.next_in = Z_NULL;
+    zs_.avail_in = 0;
+    deflate_input(Z_FINISH);
+    write_chunk("IEND", NULL, 0);
+    stream_.flush();
+    finished_ = true;
+}
+
+void png_stream_writer::deflate_input(int flush)
+{
+    for (;;)
+    {
+        zs_.next_out = &out_[0];
+        zs_.avail_out = static_cast<uInt>(out_.size());
+        int ret = deflate(&zs_, flush);
+        if (ret == Z_STREAM_ERROR)
+        {
+            throw std::runtime_error("png: deflate failed");
+        }
+        std::size_t produced = out_.size() - zs_.avail_out;
+        if (produced > 0)
+        {
+            write_chunk("IDAT", &out_[0], produced);
+        }
+        if (flush == Z_FINISH ? ret == Z_STREAM_END : zs_.avail_out != 0)
+        {
+            break;
+        }
+    }
+}
+
+void png_stream_writer::write_chunk(char const* type, unsigned char const* data, std::size_t size)
+{
+    unsigned char header[8];
+    put_uint32(header, static_cast<unsigned long>(size));
+    std::memcpy(header + 4, type, 4);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, header + 4, 4);
+    if (size > 0) crc = crc32(crc, data, static_cast<uInt>(size));
+    unsigned char footer[4];
+    put_uint32(footer, crc);
+
+    stream_.write(reinterpret_cast<char const*>(header), 8);
+    if (size > 0) stream_.write(reinterpret_cast<char const*>(data), size);
+    stream_.write(reinterpret_cast<char const*>(footer), 4);
+    if (stream_.fail())
+    {
+        throw std::runtime_error("png: could not write output");
+    }
+}
+
+}
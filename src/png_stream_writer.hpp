@@ -0,0 +1,58 @@
+#ifndef __NODE_MAPNIK_PNG_STREAM_WRITER_H__
+#define __NODE_MAPNIK_PNG_STREAM_WRITER_H__
+
+// mapnik
+#include <mapnik/image_data.hpp>        // for image_data_32
+
+// zlib
+#include <zlib.h>
+
+// boost
+#include <boost/noncopyable.hpp>
+
+// stl
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace node_mapnik {
+
+/*
+ * Minimal RGBA png encoder that accepts the image a few rows at a time, so
+ * an image taller than what fits in memory can be written band by band.
+ * Scanlines use the Sub filter and are deflated into IDAT chunks as they
+ * arrive; nothing but the current chunk is buffered.
+ */
+class png_stream_writer : private boost::noncopyable
+{
+public:
+    png_stream_writer(std::ostream & stream,
+                      unsigned width,
+                      unsigned height,
+                      int level = Z_DEFAULT_COMPRESSION);
+    ~png_stream_writer();
+
+    // appends `rows` rows of `data` starting at row `y`
+    void write_rows(mapnik::image_data_32 const& data, unsigned y, unsigned rows);
+
+    // writes the last IDAT chunk and IEND, throws if fewer rows than the
+    // image height were written
+    void finish();
+
+private:
+    void deflate_input(int flush);
+    void write_chunk(char const* type, unsigned char const* data, std::size_t size);
+
+    std::ostream & stream_;
+    unsigned width_;
+    unsigned height_;
+    unsigned rows_written_;
+    bool finished_;
+    z_stream zs_;
+    std::vector<unsigned char> scanline_;
+    std::vector<unsigned char> out_;
+};
+
+}
+
+#endif // __NODE_MAPNIK_PNG_STREAM_WRITER_H__
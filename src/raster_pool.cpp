@@ -0,0 +1,240 @@
+#include "raster_pool.hpp"
+
+// mapnik
+#include <mapnik/image_data.hpp>
+
+namespace node_mapnik {
+
+namespace {
+
+std::size_t image_bytes(unsigned width, unsigned height)
+{
+    return static_cast<std::size_t>(width) * height * 4;
+}
+
+std::size_t grid_bytes(unsigned width, unsigned height)
+{
+    return static_cast<std::size_t>(width) * height * sizeof(mapnik::grid::value_type);
+}
+
+}
+
+raster_pool & raster_pool::instance()
+{
+    // intentionally leaked: pooled objects may still be released by
+    // shared_ptrs destroyed during exit
+    static raster_pool * pool = new raster_pool();
+    return *pool;
+}
+
+raster_pool::raster_pool()
+    : images_(),
+      grids_(),
+      max_bytes_(64 * 1024 * 1024),
+      bytes_(0),
+      size_(0),
+      hits_(0),
+      misses_(0)
+{
+    uv_mutex_init(&mutex_);
+}
+
+raster_pool::~raster_pool()
+{
+    clear();
+    uv_mutex_destroy(&mutex_);
+}
+
+MAPNIK_SHARED_PTR<mapnik::image_32> raster_pool::acquire_image(unsigned width, unsigned height)
+{
+    mapnik::image_32 * image = 0;
+    uv_mutex_lock(&mutex_);
+    image_map::iterator itr = images_.find(size_class(width, height));
+    if (itr != images_.end() && !itr->second.empty())
+    {
+        image = itr->second.back();
+        itr->second.pop_back();
+        bytes_ -= image_bytes(width, height);
+        --size_;
+        ++hits_;
+    }
+    else
+    {
+        ++misses_;
+    }
+    uv_mutex_unlock(&mutex_);
+
+    if (image)
+    {
+        // images with a background are never pooled, see release
+        image->data().set(0);
+        image->painted(false);
+    }
+    else
+    {
+        image = new mapnik::image_32(width, height);
+    }
+    return MAPNIK_SHARED_PTR<mapnik::image_32>(image, image_deleter());
+}
+
+MAPNIK_SHARED_PTR<mapnik::grid> raster_pool::acquire_grid(unsigned width,
+                                                            unsigned height,
+                                                            std::string const& key,
+                                                            unsigned resolution)
+{
+    mapnik::grid * grid = 0;
+    uv_mutex_lock(&mutex_);
+    grid_map::iterator itr = grids_.find(size_class(width, height));
+    if (itr != grids_.end() && !itr->second.empty())
+    {
+        grid = itr->second.back();
+        itr->second.pop_back();
+        bytes_ -= grid_bytes(width, height);
+        --size_;
+        ++hits_;
+    }
+    else
+    {
+        ++misses_;
+    }
+    uv_mutex_unlock(&mutex_);
+
+    if (grid)
+    {
+        // cleared when it was released
+        grid->set_key(key);
+        grid->set_resolution(resolution);
+    }
+    else
+    {
+        grid = new mapnik::grid(width, height, key, resolution);
+    }
+    return MAPNIK_SHARED_PTR<mapnik::grid>(grid, grid_deleter());
+}
+
+void raster_pool::image_deleter::operator()(mapnik::image_32 * image) const
+{
+    raster_pool::instance().release(image);
+}
+
+void raster_pool::grid_deleter::operator()(mapnik::grid * grid) const
+{
+    raster_pool::instance().release(grid);
+}
+
+void raster_pool::release(mapnik::image_32 * image)
+{
+    // a background cannot be unset again, so such an image could not be
+    // handed out in the state of a freshly constructed one
+    if (image->get_background())
+    {
+        delete image;
+        return;
+    }
+    std::size_t bytes = image_bytes(image->width(), image->height());
+    uv_mutex_lock(&mutex_);
+    if (bytes > 0 && bytes_ + bytes <= max_bytes_)
+    {
+        images_[size_class(image->width(), image->height())].push_back(image);
+        bytes_ += bytes;
+        ++size_;
+        image = 0;
+    }
+    uv_mutex_unlock(&mutex_);
+    delete image;
+}
+
+void raster_pool::release(mapnik::grid * grid)
+{
+    std::size_t bytes = grid_bytes(grid->width(), grid->height());
+    if (bytes == 0 || bytes > max_bytes())
+    {
+        delete grid;
+        return;
+    }
+    // drop the features now rather than keeping them alive in the pool
+    grid->clear();
+    uv_mutex_lock(&mutex_);
+    if (bytes_ + bytes <= max_bytes_)
+    {
+        grids_[size_class(grid->width(), grid->height())].push_back(grid);
+        bytes_ += bytes;
+        ++size_;
+        grid = 0;
+    }
+    uv_mutex_unlock(&mutex_);
+    delete grid;
+}
+
+void raster_pool::clear()
+{
+    image_map images;
+    grid_map grids;
+    uv_mutex_lock(&mutex_);
+    images.swap(images_);
+    grids.swap(grids_);
+    bytes_ = 0;
+    size_ = 0;
+    uv_mutex_unlock(&mutex_);
+
+    for (image_map::iterator itr = images.begin(); itr != images.end(); ++itr)
+    {
+        for (std::size_t i = 0; i < itr->second.size(); ++i) delete itr->second[i];
+    }
+    for (grid_map::iterator itr = grids.begin(); itr != grids.end(); ++itr)
+    {
+        for (std::size_t i = 0; i < itr->second.size(); ++i) delete itr->second[i];
+    }
+}
+
+void raster_pool::set_max_bytes(std::size_t max_bytes)
+{
+    uv_mutex_lock(&mutex_);
+    max_bytes_ = max_bytes;
+    bool over = bytes_ > max_bytes_;
+    uv_mutex_unlock(&mutex_);
+    // shrinking empties the pool, it refills from later releases
+    if (over) clear();
+}
+
+std::size_t raster_pool::max_bytes() const
+{
+    uv_mutex_lock(&mutex_);
+    std::size_t max_bytes = max_bytes_;
+    uv_mutex_unlock(&mutex_);
+    return max_bytes;
+}
+
+std::size_t raster_pool::bytes() const
+{
+    uv_mutex_lock(&mutex_);
+    std::size_t bytes = bytes_;
+    uv_mutex_unlock(&mutex_);
+    return bytes;
+}
+
+std::size_t raster_pool::size() const
+{
+    uv_mutex_lock(&mutex_);
+    std::size_t size = size_;
+    uv_mutex_unlock(&mutex_);
+    return size;
+}
+
+unsigned long raster_pool::hits() const
+{
+    uv_mutex_lock(&mutex_);
+    unsigned long hits = hits_;
+    uv_mutex_unlock(&mutex_);
+    return hits;
+}
+
+unsigned long raster_pool::misses() const
+{
+    uv_mutex_lock(&mutex_);
+    unsigned long misses = misses_;
+    uv_mutex_unlock(&mutex_);
+    return misses;
+}
+
+}
@@ -0,0 +1,78 @@
+#ifndef __NODE_MAPNIK_RASTER_POOL_H__
+#define __NODE_MAPNIK_RASTER_POOL_H__
+
+// libuv
+#include <uv.h>
+
+// mapnik
+#include <mapnik/graphics.hpp>          // for image_32
+#include <mapnik/grid/grid.hpp>         // for grid
+
+#include "mapnik3x_compatibility.hpp"
+
+// boost
+#include MAPNIK_SHARED_INCLUDE
+#include <boost/noncopyable.hpp>
+
+// stl
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace node_mapnik {
+
+/*
+ * Process-wide pool recycling image_32 and grid objects by size class
+ * (width and height). Objects handed out by acquire_image/acquire_grid
+ * come back to the pool when their last shared_ptr goes away instead of
+ * freeing their pixel memory, as long as the pool stays under its byte
+ * cap; beyond it they are freed as usual. Recycled objects are reset to
+ * the state of a freshly constructed one.
+ */
+class raster_pool : private boost::noncopyable
+{
+public:
+    static raster_pool & instance();
+
+    MAPNIK_SHARED_PTR<mapnik::image_32> acquire_image(unsigned width, unsigned height);
+    MAPNIK_SHARED_PTR<mapnik::grid> acquire_grid(unsigned width,
+                                                 unsigned height,
+                                                 std::string const& key,
+                                                 unsigned resolution);
+    void clear();
+
+    void set_max_bytes(std::size_t max_bytes);
+    std::size_t max_bytes() const;
+    std::size_t bytes() const;
+    std::size_t size() const;
+    unsigned long hits() const;
+    unsigned long misses() const;
+
+private:
+    raster_pool();
+    ~raster_pool();
+
+    struct image_deleter { void operator()(mapnik::image_32 * image) const; };
+    struct grid_deleter { void operator()(mapnik::grid * grid) const; };
+
+    void release(mapnik::image_32 * image);
+    void release(mapnik::grid * grid);
+
+    typedef std::pair<unsigned, unsigned> size_class;
+    typedef std::map<size_class, std::vector<mapnik::image_32 *> > image_map;
+    typedef std::map<size_class, std::vector<mapnik::grid *> > grid_map;
+
+    image_map images_;
+    grid_map grids_;
+    std::size_t max_bytes_;
+    std::size_t bytes_;
+    std::size_t size_;
+    unsigned long hits_;
+    unsigned long misses_;
+    mutable uv_mutex_t mutex_;
+};
+
+}
+
+#endif // __NODE_MAPNIK_RASTER_POOL_H__
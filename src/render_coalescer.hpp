@@ -0,0 +1,187 @@
+#ifndef __NODE_MAPNIK_RENDER_COALESCER_H__
+#define __NODE_MAPNIK_RENDER_COALESCER_H__
+
+// v8
+#include <v8.h>
+
+// node
+#include <node.h>
+
+// mapnik
+#include <mapnik/graphics.hpp>          // for image_32
+
+#include "mapnik_image.hpp"
+#include "mapnik_vector_tile.hpp"
+#include "is_solid.hpp"
+
+// boost
+#include <boost/noncopyable.hpp>
+
+// stl
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace v8;
+
+namespace node_mapnik {
+
+/*
+ * Registry of in-flight renders that asked to be coalesced.
+ *
+ * The first render for a key runs normally; identical renders requested
+ * while it is in flight are parked here instead of rendering, and receive
+ * a copy of the first render's result when it completes. Only ever touched
+ * from the main thread, so no locking is needed.
+ */
+class render_coalescer : private boost::noncopyable
+{
+public:
+    struct waiter
+    {
+        Persistent<Object> target;
+        Persistent<Function> cb;
+    };
+    typedef std::vector<waiter> waiters_type;
+
+    static render_coalescer & instance()
+    {
+        static render_coalescer coalescer;
+        return coalescer;
+    }
+
+    // Parks the caller behind an in-flight render for `key` and returns true.
+    // Otherwise registers `key` as in flight and returns false, in which case
+    // the caller must render and later call complete() or fail().
+    bool join(std::string const& key, Handle<Object> target, Handle<Function> cb)
+    {
+        in_flight_type::iterator itr = in_flight_.find(key);
+        if (itr == in_flight_.end())
+        {
+            in_flight_.insert(std::make_pair(key, waiters_type()));
+            return false;
+        }
+        waiter w;
+        w.target = Persistent<Object>::New(target);
+        w.cb = Persistent<Function>::New(cb);
+        itr->second.push_back(w);
+        ++coalesced_;
+        return true;
+    }
+
+    // Copies the result into every parked target with `copy(target)` and
+    // calls them back as (null, target).
+    template <typename Copy>
+    void complete(std::string const& key, Copy copy)
+    {
+        waiters_type waiters;
+        take(key, waiters);
+        for (std::size_t i = 0; i < waiters.size(); ++i)
+        {
+            waiter & w = waiters[i];
+            copy(w.target);
+            Local<Value> argv[2] = { Local<Value>::New(Null()), Local<Value>::New(w.target) };
+            call(w, 2, argv);
+        }
+    }
+
+    void fail(std::string const& key, std::string const& message)
+    {
+        waiters_type waiters;
+        take(key, waiters);
+        for (std::size_t i = 0; i < waiters.size(); ++i)
+        {
+            Local<Value> argv[1] = { Exception::Error(String::New(message.c_str())) };
+            call(waiters[i], 1, argv);
+        }
+    }
+
+    std::size_t in_flight() const { return in_flight_.size(); }
+    unsigned long coalesced() const { return coalesced_; }
+
+private:
+    typedef std::map<std::string, waiters_type> in_flight_type;
+
+    render_coalescer()
+        : in_flight_(),
+          coalesced_(0) {}
+
+    void take(std::string const& key, waiters_type & waiters)
+    {
+        in_flight_type::iterator itr = in_flight_.find(key);
+        if (itr == in_flight_.end()) return;
+        waiters.swap(itr->second);
+        in_flight_.erase(itr);
+    }
+
+    static void call(waiter & w, int argc, Local<Value> argv[])
+    {
+        TryCatch try_catch;
+        w.cb->Call(Context::GetCurrent()->Global(), argc, argv);
+        if (try_catch.HasCaught()) {
+            node::FatalException(try_catch);
+        }
+        w.target.Dispose();
+        w.cb.Dispose();
+    }
+
+    in_flight_type in_flight_;
+    unsigned long coalesced_;
+};
+
+/*
+ * True if `image` is in the state of a freshly constructed one: not
+ * painted, no background and every pixel transparent black. Only such
+ * images are coalesced, as leader or waiter, since a waiter receives a
+ * copy of the leader's pixels instead of having the map drawn over what
+ * it held. image_32 keeps no premultiplied flag, but transparent black
+ * is the same premultiplied or not.
+ */
+inline bool is_blank_render_target(mapnik::image_32 const& image)
+{
+    if (image.painted() || image.get_background()) return false;
+    mapnik::image_data_32 const& data = image.data();
+    if (data.width() == 0 || data.height() == 0) return true;
+    unsigned pixel = 0;
+    return is_solid(data, pixel) && pixel == 0;
+}
+
+// copies a rendered image into a parked Image of the same size
+struct copy_image_result
+{
+    explicit copy_image_result(mapnik::image_32 const& src)
+        : src_(src) {}
+
+    void operator() (Handle<Object> target) const
+    {
+        mapnik::image_32 & dst = *node::ObjectWrap::Unwrap<Image>(target)->get();
+        std::memcpy(dst.raw_data(), src_.raw_data(), src_.width() * src_.height() * 4);
+        dst.painted(src_.painted());
+    }
+
+    mapnik::image_32 const& src_;
+};
+
+// copies a rendered tile into a parked, empty VectorTile
+struct copy_tile_result
+{
+    explicit copy_tile_result(VectorTile & src)
+        : src_(src) {}
+
+    void operator() (Handle<Object> target) const
+    {
+        VectorTile * dst = node::ObjectWrap::Unwrap<VectorTile>(target);
+        dst->clear();
+        dst->get_tile_nonconst().CopyFrom(src_.get_tile());
+        dst->status_ = VectorTile::LAZY_DONE;
+        dst->painted(src_.painted());
+        dst->cache_bytesize();
+    }
+
+    VectorTile & src_;
+};
+
+}
+
+#endif // __NODE_MAPNIK_RENDER_COALESCER_H__
@@ -0,0 +1,286 @@
+#include "style_cache.hpp"
+
+// mapnik
+#include <mapnik/datasource.hpp>
+#include <mapnik/datasource_cache.hpp>
+#include <mapnik/layer.hpp>
+#include <mapnik/load_map.hpp>
+#include <mapnik/map.hpp>
+#include <mapnik/version.hpp>
+
+// boost
+#include MAPNIK_MAKE_SHARED_INCLUDE
+#include <boost/foreach.hpp>
+#include <boost/optional/optional.hpp>
+
+// stl
+#include <fstream>
+#include <sstream>
+
+namespace node_mapnik {
+
+namespace {
+
+// 64 bit FNV-1a
+boost::uint64_t hash_key(std::string const& key)
+{
+    boost::uint64_t hash = 14695981039346656037ULL;
+    std::string::const_iterator itr = key.begin();
+    std::string::const_iterator end = key.end();
+    for (; itr != end; ++itr)
+    {
+        hash ^= static_cast<unsigned char>(*itr);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// gives every layer of a map copied from a prototype its own instance of
+// its datasource: even plugins that read everything up front (csv,
+// geojson) hand out the same features to every query, and iterating a
+// geometry moves its shared vertex cursor
+void clone_datasources(mapnik::Map & map)
+{
+    BOOST_FOREACH(mapnik::layer & lyr, map.layers())
+    {
+        mapnik::datasource_ptr ds = lyr.datasource();
+        if (!ds) continue;
+#if MAPNIK_VERSION >= 200200
+        lyr.set_datasource(mapnik::datasource_cache::instance().create(ds->params()));
+#else
+        lyr.set_datasource(mapnik::datasource_cache::instance()->create(ds->params()));
+#endif
+    }
+}
+
+// whether `map` holds nothing a stylesheet could have been loaded on top
+// of besides its size and srs, so a prototype loaded into a map with the
+// same srs can stand in for loading into it
+bool has_default_state(mapnik::Map const& map)
+{
+    mapnik::Map fresh(map.width(), map.height(), map.srs());
+    return map.layer_count() == 0 &&
+        map.styles().size() == 0 &&
+        map.buffer_size() == fresh.buffer_size() &&
+        !map.background() &&
+        !map.background_image() &&
+        !map.maximum_extent() &&
+        !map.font_directory() &&
+        map.get_aspect_fix_mode() == fresh.get_aspect_fix_mode() &&
+        map.get_current_extent() == fresh.get_current_extent()
+#if MAPNIK_VERSION >= 200200
+        && !map.base_path()
+#endif
+#if MAPNIK_VERSION >= 200100
+        && map.get_extra_parameters().empty()
+#endif
+        ;
+}
+
+bool read_file(std::string const& path, std::string & contents)
+{
+    std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+    if (!file) return false;
+    std::ostringstream s;
+    s << file.rdbuf();
+    contents = s.str();
+    return file.good() || file.eof();
+}
+
+}
+
+style_cache & style_cache::instance()
+{
+    // intentionally leaked so prototypes are never torn down after the
+    // datasource plugins they reference have been unloaded at exit
+    static style_cache * cache = new style_cache();
+    return *cache;
+}
+
+style_cache::style_cache()
+    : entries_(),
+      max_size_(32),
+      hits_(0),
+      misses_(0)
+{
+    uv_mutex_init(&mutex_);
+}
+
+style_cache::~style_cache()
+{
+    uv_mutex_destroy(&mutex_);
+}
+
+bool style_cache::find(std::string const& key, mapnik::Map & map)
+{
+    boost::uint64_t hash = hash_key(key);
+    MAPNIK_SHARED_PTR<mapnik::Map const> proto;
+    uv_mutex_lock(&mutex_);
+    lru_type::iterator itr = entries_.begin();
+    lru_type::iterator end = entries_.end();
+    for (; itr != end; ++itr)
+    {
+        if (itr->hash == hash && itr->key == key)
+        {
+            entries_.splice(entries_.begin(), entries_, itr);
+            proto = itr->map;
+            break;
+        }
+    }
+    if (proto) ++hits_;
+    else ++misses_;
+    uv_mutex_unlock(&mutex_);
+    if (!proto) return false;
+
+    // the prototype is immutable so the copy can happen unlocked
+    unsigned width = map.width();
+    unsigned height = map.height();
+    map = *proto;
+    map.resize(width, height);
+    clone_datasources(map);
+    return true;
+}
+
+void style_cache::insert(std::string const& key, mapnik::Map const& map)
+{
+    if (max_size() == 0) return;
+    entry e;
+    e.hash = hash_key(key);
+    e.key = key;
+    e.map = MAPNIK_MAKE_SHARED<mapnik::Map>(map);
+    uv_mutex_lock(&mutex_);
+    if (max_size_ == 0)
+    {
+        // resized to nothing while the prototype was being copied
+        uv_mutex_unlock(&mutex_);
+        return;
+    }
+    lru_type::iterator itr = entries_.begin();
+    lru_type::iterator end = entries_.end();
+    for (; itr != end; ++itr)
+    {
+        if (itr->hash == e.hash && itr->key == key)
+        {
+            entries_.erase(itr);
+            break;
+        }
+    }
+    entries_.push_front(e);
+    while (entries_.size() > max_size_) entries_.pop_back();
+    uv_mutex_unlock(&mutex_);
+}
+
+void style_cache::clear()
+{
+    uv_mutex_lock(&mutex_);
+    entries_.clear();
+    uv_mutex_unlock(&mutex_);
+}
+
+void style_cache::set_max_size(std::size_t max_size)
+{
+    uv_mutex_lock(&mutex_);
+    max_size_ = max_size;
+    while (entries_.size() > max_size_) entries_.pop_back();
+    uv_mutex_unlock(&mutex_);
+}
+
+std::size_t style_cache::max_size() const
+{
+    uv_mutex_lock(&mutex_);
+    std::size_t max_size = max_size_;
+    uv_mutex_unlock(&mutex_);
+    return max_size;
+}
+
+std::size_t style_cache::size() const
+{
+    uv_mutex_lock(&mutex_);
+    std::size_t size = entries_.size();
+    uv_mutex_unlock(&mutex_);
+    return size;
+}
+
+unsigned long style_cache::hits() const
+{
+    uv_mutex_lock(&mutex_);
+    unsigned long hits = hits_;
+    uv_mutex_unlock(&mutex_);
+    return hits;
+}
+
+unsigned long style_cache::misses() const
+{
+    uv_mutex_lock(&mutex_);
+    unsigned long misses = misses_;
+    uv_mutex_unlock(&mutex_);
+    return misses;
+}
+
+static void load_uncached(mapnik::Map & map,
+                          std::string const& stylesheet,
+                          bool from_string,
+                          bool strict,
+                          std::string const& base_path)
+{
+    if (from_string)
+    {
+        mapnik::load_map_string(map,stylesheet,strict,base_path);
+    }
+    else
+    {
+#if MAPNIK_VERSION >= 200200
+        mapnik::load_map(map,stylesheet,strict,base_path);
+#else
+        mapnik::load_map(map,stylesheet,strict);
+#endif
+    }
+}
+
+void load_stylesheet(mapnik::Map & map,
+                     std::string const& stylesheet,
+                     bool from_string,
+                     bool strict,
+                     std::string const& base_path,
+                     bool use_cache)
+{
+    // loading appends to existing styles and layers and only overrides
+    // the settings the stylesheet names, which a cached prototype cannot
+    // reproduce, so only maps in their default state use the cache. The
+    // srs given at construction goes in the key
+    if (!use_cache || !has_default_state(map))
+    {
+        load_uncached(map, stylesheet, from_string, strict, base_path);
+        return;
+    }
+
+    std::ostringstream key;
+    key << (from_string ? "string" : "file") << '\0'
+        << base_path << '\0'
+        << (strict ? "strict" : "") << '\0'
+        << map.srs() << '\0';
+    if (from_string)
+    {
+        key << stylesheet;
+    }
+    else
+    {
+        // key on the file content as well as the path so edited
+        // stylesheets are picked up on reload
+        std::string contents;
+        if (!read_file(stylesheet, contents))
+        {
+            // let mapnik report the error
+            load_uncached(map, stylesheet, from_string, strict, base_path);
+            return;
+        }
+        key << stylesheet << '\0' << contents;
+    }
+
+    style_cache & cache = style_cache::instance();
+    if (cache.find(key.str(), map)) return;
+    load_uncached(map, stylesheet, from_string, strict, base_path);
+    cache.insert(key.str(), map);
+}
+
+}
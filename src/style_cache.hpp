@@ -0,0 +1,81 @@
+#ifndef __NODE_MAPNIK_STYLE_CACHE_H__
+#define __NODE_MAPNIK_STYLE_CACHE_H__
+
+// libuv
+#include <uv.h>
+
+#include "mapnik3x_compatibility.hpp"
+
+// boost
+#include MAPNIK_SHARED_INCLUDE
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+// stl
+#include <list>
+#include <string>
+
+namespace mapnik { class Map; }
+
+namespace node_mapnik {
+
+/*
+ * Process-wide cache of parsed stylesheets.
+ *
+ * Each entry is a fully loaded mapnik::Map (styles, fonts, layers and
+ * their datasources) keyed by a hash of the stylesheet content, base path
+ * and load options. A hit copies the prototype into the target map, which
+ * skips xml parsing. Copies get fresh instances of every datasource:
+ * none is safe to query from several threads at once, and in-memory
+ * plugins hand the same features to every query.
+ */
+class style_cache : private boost::noncopyable
+{
+public:
+    static style_cache & instance();
+
+    // copies the cached prototype into `map`, returns false on a miss
+    bool find(std::string const& key, mapnik::Map & map);
+    // stores a copy of `map` as the prototype for `key`
+    void insert(std::string const& key, mapnik::Map const& map);
+    void clear();
+
+    void set_max_size(std::size_t max_size);
+    std::size_t max_size() const;
+    std::size_t size() const;
+    unsigned long hits() const;
+    unsigned long misses() const;
+
+private:
+    style_cache();
+    ~style_cache();
+
+    struct entry
+    {
+        boost::uint64_t hash;
+        std::string key;
+        MAPNIK_SHARED_PTR<mapnik::Map const> map;
+    };
+    typedef std::list<entry> lru_type;
+
+    lru_type entries_; // most recently used at the front
+    std::size_t max_size_;
+    unsigned long hits_;
+    unsigned long misses_;
+    mutable uv_mutex_t mutex_;
+};
+
+// Loads a stylesheet (a path, or xml when `from_string` is set) into `map`
+// like mapnik::load_map/load_map_string. With `use_cache` a map in its
+// default state (only its size and srs set) is served from, and
+// populates, the style_cache.
+void load_stylesheet(mapnik::Map & map,
+                     std::string const& stylesheet,
+                     bool from_string,
+                     bool strict,
+                     std::string const& base_path,
+                     bool use_cache);
+
+}
+
+#endif // __NODE_MAPNIK_STYLE_CACHE_H__
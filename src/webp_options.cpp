@@ -0,0 +1,90 @@
+#include "webp_options.hpp"
+#include "utils.hpp"
+
+// stl
+#include <sstream>
+
+using namespace v8;
+
+namespace node_mapnik {
+
+bool is_webp_format(std::string const& format)
+{
+    return format.compare(0, 4, "webp") == 0 && (format.size() == 4 || format[4] == ':');
+}
+
+// `integer` options are parsed as integers by mapnik, which would
+// silently drop a fraction
+static bool get_number(Local<Object> const& obj,
+                       char const* name,
+                       double min,
+                       double max,
+                       bool integer,
+                       std::ostringstream & s,
+                       std::string & error)
+{
+    if (!obj->Has(String::New(name))) return true;
+    Local<Value> value = obj->Get(String::New(name));
+    if (!value->IsNumber() || value->NumberValue() < min || value->NumberValue() > max ||
+        (integer && value->NumberValue() != value->IntegerValue()))
+    {
+        std::ostringstream e;
+        e << "webp option '" << name << "' must be " << (integer ? "an integer" : "a number")
+          << " between " << min << " and " << max;
+        error = e.str();
+        return false;
+    }
+    s << ':' << name << '=' << value->NumberValue();
+    return true;
+}
+
+static bool get_bool(Local<Object> const& obj,
+                     char const* name,
+                     std::ostringstream & s,
+                     std::string & error)
+{
+    if (!obj->Has(String::New(name))) return true;
+    Local<Value> value = obj->Get(String::New(name));
+    if (!value->IsBoolean())
+    {
+        error = std::string("webp option '") + name + "' must be a boolean";
+        return false;
+    }
+    s << ':' << name << '=' << (value->BooleanValue() ? "true" : "false");
+    return true;
+}
+
+bool parse_webp_options(Local<Value> const& value,
+                        std::string & format,
+                        std::string & error)
+{
+    if (!value->IsObject())
+    {
+        error = "option 'webp' must be an object";
+        return false;
+    }
+    Local<Object> obj = value->ToObject();
+    std::ostringstream s;
+    if (!get_number(obj, "quality", 0, 100, false, s, error) ||
+        !get_number(obj, "method", 0, 6, true, s, error) ||
+        !get_number(obj, "alpha_quality", 0, 100, true, s, error) ||
+        !get_bool(obj, "alpha", s, error))
+    {
+        return false;
+    }
+    // mapnik reads lossless as an integer
+    if (obj->Has(String::New("lossless")))
+    {
+        Local<Value> lossless = obj->Get(String::New("lossless"));
+        if (!lossless->IsBoolean())
+        {
+            error = "webp option 'lossless' must be a boolean";
+            return false;
+        }
+        s << ":lossless=" << (lossless->BooleanValue() ? 1 : 0);
+    }
+    format += s.str();
+    return true;
+}
+
+}
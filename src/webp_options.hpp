@@ -0,0 +1,27 @@
+#ifndef __NODE_MAPNIK_WEBP_OPTIONS_H__
+#define __NODE_MAPNIK_WEBP_OPTIONS_H__
+
+// v8
+#include <v8.h>
+
+// stl
+#include <string>
+
+namespace node_mapnik {
+
+// true for "webp" and "webp:<options>" formats
+bool is_webp_format(std::string const& format);
+
+/*
+ * Parses a `webp` encode option, {quality, method, lossless,
+ * alpha_quality, alpha}, and appends it to `format` as the matching
+ * mapnik format string options (e.g. "webp:quality=80:method=6").
+ * Returns false and sets `error` on invalid input.
+ */
+bool parse_webp_options(v8::Local<v8::Value> const& value,
+                        std::string & format,
+                        std::string & error);
+
+}
+
+#endif // __NODE_MAPNIK_WEBP_OPTIONS_H__
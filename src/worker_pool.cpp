@@ -0,0 +1,317 @@
+#include "worker_pool.hpp"
+#include "parallel.hpp"                 // for hardware_concurrency
+
+// stl
+#include <algorithm>
+
+namespace node_mapnik {
+
+#if defined(_MSC_VER)
+#define NODE_MAPNIK_THREAD_LOCAL __declspec(thread)
+#else
+#define NODE_MAPNIK_THREAD_LOCAL __thread
+#endif
+
+// whether the current pool thread works for a render, so helpers it posts
+// are counted toward the render cap
+static NODE_MAPNIK_THREAD_LOCAL bool rendering = false;
+
+static char const* priority_names[PRIORITY_COUNT] = {
+    "interactive",
+    "encode",
+    "housekeeping",
+    "batch"
+};
+
+char const* priority_name(work_priority priority)
+{
+    return priority_names[priority];
+}
+
+bool parse_priority(std::string const& name, work_priority & priority)
+{
+    for (int i = 0; i < PRIORITY_COUNT; ++i)
+    {
+        if (name == priority_names[i])
+        {
+            priority = static_cast<work_priority>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+worker_pool & worker_pool::instance()
+{
+    // never destroyed: worker threads live as long as the process
+    static worker_pool * pool = new worker_pool();
+    return *pool;
+}
+
+worker_pool::worker_pool()
+    : done_(),
+      threads_(),
+      size_(std::max(2u, hardware_concurrency())),
+      active_(0),
+      render_active_(0),
+      initialized_(false),
+      pending_(0)
+{
+    for (int i = 0; i < PRIORITY_COUNT; ++i)
+    {
+        class_stats & s = stats_[i];
+        s.queued = 0;
+        s.active = 0;
+        s.completed = 0;
+        s.wait_total_ms = 0;
+        s.wait_max_ms = 0;
+    }
+    uv_mutex_init(&mutex_);
+    uv_cond_init(&cond_);
+}
+
+worker_pool::~worker_pool()
+{
+    uv_cond_destroy(&cond_);
+    uv_mutex_destroy(&mutex_);
+}
+
+bool worker_pool::is_render(work_priority priority)
+{
+    return priority == PRIORITY_INTERACTIVE || priority == PRIORITY_BATCH;
+}
+
+void worker_pool::start_threads()
+{
+    // threads are only ever added, shrinking the pool lowers the number
+    // of jobs allowed to run at once and leaves the extra threads idle
+    while (threads_.size() < size_)
+    {
+        uv_thread_t tid;
+        if (uv_thread_create(&tid, run, this) != 0) break;
+        threads_.push_back(tid);
+    }
+}
+
+void worker_pool::queue(uv_work_t* req, uv_work_cb work, uv_after_work_cb after, work_priority priority)
+{
+    if (!initialized_)
+    {
+        uv_async_init(uv_default_loop(), &async_, on_complete);
+        uv_unref(reinterpret_cast<uv_handle_t*>(&async_));
+        initialized_ = true;
+    }
+    // keep the loop alive while jobs are outstanding
+    if (pending_++ == 0)
+    {
+        uv_ref(reinterpret_cast<uv_handle_t*>(&async_));
+    }
+    job j;
+    j.req = req;
+    j.work = work;
+    j.after = after;
+    j.priority = priority;
+    j.queued_at = uv_hrtime();
+    uv_mutex_lock(&mutex_);
+    start_threads();
+    queues_[priority].push_back(j);
+    ++stats_[priority].queued;
+    uv_cond_signal(&cond_);
+    uv_mutex_unlock(&mutex_);
+}
+
+void worker_pool::set_size(unsigned size)
+{
+    uv_mutex_lock(&mutex_);
+    size_ = std::max(1u, size);
+    if (initialized_) start_threads();
+    // capacity may have grown
+    uv_cond_broadcast(&cond_);
+    uv_mutex_unlock(&mutex_);
+}
+
+void worker_pool::post_helpers(helper_fn fn, void* arg, unsigned count)
+{
+    helper h;
+    h.fn = fn;
+    h.arg = arg;
+    h.render = rendering;
+    uv_mutex_lock(&mutex_);
+    start_threads();
+    for (unsigned i = 0; i < count; ++i)
+    {
+        helpers_.push_back(h);
+    }
+    uv_cond_broadcast(&cond_);
+    uv_mutex_unlock(&mutex_);
+}
+
+unsigned worker_pool::withdraw_helpers(void* arg, unsigned posted)
+{
+    unsigned dropped = 0;
+    uv_mutex_lock(&mutex_);
+    std::deque<helper>::iterator itr = helpers_.begin();
+    while (itr != helpers_.end())
+    {
+        if (itr->arg == arg)
+        {
+            itr = helpers_.erase(itr);
+            ++dropped;
+        }
+        else
+        {
+            ++itr;
+        }
+    }
+    uv_mutex_unlock(&mutex_);
+    return posted - dropped;
+}
+
+unsigned worker_pool::size() const
+{
+    uv_mutex_lock(&mutex_);
+    unsigned size = size_;
+    uv_mutex_unlock(&mutex_);
+    return size;
+}
+
+unsigned worker_pool::threads() const
+{
+    uv_mutex_lock(&mutex_);
+    unsigned threads = static_cast<unsigned>(threads_.size());
+    uv_mutex_unlock(&mutex_);
+    return threads;
+}
+
+worker_pool::class_stats worker_pool::stats(work_priority priority) const
+{
+    uv_mutex_lock(&mutex_);
+    class_stats s = stats_[priority];
+    uv_mutex_unlock(&mutex_);
+    return s;
+}
+
+// render jobs and their helpers leave one thread to the short jobs
+static unsigned render_cap(unsigned size)
+{
+    return size > 1 ? size - 1 : 1;
+}
+
+// called with mutex_ held
+bool worker_pool::next_job(job & j)
+{
+    if (active_ >= size_) return false;
+    unsigned cap = render_cap(size_);
+    for (int i = 0; i < PRIORITY_COUNT; ++i)
+    {
+        work_priority priority = static_cast<work_priority>(i);
+        if (queues_[i].empty()) continue;
+        if (is_render(priority) && render_active_ >= cap) continue;
+        j = queues_[i].front();
+        queues_[i].pop_front();
+        return true;
+    }
+    return false;
+}
+
+// called with mutex_ held; helpers only take threads no job can use, and
+// helpers of a render stay under the render cap like the render itself
+bool worker_pool::next_helper(helper & h)
+{
+    if (active_ >= size_) return false;
+    bool render_full = render_active_ >= render_cap(size_);
+    std::deque<helper>::iterator itr = helpers_.begin();
+    for (; itr != helpers_.end(); ++itr)
+    {
+        if (itr->render && render_full) continue;
+        h = *itr;
+        helpers_.erase(itr);
+        return true;
+    }
+    return false;
+}
+
+void worker_pool::run(void* arg)
+{
+    static_cast<worker_pool*>(arg)->work_loop();
+}
+
+void worker_pool::work_loop()
+{
+    uv_mutex_lock(&mutex_);
+    for (;;)
+    {
+        job j;
+        helper h;
+        bool is_job = false;
+        while (!(is_job = next_job(j)) && !next_helper(h))
+        {
+            uv_cond_wait(&cond_, &mutex_);
+        }
+        if (!is_job)
+        {
+            ++active_;
+            if (h.render) ++render_active_;
+            uv_mutex_unlock(&mutex_);
+            rendering = h.render;
+            h.fn(h.arg);
+            rendering = false;
+            uv_mutex_lock(&mutex_);
+            --active_;
+            if (h.render) --render_active_;
+            uv_cond_signal(&cond_);
+            continue;
+        }
+        class_stats & s = stats_[j.priority];
+        double wait_ms = (uv_hrtime() - j.queued_at) / 1e6;
+        --s.queued;
+        ++s.active;
+        s.wait_total_ms += wait_ms;
+        if (wait_ms > s.wait_max_ms) s.wait_max_ms = wait_ms;
+        ++active_;
+        if (is_render(j.priority)) ++render_active_;
+        uv_mutex_unlock(&mutex_);
+
+        rendering = is_render(j.priority);
+        j.work(j.req);
+        rendering = false;
+
+        uv_mutex_lock(&mutex_);
+        --s.active;
+        ++s.completed;
+        --active_;
+        if (is_render(j.priority)) --render_active_;
+        done_.push_back(j);
+        uv_async_send(&async_);
+        // a freed render slot may unblock a waiting thread
+        uv_cond_signal(&cond_);
+    }
+}
+
+#if UV_VERSION_MAJOR == 0 && UV_VERSION_MINOR < 11
+void worker_pool::on_complete(uv_async_t* handle, int status)
+#else
+void worker_pool::on_complete(uv_async_t* handle)
+#endif
+{
+    instance().complete();
+}
+
+void worker_pool::complete()
+{
+    std::vector<job> done;
+    uv_mutex_lock(&mutex_);
+    done.swap(done_);
+    uv_mutex_unlock(&mutex_);
+    for (std::size_t i = 0; i < done.size(); ++i)
+    {
+        job const& j = done[i];
+        j.after(j.req, 0);
+        if (--pending_ == 0)
+        {
+            uv_unref(reinterpret_cast<uv_handle_t*>(&async_));
+        }
+    }
+}
+
+}
@@ -0,0 +1,128 @@
+#ifndef __NODE_MAPNIK_WORKER_POOL_H__
+#define __NODE_MAPNIK_WORKER_POOL_H__
+
+// libuv
+#include <uv.h>
+
+// boost
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+// stl
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace node_mapnik {
+
+// Priority classes, highest first. Renders are expected to be slow, the
+// others short, so renders never get more than size - 1 threads.
+enum work_priority
+{
+    PRIORITY_INTERACTIVE = 0, // renders and queries a client is waiting on
+    PRIORITY_ENCODE,          // encoding, decoding and pixel operations
+    PRIORITY_HOUSEKEEPING,    // clear, isSolid and other cheap bookkeeping
+    PRIORITY_BATCH,           // seeding renders and stylesheet loading
+    PRIORITY_COUNT
+};
+
+char const* priority_name(work_priority priority);
+bool parse_priority(std::string const& name, work_priority & priority);
+
+/*
+ * Thread pool owned by node-mapnik so that mapnik work neither competes
+ * with fs/dns requests for the four libuv threads nor lets short jobs wait
+ * behind long renders. Jobs are dispatched by priority class and completed
+ * back on the default loop through a uv_async handle, so the after callback
+ * runs on the main thread exactly like with uv_queue_work.
+ */
+class worker_pool : private boost::noncopyable
+{
+public:
+    struct class_stats
+    {
+        std::size_t queued;
+        std::size_t active;
+        unsigned long completed;
+        double wait_total_ms;
+        double wait_max_ms;
+    };
+
+    static worker_pool & instance();
+
+    // main thread only
+    void queue(uv_work_t* req, uv_work_cb work, uv_after_work_cb after, work_priority priority);
+    void set_size(unsigned size);
+
+    // Helper slots let idle pool threads join a parallel_for running on
+    // another thread: `count` calls of fn(arg), each made by a thread that
+    // has no job to run, in place of a job. Any thread may post them.
+    // Helpers posted from a render count toward the render cap.
+    typedef void (*helper_fn)(void*);
+    void post_helpers(helper_fn fn, void* arg, unsigned count);
+    // drops the unclaimed slots of `arg` and returns how many of the
+    // `posted` ones were claimed
+    unsigned withdraw_helpers(void* arg, unsigned posted);
+
+    unsigned size() const;
+    unsigned threads() const;
+    class_stats stats(work_priority priority) const;
+
+private:
+    worker_pool();
+    ~worker_pool();
+
+    struct job
+    {
+        uv_work_t* req;
+        uv_work_cb work;
+        uv_after_work_cb after;
+        work_priority priority;
+        boost::uint64_t queued_at;
+    };
+
+    struct helper
+    {
+        helper_fn fn;
+        void* arg;
+        bool render;                // posted from a render job or its helper
+    };
+
+    static void run(void* arg);
+#if UV_VERSION_MAJOR == 0 && UV_VERSION_MINOR < 11
+    static void on_complete(uv_async_t* handle, int status);
+#else
+    static void on_complete(uv_async_t* handle);
+#endif
+    void work_loop();
+    bool next_job(job & j);
+    bool next_helper(helper & h);
+    void start_threads();
+    void complete();
+    static bool is_render(work_priority priority);
+
+    std::deque<job> queues_[PRIORITY_COUNT];
+    std::deque<helper> helpers_;
+    std::vector<job> done_;
+    class_stats stats_[PRIORITY_COUNT];
+    std::vector<uv_thread_t> threads_;
+    unsigned size_;
+    unsigned active_;
+    unsigned render_active_;        // render jobs and their helpers
+    bool initialized_;
+    // outstanding jobs, touched on the main thread only
+    std::size_t pending_;
+    uv_async_t async_;
+    mutable uv_mutex_t mutex_;
+    uv_cond_t cond_;
+};
+
+// drop-in replacement for uv_queue_work(uv_default_loop(), ...)
+inline void queue_work(uv_work_t* req, uv_work_cb work, uv_after_work_cb after, work_priority priority)
+{
+    worker_pool::instance().queue(req, work, after, priority);
+}
+
+}
+
+#endif // __NODE_MAPNIK_WORKER_POOL_H__
@@ -50,3 +50,67 @@ describe('mapnik.compositeOp async multiply', function() {
         })(name);
     }
 });
+
+describe('mapnik.Image.compositeMany', function() {
+    it('should match compositing the layers one at a time', function(done) {
+        var a = mapnik.Image.open('test/support/a.png');
+        a.premultiplySync();
+        var b = mapnik.Image.open('test/support/b.png');
+        b.premultiplySync();
+        var layers = [
+            {image: a, comp_op: mapnik.compositeOp.multiply, opacity: 0.5},
+            {image: b, comp_op: mapnik.compositeOp.src_over, dx: 10, dy: -7}
+        ];
+        var expected = new mapnik.Image(a.width(), a.height());
+        expected.composite(a, layers[0], function(err) {
+            if (err) throw err;
+            expected.composite(b, layers[1], function(err) {
+                if (err) throw err;
+                var im = new mapnik.Image(a.width(), a.height());
+                assert.throws(function() { im.compositeMany([{image: im}], function() {}); });
+                assert.throws(function() { im.compositeMany([{image: a, opacity: 'x'}], function() {}); });
+                im.compositeMany(layers, function(err, im_out) {
+                    if (err) throw err;
+                    assert.equal(im_out, im);
+                    assert.equal(im.data().toString('hex'), expected.data().toString('hex'));
+                    done();
+                });
+            });
+        });
+    });
+});
+
+describe('mapnik.Image image filters', function() {
+    it('should not modify the source of a filtered composite', function(done) {
+        var src = mapnik.Image.open('test/support/a.png');
+        src.premultiplySync();
+        var before = src.data().toString('hex');
+        var im = new mapnik.Image(src.width(), src.height());
+        im.composite(src, {image_filters: 'invert agg-stack-blur(10,10)'}, function(err) {
+            if (err) throw err;
+            assert.equal(src.data().toString('hex'), before);
+            im.compositeMany([{image: src, image_filters: 'gray'}], function(err) {
+                if (err) throw err;
+                assert.equal(src.data().toString('hex'), before);
+                done();
+            });
+        });
+    });
+
+    it('should filter an image in place', function(done) {
+        var im = mapnik.Image.open('test/support/a.png');
+        im.premultiplySync();
+        var before = im.data().toString('hex');
+        assert.throws(function() { im.filterSync(); });
+        assert.throws(function() { im.filterSync('not-a-filter(('); });
+        var sync = mapnik.Image.fromBuffer(im.data(), im.width(), im.height());
+        assert.equal(sync.filterSync('agg-stack-blur(4,4)'), sync);
+        assert.notEqual(sync.data().toString('hex'), before);
+        im.filter('agg-stack-blur(4,4)', function(err, result) {
+            if (err) throw err;
+            assert.equal(result, im);
+            assert.equal(im.data().toString('hex'), sync.data().toString('hex'));
+            done();
+        });
+    });
+});
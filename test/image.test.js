@@ -2,6 +2,7 @@ var mapnik = require('../');
 var assert = require('assert');
 var fs = require('fs');
 var path = require('path');
+var child_process = require('child_process');
 
 describe('mapnik.Image ', function() {
     it('should throw with invalid usage', function() {
@@ -206,6 +207,41 @@ describe('mapnik.Image ', function() {
         assert.equal(pixel3.a, 255);
     });
 
+    it('should set the alpha channel based on the amount of gray async', function(done) {
+        var gray = new mapnik.Image(256, 256);
+        gray.background = new mapnik.Color('white');
+        gray.setGrayScaleToAlpha(new mapnik.Color('green'), function(err, result) {
+            if (err) throw err;
+            assert.equal(result, gray);
+            var pixel = gray.getPixel(0, 0);
+            assert.equal(pixel.r, 0);
+            assert.equal(pixel.g, 128);
+            assert.equal(pixel.b, 0);
+            assert.equal(pixel.a, 255);
+            done();
+        });
+    });
+
+    it('should premultiply and demultiply', function(done) {
+        var im = new mapnik.Image(5, 3);
+        im.background = new mapnik.Color(200, 100, 50, 128);
+        im.premultiplySync();
+        var pixel = im.getPixel(4, 2);
+        assert.equal(pixel.r, 100);
+        assert.equal(pixel.g, 50);
+        assert.equal(pixel.b, 25);
+        assert.equal(pixel.a, 128);
+        im.demultiply(function(err) {
+            if (err) throw err;
+            var pixel2 = im.getPixel(4, 2);
+            assert.equal(pixel2.r, 199);
+            assert.equal(pixel2.g, 99);
+            assert.equal(pixel2.b, 49);
+            assert.equal(pixel2.a, 128);
+            done();
+        });
+    });
+
     it('should support setting an individual pixel', function() {
         var gray = new mapnik.Image(256, 256);
         gray.setPixel(0,0,new mapnik.Color('white'));
@@ -216,4 +252,255 @@ describe('mapnik.Image ', function() {
         assert.equal(pixel.a, 255);
     });
 
+    it('should encode png with structured options', function(done) {
+        var im = new mapnik.Image.open('./test/support/a.png');
+        assert.throws(function() { im.encodeSync('png', {png: {level: 10}}); });
+        assert.throws(function() { im.encodeSync('png', {png: {filter: 'foo'}}); });
+        assert.throws(function() { im.encodeSync('jpeg', {png: {level: 1}}); });
+        assert.throws(function() { im.encodeSync('png', {png: {threads: 1.5}}); });
+        // 256x256 pixels deflate as several pieces, decoding checks they
+        // join into one stream with the right pixels
+        var sync = im.encodeSync('png', {png: {level: 1, strategy: 'rle', filter: 'paeth', threads: 1000}});
+        var im2 = new mapnik.Image.fromBytesSync(sync);
+        assert.equal(im2.width(), im.width());
+        assert.equal(im2.height(), im.height());
+        assert.equal(im2.data().toString('hex'), im.data().toString('hex'));
+        im.encode('png', {png: {filter: 'adaptive'}}, function(err, buffer) {
+            if (err) throw err;
+            var im3 = new mapnik.Image.fromBytesSync(buffer);
+            assert.equal(im3.data().toString('hex'), im.data().toString('hex'));
+            done();
+        });
+    });
+
+    if (mapnik.supports.webp) {
+        it('should encode webp with structured options', function(done) {
+            var im = new mapnik.Image.open('./test/support/a.png');
+            assert.throws(function() { im.encodeSync('webp', {webp: {quality: 101}}); });
+            assert.throws(function() { im.encodeSync('webp', {webp: {method: 4.5}}); });
+            assert.throws(function() { im.encodeSync('png', {webp: {quality: 80}}); });
+            var lossy = im.encodeSync('webp', {webp: {quality: 50, method: 6, alpha_quality: 50}});
+            var im2 = new mapnik.Image.fromBytesSync(lossy);
+            assert.equal(im2.width(), im.width());
+            im.encode('webp', {webp: {lossless: true}}, function(err, lossless) {
+                if (err) throw err;
+                var im3 = new mapnik.Image.fromBytesSync(lossless);
+                assert.equal(im3.encodeSync('png').length, im.encodeSync('png').length);
+                done();
+            });
+        });
+    }
+
+    it('isSolid works on images', function(done) {
+        var im = new mapnik.Image(256, 256);
+        im.background = new mapnik.Color('green');
+        assert.equal(im.isSolidSync(), true);
+        var result = im.isSolidSync({stats: true});
+        assert.equal(result.solid, true);
+        assert.equal(result.pixel, 4278222848);
+        assert.equal(result.stats.g.min, 128);
+        assert.equal(result.stats.g.max, 128);
+        assert.equal(result.stats.g.mean, 128);
+        assert.equal(result.stats.a.mean, 255);
+        assert.throws(function() { im.isSolidSync(1); });
+        im.isSolid(function(err, solid, pixel) {
+            if (err) throw err;
+            assert.equal(solid, true);
+            assert.equal(pixel, 4278222848);
+            var im2 = new mapnik.Image.open('./test/support/a.png');
+            assert.equal(im2.isSolidSync(), false);
+            im2.isSolid({stats: true}, function(err, solid, pixel, stats) {
+                if (err) throw err;
+                assert.equal(solid, false);
+                assert.equal(pixel, undefined);
+                assert.ok(stats.a.min <= stats.a.mean);
+                assert.ok(stats.a.mean <= stats.a.max);
+                done();
+            });
+        });
+    });
+
+    it('should expose and wrap raw pixels', function() {
+        var im = new mapnik.Image(4, 2);
+        im.background = new mapnik.Color('green');
+        var data = im.data();
+        assert.equal(data.length, 4 * 2 * 4);
+        assert.equal(data.readUInt32LE(0), 4278222848);
+        // writes go straight to the image
+        data.writeUInt32LE(4278190335, 4);
+        assert.equal(im.getPixel(1, 0).r, 255);
+        assert.equal(im.isSolidSync(), false);
+        assert.throws(function() { mapnik.Image.fromBuffer(data, 4); });
+        assert.throws(function() { mapnik.Image.fromBuffer(data, 3, 2); });
+        assert.throws(function() { mapnik.Image.fromBuffer(data, 4, 2, 1); });
+        var im2 = mapnik.Image.fromBuffer(data, 4, 2);
+        assert.equal(im2.width(), 4);
+        assert.equal(im2.height(), 2);
+        assert.equal(im2.encodeSync('png').length, im.encodeSync('png').length);
+        var half = new Buffer(4);
+        half.writeUInt32LE(0x80404040, 0);
+        var im3 = mapnik.Image.fromBuffer(half, 1, 1, {premultiplied: true});
+        assert.equal(im3.getPixel(0, 0).r, 127);
+        assert.equal(im3.getPixel(0, 0).a, 128);
+    });
+
+    it('should recycle pixel memory through the raster pool', function() {
+        var stats = mapnik.rasterPoolStats();
+        assert.ok(stats.size > 0);
+        assert.equal(typeof stats.bytes, 'number');
+        assert.equal(typeof stats.entries, 'number');
+        assert.throws(function() { mapnik.setRasterPoolSize(-1); });
+        var before = stats.hits + stats.misses;
+        var im = new mapnik.Image(17, 13);
+        stats = mapnik.rasterPoolStats();
+        assert.equal(stats.hits + stats.misses, before + 1);
+        // recycled or not, a new image starts out transparent and unpainted
+        assert.equal(im.painted(), false);
+        assert.equal(im.isSolidSync(), true);
+        assert.equal(im.getPixel(0, 0).a, 0);
+        mapnik.clearRasterPool();
+        assert.equal(mapnik.rasterPoolStats().entries, 0);
+        assert.equal(mapnik.rasterPoolStats().bytes, 0);
+        mapnik.setRasterPoolSize(0);
+        assert.equal(mapnik.rasterPoolStats().size, 0);
+        mapnik.setRasterPoolSize(stats.size);
+    });
+
+    it('should serve repeated encodes from the encode cache', function(done) {
+        mapnik.clearEncodeCache();
+        assert.throws(function() { mapnik.setEncodeCacheSize(-1); });
+        var im = new mapnik.Image(256, 256);
+        im.background = new mapnik.Color('steelblue');
+        assert.throws(function() { im.encodeSync('png', {cache: 1}); });
+        var stats = mapnik.encodeCacheStats();
+        assert.ok(stats.size > 0);
+        var first = im.encodeSync('png', {cache: true});
+        var second = im.encodeSync('png', {cache: true});
+        assert.equal(first.toString('hex'), second.toString('hex'));
+        // the cached bytes are copied so writes to a result stay local
+        second[0] = 0;
+        assert.equal(im.encodeSync('png', {cache: true})[0], first[0]);
+        // a different format or pixels make a new entry
+        im.encodeSync('png8', {cache: true});
+        im.setPixel(0, 0, new mapnik.Color('red'));
+        im.encode('png', {cache: true}, function(err, buffer) {
+            if (err) throw err;
+            assert.notEqual(buffer.toString('hex'), first.toString('hex'));
+            stats = mapnik.encodeCacheStats();
+            assert.equal(stats.hits, 2);
+            assert.equal(stats.misses, 3);
+            assert.equal(stats.entries, 3);
+            assert.ok(stats.bytes > 0);
+            mapnik.clearEncodeCache();
+            assert.equal(mapnik.encodeCacheStats().entries, 0);
+            assert.equal(mapnik.encodeCacheStats().bytes, 0);
+            assert.equal(mapnik.encodeCacheStats().hits, 0);
+            assert.equal(mapnik.encodeCacheStats().misses, 0);
+            done();
+        });
+    });
+
+    it('should count differing pixels with compare', function(done) {
+        var im = new mapnik.Image(33, 17);
+        im.background = new mapnik.Color('rgba(0,0,255,1)');
+        var im2 = new mapnik.Image(33, 17);
+        im2.background = new mapnik.Color('rgba(0,0,255,1)');
+        assert.throws(function() { im.compareSync(); });
+        assert.throws(function() { im.compareSync(new mapnik.Image(2, 2)); });
+        assert.throws(function() { im.compareSync(im2, {threshold: 256}); });
+        assert.throws(function() { im.compareSync(im2, {threshold: 1.5}); });
+        assert.equal(im.compareSync(im2), 0);
+        im2.setPixel(0, 0, new mapnik.Color('rgba(0,0,250,1)'));
+        im2.setPixel(32, 16, new mapnik.Color('rgba(255,0,0,1)'));
+        im2.setPixel(5, 5, new mapnik.Color('rgba(0,0,255,0.5)'));
+        // small differences stay under the default threshold of 16
+        assert.equal(im.compareSync(im2), 2);
+        assert.equal(im.compareSync(im2, {threshold: 0}), 3);
+        assert.equal(im.compareSync(im2, {alpha: false}), 1);
+        var result = im.compareSync(im2, {diff: true});
+        assert.equal(result.mismatched, 2);
+        assert.equal(result.diff.getPixel(32, 16).r, 255);
+        assert.equal(result.diff.getPixel(32, 16).a, 255);
+        assert.equal(result.diff.getPixel(0, 0).a, 0);
+        im.compare(im2, {threshold: 0, diff: true}, function(err, mismatched, diff) {
+            if (err) throw err;
+            assert.equal(mismatched, 3);
+            assert.equal(diff.width(), 33);
+            assert.equal(diff.getPixel(5, 5).r, 255);
+            done();
+        });
+    });
+
+    it('should give the same results with vector and scalar pixel kernels', function(done) {
+        assert.ok(['avx2', 'sse2', 'neon', 'scalar'].indexOf(mapnik.supports.pixel_kernels) >= 0);
+        var kernels = require('./support/pixel_kernels');
+        var env = {};
+        for (var name in process.env) env[name] = process.env[name];
+        env.NODE_MAPNIK_PIXEL_KERNELS = 'scalar';
+        var script = path.join(__dirname, 'support', 'pixel_kernels.js');
+        child_process.execFile(process.execPath, [script], {env: env}, function(err, stdout) {
+            if (err) throw err;
+            assert.equal(stdout.trim(), kernels());
+            done();
+        });
+    });
+
+    it('should resize images', function(done) {
+        var im = new mapnik.Image(512, 512);
+        im.background = new mapnik.Color('rgba(0,128,0,0.5)');
+        assert.throws(function() { im.resizeSync(256); });
+        assert.throws(function() { im.resizeSync(0, 256); });
+        assert.throws(function() { im.resizeSync(256, 256, {filter: 'foo'}); });
+        assert.throws(function() { im.resizeSync(256, 256, {scale: -1}); });
+        assert.throws(function() { im.resizeSync(256, 256, {offset: 1}); });
+        // exact 2x downsampling of a solid image stays solid
+        var half = im.resizeSync(256, 256);
+        assert.equal(half.width(), 256);
+        assert.equal(half.height(), 256);
+        assert.equal(half.isSolidSync(), true);
+        // premultiplying a half transparent 128 and demultiplying it again
+        // gives 127, the same as mapnik's own scaling
+        assert.ok(Math.abs(half.getPixel(0, 0).g - im.getPixel(0, 0).g) <= 1);
+        assert.equal(half.getPixel(0, 0).a, im.getPixel(0, 0).a);
+        var source = new mapnik.Image.open('./test/support/a.png');
+        var sync = source.resizeSync(source.width() * 2, source.height() * 2, {filter: 'bicubic'});
+        source.resize(source.width() * 2, source.height() * 2, {filter: 'bicubic'}, function(err, result) {
+            if (err) throw err;
+            assert.equal(result.width(), source.width() * 2);
+            assert.equal(result.height(), source.height() * 2);
+            assert.equal(result.data().toString('hex'), sync.data().toString('hex'));
+            done();
+        });
+    });
+
+    it('should decode a window and a reduced scale', function(done) {
+        var full = mapnik.Image.open('./test/support/a.png');
+        assert.throws(function() { mapnik.Image.open('./test/support/a.png', {scale: 3}); });
+        assert.throws(function() { mapnik.Image.open('./test/support/a.png', {window: {x: -1}}); });
+        assert.throws(function() { mapnik.Image.open('./test/support/a.png', {window: {x: full.width()}}); });
+        var win = mapnik.Image.open('./test/support/a.png', {window: {x: 10, y: 10, width: 20, height: 15}});
+        assert.equal(win.width(), 20);
+        assert.equal(win.height(), 15);
+        assert.equal(win.getPixel(0, 0).r, full.getPixel(10, 10).r);
+        assert.equal(win.getPixel(19, 14).a, full.getPixel(29, 24).a);
+        var bytes = full.encodeSync('png');
+        var half = mapnik.Image.fromBytesSync(bytes, {scale: 2});
+        assert.equal(half.width(), Math.ceil(full.width() / 2));
+        assert.equal(half.height(), Math.ceil(full.height() / 2));
+        mapnik.Image.fromBytes(bytes, {scale: 4, window: {x: 8, y: 8}}, function(err, quarter) {
+            if (err) throw err;
+            assert.equal(quarter.width(), Math.ceil((full.width() - 8) / 4));
+            assert.equal(quarter.height(), Math.ceil((full.height() - 8) / 4));
+            if (!mapnik.supports.jpeg) return done();
+            var jpeg = './test/data/vector_tile/tile-raster.expected.jpg';
+            var jpeg_full = mapnik.Image.open(jpeg);
+            mapnik.Image.open(jpeg, {scale: 2}, function(err, scaled) {
+                if (err) throw err;
+                assert.equal(scaled.width(), Math.ceil(jpeg_full.width() / 2));
+                assert.equal(scaled.height(), Math.ceil(jpeg_full.height() / 2));
+                done();
+            });
+        });
+    });
+
 });
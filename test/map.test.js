@@ -72,6 +72,47 @@ describe('mapnik.Map', function() {
         assert.equal(layers2.length, 0);
     });
 
+    it('should clone maps from the stylesheet cache', function() {
+        mapnik.clearStyleCache();
+        var xml = require('fs').readFileSync('./test/stylesheet.xml', 'utf8');
+        var before = mapnik.styleCacheStats();
+        var first = new mapnik.Map(256, 256);
+        first.fromStringSync(xml, {strict: true, base: './test/', cache: true});
+        var second = new mapnik.Map(512, 512);
+        second.fromStringSync(xml, {strict: true, base: './test/', cache: true});
+        var stats = mapnik.styleCacheStats();
+        assert.equal(stats.entries, 1);
+        assert.equal(stats.misses, before.misses + 1);
+        assert.equal(stats.hits, before.hits + 1);
+        // the clone keeps its own dimensions
+        assert.equal(second.width, 512);
+        assert.equal(second.height, 512);
+        var uncached = new mapnik.Map(512, 512);
+        uncached.fromStringSync(xml, {strict: true, base: './test/'});
+        assert.equal(second.toXML(), uncached.toXML());
+        assert.deepEqual(second.layers()[0].datasource.parameters(), first.layers()[0].datasource.parameters());
+        // different options are a different entry
+        new mapnik.Map(256, 256).fromStringSync(xml, {base: './test/', cache: true});
+        assert.equal(mapnik.styleCacheStats().entries, 2);
+        // state set before loading is kept and bypasses the cache
+        var buffered = new mapnik.Map(256, 256);
+        buffered.bufferSize = 64;
+        var stats2 = mapnik.styleCacheStats();
+        buffered.fromStringSync(xml, {strict: true, base: './test/', cache: true});
+        assert.equal(buffered.bufferSize, 64);
+        assert.equal(mapnik.styleCacheStats().hits, stats2.hits);
+        assert.equal(mapnik.styleCacheStats().misses, stats2.misses);
+        // the srs given at construction is part of the key
+        new mapnik.Map(256, 256, '+init=epsg:4326').fromStringSync(xml, {base: './test/', cache: true});
+        assert.equal(mapnik.styleCacheStats().entries, 3);
+        mapnik.setStyleCacheSize(1);
+        assert.equal(mapnik.styleCacheStats().entries, 1);
+        mapnik.setStyleCacheSize(before.size);
+        mapnik.clearStyleCache();
+        assert.equal(mapnik.styleCacheStats().entries, 0);
+        assert.throws(function() { new mapnik.Map(256, 256).fromStringSync(xml, {cache: 'yes'}); });
+    });
+
     it('should allow access to layers', function() {
         var map = new mapnik.Map(600, 400);
         map.loadSync('./test/stylesheet.xml');
@@ -84,4 +84,39 @@ describe('mapnik rendering ', function() {
             done();
         }
     });
+
+    it('should render async to a file descriptor', function(done) {
+        var filename = './test/tmp/renderFile-fd.png';
+        var map = new mapnik.Map(600, 400);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        assert.throws(function() { map.renderFile(-1, {format: 'png'}, function() {}); });
+        assert.throws(function() { map.renderFile(1, {format: ''}, function() {}); });
+        var fd = fs.openSync(filename, 'w');
+        map.renderFile(fd, {format: 'png'}, function(error) {
+            fs.closeSync(fd);
+            assert.ok(!error);
+            var im = mapnik.Image.open(filename);
+            assert.equal(im.width(), 600);
+            assert.equal(im.height(), 400);
+            done();
+        });
+    });
+
+    it('should render async to file in bands', function(done) {
+        var filename = './test/tmp/renderFile-bands.png';
+        var map = new mapnik.Map(600, 400);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        assert.throws(function() { map.renderFile(filename, {band_height: 0}, function() {}); });
+        assert.throws(function() { map.renderFile(filename, {format: 'pdf', band_height: 64}, function() {}); });
+        map.renderFile(filename, {band_height: 64}, function(error) {
+            assert.ok(!error);
+            var im = mapnik.Image.open(filename);
+            assert.equal(im.width(), 600);
+            assert.equal(im.height(), 400);
+            assert.ok(!im.isSolid());
+            done();
+        });
+    });
 });
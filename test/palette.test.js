@@ -56,4 +56,44 @@ describe('mapnik.Palette ', function() {
         var stat = fs.statSync(filename);
         assert.ok(stat.size < 7300);
     });
+
+    it('should encode png8 through the palette lookup table', function(done) {
+        // red, green, blue, white and black
+        var colors = [[255, 0, 0], [0, 255, 0], [0, 0, 255], [255, 255, 255], [0, 0, 0]];
+        var pal = new mapnik.Palette('\xff\x00\x00\x00\xff\x00\x00\x00\xff\xff\xff\xff\x00\x00\x00', 'rgb');
+        var width = 13;
+        var height = 7;
+        var source = new Buffer(width * height * 4);
+        var expected = [];
+        for (var i = 0; i < width * height; ++i) {
+            var color = colors[i % colors.length];
+            expected.push(color);
+            for (var c = 0; c < 3; ++c) {
+                // up to 20 away from the palette entry it should map to
+                var noise = (i * 7 + c * 5) % 21;
+                source[i * 4 + c] = color[c] > 127 ? color[c] - noise : color[c] + noise;
+            }
+            source[i * 4 + 3] = 255;
+        }
+        var im = mapnik.Image.fromBuffer(source, width, height);
+        function check(buffer) {
+            var data = mapnik.Image.fromBytesSync(buffer).data();
+            for (var i = 0; i < width * height; ++i) {
+                assert.deepEqual([data[i * 4], data[i * 4 + 1], data[i * 4 + 2], data[i * 4 + 3]],
+                                 expected[i].concat([255]));
+            }
+        }
+        assert.throws(function() { im.encodeSync('png8', {palette: pal, lut: 1}); });
+        assert.throws(function() { im.encodeSync('png', {lut: true}); });
+        // png options alone must not switch to the lossy lookup table
+        assert.throws(function() { im.encodeSync('png8', {palette: pal, png: {level: 9}}); });
+        // mapnik's exact matching and the lookup table agree on these pixels
+        check(im.encodeSync('png8', {palette: pal}));
+        check(im.encodeSync('png8', {palette: pal, lut: true, png: {threads: 2}}));
+        im.encode('png8', {palette: pal, lut: true, png: {level: 9}}, function(err, buffer) {
+            if (err) throw err;
+            check(buffer);
+            done();
+        });
+    });
 });
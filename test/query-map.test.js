@@ -153,4 +153,41 @@ describe('mapnik.queryPoint', function() {
             done();
         });
     });
+
+    it('should query a batch of points against all layers', function(done) {
+        var map = new mapnik.Map(256, 256);
+        var options = {
+            type: 'shape',
+            file: './test/data/world_merc.shp'
+        };
+        ['world', 'world2'].forEach(function(name) {
+            var layer = new mapnik.Layer(name);
+            layer.srs = map.srs;
+            layer.datasource = new mapnik.Datasource(options);
+            map.add_layer(layer);
+        });
+        map.zoomAll();
+        assert.throws(function() { map.queryPoint([[0]], function() {}); });
+        assert.throws(function() { map.queryPoint([[0, 0]], {fields: 'NAME'}, function() {}); });
+        var points = [[-12957605.0331, 5518141.9452], [-15000000, 0]];
+        map.queryPoint(points, {fields: ['NAME', 'ISO3']}, function(err, results) {
+            if (err) throw err;
+            assert.equal(results.length, 2);
+            // first point hits the same feature in both layers
+            assert.equal(results[0].length, 2);
+            assert.equal(results[0][0].layer, 'world');
+            assert.equal(results[0][1].layer, 'world2');
+            results[0].forEach(function(result) {
+                var feat = result.featureset.next();
+                assert.deepEqual(feat.attributes(), { NAME: 'United States', ISO3: 'USA' });
+                assert.ok(feat.numGeometries() > 0);
+                assert.ok(!result.featureset.next());
+            });
+            // second point is in the middle of the pacific
+            assert.equal(results[1].length, 2);
+            assert.ok(!results[1][0].featureset.next());
+            assert.ok(!results[1][1].featureset.next());
+            done();
+        });
+    });
 });
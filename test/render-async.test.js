@@ -16,6 +16,23 @@ describe('mapnik async rendering', function() {
         });
     });
 
+    it('should release the map after rendering to a file', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        map.renderFile('./test/tmp/renderFile-release.png', function(error) {
+            assert.ok(!error);
+            // throws while the map still counts as rendering
+            map.enableFeatureCache({size: 1024 * 1024});
+            map.render(new mapnik.Image(256, 256), function(err) {
+                if (err) throw err;
+                assert.equal(map.featureCacheStats().misses, 1);
+                map.disableFeatureCache();
+                done();
+            });
+        });
+    });
+
     it('should render to an image', function(done) {
         var map = new mapnik.Map(256, 256);
         map.load('./test/stylesheet.xml', function(err,map) {
@@ -31,4 +48,138 @@ describe('mapnik async rendering', function() {
             });
         });
     });
+
+    it('should serve repeat renders from the feature cache', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        assert.equal(map.featureCacheStats(), undefined);
+        map.enableFeatureCache({size: 16 * 1024 * 1024, expand: 0.5});
+        assert.equal(map.layers()[0].datasource.parameters().type, 'shape');
+        map.render(new mapnik.Image(256, 256), function(err, first) {
+            if (err) throw err;
+            var stats = map.featureCacheStats();
+            assert.equal(stats.size, 16 * 1024 * 1024);
+            assert.equal(stats.misses, 1);
+            assert.equal(stats.entries, 1);
+            assert.ok(stats.bytes > 0);
+            map.render(new mapnik.Image(256, 256), function(err, second) {
+                if (err) throw err;
+                assert.equal(map.featureCacheStats().hits, 1);
+                assert.equal(first.encodeSync('png').toString('hex'), second.encodeSync('png').toString('hex'));
+                map.disableFeatureCache();
+                assert.equal(map.featureCacheStats(), undefined);
+                done();
+            });
+        });
+    });
+
+    it('should report worker pool metrics per priority class', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        assert.throws(function() { map.render(new mapnik.Image(256, 256), {priority: 'urgent'}, function() {}); });
+        var before = mapnik.workerPoolStats();
+        assert.ok(before.size >= 1);
+        ['interactive', 'encode', 'housekeeping', 'batch'].forEach(function(name) {
+            assert.equal(typeof before[name].queued, 'number');
+            assert.equal(typeof before[name].wait_avg_ms, 'number');
+        });
+        map.render(new mapnik.Image(256, 256), {priority: 'batch'}, function(err, im) {
+            if (err) throw err;
+            im.encode('png', function(err, buffer) {
+                if (err) throw err;
+                var stats = mapnik.workerPoolStats();
+                assert.equal(stats.batch.completed, before.batch.completed + 1);
+                assert.equal(stats.encode.completed, before.encode.completed + 1);
+                assert.ok(stats.threads >= stats.size);
+                done();
+            });
+        });
+    });
+
+    it('should coalesce identical concurrent renders', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        assert.throws(function() { map.render(new mapnik.Image(256, 256), {coalesce: 1}, function() {}); });
+        var before = mapnik.workerPoolStats().interactive.completed;
+        var results = [];
+        function check(err, im) {
+            if (err) throw err;
+            results.push(im.encodeSync('png').toString('hex'));
+            if (results.length < 3) return;
+            assert.equal(results[0], results[1]);
+            assert.equal(results[0], results[2]);
+            // a single render served all three requests
+            assert.equal(mapnik.workerPoolStats().interactive.completed, before + 1);
+            done();
+        }
+        map.render(new mapnik.Image(256, 256), {coalesce: true}, check);
+        map.render(new mapnik.Image(256, 256), {coalesce: true}, check);
+        map.render(new mapnik.Image(256, 256), {coalesce: true}, check);
+    });
+
+    it('should not coalesce renders into images that are not blank', function(done) {
+        // separate maps sharing a key, so nothing renders on one map twice
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        var map2 = new mapnik.Map(256, 256);
+        map2.loadSync('./test/stylesheet.xml');
+        map2.zoomAll();
+        var before = mapnik.workerPoolStats().interactive.completed;
+        var blank = new mapnik.Image(256, 256);
+        var filled = new mapnik.Image(256, 256);
+        filled.background = new mapnik.Color('green');
+        var remaining = 2;
+        function check(err, im) {
+            if (err) throw err;
+            if (--remaining > 0) return;
+            // the image with a background kept it and rendered on its own
+            assert.equal(filled.background.toString(), new mapnik.Color('green').toString());
+            assert.notEqual(filled.encodeSync('png').toString('hex'), blank.encodeSync('png').toString('hex'));
+            assert.equal(mapnik.workerPoolStats().interactive.completed, before + 2);
+            done();
+        }
+        map.render(blank, {coalesce: 'world'}, check);
+        map2.render(filled, {coalesce: 'world'}, check);
+    });
+
+    it('should render several targets from one query per layer', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.loadSync('./test/stylesheet.xml');
+        map.zoomAll();
+        var opts = {layer: 'world', fields: ['NAME']};
+        assert.throws(function() { map.render([], opts, function() {}); });
+        assert.throws(function() { map.render([new mapnik.Image(256, 256), {}], opts, function() {}); });
+        assert.throws(function() { map.render([new mapnik.Grid(256, 256)], {}, function() {}); });
+        var im = new mapnik.Image(256, 256);
+        var grid = new mapnik.Grid(256, 256, {key: '__id__'});
+        map.render([grid, im], opts, function(err, targets) {
+            if (err) throw err;
+            assert.equal(targets.length, 2);
+            assert.ok(targets[0] instanceof mapnik.Grid);
+            assert.ok(targets[1] instanceof mapnik.Image);
+            map.render(new mapnik.Image(256, 256), function(err, single_im) {
+                if (err) throw err;
+                assert.equal(targets[1].encodeSync('png').toString('hex'), single_im.encodeSync('png').toString('hex'));
+                map.render(new mapnik.Grid(256, 256, {key: '__id__'}), opts, function(err, single_grid) {
+                    if (err) throw err;
+                    assert.deepEqual(targets[0].encodeSync('utf'), single_grid.encodeSync('utf'));
+                    // behind a persistent feature cache, both targets of a
+                    // multi render are served by a single query of the layer
+                    map.enableFeatureCache({size: 16 * 1024 * 1024});
+                    map.render([new mapnik.Grid(256, 256, {key: '__id__'}), new mapnik.Image(256, 256)], opts, function(err) {
+                        if (err) throw err;
+                        var stats = map.featureCacheStats();
+                        assert.equal(stats.misses, 1);
+                        assert.equal(stats.hits, 0);
+                        map.disableFeatureCache();
+                        done();
+                    });
+                });
+            });
+        });
+    });
 });
@@ -2,6 +2,7 @@ var mapnik = require('../');
 var assert = require('assert');
 var path = require('path');
 var fs = require('fs');
+var zlib = require('zlib');
 
 var stylesheet = './test/stylesheet.xml';
 var reference = fs.readFileSync('./test/support/grid2.json', 'utf8');
@@ -158,4 +159,83 @@ describe('mapnik grid rendering ', function() {
         });
     });
 
+
+    it('should render several layers with layer qualified keys', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.loadSync(stylesheet, {strict: true});
+        map.zoomAll();
+        var grid = new mapnik.Grid(map.width, map.height, {key: '__id__'});
+        assert.throws(function() { map.render(grid, {layers: []}, function() {}); });
+        assert.throws(function() { map.render(grid, {layers: [{key: 'NAME'}]}, function() {}); });
+        assert.throws(function() { map.render(grid, {layers: ['missing']}, function() {}); });
+        var options = {layers: [{layer: 'world', key: 'NAME', fields: ['NAME']}]};
+        map.render(grid, options, function(err, grid) {
+            if (err) throw err;
+            var grid_utf = grid.encodeSync('utf', {resolution: 4});
+            assert.equal(grid.key, '__id__');
+            var keys = grid_utf.keys.filter(function(key) { return key !== ''; });
+            assert.ok(keys.length > 0);
+            keys.forEach(function(key) {
+                assert.equal(key.indexOf('world:'), 0);
+                assert.equal(grid_utf.data[key].NAME, key.slice('world:'.length));
+            });
+            done();
+        });
+    });
+
+
+    it('should encode to JSON and gzip off the main thread', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.loadSync(stylesheet, {strict: true});
+        map.zoomAll();
+        var grid = new mapnik.Grid(map.width, map.height, {key: '__id__'});
+        map.render(grid, {'layer': 0, 'fields': ['NAME']}, function(err, grid) {
+            if (err) throw err;
+            assert.throws(function() { grid.encode('utf', {json: 1}, function() {}); });
+            grid.encode('utf', {resolution: 4, json: true}, function(err, json) {
+                if (err) throw err;
+                assert.ok(json instanceof Buffer);
+                assert.deepEqual(JSON.parse(json.toString()), JSON.parse(reference));
+                grid.encode('utf', {resolution: 4, gzip: true}, function(err, gz) {
+                    if (err) throw err;
+                    assert.ok(gz.length < json.length);
+                    zlib.gunzip(gz, function(err, raw) {
+                        if (err) throw err;
+                        assert.equal(raw.toString(), json.toString());
+                        done();
+                    });
+                });
+            });
+        });
+    });
+
+    it('should write numbers in JSON the way JSON.stringify does', function(done) {
+        var map = new mapnik.Map(256, 256);
+        map.fromStringSync('<Map><Style name="points"><Rule><MarkersSymbolizer width="64" height="64" allow-overlap="true"/></Rule></Style></Map>');
+        var properties = {tiny: 1e-7, small: 0.000001, fraction: 0.30000000000000004, negative: -2.5, third: 1 / 3};
+        var ds = new mapnik.MemoryDatasource({'extent': '-180,-90,180,90'});
+        ds.add({'x': 0, 'y': 0, 'properties': properties});
+        var l = new mapnik.Layer('numbers');
+        l.srs = map.srs;
+        l.styles = ['points'];
+        l.datasource = ds;
+        map.add_layer(l);
+        map.zoomToBox([-10, -10, 10, 10]);
+        var grid = new mapnik.Grid(map.width, map.height, {key: '__id__'});
+        var fields = Object.keys(properties);
+        map.render(grid, {'layer': 0, 'fields': fields}, function(err, grid) {
+            if (err) throw err;
+            grid.encode('utf', {resolution: 4, json: true}, function(err, json) {
+                if (err) throw err;
+                var text = json.toString();
+                fields.forEach(function(name) {
+                    var expected = '"' + name + '":' + JSON.stringify(properties[name]);
+                    assert.ok(text.indexOf(expected) !== -1, expected + ' not in ' + text);
+                });
+                assert.equal(text.indexOf('e-07'), -1);
+                done();
+            });
+        });
+    });
+
 });
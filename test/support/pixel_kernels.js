@@ -0,0 +1,44 @@
+// Runs every pixel kernel over images whose widths are not a multiple of
+// any vector width and prints a digest of the results. image.test.js runs
+// it with NODE_MAPNIK_PIXEL_KERNELS=scalar to compare both paths.
+var mapnik = require('../../');
+var crypto = require('crypto');
+
+function pixels(width, height, seed) {
+    var data = new Buffer(width * height * 4);
+    var x = seed;
+    for (var i = 0; i < data.length; ++i) {
+        x = (x * 1103515245 + 12345) & 0x7fffffff;
+        data[i] = x >> 16 & 0xff;
+    }
+    // fully transparent and opaque pixels exercise the special cases
+    data[3] = 0;
+    data[7] = 255;
+    return data;
+}
+
+module.exports = function() {
+    var hash = crypto.createHash('md5');
+    var width = 37;
+    var height = 5;
+    var im = mapnik.Image.fromBuffer(pixels(width, height, 1), width, height);
+    im.premultiplySync();
+    hash.update(im.data());
+    im.demultiplySync();
+    hash.update(im.data());
+    var gray = mapnik.Image.fromBuffer(pixels(width, height, 2), width, height);
+    gray.setGrayScaleToAlpha(new mapnik.Color('green'));
+    hash.update(gray.data());
+    var a = mapnik.Image.fromBuffer(pixels(width, height, 3), width, height);
+    var b = mapnik.Image.fromBuffer(pixels(width, height, 4), width, height);
+    var result = a.compareSync(b, {threshold: 100, diff: true});
+    hash.update(String(result.mismatched));
+    hash.update(result.diff.data());
+    var big = mapnik.Image.fromBuffer(pixels(width * 2, height * 2, 5), width * 2, height * 2);
+    hash.update(big.resizeSync(width, height).data());
+    return hash.digest('hex');
+};
+
+if (require.main === module) {
+    console.log(module.exports());
+}
@@ -637,4 +637,22 @@ describe('mapnik.VectorTile ', function() {
         assert.deepEqual(json_obj, json_obj2);
         done();
     });
+
+    if (mapnik.supports.webp) {
+        it('should embed webp rasters and render them', function(done) {
+            var vtile = new mapnik.VectorTile(1, 0, 0);
+            var im = new mapnik.Image.fromBytesSync(fs.readFileSync('./test/data/vector_tile/cloudless_1_0_0.jpg'));
+            assert.throws(function() { vtile.addImage(im, 'raster', {image_format: 'png', webp: {quality: 80}}); });
+            vtile.addImage(im, 'raster', {webp: {quality: 80, alpha_quality: 50}});
+            var raster = vtile.toJSON()[0].features[0].raster;
+            assert.equal(raster.slice(8, 12).toString(), 'WEBP');
+            var map = new mapnik.Map(256, 256);
+            map.loadSync('./test/data/vector_tile/raster_style.xml');
+            vtile.render(map, new mapnik.Image(256, 256), {buffer_size:256}, function(err, vtile_image) {
+                if (err) throw err;
+                assert.ok(!vtile_image.isSolid());
+                done();
+            });
+        });
+    }
 });